@@ -19,7 +19,14 @@
 #include <linux/cpu.h>
 #include <linux/cpumask.h>
 #include <linux/cpufreq.h>
+#include <linux/input.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/opp.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/tick.h>
 #include <linux/time.h>
@@ -32,6 +39,17 @@
 
 static atomic_t active_count = ATOMIC_INIT(0);
 
+/* Most load samples the energy-aware mode averages over */
+#define MAX_LOAD_WINDOW 8
+
+/* One frequency of the energy model */
+struct cpufreq_interactive_opp {
+	unsigned int freq;		/* kHz */
+	unsigned int volt;		/* mV, 0 if unknown */
+	unsigned int capacity;		/* relative to the fastest, 1024 */
+	unsigned int power;		/* relative, mV^2 * MHz / 10^6 */
+};
+
 struct cpufreq_interactive_cpuinfo {
 	struct timer_list cpu_timer;
 	int timer_idlecancel;
@@ -45,6 +63,17 @@ struct cpufreq_interactive_cpuinfo {
 	struct cpufreq_frequency_table *freq_table;
 	unsigned int target_freq;
 	int governor_enabled;
+	/* residency per freq_table entry, kept for policy->cpu only */
+	u64 *time_in_state;
+	unsigned int stats_index;
+	u64 stats_time;
+	/* energy model, one entry per valid freq_table entry */
+	struct cpufreq_interactive_opp *em;
+	unsigned int em_count;
+	/* recent demand samples, load scaled to kHz */
+	unsigned int load_hist[MAX_LOAD_WINDOW];
+	unsigned int load_hist_next;
+	unsigned int load_hist_count;
 };
 
 static DEFINE_PER_CPU(struct cpufreq_interactive_cpuinfo, cpuinfo);
@@ -78,6 +107,36 @@ static unsigned long min_sample_time;
 #define DEFAULT_TIMER_RATE 20 * USEC_PER_MSEC
 static unsigned long timer_rate;
 
+/*
+ * While boost is set, or until boostpulse_endtime (usecs of ktime) has
+ * passed, the CPUs are not allowed below hispeed_freq.
+ */
+static int boost_val;
+static u64 boostpulse_endtime;
+
+/* How long a boost pulse or an input event holds hispeed_freq, in usecs */
+#define DEFAULT_BOOSTPULSE_DURATION 80 * USEC_PER_MSEC
+static unsigned long boostpulse_duration;
+
+/* Boost on touchscreen, touchpad and key events */
+static int input_boost_val = 1;
+
+static unsigned long input_boost_count;
+static unsigned long boostpulse_count;
+
+/*
+ * Energy-aware mode: pick the frequency that does the recent demand for
+ * the least energy while staying at or below target_load percent busy.
+ */
+static int energy_aware;
+
+#define DEFAULT_TARGET_LOAD 80
+static unsigned long target_load;
+
+/* Number of timer samples the demand is averaged over */
+#define DEFAULT_LOAD_WINDOW 4
+static unsigned long load_window;
+
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event);
 
@@ -91,6 +150,66 @@ struct cpufreq_governor cpufreq_gov_interactive = {
 	.owner = THIS_MODULE,
 };
 
+/*
+ * Record a demand sample and return the demand to provide for: the mean
+ * over the window, or the latest sample if higher, so that rising load
+ * is followed at once while falling load is followed gradually.
+ */
+static unsigned int cpufreq_interactive_demand(
+	struct cpufreq_interactive_cpuinfo *pcpu, unsigned int sample)
+{
+	unsigned int i, window = load_window;
+	u64 sum = 0;
+
+	pcpu->load_hist[pcpu->load_hist_next] = sample;
+	pcpu->load_hist_next = (pcpu->load_hist_next + 1) % MAX_LOAD_WINDOW;
+	if (pcpu->load_hist_count < MAX_LOAD_WINDOW)
+		pcpu->load_hist_count++;
+
+	if (window > pcpu->load_hist_count)
+		window = pcpu->load_hist_count;
+	for (i = 1; i <= window; i++)
+		sum += pcpu->load_hist[(pcpu->load_hist_next + MAX_LOAD_WINDOW -
+					i) % MAX_LOAD_WINDOW];
+
+	return max_t(unsigned int, div_u64(sum, window), sample);
+}
+
+/*
+ * Cheapest frequency within the policy limits that runs 'demand' at no
+ * more than target_load percent busy.  The cost of a frequency is its
+ * energy per unit of work, power / frequency; ties go to the lower
+ * frequency.  If none is fast enough, the fastest allowed one.
+ */
+static unsigned int cpufreq_interactive_em_target(
+	struct cpufreq_interactive_cpuinfo *pcpu, unsigned int demand)
+{
+	struct cpufreq_policy *policy = pcpu->policy;
+	struct cpufreq_interactive_opp *opp;
+	unsigned int i, best_freq = 0, fastest = policy->min;
+	u64 cost, best_cost = ~0ULL;
+
+	for (i = 0; i < pcpu->em_count; i++) {
+		opp = &pcpu->em[i];
+
+		if (opp->freq < policy->min || opp->freq > policy->max)
+			continue;
+		if (opp->freq > fastest)
+			fastest = opp->freq;
+		if ((u64)demand * 100 > (u64)opp->freq * target_load)
+			continue;
+
+		cost = div_u64((u64)opp->power * 1000000, opp->freq);
+		if (cost < best_cost ||
+		    (cost == best_cost && opp->freq < best_freq)) {
+			best_cost = cost;
+			best_freq = opp->freq;
+		}
+	}
+
+	return best_freq ? best_freq : fastest;
+}
+
 static void cpufreq_interactive_timer(unsigned long data)
 {
 	unsigned int delta_idle;
@@ -103,6 +222,7 @@ static void cpufreq_interactive_timer(unsigned long data)
 		&per_cpu(cpuinfo, data);
 	u64 now_idle;
 	unsigned int new_freq;
+	unsigned int demand;
 	unsigned int index;
 	unsigned long flags;
 
@@ -172,6 +292,20 @@ static void cpufreq_interactive_timer(unsigned long data)
 		new_freq = pcpu->policy->cur * cpu_load / 100;
 	}
 
+	/*
+	 * policy->cur * cpu_load can't show how much more a saturated CPU
+	 * needs, so at or above go_hispeed_load the demand is what the
+	 * default mode jumps to.
+	 */
+	demand = cpufreq_interactive_demand(pcpu, new_freq);
+
+	if (energy_aware && pcpu->em)
+		new_freq = cpufreq_interactive_em_target(pcpu, demand);
+
+	if ((boost_val || pcpu->timer_run_time < boostpulse_endtime) &&
+	    new_freq < hispeed_freq)
+		new_freq = hispeed_freq;
+
 	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
 					   new_freq, CPUFREQ_RELATION_H,
 					   &index)) {
@@ -327,6 +461,72 @@ static void cpufreq_interactive_idle_end(void)
 
 }
 
+static unsigned int cpufreq_interactive_freq_index(
+	struct cpufreq_frequency_table *freq_table, unsigned int freq)
+{
+	unsigned int i;
+
+	for (i = 0; freq_table[i].frequency != CPUFREQ_TABLE_END; i++)
+		if (freq_table[i].frequency == freq)
+			return i;
+	return 0;
+}
+
+/*
+ * Charge the time since the last update to the frequency the policy
+ * was running at, then switch to its current frequency.  Called with
+ * set_speed_lock held.
+ */
+static void cpufreq_interactive_stats_update(struct cpufreq_policy *policy)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu =
+		&per_cpu(cpuinfo, policy->cpu);
+	u64 now = get_jiffies_64();
+
+	if (!pcpu->time_in_state)
+		return;
+
+	pcpu->time_in_state[pcpu->stats_index] += now - pcpu->stats_time;
+	pcpu->stats_time = now;
+	pcpu->stats_index = cpufreq_interactive_freq_index(pcpu->freq_table,
+							   policy->cur);
+}
+
+/*
+ * Raise the CPUs running the governor to hispeed_freq straight away
+ * rather than on their next timer run.  May be called in atomic context.
+ */
+static void cpufreq_interactive_boost(void)
+{
+	int i;
+	int anyboost = 0;
+	unsigned int freq;
+	unsigned long flags;
+	struct cpufreq_interactive_cpuinfo *pcpu;
+
+	spin_lock_irqsave(&up_cpumask_lock, flags);
+
+	for_each_online_cpu(i) {
+		pcpu = &per_cpu(cpuinfo, i);
+		smp_rmb();
+
+		if (!pcpu->governor_enabled)
+			continue;
+
+		freq = min_t(u64, hispeed_freq, pcpu->policy->max);
+		if (pcpu->target_freq < freq) {
+			pcpu->target_freq = freq;
+			cpumask_set_cpu(i, &up_cpumask);
+			anyboost = 1;
+		}
+	}
+
+	spin_unlock_irqrestore(&up_cpumask_lock, flags);
+
+	if (anyboost)
+		wake_up_process(up_task);
+}
+
 static int cpufreq_interactive_up_task(void *data)
 {
 	unsigned int cpu;
@@ -373,10 +573,12 @@ static int cpufreq_interactive_up_task(void *data)
 					max_freq = pjcpu->target_freq;
 			}
 
-			if (max_freq != pcpu->policy->cur)
+			if (max_freq != pcpu->policy->cur) {
 				__cpufreq_driver_target(pcpu->policy,
 							max_freq,
 							CPUFREQ_RELATION_H);
+				cpufreq_interactive_stats_update(pcpu->policy);
+			}
 			mutex_unlock(&set_speed_lock);
 
 			pcpu->freq_change_time_in_idle =
@@ -420,9 +622,11 @@ static void cpufreq_interactive_freq_down(struct work_struct *work)
 				max_freq = pjcpu->target_freq;
 		}
 
-		if (max_freq != pcpu->policy->cur)
+		if (max_freq != pcpu->policy->cur) {
 			__cpufreq_driver_target(pcpu->policy, max_freq,
 						CPUFREQ_RELATION_H);
+			cpufreq_interactive_stats_update(pcpu->policy);
+		}
 
 		mutex_unlock(&set_speed_lock);
 		pcpu->freq_change_time_in_idle =
@@ -521,11 +725,338 @@ static ssize_t store_timer_rate(struct kobject *kobj,
 static struct global_attr timer_rate_attr = __ATTR(timer_rate, 0644,
 		show_timer_rate, store_timer_rate);
 
+static ssize_t show_boost(struct kobject *kobj, struct attribute *attr,
+			  char *buf)
+{
+	return sprintf(buf, "%d\n", boost_val);
+}
+
+static ssize_t store_boost(struct kobject *kobj, struct attribute *attr,
+			   const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+
+	boost_val = val;
+	if (boost_val)
+		cpufreq_interactive_boost();
+	return count;
+}
+
+static struct global_attr boost_attr = __ATTR(boost, 0644,
+		show_boost, store_boost);
+
+static ssize_t store_boostpulse(struct kobject *kobj, struct attribute *attr,
+				const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+
+	boostpulse_endtime = ktime_to_us(ktime_get()) + boostpulse_duration;
+	boostpulse_count++;
+	cpufreq_interactive_boost();
+	return count;
+}
+
+static struct global_attr boostpulse_attr = __ATTR(boostpulse, 0200,
+		NULL, store_boostpulse);
+
+static ssize_t show_boostpulse_duration(struct kobject *kobj,
+					struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", boostpulse_duration);
+}
+
+static ssize_t store_boostpulse_duration(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	boostpulse_duration = val;
+	return count;
+}
+
+static struct global_attr boostpulse_duration_attr =
+	__ATTR(boostpulse_duration, 0644, show_boostpulse_duration,
+	       store_boostpulse_duration);
+
+static ssize_t show_input_boost(struct kobject *kobj, struct attribute *attr,
+				char *buf)
+{
+	return sprintf(buf, "%d\n", input_boost_val);
+}
+
+static ssize_t store_input_boost(struct kobject *kobj, struct attribute *attr,
+				 const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	input_boost_val = val;
+	return count;
+}
+
+static struct global_attr input_boost_attr = __ATTR(input_boost, 0644,
+		show_input_boost, store_input_boost);
+
+static ssize_t show_input_boost_count(struct kobject *kobj,
+				      struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", input_boost_count);
+}
+
+static struct global_attr input_boost_count_attr =
+	__ATTR(input_boost_count, 0444, show_input_boost_count, NULL);
+
+static ssize_t show_boostpulse_count(struct kobject *kobj,
+				     struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", boostpulse_count);
+}
+
+static struct global_attr boostpulse_count_attr =
+	__ATTR(boostpulse_count, 0444, show_boostpulse_count, NULL);
+
+/* "freq time" lines in USER_HZ units per policy, as cpufreq_stats does */
+static ssize_t show_time_in_state(struct kobject *kobj,
+				  struct attribute *attr, char *buf)
+{
+	ssize_t len = 0;
+	unsigned int cpu, i;
+	struct cpufreq_interactive_cpuinfo *pcpu;
+
+	mutex_lock(&set_speed_lock);
+
+	for_each_online_cpu(cpu) {
+		pcpu = &per_cpu(cpuinfo, cpu);
+
+		if (!pcpu->governor_enabled || !pcpu->time_in_state)
+			continue;
+
+		cpufreq_interactive_stats_update(pcpu->policy);
+		len += snprintf(buf + len, PAGE_SIZE - len, "cpu%u\n", cpu);
+		for (i = 0; pcpu->freq_table[i].frequency !=
+			     CPUFREQ_TABLE_END; i++) {
+			if (pcpu->freq_table[i].frequency ==
+			    CPUFREQ_ENTRY_INVALID)
+				continue;
+			len += snprintf(buf + len, PAGE_SIZE - len,
+				"%u %llu\n", pcpu->freq_table[i].frequency,
+				(unsigned long long)jiffies_64_to_clock_t(
+					pcpu->time_in_state[i]));
+		}
+	}
+
+	mutex_unlock(&set_speed_lock);
+	return len;
+}
+
+static struct global_attr time_in_state_attr = __ATTR(time_in_state, 0444,
+		show_time_in_state, NULL);
+
+static ssize_t show_energy_aware(struct kobject *kobj, struct attribute *attr,
+				 char *buf)
+{
+	return sprintf(buf, "%d\n", energy_aware);
+}
+
+static ssize_t store_energy_aware(struct kobject *kobj, struct attribute *attr,
+				  const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	energy_aware = !!val;
+	return count;
+}
+
+static struct global_attr energy_aware_attr = __ATTR(energy_aware, 0644,
+		show_energy_aware, store_energy_aware);
+
+static ssize_t show_target_load(struct kobject *kobj, struct attribute *attr,
+				char *buf)
+{
+	return sprintf(buf, "%lu\n", target_load);
+}
+
+static ssize_t store_target_load(struct kobject *kobj, struct attribute *attr,
+				 const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	if (val == 0 || val > 100)
+		return -EINVAL;
+	target_load = val;
+	return count;
+}
+
+static struct global_attr target_load_attr = __ATTR(target_load, 0644,
+		show_target_load, store_target_load);
+
+static ssize_t show_load_window(struct kobject *kobj, struct attribute *attr,
+				char *buf)
+{
+	return sprintf(buf, "%lu\n", load_window);
+}
+
+static ssize_t store_load_window(struct kobject *kobj, struct attribute *attr,
+				 const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	if (val == 0 || val > MAX_LOAD_WINDOW)
+		return -EINVAL;
+	load_window = val;
+	return count;
+}
+
+static struct global_attr load_window_attr = __ATTR(load_window, 0644,
+		show_load_window, store_load_window);
+
+/* "freq volt capacity power" lines per policy */
+static ssize_t show_opp_power(struct kobject *kobj, struct attribute *attr,
+			      char *buf)
+{
+	ssize_t len = 0;
+	unsigned int cpu, i;
+	struct cpufreq_interactive_cpuinfo *pcpu;
+
+	mutex_lock(&set_speed_lock);
+
+	for_each_online_cpu(cpu) {
+		pcpu = &per_cpu(cpuinfo, cpu);
+
+		if (!pcpu->em || pcpu->policy->cpu != cpu)
+			continue;
+
+		len += snprintf(buf + len, PAGE_SIZE - len, "cpu%u\n", cpu);
+		for (i = 0; i < pcpu->em_count; i++)
+			len += snprintf(buf + len, PAGE_SIZE - len,
+					"%u %u %u %u\n", pcpu->em[i].freq,
+					pcpu->em[i].volt, pcpu->em[i].capacity,
+					pcpu->em[i].power);
+	}
+
+	mutex_unlock(&set_speed_lock);
+	return len;
+}
+
+/* "freq power" replaces the estimated power of freq, e.g. by a measured one */
+static ssize_t store_opp_power(struct kobject *kobj, struct attribute *attr,
+			       const char *buf, size_t count)
+{
+	unsigned int freq, power, cpu, i;
+	struct cpufreq_interactive_cpuinfo *pcpu;
+	int found = 0;
+
+	if (sscanf(buf, "%u %u", &freq, &power) != 2 || !power)
+		return -EINVAL;
+
+	mutex_lock(&set_speed_lock);
+
+	for_each_online_cpu(cpu) {
+		pcpu = &per_cpu(cpuinfo, cpu);
+
+		for (i = 0; pcpu->em && i < pcpu->em_count; i++) {
+			if (pcpu->em[i].freq == freq) {
+				pcpu->em[i].power = power;
+				found = 1;
+			}
+		}
+	}
+
+	mutex_unlock(&set_speed_lock);
+	return found ? count : -EINVAL;
+}
+
+static struct global_attr opp_power_attr = __ATTR(opp_power, 0644,
+		show_opp_power, store_opp_power);
+
+/*
+ * Energy used per policy since the governor started, from time_in_state
+ * and the energy model, in power units times seconds.
+ */
+static ssize_t show_energy_estimate(struct kobject *kobj,
+				    struct attribute *attr, char *buf)
+{
+	ssize_t len = 0;
+	unsigned int cpu, i, j;
+	u64 energy;
+	struct cpufreq_interactive_cpuinfo *pcpu;
+
+	mutex_lock(&set_speed_lock);
+
+	for_each_online_cpu(cpu) {
+		pcpu = &per_cpu(cpuinfo, cpu);
+
+		if (!pcpu->governor_enabled || !pcpu->time_in_state ||
+		    !pcpu->em)
+			continue;
+
+		cpufreq_interactive_stats_update(pcpu->policy);
+		energy = 0;
+		for (i = 0; pcpu->freq_table[i].frequency !=
+			     CPUFREQ_TABLE_END; i++)
+			for (j = 0; j < pcpu->em_count; j++)
+				if (pcpu->em[j].freq ==
+				    pcpu->freq_table[i].frequency)
+					energy += pcpu->time_in_state[i] *
+						pcpu->em[j].power;
+
+		len += snprintf(buf + len, PAGE_SIZE - len, "cpu%u %llu\n",
+				cpu, (unsigned long long)div_u64(energy, HZ));
+	}
+
+	mutex_unlock(&set_speed_lock);
+	return len;
+}
+
+static struct global_attr energy_estimate_attr = __ATTR(energy_estimate,
+		0444, show_energy_estimate, NULL);
+
 static struct attribute *interactive_attributes[] = {
 	&hispeed_freq_attr.attr,
 	&go_hispeed_load_attr.attr,
 	&min_sample_time_attr.attr,
 	&timer_rate_attr.attr,
+	&boost_attr.attr,
+	&boostpulse_attr.attr,
+	&boostpulse_duration_attr.attr,
+	&input_boost_attr.attr,
+	&input_boost_count_attr.attr,
+	&boostpulse_count_attr.attr,
+	&time_in_state_attr.attr,
+	&energy_aware_attr.attr,
+	&target_load_attr.attr,
+	&load_window_attr.attr,
+	&opp_power_attr.attr,
+	&energy_estimate_attr.attr,
 	NULL,
 };
 
@@ -534,6 +1065,240 @@ static struct attribute_group interactive_attr_group = {
 	.name = "interactive",
 };
 
+#ifdef CONFIG_INPUT
+static void cpufreq_interactive_input_event(struct input_handle *handle,
+					    unsigned int type,
+					    unsigned int code, int value)
+{
+	u64 now;
+
+	if (!input_boost_val || type == EV_SYN)
+		return;
+
+	/*
+	 * A moving finger reports events continuously; only start a new
+	 * boost once half of the current one has elapsed.
+	 */
+	now = ktime_to_us(ktime_get());
+	if (now + boostpulse_duration / 2 < boostpulse_endtime)
+		return;
+
+	boostpulse_endtime = now + boostpulse_duration;
+	input_boost_count++;
+	cpufreq_interactive_boost();
+}
+
+static int cpufreq_interactive_input_connect(struct input_handler *handler,
+					     struct input_dev *dev,
+					     const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int error;
+
+	handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_interactive";
+
+	error = input_register_handle(handle);
+	if (error)
+		goto err_free;
+
+	error = input_open_device(handle);
+	if (error)
+		goto err_unregister;
+
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return error;
+}
+
+static void cpufreq_interactive_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id cpufreq_interactive_ids[] = {
+	/* multi-touch touchscreens */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_MT_POSITION_X)] =
+			    BIT_MASK(ABS_MT_POSITION_X) |
+			    BIT_MASK(ABS_MT_POSITION_Y) },
+	},
+	/* single-touch touchscreens and touchpads */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_KEYBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
+		.absbit = { [BIT_WORD(ABS_X)] =
+			    BIT_MASK(ABS_X) | BIT_MASK(ABS_Y) },
+	},
+	/* keypads and buttons */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
+
+static struct input_handler cpufreq_interactive_input_handler = {
+	.event		= cpufreq_interactive_input_event,
+	.connect	= cpufreq_interactive_input_connect,
+	.disconnect	= cpufreq_interactive_input_disconnect,
+	.name		= "cpufreq_interactive",
+	.id_table	= cpufreq_interactive_ids,
+};
+#endif
+
+static int cpufreq_interactive_stats_start(struct cpufreq_policy *policy,
+			struct cpufreq_frequency_table *freq_table)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu =
+		&per_cpu(cpuinfo, policy->cpu);
+	unsigned int count = 0;
+	u64 *time_in_state;
+
+	if (!freq_table)
+		return 0;
+
+	while (freq_table[count].frequency != CPUFREQ_TABLE_END)
+		count++;
+
+	time_in_state = kcalloc(count, sizeof(u64), GFP_KERNEL);
+	if (!time_in_state)
+		return -ENOMEM;
+
+	mutex_lock(&set_speed_lock);
+	pcpu->time_in_state = time_in_state;
+	pcpu->stats_time = get_jiffies_64();
+	pcpu->stats_index = cpufreq_interactive_freq_index(freq_table,
+							   policy->cur);
+	mutex_unlock(&set_speed_lock);
+	return 0;
+}
+
+static void cpufreq_interactive_stats_stop(struct cpufreq_policy *policy)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu =
+		&per_cpu(cpuinfo, policy->cpu);
+
+	mutex_lock(&set_speed_lock);
+	kfree(pcpu->time_in_state);
+	pcpu->time_in_state = NULL;
+	mutex_unlock(&set_speed_lock);
+}
+
+/*
+ * Build the energy model of a policy from its frequency table and the
+ * voltages of the matching PM_OPP entries.  Dynamic power is taken as
+ * proportional to V^2 * f; frequencies without a known voltage are
+ * costed at 1V.
+ */
+static struct cpufreq_interactive_opp *cpufreq_interactive_em_build(
+	struct cpufreq_policy *policy,
+	struct cpufreq_frequency_table *freq_table, unsigned int *count)
+{
+	struct device *dev = cpufreq_frequency_get_opp_dev(policy->cpu);
+	struct cpufreq_interactive_opp *em;
+	unsigned int i, n = 0, freq, mv;
+	struct opp *opp;
+
+	for (i = 0; freq_table[i].frequency != CPUFREQ_TABLE_END; i++)
+		if (freq_table[i].frequency != CPUFREQ_ENTRY_INVALID)
+			n++;
+	if (!n)
+		return NULL;
+
+	em = kcalloc(n, sizeof(*em), GFP_KERNEL);
+	if (!em)
+		return NULL;
+
+	for (i = 0, n = 0; freq_table[i].frequency != CPUFREQ_TABLE_END; i++) {
+		freq = freq_table[i].frequency;
+		if (freq == CPUFREQ_ENTRY_INVALID)
+			continue;
+
+		mv = 0;
+		if (dev) {
+			rcu_read_lock();
+			opp = opp_find_freq_exact(dev, freq * 1000UL, true);
+			if (!IS_ERR(opp))
+				mv = opp_get_voltage(opp) / 1000;
+			rcu_read_unlock();
+		}
+
+		em[n].freq = freq;
+		em[n].volt = mv;
+		em[n].capacity = div_u64((u64)freq * 1024,
+					 policy->cpuinfo.max_freq);
+		if (!mv)
+			mv = 1000;
+		em[n].power = max_t(unsigned int, 1,
+			div_u64((u64)mv * mv * (freq / 1000), 1000000));
+		n++;
+	}
+
+	*count = n;
+	return em;
+}
+
+static void cpufreq_interactive_em_start(struct cpufreq_policy *policy,
+			struct cpufreq_frequency_table *freq_table)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu;
+	struct cpufreq_interactive_opp *em;
+	unsigned int j, count = 0;
+
+	if (!freq_table)
+		return;
+
+	em = cpufreq_interactive_em_build(policy, freq_table, &count);
+	if (!em)
+		return;
+
+	mutex_lock(&set_speed_lock);
+	for_each_cpu(j, policy->cpus) {
+		pcpu = &per_cpu(cpuinfo, j);
+		pcpu->load_hist_next = 0;
+		pcpu->load_hist_count = 0;
+		pcpu->em_count = count;
+		if (j == policy->cpu)
+			pcpu->em = em;
+		else
+			pcpu->em = kmemdup(em, count * sizeof(*em),
+					   GFP_KERNEL);
+	}
+	mutex_unlock(&set_speed_lock);
+}
+
+/* Called once the timers of the policy have been stopped */
+static void cpufreq_interactive_em_stop(struct cpufreq_policy *policy)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu;
+	unsigned int j;
+
+	mutex_lock(&set_speed_lock);
+	for_each_cpu(j, policy->cpus) {
+		pcpu = &per_cpu(cpuinfo, j);
+		kfree(pcpu->em);
+		pcpu->em = NULL;
+		pcpu->em_count = 0;
+	}
+	mutex_unlock(&set_speed_lock);
+}
+
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event)
 {
@@ -565,6 +1330,11 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		if (!hispeed_freq)
 			hispeed_freq = policy->max;
 
+		if (cpufreq_interactive_stats_start(policy, freq_table))
+			pr_warn("%s: no memory for time_in_state of cpu%u\n",
+				__func__, policy->cpu);
+		cpufreq_interactive_em_start(policy, freq_table);
+
 		/*
 		 * Do not register the idle hook and create sysfs
 		 * entries if we have already done so.
@@ -577,6 +1347,12 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		if (rc)
 			return rc;
 
+#ifdef CONFIG_INPUT
+		rc = input_register_handler(&cpufreq_interactive_input_handler);
+		if (rc)
+			pr_warn("%s: failed to register input handler: %d\n",
+				__func__, rc);
+#endif
 		break;
 
 	case CPUFREQ_GOV_STOP:
@@ -596,21 +1372,29 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		}
 
 		flush_work(&freq_scale_down_work);
+		cpufreq_interactive_stats_stop(policy);
+		cpufreq_interactive_em_stop(policy);
 		if (atomic_dec_return(&active_count) > 0)
 			return 0;
 
+#ifdef CONFIG_INPUT
+		input_unregister_handler(&cpufreq_interactive_input_handler);
+#endif
 		sysfs_remove_group(cpufreq_global_kobject,
 				&interactive_attr_group);
 
 		break;
 
 	case CPUFREQ_GOV_LIMITS:
+		mutex_lock(&set_speed_lock);
 		if (policy->max < policy->cur)
 			__cpufreq_driver_target(policy,
 					policy->max, CPUFREQ_RELATION_H);
 		else if (policy->min > policy->cur)
 			__cpufreq_driver_target(policy,
 					policy->min, CPUFREQ_RELATION_L);
+		cpufreq_interactive_stats_update(policy);
+		mutex_unlock(&set_speed_lock);
 		break;
 	}
 	return 0;
@@ -645,6 +1429,9 @@ static int __init cpufreq_interactive_init(void)
 	go_hispeed_load = DEFAULT_GO_HISPEED_LOAD;
 	min_sample_time = DEFAULT_MIN_SAMPLE_TIME;
 	timer_rate = DEFAULT_TIMER_RATE;
+	boostpulse_duration = DEFAULT_BOOSTPULSE_DURATION;
+	target_load = DEFAULT_TARGET_LOAD;
+	load_window = DEFAULT_LOAD_WINDOW;
 
 	/* Initalize per-cpu timers */
 	for_each_possible_cpu(i) {
@@ -231,6 +231,26 @@ struct cpufreq_frequency_table *cpufreq_frequency_get_table(unsigned int cpu)
 }
 EXPORT_SYMBOL_GPL(cpufreq_frequency_get_table);
 
+static DEFINE_PER_CPU(struct device *, cpufreq_opp_dev);
+
+/*
+ * Drivers whose frequency table comes from PM_OPP can publish the device
+ * the OPPs are registered on, so that governors can look up the voltage
+ * of each frequency.
+ */
+void cpufreq_frequency_table_set_opp_dev(struct device *dev,
+					 unsigned int cpu)
+{
+	per_cpu(cpufreq_opp_dev, cpu) = dev;
+}
+EXPORT_SYMBOL_GPL(cpufreq_frequency_table_set_opp_dev);
+
+struct device *cpufreq_frequency_get_opp_dev(unsigned int cpu)
+{
+	return per_cpu(cpufreq_opp_dev, cpu);
+}
+EXPORT_SYMBOL_GPL(cpufreq_frequency_get_opp_dev);
+
 MODULE_AUTHOR("Dominik Brodowski <linux@brodo.de>");
 MODULE_DESCRIPTION("CPUfreq frequency table helpers");
 MODULE_LICENSE("GPL");
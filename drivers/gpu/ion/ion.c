@@ -15,14 +15,17 @@
  */
 
 #include <linux/device.h>
+#include <linux/dma-mapping.h>
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/anon_inodes.h>
 #include <linux/ion.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/mm_types.h>
+#include <linux/moduleparam.h>
 #include <linux/rbtree.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
@@ -40,6 +43,10 @@
  * @lock:		lock protecting the buffers & heaps trees
  * @heaps:		list of all the heaps in the system
  * @user_clients:	list of all the clients created from userspace
+ * @kmap_lock:		protects kmap_lru and kmap_idle
+ * @kmap_lru:		buffers whose kernel mapping is cached but unused,
+ *			least recently unmapped first
+ * @kmap_idle:		total size of the buffers on kmap_lru
  */
 struct ion_device {
 	struct miscdevice dev;
@@ -51,8 +58,18 @@ struct ion_device {
 	struct rb_root user_clients;
 	struct rb_root kernel_clients;
 	struct dentry *debug_root;
+	spinlock_t kmap_lock;
+	struct list_head kmap_lru;
+	size_t kmap_idle;
 };
 
+/*
+ * Kernel mappings eat into the vmalloc space, so only this many bytes worth
+ * of buffers may keep an unused kernel mapping around.
+ */
+static unsigned long ion_kmap_cache_size = 32 << 20;
+module_param_named(kmap_cache_size, ion_kmap_cache_size, ulong, 0644);
+
 /**
  * struct ion_client - a process/hw block local address space
  * @ref:		for reference counting the client
@@ -130,6 +147,15 @@ static void ion_buffer_add(struct ion_device *dev,
 	rb_insert_color(&buffer->node, &dev->buffers);
 }
 
+/* this function should only be called while dev->lock is held */
+static void ion_heap_account_alloc(struct ion_heap *heap, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket = us > 0 ? fls64(us) : 0;
+
+	heap->alloc_hist[min(bucket, ION_ALLOC_HIST_BUCKETS - 1)]++;
+}
+
 /* this function should only be called while dev->lock is held */
 static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 				     struct ion_device *dev,
@@ -138,6 +164,7 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 				     unsigned long flags)
 {
 	struct ion_buffer *buffer;
+	ktime_t start;
 	int ret;
 
 	buffer = kzalloc(sizeof(struct ion_buffer), GFP_KERNEL);
@@ -147,7 +174,12 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	buffer->heap = heap;
 	kref_init(&buffer->ref);
 
+	buffer->flags = flags;
+	start = ktime_get();
 	ret = heap->ops->allocate(heap, buffer, len, align, flags);
+	if (ret == -ENOMEM && heap->ops->compact && heap->ops->compact(heap))
+		ret = heap->ops->allocate(heap, buffer, len, align, flags);
+	ion_heap_account_alloc(heap, start);
 	if (ret) {
 		kfree(buffer);
 		return ERR_PTR(ret);
@@ -155,15 +187,24 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	buffer->dev = dev;
 	buffer->size = len;
 	mutex_init(&buffer->lock);
+	INIT_LIST_HEAD(&buffer->kmap_lru);
 	ion_buffer_add(dev, buffer);
 	return buffer;
 }
 
+static void ion_buffer_kmap_busy(struct ion_buffer *buffer);
+
 static void ion_buffer_destroy(struct kref *kref)
 {
 	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
 	struct ion_device *dev = buffer->dev;
 
+	/* drop the mappings the buffer kept cached */
+	ion_buffer_kmap_busy(buffer);
+	if (buffer->vaddr)
+		buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
+	if (buffer->sglist)
+		buffer->heap->ops->unmap_dma(buffer->heap, buffer);
 	buffer->heap->ops->free(buffer);
 	mutex_lock(&dev->lock);
 	rb_erase(&buffer->node, &dev->buffers);
@@ -382,6 +423,120 @@ static bool _ion_unmap(int *buffer_cnt, int *handle_cnt)
 	return false;
 }
 
+/*
+ * Mappings are not torn down when their last user goes away: the dma
+ * scatterlist stays with the buffer until it is freed, and the kernel
+ * mapping is parked on the device's kmap_lru, which is trimmed back to
+ * ion_kmap_cache_size.  Buffers bouncing between the decoder, compositor
+ * and display thus get mapped once.
+ */
+
+/* called with buffer->lock held when kmap_cnt drops to zero */
+static void ion_buffer_kmap_idle(struct ion_buffer *buffer)
+{
+	struct ion_device *dev = buffer->dev;
+
+	spin_lock(&dev->kmap_lock);
+	list_add_tail(&buffer->kmap_lru, &dev->kmap_lru);
+	dev->kmap_idle += buffer->size;
+	spin_unlock(&dev->kmap_lock);
+}
+
+/* take the buffer's idle kernel mapping off the lru, if it is there */
+static void ion_buffer_kmap_busy(struct ion_buffer *buffer)
+{
+	struct ion_device *dev = buffer->dev;
+
+	spin_lock(&dev->kmap_lock);
+	if (!list_empty(&buffer->kmap_lru)) {
+		list_del_init(&buffer->kmap_lru);
+		dev->kmap_idle -= buffer->size;
+	}
+	spin_unlock(&dev->kmap_lock);
+}
+
+/* must be called without any client or buffer lock held */
+static void ion_kmap_cache_trim(struct ion_device *dev)
+{
+	struct ion_buffer *buffer;
+
+	for (;;) {
+		spin_lock(&dev->kmap_lock);
+		if (dev->kmap_idle <= ion_kmap_cache_size) {
+			spin_unlock(&dev->kmap_lock);
+			break;
+		}
+		buffer = list_first_entry(&dev->kmap_lru, struct ion_buffer,
+					  kmap_lru);
+		list_del_init(&buffer->kmap_lru);
+		dev->kmap_idle -= buffer->size;
+		/* a buffer on its way out is unmapped by ion_buffer_destroy */
+		if (!atomic_inc_not_zero(&buffer->ref.refcount)) {
+			spin_unlock(&dev->kmap_lock);
+			continue;
+		}
+		spin_unlock(&dev->kmap_lock);
+
+		mutex_lock(&buffer->lock);
+		/* somebody may have picked the mapping up again meanwhile */
+		if (!buffer->kmap_cnt && buffer->vaddr &&
+		    list_empty(&buffer->kmap_lru)) {
+			buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
+			buffer->vaddr = NULL;
+		}
+		mutex_unlock(&buffer->lock);
+		ion_buffer_put(buffer);
+	}
+}
+
+static int ion_sg_nents(struct scatterlist *sglist)
+{
+	int nents = 0;
+
+	for (; sglist; sglist = sg_next(sglist))
+		nents++;
+	return nents;
+}
+
+/*
+ * Cache maintenance is only done when ownership of the buffer really
+ * changes hands.  As long as the cpu may still write to the buffer through
+ * a live kernel or userspace mapping, every dma map is treated as a
+ * transition, since we can't tell whether those mappings were used.
+ *
+ * Both must be called with buffer->lock held.
+ */
+static void ion_buffer_sync_for_device(struct ion_buffer *buffer)
+{
+	struct ion_heap *heap = buffer->heap;
+
+	if (buffer->owner == ION_OWNER_DEVICE && !buffer->kmap_cnt &&
+	    !atomic_read(&buffer->umap_cnt)) {
+		atomic_long_inc(&heap->sync_avoided);
+		return;
+	}
+	dma_sync_sg_for_device(buffer->dev->dev.this_device, buffer->sglist,
+			       ion_sg_nents(buffer->sglist),
+			       DMA_BIDIRECTIONAL);
+	buffer->owner = ION_OWNER_DEVICE;
+	atomic_long_inc(&heap->sync_for_device);
+}
+
+static void ion_buffer_sync_for_cpu(struct ion_buffer *buffer)
+{
+	struct ion_heap *heap = buffer->heap;
+
+	if (buffer->owner == ION_OWNER_CPU) {
+		atomic_long_inc(&heap->sync_avoided);
+		return;
+	}
+	/* only ion_buffer_sync_for_device hands the buffer to the device */
+	dma_sync_sg_for_cpu(buffer->dev->dev.this_device, buffer->sglist,
+			    ion_sg_nents(buffer->sglist), DMA_FROM_DEVICE);
+	buffer->owner = ION_OWNER_CPU;
+	atomic_long_inc(&heap->sync_for_cpu);
+}
+
 int ion_phys(struct ion_client *client, struct ion_handle *handle,
 	     ion_phys_addr_t *addr, size_t *len)
 {
@@ -403,7 +558,11 @@ int ion_phys(struct ion_client *client, struct ion_handle *handle,
 		return -ENODEV;
 	}
 	mutex_unlock(&client->lock);
+	mutex_lock(&buffer->lock);
+	/* the caller may hand the address to hardware, never move it again */
+	buffer->flags &= ~ION_FLAG_MOVABLE;
 	ret = buffer->heap->ops->phys(buffer->heap, buffer, addr, len);
+	mutex_unlock(&buffer->lock);
 	return ret;
 }
 
@@ -432,13 +591,25 @@ void *ion_map_kernel(struct ion_client *client, struct ion_handle *handle)
 	}
 
 	if (_ion_map(&buffer->kmap_cnt, &handle->kmap_cnt)) {
-		vaddr = buffer->heap->ops->map_kernel(buffer->heap, buffer);
-		if (IS_ERR_OR_NULL(vaddr))
-			_ion_unmap(&buffer->kmap_cnt, &handle->kmap_cnt);
-		buffer->vaddr = vaddr;
+		if (buffer->vaddr) {
+			ion_buffer_kmap_busy(buffer);
+			vaddr = buffer->vaddr;
+			atomic_long_inc(&buffer->heap->kmap_reused);
+		} else {
+			vaddr = buffer->heap->ops->map_kernel(buffer->heap,
+							      buffer);
+			if (IS_ERR_OR_NULL(vaddr))
+				_ion_unmap(&buffer->kmap_cnt,
+					   &handle->kmap_cnt);
+			else
+				buffer->vaddr = vaddr;
+			atomic_long_inc(&buffer->heap->kmap_created);
+		}
 	} else {
 		vaddr = buffer->vaddr;
 	}
+	if (!IS_ERR_OR_NULL(vaddr))
+		ion_buffer_sync_for_cpu(buffer);
 	mutex_unlock(&buffer->lock);
 	mutex_unlock(&client->lock);
 	return vaddr;
@@ -468,13 +639,24 @@ struct scatterlist *ion_map_dma(struct ion_client *client,
 		return ERR_PTR(-ENODEV);
 	}
 	if (_ion_map(&buffer->dmap_cnt, &handle->dmap_cnt)) {
-		sglist = buffer->heap->ops->map_dma(buffer->heap, buffer);
-		if (IS_ERR_OR_NULL(sglist))
-			_ion_unmap(&buffer->dmap_cnt, &handle->dmap_cnt);
-		buffer->sglist = sglist;
+		if (buffer->sglist) {
+			sglist = buffer->sglist;
+			atomic_long_inc(&buffer->heap->dmap_reused);
+		} else {
+			sglist = buffer->heap->ops->map_dma(buffer->heap,
+							    buffer);
+			if (IS_ERR_OR_NULL(sglist))
+				_ion_unmap(&buffer->dmap_cnt,
+					   &handle->dmap_cnt);
+			else
+				buffer->sglist = sglist;
+			atomic_long_inc(&buffer->heap->dmap_created);
+		}
 	} else {
 		sglist = buffer->sglist;
 	}
+	if (!IS_ERR_OR_NULL(sglist))
+		ion_buffer_sync_for_device(buffer);
 	mutex_unlock(&buffer->lock);
 	mutex_unlock(&client->lock);
 	return sglist;
@@ -483,16 +665,18 @@ struct scatterlist *ion_map_dma(struct ion_client *client,
 void ion_unmap_kernel(struct ion_client *client, struct ion_handle *handle)
 {
 	struct ion_buffer *buffer;
+	struct ion_device *dev;
 
 	mutex_lock(&client->lock);
 	buffer = handle->buffer;
+	/* the buffer may be freed as soon as the client lock is dropped */
+	dev = buffer->dev;
 	mutex_lock(&buffer->lock);
-	if (_ion_unmap(&buffer->kmap_cnt, &handle->kmap_cnt)) {
-		buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
-		buffer->vaddr = NULL;
-	}
+	if (_ion_unmap(&buffer->kmap_cnt, &handle->kmap_cnt))
+		ion_buffer_kmap_idle(buffer);
 	mutex_unlock(&buffer->lock);
 	mutex_unlock(&client->lock);
+	ion_kmap_cache_trim(dev);
 }
 
 void ion_unmap_dma(struct ion_client *client, struct ion_handle *handle)
@@ -502,10 +686,7 @@ void ion_unmap_dma(struct ion_client *client, struct ion_handle *handle)
 	mutex_lock(&client->lock);
 	buffer = handle->buffer;
 	mutex_lock(&buffer->lock);
-	if (_ion_unmap(&buffer->dmap_cnt, &handle->dmap_cnt)) {
-		buffer->heap->ops->unmap_dma(buffer->heap, buffer);
-		buffer->sglist = NULL;
-	}
+	_ion_unmap(&buffer->dmap_cnt, &handle->dmap_cnt);
 	mutex_unlock(&buffer->lock);
 	mutex_unlock(&client->lock);
 }
@@ -576,6 +757,11 @@ end:
 	return handle;
 }
 
+int is_ion_share_file(struct file *file)
+{
+	return file->f_op == &ion_share_fops;
+}
+
 static int ion_debug_client_show(struct seq_file *s, void *unused)
 {
 	struct ion_client *client = s->private;
@@ -789,6 +975,7 @@ static void ion_vma_open(struct vm_area_struct *vma)
 	struct ion_client *client;
 
 	pr_debug("%s: %d\n", __func__, __LINE__);
+	atomic_inc(&buffer->umap_cnt);
 	/* check that the client still exists and take a reference so
 	   it can't go away until this vma is closed */
 	client = ion_client_lookup(buffer->dev, current->group_leader);
@@ -810,6 +997,7 @@ static void ion_vma_close(struct vm_area_struct *vma)
 	struct ion_client *client;
 
 	pr_debug("%s: %d\n", __func__, __LINE__);
+	atomic_dec(&buffer->umap_cnt);
 	/* this indicates the client is gone, nothing to do here */
 	if (!handle)
 		return;
@@ -877,6 +1065,10 @@ static int ion_share_mmap(struct file *file, struct vm_area_struct *vma)
 	mutex_lock(&buffer->lock);
 	/* now map it to userspace */
 	ret = buffer->heap->ops->map_user(buffer->heap, buffer, vma);
+	if (!ret) {
+		atomic_inc(&buffer->umap_cnt);
+		ion_buffer_sync_for_cpu(buffer);
+	}
 	mutex_unlock(&buffer->lock);
 	if (ret) {
 		pr_err("%s: failure mapping buffer to userspace\n",
@@ -1073,6 +1265,7 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 	struct ion_heap *heap = s->private;
 	struct ion_device *dev = heap->dev;
 	struct rb_node *n;
+	int i;
 
 	seq_printf(s, "%16.s %16.s %16.s\n", "client", "pid", "size");
 	for (n = rb_first(&dev->user_clients); n; n = rb_next(n)) {
@@ -1097,6 +1290,28 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 		seq_printf(s, "%16.s %16u %16u\n", client->name, client->pid,
 			   size);
 	}
+
+	seq_printf(s, "\n%16s %16s\n", "alloc usecs <", "count");
+	for (i = 0; i < ION_ALLOC_HIST_BUCKETS - 1; i++)
+		seq_printf(s, "%16u %16lu\n", 1U << i, heap->alloc_hist[i]);
+	seq_printf(s, "%16s %16lu\n", "inf", heap->alloc_hist[i]);
+
+	seq_printf(s, "\n%16s %16s %16s\n", "mappings", "created", "reused");
+	seq_printf(s, "%16s %16ld %16ld\n", "kernel",
+		   atomic_long_read(&heap->kmap_created),
+		   atomic_long_read(&heap->kmap_reused));
+	seq_printf(s, "%16s %16ld %16ld\n", "dma",
+		   atomic_long_read(&heap->dmap_created),
+		   atomic_long_read(&heap->dmap_reused));
+	seq_printf(s, "\n%16s %16s %16s\n", "sync for cpu", "for device",
+		   "avoided");
+	seq_printf(s, "%16ld %16ld %16ld\n",
+		   atomic_long_read(&heap->sync_for_cpu),
+		   atomic_long_read(&heap->sync_for_device),
+		   atomic_long_read(&heap->sync_avoided));
+
+	if (heap->ops->debug_show)
+		heap->ops->debug_show(heap, s);
 	return 0;
 }
 
@@ -1175,6 +1390,8 @@ struct ion_device *ion_device_create(long (*custom_ioctl)
 	idev->heaps = RB_ROOT;
 	idev->user_clients = RB_ROOT;
 	idev->kernel_clients = RB_ROOT;
+	spin_lock_init(&idev->kmap_lock);
+	INIT_LIST_HEAD(&idev->kmap_lru);
 	return idev;
 }
 
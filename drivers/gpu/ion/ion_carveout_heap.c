@@ -13,38 +13,239 @@
  * GNU General Public License for more details.
  *
  */
-#include <linux/spinlock.h>
-
 #include <linux/err.h>
-#include <linux/genalloc.h>
 #include <linux/io.h>
 #include <linux/ion.h>
+#include <linux/list_sort.h>
 #include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
 #include <linux/scatterlist.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include "ion_priv.h"
 
 #include <asm/mach/map.h>
 
+/*
+ * The carveout is managed as a set of free extents, each kept in two trees:
+ * one ordered by address to coalesce neighbours on free, one ordered by
+ * size (then address) to find the best fitting extent in O(log n).  Best
+ * fit leaves the large extents alone for the large requests, which is what
+ * keeps full-HD frames allocatable after long uptimes with mixed sizes.
+ */
+struct ion_carveout_extent {
+	struct rb_node addr_node;
+	struct rb_node size_node;
+	ion_phys_addr_t base;
+	unsigned long size;
+};
+
+/* a buffer allocated with ION_FLAG_MOVABLE, candidate for compaction */
+struct ion_carveout_movable {
+	struct list_head list;
+	struct ion_buffer *buffer;
+	unsigned long size;
+	unsigned long align;	/* as allocated, kept when moved */
+};
+
 struct ion_carveout_heap {
 	struct ion_heap heap;
-	struct gen_pool *pool;
+	struct mutex lock;
+	struct rb_root free_by_addr;
+	struct rb_root free_by_size;
+	struct list_head movable;
 	ion_phys_addr_t base;
+	unsigned long size;
+	unsigned long free;
+	unsigned int nr_extents;
+	unsigned long compactions;
+	unsigned long bytes_moved;
 };
 
+static void extent_insert_addr(struct ion_carveout_heap *heap,
+			       struct ion_carveout_extent *ext)
+{
+	struct rb_node **p = &heap->free_by_addr.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (ext->base < rb_entry(parent, struct ion_carveout_extent,
+					 addr_node)->base)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&ext->addr_node, parent, p);
+	rb_insert_color(&ext->addr_node, &heap->free_by_addr);
+}
+
+static void extent_insert_size(struct ion_carveout_heap *heap,
+			       struct ion_carveout_extent *ext)
+{
+	struct rb_node **p = &heap->free_by_size.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		struct ion_carveout_extent *entry;
+
+		parent = *p;
+		entry = rb_entry(parent, struct ion_carveout_extent, size_node);
+		if (ext->size < entry->size ||
+		    (ext->size == entry->size && ext->base < entry->base))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&ext->size_node, parent, p);
+	rb_insert_color(&ext->size_node, &heap->free_by_size);
+}
+
+/* smallest free extent of at least 'size' bytes */
+static struct rb_node *extent_lower_bound(struct ion_carveout_heap *heap,
+					  unsigned long size)
+{
+	struct rb_node *n = heap->free_by_size.rb_node;
+	struct rb_node *found = NULL;
+
+	while (n) {
+		if (rb_entry(n, struct ion_carveout_extent,
+			     size_node)->size >= size) {
+			found = n;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	return found;
+}
+
+static bool extent_fits(struct ion_carveout_extent *ext, unsigned long size,
+			unsigned long align, ion_phys_addr_t *start)
+{
+	*start = ALIGN(ext->base, align);
+	return *start + size <= ext->base + ext->size;
+}
+
+/*
+ * Carve [start, start + size) out of 'ext'.  'tail' is a preallocated
+ * extent for what is left above the allocation; it is freed if unused.
+ */
+static void extent_take(struct ion_carveout_heap *heap,
+			struct ion_carveout_extent *ext,
+			struct ion_carveout_extent *tail,
+			ion_phys_addr_t start, unsigned long size)
+{
+	ion_phys_addr_t end = ext->base + ext->size;
+
+	rb_erase(&ext->size_node, &heap->free_by_size);
+	if (start > ext->base) {
+		ext->size = start - ext->base;
+		extent_insert_size(heap, ext);
+	} else {
+		rb_erase(&ext->addr_node, &heap->free_by_addr);
+		kfree(ext);
+		heap->nr_extents--;
+	}
+
+	if (start + size < end) {
+		tail->base = start + size;
+		tail->size = end - tail->base;
+		extent_insert_addr(heap, tail);
+		extent_insert_size(heap, tail);
+		heap->nr_extents++;
+	} else {
+		kfree(tail);
+	}
+	heap->free -= size;
+}
+
+static void extent_release(struct ion_carveout_heap *heap,
+			   ion_phys_addr_t addr, unsigned long size,
+			   struct ion_carveout_extent *new)
+{
+	struct ion_carveout_extent *prev = NULL, *next = NULL;
+	struct rb_node *n = heap->free_by_addr.rb_node;
+
+	/* find the free neighbours on either side */
+	while (n) {
+		struct ion_carveout_extent *ext;
+
+		ext = rb_entry(n, struct ion_carveout_extent, addr_node);
+		if (ext->base < addr) {
+			prev = ext;
+			n = n->rb_right;
+		} else {
+			next = ext;
+			n = n->rb_left;
+		}
+	}
+	heap->free += size;
+
+	if (prev && prev->base + prev->size == addr) {
+		rb_erase(&prev->size_node, &heap->free_by_size);
+		prev->size += size;
+		if (next && addr + size == next->base) {
+			prev->size += next->size;
+			rb_erase(&next->size_node, &heap->free_by_size);
+			rb_erase(&next->addr_node, &heap->free_by_addr);
+			kfree(next);
+			heap->nr_extents--;
+		}
+		extent_insert_size(heap, prev);
+		kfree(new);
+	} else if (next && addr + size == next->base) {
+		rb_erase(&next->size_node, &heap->free_by_size);
+		next->base = addr;
+		next->size += size;
+		extent_insert_size(heap, next);
+		kfree(new);
+	} else {
+		new->base = addr;
+		new->size = size;
+		extent_insert_addr(heap, new);
+		extent_insert_size(heap, new);
+		heap->nr_extents++;
+	}
+}
+
 ion_phys_addr_t ion_carveout_allocate(struct ion_heap *heap,
 				      unsigned long size,
 				      unsigned long align)
 {
 	struct ion_carveout_heap *carveout_heap =
 		container_of(heap, struct ion_carveout_heap, heap);
-	unsigned long offset = gen_pool_alloc(carveout_heap->pool, size);
+	struct ion_carveout_extent *ext = NULL, *tail;
+	ion_phys_addr_t start = ION_CARVEOUT_ALLOCATE_FAIL;
+	struct rb_node *n;
+
+	size = PAGE_ALIGN(size);
+	align = max_t(unsigned long, align, PAGE_SIZE);
+	if (!size || align & (align - 1))
+		return ION_CARVEOUT_ALLOCATE_FAIL;
 
-	if (!offset)
+	tail = kmalloc(sizeof(struct ion_carveout_extent), GFP_KERNEL);
+	if (!tail)
 		return ION_CARVEOUT_ALLOCATE_FAIL;
 
-	return offset;
+	mutex_lock(&carveout_heap->lock);
+	/* the best fit is the smallest extent that still fits once aligned */
+	for (n = extent_lower_bound(carveout_heap, size); n; n = rb_next(n)) {
+		ext = rb_entry(n, struct ion_carveout_extent, size_node);
+		if (extent_fits(ext, size, align, &start))
+			break;
+	}
+	if (n) {
+		extent_take(carveout_heap, ext, tail, start, size);
+	} else {
+		start = ION_CARVEOUT_ALLOCATE_FAIL;
+		kfree(tail);
+	}
+	mutex_unlock(&carveout_heap->lock);
+
+	return start;
 }
 
 void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
@@ -52,10 +253,17 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 {
 	struct ion_carveout_heap *carveout_heap =
 		container_of(heap, struct ion_carveout_heap, heap);
+	struct ion_carveout_extent *new;
 
 	if (addr == ION_CARVEOUT_ALLOCATE_FAIL)
 		return;
-	gen_pool_free(carveout_heap->pool, addr, size);
+
+	/* freeing can't fail, the extent is only used if nothing merges */
+	new = kmalloc(sizeof(struct ion_carveout_extent),
+		      GFP_KERNEL | __GFP_NOFAIL);
+	mutex_lock(&carveout_heap->lock);
+	extent_release(carveout_heap, addr, PAGE_ALIGN(size), new);
+	mutex_unlock(&carveout_heap->lock);
 }
 
 static int ion_carveout_heap_phys(struct ion_heap *heap,
@@ -72,13 +280,55 @@ static int ion_carveout_heap_allocate(struct ion_heap *heap,
 				      unsigned long size, unsigned long align,
 				      unsigned long flags)
 {
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+	struct ion_carveout_movable *movable = NULL;
+
+	if (flags & ION_FLAG_MOVABLE) {
+		movable = kmalloc(sizeof(struct ion_carveout_movable),
+				  GFP_KERNEL);
+		if (!movable)
+			return -ENOMEM;
+	}
+
 	buffer->priv_phys = ion_carveout_allocate(heap, size, align);
-	return buffer->priv_phys == ION_CARVEOUT_ALLOCATE_FAIL ? -ENOMEM : 0;
+	if (buffer->priv_phys == ION_CARVEOUT_ALLOCATE_FAIL) {
+		kfree(movable);
+		return -ENOMEM;
+	}
+
+	if (movable) {
+		movable->buffer = buffer;
+		movable->size = PAGE_ALIGN(size);
+		movable->align = max_t(unsigned long, align, PAGE_SIZE);
+		mutex_lock(&carveout_heap->lock);
+		list_add(&movable->list, &carveout_heap->movable);
+		mutex_unlock(&carveout_heap->lock);
+	}
+	return 0;
 }
 
 static void ion_carveout_heap_free(struct ion_buffer *buffer)
 {
 	struct ion_heap *heap = buffer->heap;
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+	struct ion_carveout_movable *movable;
+
+	/*
+	 * The buffer flags may have lost ION_FLAG_MOVABLE through ion_phys(),
+	 * so always look.  The heap lock also waits out a compaction that
+	 * might be moving the buffer right now.
+	 */
+	mutex_lock(&carveout_heap->lock);
+	list_for_each_entry(movable, &carveout_heap->movable, list) {
+		if (movable->buffer == buffer) {
+			list_del(&movable->list);
+			kfree(movable);
+			break;
+		}
+	}
+	mutex_unlock(&carveout_heap->lock);
 
 	ion_carveout_free(heap, buffer->priv_phys, buffer->size);
 	buffer->priv_phys = ION_CARVEOUT_ALLOCATE_FAIL;
@@ -120,6 +370,145 @@ int ion_carveout_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 			       pgprot_noncached(vma->vm_page_prot));
 }
 
+static int movable_cmp(void *priv, struct list_head *a, struct list_head *b)
+{
+	struct ion_buffer *ba = list_entry(a, struct ion_carveout_movable,
+					   list)->buffer;
+	struct ion_buffer *bb = list_entry(b, struct ion_carveout_movable,
+					   list)->buffer;
+
+	/* highest address first */
+	if (ba->priv_phys == bb->priv_phys)
+		return 0;
+	return ba->priv_phys < bb->priv_phys ? 1 : -1;
+}
+
+/*
+ * A buffer can be moved while nobody can observe its address: it must
+ * still be movable (ion_phys() was never called on it) and have no dma,
+ * kernel (even an idle cached one) or userspace mapping.  The buffer lock
+ * keeps new mappings out while it is being copied.
+ */
+static bool ion_carveout_buffer_movable(struct ion_buffer *buffer)
+{
+	return (buffer->flags & ION_FLAG_MOVABLE) &&
+		atomic_read(&buffer->ref.refcount) &&
+		!buffer->dmap_cnt && !buffer->sglist &&
+		!buffer->kmap_cnt && !buffer->vaddr &&
+		!atomic_read(&buffer->umap_cnt);
+}
+
+static bool ion_carveout_move(struct ion_carveout_heap *heap,
+			      struct ion_carveout_movable *movable,
+			      struct ion_carveout_extent *tail)
+{
+	struct ion_buffer *buffer = movable->buffer;
+	unsigned long size = movable->size;
+	struct ion_carveout_extent *ext;
+	ion_phys_addr_t start;
+	void *src, *dst;
+	struct rb_node *n;
+
+	/* lowest extent below the buffer that can take it */
+	for (n = rb_first(&heap->free_by_addr); n; n = rb_next(n)) {
+		ext = rb_entry(n, struct ion_carveout_extent, addr_node);
+		if (ext->base >= buffer->priv_phys)
+			return false;
+		if (extent_fits(ext, size, movable->align, &start))
+			break;
+	}
+	if (!n)
+		return false;
+
+	src = __arch_ioremap(buffer->priv_phys, size, MT_MEMORY_NONCACHED);
+	dst = __arch_ioremap(start, size, MT_MEMORY_NONCACHED);
+	if (!src || !dst) {
+		if (src)
+			__arch_iounmap(src);
+		if (dst)
+			__arch_iounmap(dst);
+		return false;
+	}
+
+	extent_take(heap, ext, tail, start, size);
+	memcpy(dst, src, size);
+	__arch_iounmap(src);
+	__arch_iounmap(dst);
+
+	extent_release(heap, buffer->priv_phys, size,
+		       kmalloc(sizeof(struct ion_carveout_extent),
+			       GFP_KERNEL | __GFP_NOFAIL));
+	buffer->priv_phys = start;
+	heap->bytes_moved += size;
+	return true;
+}
+
+/*
+ * Slide movable buffers down into the lowest free extents that take them,
+ * starting with the highest buffer, so that free space collects at the
+ * top of the carveout.
+ */
+static unsigned long ion_carveout_heap_compact(struct ion_heap *heap)
+{
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+	struct ion_carveout_movable *movable;
+	unsigned long moved = 0;
+
+	mutex_lock(&carveout_heap->lock);
+	carveout_heap->compactions++;
+	list_sort(NULL, &carveout_heap->movable, movable_cmp);
+	list_for_each_entry(movable, &carveout_heap->movable, list) {
+		struct ion_buffer *buffer = movable->buffer;
+		struct ion_carveout_extent *tail;
+
+		if (!mutex_trylock(&buffer->lock))
+			continue;
+		if (!ion_carveout_buffer_movable(buffer)) {
+			mutex_unlock(&buffer->lock);
+			continue;
+		}
+		tail = kmalloc(sizeof(struct ion_carveout_extent), GFP_KERNEL);
+		if (tail && ion_carveout_move(carveout_heap, movable, tail))
+			moved += movable->size;
+		else
+			kfree(tail);
+		mutex_unlock(&buffer->lock);
+	}
+	mutex_unlock(&carveout_heap->lock);
+
+	return moved;
+}
+
+static void ion_carveout_heap_debug_show(struct ion_heap *heap,
+					 struct seq_file *s)
+{
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+	unsigned long largest = 0;
+	struct rb_node *n;
+
+	mutex_lock(&carveout_heap->lock);
+	n = rb_last(&carveout_heap->free_by_size);
+	if (n)
+		largest = rb_entry(n, struct ion_carveout_extent,
+				   size_node)->size;
+	seq_printf(s, "\n%16s %16lu\n", "total", carveout_heap->size);
+	seq_printf(s, "%16s %16lu\n", "free", carveout_heap->free);
+	seq_printf(s, "%16s %16lu\n", "largest free", largest);
+	seq_printf(s, "%16s %16u\n", "free extents",
+		   carveout_heap->nr_extents);
+	/* 0 when all free memory is one extent, towards 1000 when shattered */
+	seq_printf(s, "%16s %16lu\n", "frag index",
+		   carveout_heap->free ? 1000 - (unsigned long)
+		   div_u64((u64)largest * 1000, carveout_heap->free) : 0);
+	seq_printf(s, "%16s %16lu\n", "compactions",
+		   carveout_heap->compactions);
+	seq_printf(s, "%16s %16lu\n", "bytes moved",
+		   carveout_heap->bytes_moved);
+	mutex_unlock(&carveout_heap->lock);
+}
+
 static struct ion_heap_ops carveout_heap_ops = {
 	.allocate = ion_carveout_heap_allocate,
 	.free = ion_carveout_heap_free,
@@ -127,6 +516,8 @@ static struct ion_heap_ops carveout_heap_ops = {
 	.map_user = ion_carveout_heap_map_user,
 	.map_kernel = ion_carveout_heap_map_kernel,
 	.unmap_kernel = ion_carveout_heap_unmap_kernel,
+	.debug_show = ion_carveout_heap_debug_show,
+	.compact = ion_carveout_heap_compact,
 };
 
 struct ion_heap *ion_carveout_heap_create(struct ion_platform_heap *heap_data)
@@ -137,14 +528,27 @@ struct ion_heap *ion_carveout_heap_create(struct ion_platform_heap *heap_data)
 	if (!carveout_heap)
 		return ERR_PTR(-ENOMEM);
 
-	carveout_heap->pool = gen_pool_create(12, -1);
-	if (!carveout_heap->pool) {
-		kfree(carveout_heap);
-		return ERR_PTR(-ENOMEM);
-	}
+	mutex_init(&carveout_heap->lock);
+	carveout_heap->free_by_addr = RB_ROOT;
+	carveout_heap->free_by_size = RB_ROOT;
+	INIT_LIST_HEAD(&carveout_heap->movable);
 	carveout_heap->base = heap_data->base;
-	gen_pool_add(carveout_heap->pool, carveout_heap->base, heap_data->size,
-		     -1);
+	carveout_heap->size = heap_data->size & PAGE_MASK;
+	if (carveout_heap->size) {
+		struct ion_carveout_extent *ext;
+
+		ext = kmalloc(sizeof(struct ion_carveout_extent), GFP_KERNEL);
+		if (!ext) {
+			kfree(carveout_heap);
+			return ERR_PTR(-ENOMEM);
+		}
+		ext->base = carveout_heap->base;
+		ext->size = carveout_heap->size;
+		extent_insert_addr(carveout_heap, ext);
+		extent_insert_size(carveout_heap, ext);
+		carveout_heap->nr_extents = 1;
+		carveout_heap->free = ext->size;
+	}
 	carveout_heap->heap.ops = &carveout_heap_ops;
 	carveout_heap->heap.type = ION_HEAP_TYPE_CARVEOUT;
 
@@ -155,8 +559,12 @@ void ion_carveout_heap_destroy(struct ion_heap *heap)
 {
 	struct ion_carveout_heap *carveout_heap =
 	     container_of(heap, struct  ion_carveout_heap, heap);
+	struct rb_node *n;
 
-	gen_pool_destroy(carveout_heap->pool);
+	while ((n = rb_first(&carveout_heap->free_by_addr))) {
+		rb_erase(n, &carveout_heap->free_by_addr);
+		kfree(rb_entry(n, struct ion_carveout_extent, addr_node));
+	}
 	kfree(carveout_heap);
 	carveout_heap = NULL;
 }
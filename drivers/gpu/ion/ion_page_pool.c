@@ -0,0 +1,178 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/err.h>
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include "ion_priv.h"
+
+/*
+ * Pages handed back to a pool still hold the previous owner's data.  They
+ * are parked on the dirty list and a worker clears them in the background,
+ * moving them to the clean list; an allocation that finds only dirty pages
+ * clears one inline, which is still far cheaper than a trip through the
+ * buddy allocator for a high-order chunk.  The pages are chained through
+ * page->lru, which is unused while we own them.
+ */
+
+static void ion_page_pool_zero(struct ion_page_pool *pool, struct page *page)
+{
+	int i;
+
+	for (i = 0; i < (1 << pool->order); i++)
+		clear_highpage(page + i);
+}
+
+static void ion_page_pool_zero_worker(struct work_struct *work)
+{
+	struct ion_page_pool *pool = container_of(work, struct ion_page_pool,
+						  zero_work);
+	struct page *page;
+
+	for (;;) {
+		spin_lock(&pool->lock);
+		if (list_empty(&pool->dirty_items)) {
+			spin_unlock(&pool->lock);
+			break;
+		}
+		page = list_first_entry(&pool->dirty_items, struct page, lru);
+		list_del(&page->lru);
+		pool->dirty_count--;
+		spin_unlock(&pool->lock);
+
+		ion_page_pool_zero(pool, page);
+
+		spin_lock(&pool->lock);
+		list_add_tail(&page->lru, &pool->clean_items);
+		pool->clean_count++;
+		spin_unlock(&pool->lock);
+		cond_resched();
+	}
+}
+
+struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct page *page = NULL;
+	bool dirty = false;
+
+	spin_lock(&pool->lock);
+	if (pool->clean_count) {
+		page = list_first_entry(&pool->clean_items, struct page, lru);
+		pool->clean_count--;
+	} else if (pool->dirty_count) {
+		page = list_first_entry(&pool->dirty_items, struct page, lru);
+		pool->dirty_count--;
+		dirty = true;
+	}
+	if (page) {
+		list_del(&page->lru);
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+	spin_unlock(&pool->lock);
+
+	if (!page)
+		return alloc_pages(pool->gfp_mask | __GFP_ZERO, pool->order);
+	if (dirty)
+		ion_page_pool_zero(pool, page);
+	return page;
+}
+
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	spin_lock(&pool->lock);
+	list_add_tail(&page->lru, &pool->dirty_items);
+	pool->dirty_count++;
+	spin_unlock(&pool->lock);
+	queue_work(system_unbound_wq, &pool->zero_work);
+}
+
+/*
+ * Returns the number of pages still held by the pool after trying to give
+ * back 'nr_to_scan' of them; dirty pages go first since they would need
+ * clearing before reuse anyway.
+ */
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_scan)
+{
+	int freed = 0;
+	int count;
+
+	while (freed < nr_to_scan) {
+		struct page *page;
+
+		spin_lock(&pool->lock);
+		if (pool->dirty_count) {
+			page = list_first_entry(&pool->dirty_items,
+						struct page, lru);
+			pool->dirty_count--;
+		} else if (pool->clean_count) {
+			page = list_first_entry(&pool->clean_items,
+						struct page, lru);
+			pool->clean_count--;
+		} else {
+			spin_unlock(&pool->lock);
+			break;
+		}
+		list_del(&page->lru);
+		spin_unlock(&pool->lock);
+
+		__free_pages(page, pool->order);
+		freed += 1 << pool->order;
+	}
+
+	spin_lock(&pool->lock);
+	count = (pool->clean_count + pool->dirty_count) << pool->order;
+	spin_unlock(&pool->lock);
+	return count;
+}
+
+void ion_page_pool_debug_show(struct ion_page_pool *pool, struct seq_file *s)
+{
+	spin_lock(&pool->lock);
+	seq_printf(s, "%8u %8d %8d %10lu %10lu\n", pool->order,
+		   pool->clean_count, pool->dirty_count, pool->hits,
+		   pool->misses);
+	spin_unlock(&pool->lock);
+}
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
+{
+	struct ion_page_pool *pool = kzalloc(sizeof(struct ion_page_pool),
+					     GFP_KERNEL);
+	if (!pool)
+		return NULL;
+	INIT_LIST_HEAD(&pool->clean_items);
+	INIT_LIST_HEAD(&pool->dirty_items);
+	spin_lock_init(&pool->lock);
+	INIT_WORK(&pool->zero_work, ion_page_pool_zero_worker);
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+	return pool;
+}
+
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	cancel_work_sync(&pool->zero_work);
+	ion_page_pool_shrink(pool, INT_MAX);
+	kfree(pool);
+}
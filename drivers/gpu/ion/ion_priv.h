@@ -21,8 +21,12 @@
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/ion.h>
 
+struct seq_file;
+
 struct ion_mapping;
 
 struct ion_dma_mapping {
@@ -51,9 +55,15 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  *			an ion_phys_addr_t (and someday a phys_addr_t)
  * @lock:		protects the buffers cnt fields
  * @kmap_cnt:		number of times the buffer is mapped to the kernel
- * @vaddr:		the kenrel mapping if kmap_cnt is not zero
+ * @vaddr:		the kernel mapping; kept after kmap_cnt drops to zero
+ *			until the buffer is freed or the mapping evicted
+ * @kmap_lru:		entry in the device's list of idle kernel mappings
  * @dmap_cnt:		number of times the buffer is mapped for dma
- * @sglist:		the scatterlist for the buffer is dmap_cnt is not zero
+ * @sglist:		the scatterlist for the buffer; kept after dmap_cnt
+ *			drops to zero until the buffer is freed
+ * @umap_cnt:		number of userspace vmas mapping the buffer
+ * @owner:		ION_OWNER_CPU or ION_OWNER_DEVICE, who last had the
+ *			buffer and its caches
 */
 struct ion_buffer {
 	struct kref ref;
@@ -69,10 +79,16 @@ struct ion_buffer {
 	struct mutex lock;
 	int kmap_cnt;
 	void *vaddr;
+	struct list_head kmap_lru;
 	int dmap_cnt;
 	struct scatterlist *sglist;
+	atomic_t umap_cnt;
+	int owner;
 };
 
+#define ION_OWNER_CPU		0
+#define ION_OWNER_DEVICE	1
+
 /**
  * struct ion_heap_ops - ops to operate on a given heap
  * @allocate:		allocate memory
@@ -84,6 +100,11 @@ struct ion_buffer {
  * @map_kernel		map memory to the kernel
  * @unmap_kernel	unmap memory to the kernel
  * @map_user		map memory to userspace
+ * @debug_show		print heap specific state into the heap's debugfs
+ *			file (optional)
+ * @compact		relocate movable buffers to defragment the heap,
+ *			returns the number of bytes moved (optional).  Called
+ *			with the device lock held when an allocation failed.
  */
 struct ion_heap_ops {
 	int (*allocate) (struct ion_heap *heap,
@@ -99,8 +120,16 @@ struct ion_heap_ops {
 	void (*unmap_kernel) (struct ion_heap *heap, struct ion_buffer *buffer);
 	int (*map_user) (struct ion_heap *mapper, struct ion_buffer *buffer,
 			 struct vm_area_struct *vma);
+	void (*debug_show) (struct ion_heap *heap, struct seq_file *s);
+	unsigned long (*compact) (struct ion_heap *heap);
 };
 
+/*
+ * Allocation latency histogram buckets: bucket i counts allocations that
+ * took less than 2^i microseconds, the last one everything slower.
+ */
+#define ION_ALLOC_HIST_BUCKETS	16
+
 /**
  * struct ion_heap - represents a heap in the system
  * @node:		rb node to put the heap on the device's tree of heaps
@@ -111,6 +140,15 @@ struct ion_heap_ops {
  *			allocating.  These are specified by platform data and
  *			MUST be unique
  * @name:		used for debugging
+ * @alloc_hist:		allocation latency histogram, see
+ *			ION_ALLOC_HIST_BUCKETS; protected by the device lock
+ * @kmap_created:	kernel mappings created by the heap
+ * @kmap_reused:	idle cached kernel mappings handed out again
+ * @dmap_created:	dma mappings created by the heap
+ * @dmap_reused:	idle cached dma mappings handed out again
+ * @sync_for_cpu:	cache invalidates on device to cpu transitions
+ * @sync_for_device:	cache cleans on cpu to device transitions
+ * @sync_avoided:	maps that needed no cache maintenance
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -124,6 +162,14 @@ struct ion_heap {
 	struct ion_heap_ops *ops;
 	int id;
 	const char *name;
+	unsigned long alloc_hist[ION_ALLOC_HIST_BUCKETS];
+	atomic_long_t kmap_created;
+	atomic_long_t kmap_reused;
+	atomic_long_t dmap_created;
+	atomic_long_t dmap_reused;
+	atomic_long_t sync_for_cpu;
+	atomic_long_t sync_for_device;
+	atomic_long_t sync_avoided;
 };
 
 /**
@@ -175,6 +221,51 @@ ion_phys_addr_t ion_carveout_allocate(struct ion_heap *heap, unsigned long size,
 				      unsigned long align);
 void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 		       unsigned long size);
+/**
+ * struct ion_page_pool - pagepool struct
+ * @clean_count:	number of zeroed items in the pool
+ * @dirty_count:	number of items still waiting to be zeroed
+ * @clean_items:	list of zeroed pages
+ * @dirty_items:	list of pages waiting to be zeroed
+ * @lock:		protects the lists, counts and statistics
+ * @zero_work:		background work clearing the dirty items
+ * @gfp_mask:		gfp_mask to use from alloc
+ * @order:		order of pages in the pool
+ * @hits:		allocations served from the pool
+ * @misses:		allocations that fell back to the page allocator
+ *
+ * Allows you to keep a pool of pre allocated pages to use from your heap.
+ * Recycling already zeroed chunks of the heap's allocation orders keeps both
+ * the page allocator and page clearing off the allocation path.  The pool
+ * is only trimmed by the heap's shrinker.
+ */
+struct ion_page_pool {
+	int clean_count;
+	int dirty_count;
+	struct list_head clean_items;
+	struct list_head dirty_items;
+	spinlock_t lock;
+	struct work_struct zero_work;
+	gfp_t gfp_mask;
+	unsigned int order;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+/**
+ * ion_page_pool_shrink - shrinks the size of the memory cached in the pool
+ * @pool:		the pool
+ * @nr_to_scan:		number of pages to free, 0 just reports the size
+ *
+ * returns the number of pages left in the pool
+ */
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_scan);
+void ion_page_pool_debug_show(struct ion_page_pool *pool, struct seq_file *s);
+
 /**
  * The carveout heap returns physical addresses, since 0 may be a valid
  * physical address, this is used to indicate allocation failed
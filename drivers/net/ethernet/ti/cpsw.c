@@ -28,6 +28,7 @@
 #include <linux/delay.h>
 #include <linux/interrupt.h>
 #include <linux/pm_runtime.h>
+#include <linux/prefetch.h>
 #include <linux/if_vlan.h>
 #include <linux/net_switch_config.h>
 
@@ -70,6 +71,8 @@ do {								\
 #define CPSW_MIN_PACKET_SIZE	60
 #define CPSW_MAX_PACKET_SIZE	(1500 + 14 + 4 + 4)
 #define CPSW_PHY_SPEED		1000
+/* Bytes of a large frame copied into the skb head, enough for GRO */
+#define CPSW_RX_HDR_LEN		128
 
 #define CPSW_PRIMAP(shift, priority)	(priority << (shift * 4))
 
@@ -197,18 +200,21 @@ do {								\
 	do {							\
 		(func)((priv)->slaves + priv->emac_port, ##arg);\
 	} while (0)
-#define cpsw_dual_emac_source_port_detect(status, priv, ndev, skb)	\
+#define cpsw_dual_emac_source_port_detect(status, priv, ndev)		\
 	do {								\
 		if (CPDMA_RX_SOURCE_PORT(status) == 1) {		\
 			ndev = cpsw_get_slave_ndev(priv, 0);		\
 			priv = netdev_priv(ndev);			\
-			skb->dev = ndev;				\
 		} else if (CPDMA_RX_SOURCE_PORT(status) == 2) {		\
 			ndev = cpsw_get_slave_ndev(priv, 1);		\
 			priv = netdev_priv(ndev);			\
-			skb->dev = ndev;				\
 		}							\
 	} while (0)
+/*
+ * Either slave's napi may be the one polling the shared rx channel, so
+ * the frame can't be held back for GRO on the napi of its own port.
+ */
+#define cpsw_rx_deliver(priv, skb)	netif_receive_skb(skb)
 #define cpsw_add_switch_mode_bcast_ale_entries(priv, slave_port)
 #define cpsw_update_slave_open_state(priv, state)		\
 	priv->slaves[priv->emac_port].open_stat = state;
@@ -229,7 +235,8 @@ do {								\
 		for (idx = 0; idx < (priv)->data.slaves; idx++)	\
 			(func)((priv)->slaves + idx, ##arg);	\
 	} while (0)
-#define cpsw_dual_emac_source_port_detect(status, priv, ndev, skb)
+#define cpsw_dual_emac_source_port_detect(status, priv, ndev)
+#define cpsw_rx_deliver(priv, skb)	napi_gro_receive(&(priv)->napi, skb)
 #define cpsw_add_switch_mode_bcast_ale_entries(priv, slave_port)	\
 	cpsw_ale_add_mcast(priv->ale, priv->ndev->broadcast,		\
 			   1 << slave_port, 0, 0)
@@ -264,6 +271,28 @@ static int rx_packet_max = CPSW_MAX_PACKET_SIZE;
 module_param(rx_packet_max, int, 0);
 MODULE_PARM_DESC(rx_packet_max, "maximum receive packet size (bytes)");
 
+static int rx_copybreak = 256;
+module_param(rx_copybreak, int, 0644);
+MODULE_PARM_DESC(rx_copybreak, "copy received frames up to this size into "
+		 "a new skb and recycle the rx buffer (bytes)");
+
+static int tx_queue_bytes = 32 * 1024;
+module_param(tx_queue_bytes, int, 0644);
+MODULE_PARM_DESC(tx_queue_bytes, "stop the tx queue once this many bytes "
+		 "are queued to the hardware, 0 for no limit (bytes)");
+
+/*
+ * Receive buffers are halves of a page (or of a higher order block for
+ * large rx_packet_max). The half holding a large frame is attached to the
+ * skb and the other half is submitted in its place when the page is not
+ * shared with the stack anymore.
+ */
+struct cpsw_rx_buf {
+	struct net_device	*ndev;
+	struct page		*page;
+	unsigned int		page_offset;
+};
+
 struct cpsw_wr_regs {
 	u32	id_ver;
 	u32	soft_reset;
@@ -405,6 +434,9 @@ struct cpsw_priv {
 	u32 irqs_table[4];
 	u32 num_irqs;
 	struct cpts *cpts;
+	/* bytes handed to cpdma and bytes completed, both free running */
+	unsigned int			tx_sent_bytes;
+	unsigned int			tx_done_bytes;
 };
 
 static inline u32 slave_read(struct cpsw_slave *slave, u32 offset)
@@ -654,10 +686,10 @@ static inline int cpsw_tx_packet_submit(struct net_device *ndev,
 {
 	if (ndev == cpsw_get_slave_ndev(priv, 0))
 		return cpdma_chan_submit(priv->txch, skb, skb->data,
-				  skb->len, 1, GFP_KERNEL);
+				  skb->len, 1, GFP_ATOMIC);
 	else
 		return cpdma_chan_submit(priv->txch, skb, skb->data,
-				  skb->len, 2, GFP_KERNEL);
+				  skb->len, 2, GFP_ATOMIC);
 }
 
 #define cpsw_add_switch_mode_default_ale_entries(priv)
@@ -749,7 +781,7 @@ static void cpsw_ndo_change_rx_flags(struct net_device *ndev, int flags)
 #define cpsw_common_res_usage_state(priv)	0
 #define cpsw_tx_packet_submit(ndev, priv, skb)		\
 	cpdma_chan_submit(priv->txch, skb, skb->data,	\
-			  skb->len, 0, GFP_KERNEL)
+			  skb->len, 0, GFP_ATOMIC)
 
 static inline void cpsw_add_switch_mode_default_ale_entries(
 			struct cpsw_priv *priv)
@@ -783,63 +815,151 @@ static void cpsw_intr_disable(struct cpsw_priv *priv)
 	return;
 }
 
+static inline bool cpsw_tx_queue_full(struct cpsw_priv *priv)
+{
+	int limit = ACCESS_ONCE(tx_queue_bytes);
+
+	return limit > 0 && (int)(priv->tx_sent_bytes -
+				  ACCESS_ONCE(priv->tx_done_bytes)) >= limit;
+}
+
 void cpsw_tx_handler(void *token, int len, int status)
 {
 	struct sk_buff		*skb = token;
 	struct net_device	*ndev = skb->dev;
 	struct cpsw_priv	*priv = netdev_priv(ndev);
 
-	if (unlikely(netif_queue_stopped(ndev)))
-		netif_start_queue(ndev);
+	priv->tx_done_bytes += skb->len;
+	/* pairs with the barrier in cpsw_ndo_start_xmit() */
+	smp_mb();
+	if (unlikely(netif_queue_stopped(ndev)) && !cpsw_tx_queue_full(priv))
+		netif_wake_queue(ndev);
 	cpts_tx_timestamp(priv->cpts, skb);
 	priv->stats.tx_packets++;
 	priv->stats.tx_bytes += len;
 	dev_kfree_skb_any(skb);
 }
 
-void cpsw_rx_handler(void *token, int len, int status)
+static inline int cpsw_rx_buf_order(struct cpsw_priv *priv)
 {
-	struct sk_buff		*skb = token;
-	struct net_device	*ndev = skb->dev;
-	struct cpsw_priv	*priv = netdev_priv(ndev);
-	int			ret = 0;
+	return get_order(2 * priv->rx_packet_max);
+}
 
-	cpsw_dual_emac_source_port_detect(status, priv, ndev, skb);
+static inline unsigned int cpsw_rx_buf_size(struct cpsw_priv *priv)
+{
+	return (PAGE_SIZE << cpsw_rx_buf_order(priv)) / 2;
+}
 
-	if (unlikely(!netif_running(ndev)) ||
-			unlikely(!netif_carrier_ok(ndev))) {
-		dev_kfree_skb_any(skb);
-		return;
-	}
+static struct cpsw_rx_buf *cpsw_rx_buf_alloc(struct cpsw_priv *priv)
+{
+	struct cpsw_rx_buf *buf;
 
-	if (likely(status >= 0)) {
-		skb_put(skb, len);
-		cpts_rx_timestamp(priv->cpts, skb);
-		skb->protocol = eth_type_trans(skb, ndev);
-		netif_receive_skb(skb);
-		priv->stats.rx_bytes += len;
-		priv->stats.rx_packets++;
-		skb = NULL;
+	buf = kmalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return NULL;
+	buf->page = alloc_pages(GFP_KERNEL | __GFP_COLD | __GFP_COMP,
+				cpsw_rx_buf_order(priv));
+	if (!buf->page) {
+		kfree(buf);
+		return NULL;
 	}
+	buf->ndev = priv->ndev;
+	buf->page_offset = 0;
+	return buf;
+}
 
+static void cpsw_rx_buf_free(struct cpsw_rx_buf *buf)
+{
+	put_page(buf->page);
+	kfree(buf);
+}
 
-	if (unlikely(!netif_running(ndev))) {
-		if (skb)
+static inline int cpsw_rx_buf_submit(struct cpsw_priv *priv,
+				     struct cpsw_rx_buf *buf, gfp_t gfp)
+{
+	return cpdma_chan_submit(priv->rxch, buf,
+				 page_address(buf->page) + buf->page_offset,
+				 priv->rx_packet_max, 0, gfp);
+}
+
+/*
+ * Build the skb for a received frame. Small frames are copied and the
+ * buffer is left as it is. Larger ones get their headers copied and the
+ * rest attached as a page fragment; buf then points to the other half
+ * of the page, or to a new page if the stack still holds the other half.
+ * Returns NULL, with buf untouched, if memory is short.
+ */
+static struct sk_buff *cpsw_rx_build_skb(struct cpsw_priv *priv,
+					 struct cpsw_rx_buf *buf, int len)
+{
+	unsigned int truesize = cpsw_rx_buf_size(priv);
+	struct page *page = buf->page;
+	unsigned int offset = buf->page_offset;
+	void *va = page_address(page) + offset;
+	struct sk_buff *skb;
+	int hlen;
+
+	prefetch(va);
+	hlen = (len <= rx_copybreak) ? len : min(len, CPSW_RX_HDR_LEN);
+
+	skb = netdev_alloc_skb_ip_align(priv->ndev, hlen);
+	if (unlikely(!skb))
+		return NULL;
+	memcpy(skb_put(skb, hlen), va, hlen);
+	if (hlen == len)
+		return skb;
+
+	if (page_count(page) == 1) {
+		/* Only the rx ring uses this page, flip to the other half */
+		get_page(page);
+		buf->page_offset ^= truesize;
+	} else {
+		buf->page = alloc_pages(GFP_ATOMIC | __GFP_COLD | __GFP_COMP,
+					cpsw_rx_buf_order(priv));
+		if (unlikely(!buf->page)) {
+			buf->page = page;
 			dev_kfree_skb_any(skb);
-		return;
+			return NULL;
+		}
+		buf->page_offset = 0;
 	}
 
-	if (likely(!skb)) {
-		skb = netdev_alloc_skb_ip_align(ndev, priv->rx_packet_max);
-		if (WARN_ON(!skb))
-			return;
+	skb_add_rx_frag(skb, 0, page, offset + hlen, len - hlen);
+	skb->truesize += truesize - (len - hlen);
+	return skb;
+}
+
+void cpsw_rx_handler(void *token, int len, int status)
+{
+	struct cpsw_rx_buf	*buf = token;
+	struct net_device	*ndev = buf->ndev;
+	struct cpsw_priv	*priv = netdev_priv(ndev);
+	struct sk_buff		*skb;
 
-		ret = cpdma_chan_submit(priv->rxch, skb, skb->data,
-				skb_tailroom(skb), 0, GFP_KERNEL);
+	/* Channel teardown, the buffer goes away with it */
+	if (unlikely(status < 0)) {
+		cpsw_rx_buf_free(buf);
+		return;
 	}
 
-	WARN_ON(ret < 0);
+	cpsw_dual_emac_source_port_detect(status, priv, ndev);
+
+	if (likely(netif_running(ndev)) && likely(netif_carrier_ok(ndev))) {
+		skb = cpsw_rx_build_skb(priv, buf, len);
+		if (likely(skb)) {
+			cpts_rx_timestamp(priv->cpts, skb);
+			skb->protocol = eth_type_trans(skb, ndev);
+			cpsw_rx_deliver(priv, skb);
+			priv->stats.rx_bytes += len;
+			priv->stats.rx_packets++;
+		} else {
+			priv->stats.rx_dropped++;
+		}
+	}
 
+	/* Recycle the buffer; this only fails while tearing down */
+	if (unlikely(cpsw_rx_buf_submit(priv, buf, GFP_ATOMIC) < 0))
+		cpsw_rx_buf_free(buf);
 }
 
 static void set_cpsw_dmtimer_clear(void)
@@ -1257,17 +1377,15 @@ static int cpsw_ndo_open(struct net_device *ndev)
 			priv->data.rx_descs = 128;
 
 		for (i = 0; i < priv->data.rx_descs; i++) {
-			struct sk_buff *skb;
+			struct cpsw_rx_buf *buf;
 
 			ret = -ENOMEM;
-			skb = netdev_alloc_skb_ip_align(priv->ndev,
-							priv->rx_packet_max);
-			if (!skb)
+			buf = cpsw_rx_buf_alloc(priv);
+			if (!buf)
 				break;
-			ret = cpdma_chan_submit(priv->rxch, skb, skb->data,
-					skb_tailroom(skb), 0, GFP_KERNEL);
+			ret = cpsw_rx_buf_submit(priv, buf, GFP_KERNEL);
 			if (WARN_ON(ret < 0)) {
-				dev_kfree_skb_any(skb);
+				cpsw_rx_buf_free(buf);
 				break;
 			}
 		}
@@ -1357,6 +1475,7 @@ static netdev_tx_t cpsw_ndo_start_xmit(struct sk_buff *skb,
 				       struct net_device *ndev)
 {
 	struct cpsw_priv *priv = netdev_priv(ndev);
+	unsigned int len;
 	int ret;
 
 	ndev->trans_start = jiffies;
@@ -1373,11 +1492,27 @@ static netdev_tx_t cpsw_ndo_start_xmit(struct sk_buff *skb,
 
 	skb_tx_timestamp(skb);
 
+	/* the skb may be completed and freed as soon as it is submitted */
+	len = skb->len;
 	ret = cpsw_tx_packet_submit(ndev, priv, skb);
 	if (unlikely(ret != 0)) {
 		msg(err, tx_err, "desc submit failed");
 		goto fail;
 	}
+	priv->tx_sent_bytes += len;
+
+	/*
+	 * Keep only tx_queue_bytes in the hardware ring so that latency
+	 * sensitive traffic is not queued behind a full ring of bulk data;
+	 * the rest waits in the qdisc.
+	 */
+	if (cpsw_tx_queue_full(priv)) {
+		netif_stop_queue(ndev);
+		/* completions may have drained the ring meanwhile */
+		smp_mb();
+		if (!cpsw_tx_queue_full(priv))
+			netif_wake_queue(ndev);
+	}
 
 	return NETDEV_TX_OK;
 fail:
@@ -23,6 +23,7 @@
 #include <linux/export.h>
 #include <linux/module.h>
 #include <linux/etherdevice.h>
+#include <linux/hash.h>
 
 #include "cpsw_ale.h"
 
@@ -129,92 +130,294 @@ static inline void cpsw_ale_set_addr(u32 *ale_entry, u8 *addr)
 		cpsw_ale_set_field(ale_entry, 40 - 8*i, 8, addr[i]);
 }
 
-static int cpsw_ale_read(struct cpsw_ale *ale, int idx, u32 *ale_entry)
+static void cpsw_ale_reg_read(struct cpsw_ale *ale, int idx, u32 *ale_entry)
 {
 	int i;
 
-	WARN_ON(idx > ale->ale_entries);
-
 	__raw_writel(idx, ale->ale_regs + ALE_TABLE_CONTROL);
 
 	for (i = 0; i < ALE_ENTRY_WORDS; i++)
 		ale_entry[i] = __raw_readl(ale->ale_regs + ALE_TABLE + 4 * i);
-
-	return idx;
 }
 
-static int cpsw_ale_write(struct cpsw_ale *ale, int idx, u32 *ale_entry)
+static void cpsw_ale_reg_write(struct cpsw_ale *ale, int idx, u32 *ale_entry)
 {
 	int i;
 
-	WARN_ON(idx > ale->ale_entries);
-
 	for (i = 0; i < ALE_ENTRY_WORDS; i++)
 		__raw_writel(ale_entry[i], ale->ale_regs + ALE_TABLE + 4 * i);
 
 	__raw_writel(idx | ALE_TABLE_WRITE, ale->ale_regs + ALE_TABLE_CONTROL);
+}
+
+static const struct cpsw_ale_table_ops cpsw_ale_reg_ops = {
+	.read	= cpsw_ale_reg_read,
+	.write	= cpsw_ale_reg_write,
+};
+
+/*
+ * Shadow table.
+ *
+ * Every entry written by the driver goes through cpsw_ale_write(), which
+ * keeps the RAM copy and its hash index in step, so lookups and free slot
+ * searches run from RAM. The hardware changes the table on its own only
+ * for unicast entries it learns or ages out, and it does not tell the
+ * driver when it does. Those slots are picked up by cpsw_ale_read_hw(),
+ * and unicast lookups that depend on them are checked against the
+ * hardware; see cpsw_ale_match_addr().
+ */
+static inline u32 *cpsw_ale_shadow_entry(struct cpsw_ale *ale, int idx)
+{
+	return ale->shadow + idx * ALE_ENTRY_WORDS;
+}
+
+static inline struct hlist_head *cpsw_ale_bucket(struct cpsw_ale *ale,
+						 u8 *addr, u16 vid)
+{
+	u64 key = vid;
+	int i;
+
+	/* vlan entries hash with a NULL addr */
+	for (i = 0; addr && i < 6; i++)
+		key = (key << 8) | addr[i];
+	return &ale->shadow_hash[hash_64(key, CPSW_ALE_HASH_BITS)];
+}
+
+static struct hlist_head *cpsw_ale_entry_bucket(struct cpsw_ale *ale,
+						u32 *ale_entry)
+{
+	u8 addr[6];
+	int type;
+
+	type = cpsw_ale_get_entry_type(ale_entry);
+	if (type == ALE_TYPE_FREE)
+		return NULL;
+	if (type == ALE_TYPE_VLAN)
+		return cpsw_ale_bucket(ale, NULL,
+				       cpsw_ale_get_vlan_id(ale_entry));
+	cpsw_ale_get_addr(ale_entry, addr);
+	return cpsw_ale_bucket(ale, addr, cpsw_ale_get_vlan_id(ale_entry));
+}
+
+/* Caller must hold shadow_lock */
+static void __cpsw_ale_shadow_update(struct cpsw_ale *ale, int idx,
+				     u32 *ale_entry)
+{
+	struct hlist_node *node = &ale->shadow_node[idx];
+	struct hlist_head *bucket;
+
+	hlist_del_init(node);
+	memcpy(cpsw_ale_shadow_entry(ale, idx), ale_entry,
+	       ALE_ENTRY_WORDS * sizeof(u32));
+	bucket = cpsw_ale_entry_bucket(ale, ale_entry);
+	if (bucket)
+		hlist_add_head(node, bucket);
+}
+
+/* The table was cleared, everything is free now */
+static void cpsw_ale_shadow_reset(struct cpsw_ale *ale)
+{
+	unsigned long flags;
+	int idx;
+
+	spin_lock_irqsave(&ale->shadow_lock, flags);
+	for (idx = 0; idx < ale->ale_entries; idx++)
+		hlist_del_init(&ale->shadow_node[idx]);
+	memset(ale->shadow, 0,
+	       ale->ale_entries * ALE_ENTRY_WORDS * sizeof(u32));
+	spin_unlock_irqrestore(&ale->shadow_lock, flags);
+}
+
+/* Read the entry from the shadow table */
+static int cpsw_ale_read(struct cpsw_ale *ale, int idx, u32 *ale_entry)
+{
+	unsigned long flags;
+
+	if (WARN_ON(idx >= ale->ale_entries))
+		return -EINVAL;
+
+	spin_lock_irqsave(&ale->shadow_lock, flags);
+	memcpy(ale_entry, cpsw_ale_shadow_entry(ale, idx),
+	       ALE_ENTRY_WORDS * sizeof(u32));
+	spin_unlock_irqrestore(&ale->shadow_lock, flags);
 
 	return idx;
 }
 
-int cpsw_ale_match_addr(struct cpsw_ale *ale, u8* addr, u16 vid)
+/* Read the entry from the hardware, refreshing the shadow copy */
+static int cpsw_ale_read_hw(struct cpsw_ale *ale, int idx, u32 *ale_entry)
+{
+	unsigned long flags;
+
+	if (WARN_ON(idx >= ale->ale_entries))
+		return -EINVAL;
+
+	spin_lock_irqsave(&ale->shadow_lock, flags);
+	ale->params.table_ops->read(ale, idx, ale_entry);
+	__cpsw_ale_shadow_update(ale, idx, ale_entry);
+	spin_unlock_irqrestore(&ale->shadow_lock, flags);
+
+	return idx;
+}
+
+static int cpsw_ale_write(struct cpsw_ale *ale, int idx, u32 *ale_entry)
+{
+	unsigned long flags;
+
+	if (WARN_ON(idx >= ale->ale_entries))
+		return -EINVAL;
+
+	spin_lock_irqsave(&ale->shadow_lock, flags);
+	ale->params.table_ops->write(ale, idx, ale_entry);
+	__cpsw_ale_shadow_update(ale, idx, ale_entry);
+	spin_unlock_irqrestore(&ale->shadow_lock, flags);
+
+	return idx;
+}
+
+static bool cpsw_ale_entry_match(u32 *ale_entry, u8 *addr, u16 vid)
+{
+	u8 entry_addr[6];
+	int type;
+
+	type = cpsw_ale_get_entry_type(ale_entry);
+	if (type != ALE_TYPE_ADDR && type != ALE_TYPE_VLAN_ADDR)
+		return false;
+	if (cpsw_ale_get_vlan_id(ale_entry) != vid)
+		return false;
+	cpsw_ale_get_addr(ale_entry, entry_addr);
+	return memcmp(entry_addr, addr, 6) == 0;
+}
+
+/*
+ * Whether the hardware may change the slot on its own: it learns into free
+ * slots and ages out the unicast entries it learned. Entries the driver
+ * wrote, multicast, vlan, persistent and OUI unicast, are left alone.
+ */
+static bool cpsw_ale_entry_hw_owned(u32 *ale_entry)
+{
+	int type;
+
+	type = cpsw_ale_get_entry_type(ale_entry);
+	if (type == ALE_TYPE_FREE)
+		return true;
+	if (type == ALE_TYPE_VLAN || cpsw_ale_get_mcast(ale_entry))
+		return false;
+	type = cpsw_ale_get_ucast_type(ale_entry);
+	return type != ALE_UCAST_PERSISTANT && type != ALE_UCAST_OUI;
+}
+
+/* Read back the slots the hardware may have learned the address into */
+static int cpsw_ale_match_addr_hw(struct cpsw_ale *ale, u8 *addr, u16 vid)
 {
 	u32 ale_entry[ALE_ENTRY_WORDS];
-	int type, idx;
+	int idx;
 
 	for (idx = 0; idx < ale->ale_entries; idx++) {
-		u8 entry_addr[6];
-
 		cpsw_ale_read(ale, idx, ale_entry);
-		type = cpsw_ale_get_entry_type(ale_entry);
-		if (type != ALE_TYPE_ADDR && type != ALE_TYPE_VLAN_ADDR)
+		if (!cpsw_ale_entry_hw_owned(ale_entry))
 			continue;
-		if (cpsw_ale_get_vlan_id(ale_entry) != vid)
-			continue;
-		cpsw_ale_get_addr(ale_entry, entry_addr);
-		if (memcmp(entry_addr, addr, 6) == 0)
+		cpsw_ale_read_hw(ale, idx, ale_entry);
+		if (cpsw_ale_entry_match(ale_entry, addr, vid))
 			return idx;
 	}
 	return -ENOENT;
 }
 
-int cpsw_ale_match_vlan(struct cpsw_ale *ale, u16 vid)
+/*
+ * Multicast addresses and the unicast entries the driver wrote are looked
+ * up in the shadow alone. The shadow can't be authoritative for the rest
+ * of unicast: a learned entry it holds may have been aged out, and an
+ * address it misses may have been learned since. Adding such an address
+ * again would give the ALE two entries for it, and deleting a stale one
+ * would free a slot the hardware has reused. So a learned hit is re-read,
+ * and a unicast miss reads back the free and learned slots. Unicast
+ * lookups only come from setting up the interface's own addresses and
+ * from the switch config ioctl, never from the data or rx_mode paths.
+ */
+int cpsw_ale_match_addr(struct cpsw_ale *ale, u8* addr, u16 vid)
 {
 	u32 ale_entry[ALE_ENTRY_WORDS];
-	int type, idx;
+	struct hlist_node *node;
+	unsigned long flags;
+	int idx = -ENOENT;
+
+	spin_lock_irqsave(&ale->shadow_lock, flags);
+	hlist_for_each(node, cpsw_ale_bucket(ale, addr, vid)) {
+		if (cpsw_ale_entry_match(cpsw_ale_shadow_entry(ale,
+					 node - ale->shadow_node), addr, vid)) {
+			idx = node - ale->shadow_node;
+			memcpy(ale_entry, cpsw_ale_shadow_entry(ale, idx),
+			       sizeof(ale_entry));
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&ale->shadow_lock, flags);
 
-	for (idx = 0; idx < ale->ale_entries; idx++) {
-		cpsw_ale_read(ale, idx, ale_entry);
-		type = cpsw_ale_get_entry_type(ale_entry);
-		if (type != ALE_TYPE_VLAN)
-			continue;
-		if (cpsw_ale_get_vlan_id(ale_entry) == vid)
+	if (is_multicast_ether_addr(addr))
+		return idx;
+	if (idx >= 0 && !cpsw_ale_entry_hw_owned(ale_entry))
+		return idx;
+
+	if (idx >= 0) {
+		cpsw_ale_read_hw(ale, idx, ale_entry);
+		if (cpsw_ale_entry_match(ale_entry, addr, vid))
 			return idx;
 	}
-	return -ENOENT;
+	return cpsw_ale_match_addr_hw(ale, addr, vid);
+}
+
+int cpsw_ale_match_vlan(struct cpsw_ale *ale, u16 vid)
+{
+	struct hlist_node *node;
+	unsigned long flags;
+	u32 *ale_entry;
+	int idx = -ENOENT;
+
+	spin_lock_irqsave(&ale->shadow_lock, flags);
+	hlist_for_each(node, cpsw_ale_bucket(ale, NULL, vid)) {
+		ale_entry = cpsw_ale_shadow_entry(ale, node - ale->shadow_node);
+		if (cpsw_ale_get_entry_type(ale_entry) != ALE_TYPE_VLAN)
+			continue;
+		if (cpsw_ale_get_vlan_id(ale_entry) == vid) {
+			idx = node - ale->shadow_node;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&ale->shadow_lock, flags);
+	return idx;
 }
 
+/*
+ * A slot that is free in the shadow may hold an entry the hardware has
+ * learned since; overwriting it only costs relearning that address.
+ */
 static int cpsw_ale_match_free(struct cpsw_ale *ale)
 {
-	u32 ale_entry[ALE_ENTRY_WORDS];
-	int type, idx;
+	unsigned long flags;
+	int type, idx, ret = -ENOENT;
 
+	spin_lock_irqsave(&ale->shadow_lock, flags);
 	for (idx = 0; idx < ale->ale_entries; idx++) {
-		cpsw_ale_read(ale, idx, ale_entry);
-		type = cpsw_ale_get_entry_type(ale_entry);
-		if (type == ALE_TYPE_FREE)
-			return idx;
+		type = cpsw_ale_get_entry_type(cpsw_ale_shadow_entry(ale, idx));
+		if (type == ALE_TYPE_FREE) {
+			ret = idx;
+			break;
+		}
 	}
-	return -ENOENT;
+	spin_unlock_irqrestore(&ale->shadow_lock, flags);
+	return ret;
 }
 
 static int cpsw_ale_find_ageable(struct cpsw_ale *ale)
 {
-	u32 ale_entry[ALE_ENTRY_WORDS];
-	int type, idx;
+	unsigned long flags;
+	u32 *ale_entry;
+	int type, idx, ret = -ENOENT;
 
+	spin_lock_irqsave(&ale->shadow_lock, flags);
 	for (idx = 0; idx < ale->ale_entries; idx++) {
-		cpsw_ale_read(ale, idx, ale_entry);
+		ale_entry = cpsw_ale_shadow_entry(ale, idx);
 		type = cpsw_ale_get_entry_type(ale_entry);
 		if (type != ALE_TYPE_ADDR && type != ALE_TYPE_VLAN_ADDR)
 			continue;
@@ -222,10 +425,13 @@ static int cpsw_ale_find_ageable(struct cpsw_ale *ale)
 			continue;
 		type = cpsw_ale_get_ucast_type(ale_entry);
 		if (type != ALE_UCAST_PERSISTANT &&
-		    type != ALE_UCAST_OUI)
-			return idx;
+		    type != ALE_UCAST_OUI) {
+			ret = idx;
+			break;
+		}
 	}
-	return -ENOENT;
+	spin_unlock_irqrestore(&ale->shadow_lock, flags);
+	return ret;
 }
 
 static void cpsw_ale_flush_mcast(struct cpsw_ale *ale, u32 *ale_entry,
@@ -250,6 +456,7 @@ int cpsw_ale_flush_multicast(struct cpsw_ale *ale, int port_mask)
 	u32 ale_entry[ALE_ENTRY_WORDS];
 	int ret, idx;
 
+	/* Multicast entries are never learned, the shadow has them all */
 	for (idx = 0; idx < ale->ale_entries; idx++) {
 		cpsw_ale_read(ale, idx, ale_entry);
 		ret = cpsw_ale_get_entry_type(ale_entry);
@@ -260,11 +467,11 @@ int cpsw_ale_flush_multicast(struct cpsw_ale *ale, int port_mask)
 			u8 addr[6];
 
 			cpsw_ale_get_addr(ale_entry, addr);
-			if (!is_broadcast_ether_addr(addr))
+			if (!is_broadcast_ether_addr(addr)) {
 				cpsw_ale_flush_mcast(ale, ale_entry, port_mask);
+				cpsw_ale_write(ale, idx, ale_entry);
+			}
 		}
-
-		cpsw_ale_write(ale, idx, ale_entry);
 	}
 	return 0;
 }
@@ -310,8 +517,9 @@ int cpsw_ale_flush(struct cpsw_ale *ale, int port_mask)
 	u32 ale_entry[ALE_ENTRY_WORDS];
 	int ret, idx;
 
+	/* This flushes learned entries too, so go by the hardware */
 	for (idx = 0; idx < ale->ale_entries; idx++) {
-		cpsw_ale_read(ale, idx, ale_entry);
+		cpsw_ale_read_hw(ale, idx, ale_entry);
 		ret = cpsw_ale_get_entry_type(ale_entry);
 		if (ret != ALE_TYPE_ADDR && ret != ALE_TYPE_VLAN_ADDR)
 			continue;
@@ -430,12 +638,13 @@ int cpsw_ale_dump(struct cpsw_ale *ale, int index, char *buf, int len)
 	u32 ale_entry[ALE_ENTRY_WORDS];
 
 	if (index) {
-		cpsw_ale_read(ale, index, ale_entry);
+		if (cpsw_ale_read_hw(ale, index, ale_entry) < 0)
+			return 0;
 		outlen += cpsw_ale_dump_entry(index, ale_entry,
 				buf + outlen, len - outlen);
 	} else {
 		for (idx = 0; idx < ale->ale_entries; idx++) {
-			cpsw_ale_read(ale, idx, ale_entry);
+			cpsw_ale_read_hw(ale, idx, ale_entry);
 			outlen += cpsw_ale_dump_entry(idx, ale_entry,
 					buf + outlen, len - outlen);
 		}
@@ -772,6 +981,9 @@ int cpsw_ale_control_set(struct cpsw_ale *ale, int port, int control,
 		while (dly--)
 			;
 	}
+
+	if (control == ALE_CLEAR && value)
+		cpsw_ale_shadow_reset(ale);
 	return 0;
 }
 EXPORT_SYMBOL_GPL(cpsw_ale_control_set);
@@ -878,7 +1090,7 @@ static ssize_t cpsw_ale_table_show(struct device *dev,
 	struct cpsw_ale *ale = table_attr_to_ale(attr);
 
 	for (idx = 0; idx < ale->ale_entries; idx++) {
-		cpsw_ale_read(ale, idx, ale_entry);
+		cpsw_ale_read_hw(ale, idx, ale_entry);
 		outlen += cpsw_ale_dump_entry(idx, ale_entry, buf + outlen,
 					      len - outlen);
 	}
@@ -952,7 +1164,7 @@ EXPORT_SYMBOL_GPL(cpsw_ale_stop);
 struct cpsw_ale *cpsw_ale_create(struct cpsw_ale_params *params)
 {
 	struct cpsw_ale *ale;
-	int ret;
+	int ret, idx;
 
 	ret = -ENOMEM;
 	ale = kzalloc(sizeof(*ale), GFP_KERNEL);
@@ -961,6 +1173,22 @@ struct cpsw_ale *cpsw_ale_create(struct cpsw_ale_params *params)
 
 	ale->params = *params;
 	ale->ageout = ale->params.ale_ageout * HZ;
+	if (!ale->params.table_ops)
+		ale->params.table_ops = &cpsw_ale_reg_ops;
+
+	spin_lock_init(&ale->shadow_lock);
+	ale->shadow = kcalloc(ale->ale_entries,
+			      ALE_ENTRY_WORDS * sizeof(u32), GFP_KERNEL);
+	ale->shadow_node = kcalloc(ale->ale_entries,
+				   sizeof(*ale->shadow_node), GFP_KERNEL);
+	if (WARN_ON(!ale->shadow || !ale->shadow_node)) {
+		kfree(ale->shadow_node);
+		kfree(ale->shadow);
+		kfree(ale);
+		return NULL;
+	}
+	for (idx = 0; idx < ale->ale_entries; idx++)
+		INIT_HLIST_NODE(&ale->shadow_node[idx]);
 
 	return ale;
 }
@@ -972,6 +1200,8 @@ int cpsw_ale_destroy(struct cpsw_ale *ale)
 		return -EINVAL;
 	cpsw_ale_stop(ale);
 	cpsw_ale_control_set(ale, 0, ALE_ENABLE, 0);
+	kfree(ale->shadow_node);
+	kfree(ale->shadow);
 	kfree(ale);
 	return 0;
 }
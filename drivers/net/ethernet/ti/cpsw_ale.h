@@ -15,14 +15,28 @@
 #ifndef __TI_CPSW_ALE_H__
 #define __TI_CPSW_ALE_H__
 
+struct cpsw_ale;
+
+/*
+ * Access to the ALE table entries (ALE_ENTRY_WORDS words each). Defaults
+ * to the ALE_TABLE registers; a simulated table can be plugged in instead.
+ */
+struct cpsw_ale_table_ops {
+	void (*read)(struct cpsw_ale *ale, int idx, u32 *ale_entry);
+	void (*write)(struct cpsw_ale *ale, int idx, u32 *ale_entry);
+};
+
 struct cpsw_ale_params {
 	struct device		*dev;
 	void __iomem		*ale_regs;
 	unsigned long		ale_ageout;	/* in secs */
 	unsigned long		ale_entries;
 	unsigned long		ale_ports;
+	const struct cpsw_ale_table_ops *table_ops;	/* NULL for registers */
 };
 
+#define CPSW_ALE_HASH_BITS	8
+
 struct cpsw_ale {
 	struct cpsw_ale_params	params;
 	struct timer_list	timer;
@@ -33,6 +47,15 @@ struct cpsw_ale {
 	struct device_attribute ale_table_attr;
 #define table_attr_to_ale(attr)		\
 	container_of(attr, struct cpsw_ale, ale_table_attr);
+
+	/*
+	 * RAM copy of the table, hashed on {addr, vid} (vid only for vlan
+	 * entries) so that lookups don't have to scan the registers.
+	 */
+	spinlock_t		shadow_lock;
+	u32			*shadow;
+	struct hlist_node	*shadow_node;
+	struct hlist_head	shadow_hash[1 << CPSW_ALE_HASH_BITS];
 };
 
 enum cpsw_ale_control {
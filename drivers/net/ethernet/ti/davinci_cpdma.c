@@ -65,6 +65,9 @@
 
 #define CPDMA_TEARDOWN_VALUE	0xfffffffc
 
+/* Completed descriptors reclaimed per channel lock/cp write */
+#define CPDMA_PROCESS_BATCH	16
+
 struct cpdma_desc {
 	/* hardware fields */
 	u32			hw_next;
@@ -782,18 +785,82 @@ unlock_ret:
 	return status;
 }
 
+/*
+ * Detach up to nr completed descriptors from the head of the channel and
+ * acknowledge them with a single completion pointer write.
+ * Returns the number of descriptors detached.
+ */
+static int __cpdma_chan_reap(struct cpdma_chan *chan,
+			     struct cpdma_desc __iomem **descs,
+			     int *outlens, int *statuses, int nr)
+{
+	struct cpdma_desc_pool		*pool = chan->ctlr->pool;
+	struct cpdma_desc __iomem	*desc;
+	dma_addr_t			desc_dma = 0;
+	unsigned long			flags;
+	int				status, n = 0;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	while (n < nr) {
+		desc = chan->head;
+		if (!desc) {
+			if (!n)
+				chan->stats.empty_dequeue++;
+			break;
+		}
+
+		status = __raw_readl(&desc->hw_mode);
+		if (status & CPDMA_DESC_OWNER) {
+			if (!n)
+				chan->stats.busy_dequeue++;
+			break;
+		}
+		desc_dma = desc_phys(pool, desc);
+		outlens[n] = status & 0x7ff;
+		status &= (CPDMA_DESC_EOQ | CPDMA_DESC_TD_COMPLETE |
+			   CPDMA_DESC_PORT_MASK);
+
+		chan->head = desc_from_phys(pool, desc_read(desc, hw_next));
+		chan->count--;
+		chan->stats.good_dequeue++;
+
+		if ((status & CPDMA_DESC_EOQ) && (chan->head) &&
+				(!(status & CPDMA_DESC_TD_COMPLETE))) {
+			chan->stats.requeue++;
+			chan_write(chan, hdp, desc_phys(pool, chan->head));
+		}
+
+		descs[n] = desc;
+		statuses[n] = status;
+		n++;
+	}
+	if (n)
+		chan_write(chan, cp, desc_dma);
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	return n;
+}
+
 int cpdma_chan_process(struct cpdma_chan *chan, int quota)
 {
-	int used = 0, ret = 0;
+	struct cpdma_desc __iomem	*descs[CPDMA_PROCESS_BATCH];
+	int				outlens[CPDMA_PROCESS_BATCH];
+	int				statuses[CPDMA_PROCESS_BATCH];
+	int				used = 0, n, i;
 
 	if (chan->state != CPDMA_STATE_ACTIVE)
 		return -EINVAL;
 
 	while (used < quota) {
-		ret = __cpdma_chan_process(chan);
-		if (ret < 0)
+		n = __cpdma_chan_reap(chan, descs, outlens, statuses,
+				      min(quota - used, CPDMA_PROCESS_BATCH));
+		/* handlers run without the lock, they may resubmit */
+		for (i = 0; i < n; i++)
+			__cpdma_chan_free(chan, descs[i], outlens[i],
+					  statuses[i]);
+		used += n;
+		if (n < CPDMA_PROCESS_BATCH)
 			break;
-		used++;
 	}
 	return used;
 }
@@ -32,13 +32,23 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_FD_SEGMENT	= B_PACK_CHARS('s', 'g', '*', B_TYPE_LARGE),
 };
 
+/*
+ * The low byte of a node's flags is its minimum priority: a nice value
+ * (sign-extended) for SCHED_NORMAL and SCHED_BATCH, or an rt priority
+ * (1..99) for SCHED_FIFO and SCHED_RR.  The policy it applies to is
+ * taken from the FLAT_BINDER_FLAG_SCHED_POLICY bits.
+ */
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	FLAT_BINDER_FLAG_SCHED_POLICY_MASK = 0x600,
 };
 
+#define FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT	9
+
 /*
  * This is the flattened representation of a Binder object for transfer
  * between processes.  The 'offsets' supplied as part of a binder transaction
@@ -61,6 +71,29 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+enum {
+	BINDER_SEGMENT_FLAG_WRITE = 0x01,
+};
+
+/*
+ * A region of an ashmem or ion buffer, passed with BINDER_TYPE_FD_SEGMENT
+ * instead of copying its contents into the transaction.  The sender fills
+ * in fd, offset (page aligned) and length.  The driver maps the region
+ * shared into the receiving process when the transaction is read and
+ * stores the address in ptr, or NULL if it could not be mapped.  The
+ * region is read-only unless BINDER_SEGMENT_FLAG_WRITE is set in flags.
+ * The receiver owns the mapping and must munmap() it when done.  Like
+ * fds, segments are only accepted by targets that accept fds.
+ */
+struct binder_fd_segment_object {
+	unsigned long		type;
+	unsigned long		flags;
+	signed long		fd;
+	unsigned long		offset;
+	size_t			length;
+	void			*ptr;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -21,10 +21,18 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/vmalloc.h>
+#include <linux/io.h>
+#include <linux/lzo.h>
+#include <linux/platform_device.h>
+#include <linux/proc_fs.h>
+#include <linux/workqueue.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -33,17 +41,25 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * There is no lock.  w_reserve and the w_commit and head fields of the
+ * header are free-running 32-bit byte positions; logger_offset() turns them
+ * into buffer offsets.  A writer
+ * reserves [start, end) by advancing w_reserve with cmpxchg, pushes head
+ * past anything it is about to overwrite, copies its entry in and then
+ * publishes it by moving w_commit from start to end once every earlier
+ * writer has done the same.  Writers run with preemption disabled from
+ * reservation to commit, so waiting for the previous writer is bounded by
+ * one memcpy on another CPU.  Everything in [head, w_commit) is readable.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	struct logger_mmap_header *hdr; /* state shared with mmap() readers */
+	u32			w_reserve; /* next position handed to a writer */
+	atomic_t		wake_armed; /* a reader wants the next wakeup */
 	size_t			size;	/* size of the log */
 };
 
@@ -51,14 +67,33 @@ struct logger_log {
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by 'mutex'.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* serializes readers of this file */
+	u32			r_pos;	/* current read position */
+	unsigned char		buf[LOGGER_ENTRY_MAX_LEN]; /* entry snapshot */
+};
+
+/*
+ * struct logger_slot - per-cpu staging area a writer copies its entry into
+ * before reserving space, so no user access happens inside the ring.
+ */
+struct logger_slot {
+	unsigned char		buf[LOGGER_ENTRY_MAX_LEN];
 };
 
+static struct logger_slot __percpu *logger_slots;
+
+#ifdef CONFIG_ANDROID_LOGGER_PERSIST
+static void logger_persist_entry(struct logger_log *log,
+				 const struct logger_entry *entry);
+#else
+static inline void logger_persist_entry(struct logger_log *log,
+					const struct logger_entry *entry) { }
+#endif
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -89,7 +124,8 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * The result is only meaningful if the entry at 'off' is committed and was
+ * not overwritten meanwhile; callers validate against log->hdr->head.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -108,38 +144,86 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log - copies 'count' bytes starting at position 'pos' out of 'log'.
+ */
+static void do_read_log(struct logger_log *log, u32 pos,
+			void *buf, size_t count)
+{
+	size_t off = logger_offset(pos);
+	size_t len;
+
+	len = min(count, log->size - off);
+	memcpy(buf, log->buffer + off, len);
+
+	if (count != len)
+		memcpy(buf + len, log->buffer, count - len);
+}
+
+/*
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at position 'pos'.
  *
- * Caller must hold log->mutex.
+ * The caller must own [pos, pos + count) through a reservation.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static void do_write_log(struct logger_log *log, u32 pos,
+			 const void *buf, size_t count)
 {
+	size_t off = logger_offset(pos);
 	size_t len;
 
-	/*
-	 * We read from the log in two disjoint operations. First, we read from
-	 * the current read head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
-	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
-		return -EFAULT;
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
-	/*
-	 * Second, we read any remaining bytes, starting back at the head of
-	 * the log.
-	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+		memcpy(log->buffer, buf + len, count - len);
+}
+
+/*
+ * logger_fetch_entry - snapshot the entry at the reader's position into
+ * reader->buf.  Readers that were lapped are pulled forward to log->hdr->head.
+ * Returns the length of the entry, or 0 if there is nothing to read.
+ *
+ * The reader does not advance; the caller does that once the entry has been
+ * consumed.  Caller must hold reader->mutex.
+ */
+static size_t logger_fetch_entry(struct logger_log *log,
+				 struct logger_reader *reader)
+{
+	u32 commit;
+	size_t len;
 
-	reader->r_off = logger_offset(reader->r_off + count);
+	for (;;) {
+		commit = ACCESS_ONCE(log->hdr->w_commit);
+		smp_rmb();	/* pairs with smp_wmb() in logger_commit_entry */
+		if ((s32)(reader->r_pos - ACCESS_ONCE(log->hdr->head)) < 0)
+			reader->r_pos = ACCESS_ONCE(log->hdr->head);
+		if ((s32)(commit - reader->r_pos) <= 0)
+			return 0;
+
+		len = get_entry_len(log, logger_offset(reader->r_pos));
+		len = min_t(size_t, len, LOGGER_ENTRY_MAX_LEN);
+		do_read_log(log, reader->r_pos, reader->buf, len);
+
+		/*
+		 * Writers move head past an entry before overwriting it, so
+		 * if head is still behind us the snapshot is intact.
+		 */
+		smp_rmb();
+		if ((s32)(reader->r_pos - ACCESS_ONCE(log->hdr->head)) >= 0)
+			return len;
+	}
+}
 
-	return count;
+/*
+ * logger_arm_wakeup - ask the next writer to wake log->wq, then report
+ * whether the reader has anything to read.  The caller must already be on
+ * the wait queue.
+ */
+static bool logger_arm_wakeup(struct logger_log *log,
+			      struct logger_reader *reader)
+{
+	atomic_set(&log->wake_armed, 1);
+	smp_mb();	/* pairs with smp_mb() in logger_wake_readers */
+	return ACCESS_ONCE(log->hdr->w_commit) != ACCESS_ONCE(reader->r_pos);
 }
 
 /*
@@ -166,9 +250,7 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		ret = !logger_arm_wakeup(log, reader);
 		if (!ret)
 			break;
 
@@ -189,196 +271,190 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
 
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	/* get exactly one entry from the log, or retry if we raced */
+	ret = logger_fetch_entry(log, reader);
+	if (unlikely(!ret)) {
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (copy_to_user(buf, reader->buf, ret)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	reader->r_pos += ret;
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * logger_release_space - move log->hdr->head forward to the first entry at or
+ * after 'limit', so that everything before 'limit' may be overwritten.
  *
- * Caller must hold log->mutex.
+ * Called with preemption disabled.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static void logger_release_space(struct logger_log *log, u32 limit)
 {
-	size_t count = 0;
+	u32 head;
 
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
+	/* entries are only parsed once their writers have committed them */
+	while ((s32)(ACCESS_ONCE(log->hdr->w_commit) - limit) < 0)
+		cpu_relax();
+	smp_rmb();
 
-	return off;
-}
-
-/*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
- */
-static inline int clock_interval(size_t a, size_t b, size_t c)
-{
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
+	for (;;) {
+		head = ACCESS_ONCE(log->hdr->head);
+		if ((s32)(head - limit) >= 0)
+			break;
+		/* a failed cmpxchg means someone else moved head; reparse */
+		cmpxchg(&log->hdr->head, head,
+			head + get_entry_len(log, logger_offset(head)));
 	}
-
-	return 0;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * logger_commit_entry - reserve space for 'entry', copy it into the log and
+ * make it visible to readers.
  *
- * The caller needs to hold log->mutex.
+ * Called with preemption disabled.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void logger_commit_entry(struct logger_log *log,
+				const struct logger_entry *entry)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	size_t count = sizeof(struct logger_entry) + entry->len;
+	u32 start, end;
+
+	do {
+		start = ACCESS_ONCE(log->w_reserve);
+		end = start + count;
+	} while (cmpxchg(&log->w_reserve, start, end) != start);
+
+	logger_release_space(log, end - log->size);
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	/* readers must see the new head before any of the new bytes */
+	smp_mb();
+	do_write_log(log, start, entry, count);
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	/* commit in reservation order */
+	while (ACCESS_ONCE(log->hdr->w_commit) != start)
+		cpu_relax();
+	smp_wmb();
+	log->hdr->w_commit = end;
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
+ * logger_wake_readers - wake readers if one of them asked for it since the
+ * last wakeup.  A burst of writes thus costs one wakeup, not one per entry.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void logger_wake_readers(struct logger_log *log)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
-
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
+	smp_mb();	/* publish w_commit before testing wake_armed */
+	if (atomic_read(&log->wake_armed) && atomic_xchg(&log->wake_armed, 0))
+		wake_up_interruptible(&log->wq);
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * logger_copy_iov - gathers 'len' bytes of payload from 'iov' into 'dst'.
+ * With 'atomic' set it must not fault, and fails if the pages aren't there.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int logger_copy_iov(void *dst, const struct iovec *iov,
+			   unsigned long nr_segs, size_t len, bool atomic)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	while (len && nr_segs--) {
+		size_t n = min(iov->iov_len, len);
+		unsigned long left;
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		if (!access_ok(VERIFY_READ, iov->iov_base, n))
+			return -EFAULT;
+		if (atomic)
+			left = __copy_from_user_inatomic(dst, iov->iov_base, n);
+		else
+			left = copy_from_user(dst, iov->iov_base, n);
+		if (left)
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
+		dst += n;
+		len -= n;
+		iov++;
+	}
 
-	return count;
+	return 0;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is assembled in this cpu's slot with page faults disabled; only
+ * if the payload is not resident do we take the slow path through a
+ * kmalloc()ed buffer.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
-	struct logger_entry header;
+	struct logger_entry *entry;
+	void *bounce = NULL;
 	struct timespec now;
-	ssize_t ret = 0;
-
-	now = current_kernel_time();
+	size_t len;
+	int ret;
 
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
+	if (unlikely(!len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+	preempt_disable();
+	entry = (struct logger_entry *)this_cpu_ptr(logger_slots)->buf;
+	pagefault_disable();
+	ret = logger_copy_iov(entry->msg, iov, nr_segs, len, true);
+	pagefault_enable();
+	if (unlikely(ret)) {
+		preempt_enable();
+		bounce = kmalloc(sizeof(struct logger_entry) + len, GFP_KERNEL);
+		if (!bounce)
+			return -ENOMEM;
+		entry = bounce;
+		ret = logger_copy_iov(entry->msg, iov, nr_segs, len, false);
+		if (ret) {
+			kfree(bounce);
+			return ret;
+		}
+		preempt_disable();
+	}
 
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+	now = current_kernel_time();
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
-		}
+	entry->len = len;
+	entry->__pad = 0;
+	entry->pid = current->tgid;
+	entry->tid = current->pid;
+	entry->sec = now.tv_sec;
+	entry->nsec = now.tv_nsec;
 
-		iov++;
-		ret += nr;
-	}
+	logger_commit_entry(log, entry);
+	logger_persist_entry(log, entry);
+	preempt_enable();
 
-	mutex_unlock(&log->mutex);
+	kfree(bounce);
 
 	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	logger_wake_readers(log);
 
-	return ret;
+	return len;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -409,12 +485,8 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		mutex_init(&reader->mutex);
+		reader->r_pos = ACCESS_ONCE(log->hdr->head);
 
 		file->private_data = reader;
 	} else
@@ -432,7 +504,6 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		list_del(&reader->list);
 		kfree(reader);
 	}
 
@@ -462,22 +533,95 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (logger_arm_wakeup(log, reader))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
 
 	return ret;
 }
 
+/*
+ * logger_flush - discard everything committed so far.  Readers notice that
+ * head moved past them and skip ahead on their next read.
+ */
+static void logger_flush(struct logger_log *log)
+{
+	u32 head, commit, gen;
+
+	do {
+		head = ACCESS_ONCE(log->hdr->head);
+		commit = ACCESS_ONCE(log->hdr->w_commit);
+		if ((s32)(commit - head) <= 0)
+			break;
+	} while (cmpxchg(&log->hdr->head, head, commit) != head);
+
+	do {
+		gen = ACCESS_ONCE(log->hdr->generation);
+	} while (cmpxchg(&log->hdr->generation, gen, gen + 1) != gen);
+}
+
+/*
+ * logger_set_read_pos - move a reader to 'pos', which an mmap() reader has
+ * consumed up to, clamped to the readable part of the log.
+ */
+static void logger_set_read_pos(struct logger_log *log,
+				struct logger_reader *reader, u32 pos)
+{
+	u32 head = ACCESS_ONCE(log->hdr->head);
+	u32 commit = ACCESS_ONCE(log->hdr->w_commit);
+
+	if ((s32)(pos - head) < 0)
+		pos = head;
+	if ((s32)(commit - pos) < 0)
+		pos = commit;
+	reader->r_pos = pos;
+}
+
+/*
+ * logger_mmap - map the header page and the ring read-only, the ring once
+ * or twice back to back; see struct logger_mmap_header.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long len = vma->vm_end - vma->vm_start;
+	unsigned long off;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (vma->vm_pgoff)
+		return -EINVAL;
+	if (len != PAGE_SIZE + log->size && len != PAGE_SIZE + 2 * log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND;
+
+	for (off = 0; off < len; off += PAGE_SIZE) {
+		void *addr;
+
+		if (off < PAGE_SIZE)
+			addr = log->hdr;
+		else
+			addr = log->buffer + logger_offset(off - PAGE_SIZE);
+		ret = vm_insert_page(vma, vma->vm_start + off,
+				     vmalloc_to_page(addr));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	u32 head;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
-
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
 		ret = log->size;
@@ -488,10 +632,14 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		mutex_lock(&reader->mutex);
+		head = ACCESS_ONCE(log->hdr->head);
+		if ((s32)(reader->r_pos - head) < 0)
+			reader->r_pos = head;
+		ret = (s32)(ACCESS_ONCE(log->hdr->w_commit) - reader->r_pos);
+		mutex_unlock(&reader->mutex);
+		if (ret < 0)
+			ret = 0;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -499,25 +647,31 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
-		else
-			ret = 0;
+		mutex_lock(&reader->mutex);
+		ret = logger_fetch_entry(log, reader);
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		logger_flush(log);
+		ret = 0;
+		break;
+	case LOGGER_SET_READ_POS:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+		logger_set_read_pos(log, reader, arg);
+		mutex_unlock(&reader->mutex);
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	return ret;
 }
 
@@ -526,6 +680,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -534,13 +689,12 @@ static const struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * must be a power of two, a multiple of PAGE_SIZE, greater than
+ * LOGGER_ENTRY_MAX_LEN, and less than INT_MAX.  The buffer and its header
+ * page are allocated by init_log().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -548,10 +702,8 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
-	.head = 0, \
+	.w_reserve = 0, \
+	.wake_armed = ATOMIC_INIT(0), \
 	.size = SIZE, \
 };
 
@@ -577,10 +729,22 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	/* vmalloc_user() hands back zeroed pages that may be mapped to user */
+	log->hdr = vmalloc_user(PAGE_SIZE + log->size);
+	if (!log->hdr) {
+		printk(KERN_ERR "logger: failed to allocate buffer "
+		       "for log '%s'!\n", log->misc.name);
+		return -ENOMEM;
+	}
+	log->hdr->size = log->size;
+	log->buffer = (unsigned char *)log->hdr + PAGE_SIZE;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		vfree(log->hdr);
+		log->hdr = NULL;
 		return ret;
 	}
 
@@ -590,10 +754,585 @@ static int __init init_log(struct logger_log *log)
 	return 0;
 }
 
+#ifdef CONFIG_ANDROID_LOGGER_PERSIST
+/*
+ * Persistent logs
+ *
+ * A "logger_persist" platform device provides a RAM region that survives
+ * a warm reset, in the same way ram_console gets its buffer.  Writers copy
+ * every entry into one of two raw "open" blocks kept in that region before
+ * they return, so what was logged survives a reset, however the system
+ * died.  Space in the open block is reserved with cmpxchg() and committed
+ * in reservation order, as in the live log.  Once the active open block is
+ * full writers switch to the other one and a work item compresses the full
+ * one with LZO and appends it to a ring of blocks behind them.  Writers
+ * never compress: if the work is still busy with the other block when the
+ * active one fills up, entries are dropped and counted until it is done.
+ * Each record in a block is a __u32 log index followed by the logger_entry
+ * and its payload.
+ *
+ * At probe time the previous boot's blocks are copied out, still
+ * compressed, and /proc/last_log/<log> decompresses them a block at a time
+ * as it is read.  What it returns has the same format as read() on the
+ * live log.
+ */
+
+#define LOGGER_PERSIST_SIG		0x324f4c41	/* ALO2 */
+#define LOGGER_PERSIST_BLOCK_MAGIC	0x4b4c4241	/* ABLK */
+#define LOGGER_PERSIST_WRAP_MAGIC	0x50525741	/* AWRP */
+#define LOGGER_PERSIST_BLOCK_SIZE	(16 * 1024)
+
+/* logger_persist.reserve: active block, other block being sealed, length */
+#define LOGGER_PERSIST_ACTIVE		0x80000000
+#define LOGGER_PERSIST_SEALING		0x40000000
+#define LOGGER_PERSIST_LEN_MASK		0x3fffffff
+
+struct logger_persist_buffer {
+	uint32_t	sig;
+	uint32_t	size;		/* size of data[] */
+	uint32_t	start;		/* offset of the oldest block in data[] */
+	uint32_t	end;		/* offset after the newest block */
+	uint32_t	active;		/* open block being appended to */
+	uint32_t	open_len[2];	/* valid bytes in open[] */
+	uint8_t		open[2][LOGGER_PERSIST_BLOCK_SIZE];
+	uint8_t		data[0];
+};
+
+struct logger_persist_block {
+	uint32_t	magic;
+	uint32_t	clen;		/* bytes stored after this header */
+	uint32_t	rlen;		/* bytes decompressed, clen if stored raw */
+};
+
+static struct logger_log *logger_logs[] = {
+	&log_main, &log_events, &log_radio, &log_system,
+};
+
+static struct {
+	struct logger_persist_buffer *buffer;	/* ioremap()ed region */
+
+	/* taken by writers */
+	uint32_t reserve;			/* LOGGER_PERSIST_* | reserved */
+	uint32_t commit[2];			/* committed bytes per block */
+	unsigned char *open[2];			/* cached copies of open[] */
+	uint32_t seal_len;			/* length of the block to seal */
+	atomic_t dropped;			/* entries lost while sealing */
+
+	/* serializes sealing */
+	spinlock_t seal_lock;
+	unsigned char *cbuf;			/* compression output */
+	void *wrkmem;
+
+	/* the previous boot's contents */
+	unsigned char *old_data;
+	uint32_t old_size;
+	uint32_t old_start;
+	uint32_t old_end;
+	unsigned char *old_open;		/* older open block first */
+	uint32_t old_open_len[2];
+} logger_persist;
+
+/* does the block ring of 'size' bytes continue at offset 0 after 'off'? */
+static bool logger_persist_is_wrap(const unsigned char *data, uint32_t size,
+				   uint32_t off)
+{
+	uint32_t magic;
+
+	if (size - off < sizeof(struct logger_persist_block))
+		return true;
+	memcpy(&magic, data + off, sizeof(magic));
+	return magic == LOGGER_PERSIST_WRAP_MAGIC;
+}
+
+/*
+ * logger_persist_next - offset of the block after the one at 'off' in a
+ * block ring of 'size' bytes, or -1 if the header at 'off' is corrupt.
+ */
+static long logger_persist_next(const unsigned char *data, uint32_t size,
+				uint32_t off)
+{
+	struct logger_persist_block blk;
+
+	if (logger_persist_is_wrap(data, size, off))
+		return 0;
+	memcpy(&blk, data + off, sizeof(blk));
+	if (blk.magic != LOGGER_PERSIST_BLOCK_MAGIC ||
+	    blk.clen > size - off - sizeof(blk) ||
+	    blk.rlen > LOGGER_PERSIST_BLOCK_SIZE)
+		return -1;
+	return off + ALIGN(sizeof(blk) + blk.clen, 4);
+}
+
+/*
+ * logger_persist_write_block - append a block to the ring, dropping the
+ * oldest blocks it overlaps.  'start' is moved before the new bytes are
+ * written and 'end' after, so a reset in the middle loses only this block.
+ */
+static void logger_persist_write_block(const void *data, uint32_t clen,
+				       uint32_t rlen)
+{
+	struct logger_persist_buffer *buffer = logger_persist.buffer;
+	struct logger_persist_block blk;
+	uint32_t need = ALIGN(sizeof(blk) + clen, 4);
+	uint32_t old_end = buffer->end;
+	uint32_t start = buffer->start;
+	uint32_t pos = old_end;
+	long next;
+
+	if (pos + need > buffer->size) {
+		/* everything between the old end and the wrap point goes */
+		while (start != old_end && start >= old_end) {
+			next = logger_persist_next(buffer->data,
+						   buffer->size, start);
+			start = next < 0 ? old_end : next;
+		}
+		if (buffer->size - pos >= sizeof(blk)) {
+			blk.magic = LOGGER_PERSIST_WRAP_MAGIC;
+			blk.clen = blk.rlen = 0;
+			buffer->start = start;
+			wmb();
+			memcpy(buffer->data + pos, &blk, sizeof(blk));
+		}
+		pos = 0;
+	}
+
+	while (start != old_end && start >= pos && start < pos + need) {
+		next = logger_persist_next(buffer->data, buffer->size, start);
+		start = next < 0 ? old_end : next;
+	}
+	if (start == old_end)
+		start = pos;
+
+	buffer->start = start;
+	wmb();
+
+	blk.magic = LOGGER_PERSIST_BLOCK_MAGIC;
+	blk.clen = clen;
+	blk.rlen = rlen;
+	memcpy(buffer->data + pos, &blk, sizeof(blk));
+	memcpy(buffer->data + pos + sizeof(blk), data, clen);
+	wmb();
+	buffer->end = pos + need;
+}
+
+/*
+ * logger_persist_seal - compress the block writers switched away from, if
+ * there is one, into the ring and hand it back to them.  Blocks that don't
+ * shrink are stored as they are.  A reset between the ring update and the
+ * reset of open_len shows the block twice in the next boot's last_log.
+ *
+ * Called with seal_lock held.
+ */
+static void logger_persist_seal(void)
+{
+	struct logger_persist_buffer *buffer = logger_persist.buffer;
+	uint32_t old, rlen;
+	unsigned int dropped;
+	size_t clen;
+	int b, ret;
+
+	old = ACCESS_ONCE(logger_persist.reserve);
+	if (!(old & LOGGER_PERSIST_SEALING))
+		return;
+	b = !(old & LOGGER_PERSIST_ACTIVE);
+	rlen = ACCESS_ONCE(logger_persist.seal_len);
+
+	/* writers that reserved space before the switch may still be copying */
+	while (ACCESS_ONCE(logger_persist.commit[b]) != rlen)
+		cpu_relax();
+	smp_rmb();
+
+	ret = lzo1x_1_compress(logger_persist.open[b], rlen,
+			       logger_persist.cbuf, &clen,
+			       logger_persist.wrkmem);
+	if (ret == LZO_E_OK && clen < rlen)
+		logger_persist_write_block(logger_persist.cbuf, clen, rlen);
+	else
+		logger_persist_write_block(logger_persist.open[b], rlen, rlen);
+
+	wmb();
+	buffer->open_len[b] = 0;
+	logger_persist.commit[b] = 0;
+	smp_wmb();
+	do {
+		old = ACCESS_ONCE(logger_persist.reserve);
+	} while (cmpxchg(&logger_persist.reserve, old,
+			 old & ~LOGGER_PERSIST_SEALING) != old);
+
+	dropped = atomic_xchg(&logger_persist.dropped, 0);
+	if (dropped)
+		printk(KERN_WARNING "logger: %u entries not persisted, "
+		       "sealing fell behind\n", dropped);
+}
+
+static void logger_persist_work_fn(struct work_struct *work)
+{
+	spin_lock(&logger_persist.seal_lock);
+	logger_persist_seal();
+	spin_unlock(&logger_persist.seal_lock);
+}
+
+static DECLARE_WORK(logger_persist_work, logger_persist_work_fn);
+
+/*
+ * logger_persist_entry - copy a committed entry into the persistent open
+ * block.  Called by writers, with preemption disabled.
+ */
+static void logger_persist_entry(struct logger_log *log,
+				 const struct logger_entry *entry)
+{
+	struct logger_persist_buffer *buffer = logger_persist.buffer;
+	uint32_t len = sizeof(uint32_t) + sizeof(*entry) + entry->len;
+	uint32_t index, old, new, b, off;
+
+	if (!buffer)
+		return;
+
+	for (index = 0; index < ARRAY_SIZE(logger_logs); index++)
+		if (logger_logs[index] == log)
+			break;
+
+	do {
+		old = ACCESS_ONCE(logger_persist.reserve);
+		off = old & LOGGER_PERSIST_LEN_MASK;
+		if (off + len <= LOGGER_PERSIST_BLOCK_SIZE) {
+			new = old + len;
+		} else if (!(old & LOGGER_PERSIST_SEALING)) {
+			/* the other block was sealed and is empty */
+			new = ((old & LOGGER_PERSIST_ACTIVE) ^
+			       LOGGER_PERSIST_ACTIVE) |
+			      LOGGER_PERSIST_SEALING | len;
+		} else {
+			/* the work is a whole block behind */
+			atomic_inc(&logger_persist.dropped);
+			return;
+		}
+	} while (cmpxchg(&logger_persist.reserve, old, new) != old);
+
+	b = !!(new & LOGGER_PERSIST_ACTIVE);
+	if ((old ^ new) & LOGGER_PERSIST_ACTIVE) {
+		logger_persist.seal_len = off;
+		buffer->active = b;
+		off = 0;
+		schedule_work(&logger_persist_work);
+	}
+
+	memcpy(logger_persist.open[b] + off, &index, sizeof(index));
+	memcpy(logger_persist.open[b] + off + sizeof(index), entry,
+	       len - sizeof(index));
+	memcpy(buffer->open[b] + off, logger_persist.open[b] + off, len);
+
+	/* commit in reservation order */
+	while (ACCESS_ONCE(logger_persist.commit[b]) != off)
+		cpu_relax();
+	wmb();
+	buffer->open_len[b] = off + len;
+	logger_persist.commit[b] = off + len;
+}
+
+/*
+ * struct logger_persist_cursor - state of one open /proc/last_log file
+ *
+ * 'buf' holds the entries of this log found in the last decoded block and
+ * starts at file position 'base'.
+ */
+struct logger_persist_cursor {
+	uint32_t	index;		/* which log */
+	uint32_t	off;		/* next block in the old ring */
+	uint32_t	steps;		/* blocks walked, bounds a corrupt ring */
+	unsigned	ring_done:1;	/* reached the end of the old ring */
+	unsigned	open_done:2;	/* old open blocks decoded so far */
+	loff_t		base;
+	size_t		len;
+	unsigned char	raw[LOGGER_PERSIST_BLOCK_SIZE];
+	unsigned char	buf[LOGGER_PERSIST_BLOCK_SIZE];
+};
+
+static void logger_persist_rewind(struct logger_persist_cursor *c)
+{
+	c->off = logger_persist.old_start;
+	c->steps = 0;
+	c->ring_done = c->off == logger_persist.old_end;
+	c->open_done = 0;
+	c->base = 0;
+	c->len = 0;
+}
+
+/* copy the records of the cursor's log out of a decoded block */
+static void logger_persist_filter(struct logger_persist_cursor *c,
+				  const unsigned char *raw, size_t rlen)
+{
+	size_t off = 0;
+
+	c->len = 0;
+	while (off + sizeof(uint32_t) + sizeof(struct logger_entry) <= rlen) {
+		struct logger_entry entry;
+		uint32_t index;
+		size_t len;
+
+		memcpy(&index, raw + off, sizeof(index));
+		memcpy(&entry, raw + off + sizeof(index), sizeof(entry));
+		len = sizeof(entry) + entry.len;
+		if (entry.len > LOGGER_ENTRY_MAX_PAYLOAD ||
+		    off + sizeof(index) + len > rlen)
+			break;
+		if (index == c->index) {
+			memcpy(c->buf + c->len, raw + off + sizeof(index), len);
+			c->len += len;
+		}
+		off += sizeof(index) + len;
+	}
+}
+
+/*
+ * logger_persist_decode - decode the next block of the old ring (or the old
+ * open block once the ring is exhausted) into c->buf.  Returns false when
+ * there is nothing left.
+ */
+static bool logger_persist_decode(struct logger_persist_cursor *c)
+{
+	const unsigned char *data = logger_persist.old_data;
+	uint32_t size = logger_persist.old_size;
+	struct logger_persist_block blk;
+	size_t rlen;
+	long next;
+
+	while (!c->ring_done) {
+		if (++c->steps > size / sizeof(blk)) {
+			c->ring_done = 1;
+			break;
+		}
+		if (logger_persist_is_wrap(data, size, c->off)) {
+			c->off = 0;
+			c->ring_done = c->off == logger_persist.old_end;
+			continue;
+		}
+		next = logger_persist_next(data, size, c->off);
+		if (next < 0) {
+			c->ring_done = 1;
+			break;
+		}
+
+		memcpy(&blk, data + c->off, sizeof(blk));
+		rlen = blk.rlen;
+		if (blk.clen == blk.rlen)
+			memcpy(c->raw, data + c->off + sizeof(blk), rlen);
+		else if (lzo1x_decompress_safe(data + c->off + sizeof(blk),
+					       blk.clen, c->raw, &rlen) !=
+			 LZO_E_OK)
+			rlen = 0;
+
+		c->off = next;
+		c->ring_done = c->off == logger_persist.old_end;
+		logger_persist_filter(c, c->raw, rlen);
+		return true;
+	}
+
+	if (c->open_done < 2) {
+		logger_persist_filter(c, logger_persist.old_open +
+				      c->open_done * LOGGER_PERSIST_BLOCK_SIZE,
+				      logger_persist.old_open_len[c->open_done]);
+		c->open_done++;
+		return true;
+	}
+
+	return false;
+}
+
+static ssize_t logger_persist_read(struct file *file, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct logger_persist_cursor *c = file->private_data;
+	loff_t pos = *ppos;
+	size_t len;
+
+	if (pos < c->base)
+		logger_persist_rewind(c);
+
+	while (pos >= c->base + c->len) {
+		c->base += c->len;
+		if (!logger_persist_decode(c))
+			return 0;
+	}
+
+	len = min_t(size_t, count, c->base + c->len - pos);
+	if (copy_to_user(buf, c->buf + (pos - c->base), len))
+		return -EFAULT;
+
+	*ppos += len;
+	return len;
+}
+
+static int logger_persist_open(struct inode *inode, struct file *file)
+{
+	struct logger_persist_cursor *c;
+
+	c = vmalloc(sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	c->index = (uintptr_t)PDE(inode)->data;
+	logger_persist_rewind(c);
+	file->private_data = c;
+
+	return 0;
+}
+
+static int logger_persist_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations logger_persist_fops = {
+	.owner = THIS_MODULE,
+	.open = logger_persist_open,
+	.read = logger_persist_read,
+	.llseek = default_llseek,
+	.release = logger_persist_release,
+};
+
+/* keep a copy of what the previous boot left behind and publish it */
+static void logger_persist_save_old(struct logger_persist_buffer *old)
+{
+	struct proc_dir_entry *dir;
+	uint32_t i, b;
+
+	if (old->start >= old->size || old->end > old->size ||
+	    old->active > 1 ||
+	    old->open_len[0] > LOGGER_PERSIST_BLOCK_SIZE ||
+	    old->open_len[1] > LOGGER_PERSIST_BLOCK_SIZE)
+		return;
+
+	logger_persist.old_data = vmalloc(old->size);
+	logger_persist.old_open = vmalloc(2 * LOGGER_PERSIST_BLOCK_SIZE);
+	if (!logger_persist.old_data || !logger_persist.old_open)
+		goto err;
+
+	memcpy(logger_persist.old_data, old->data, old->size);
+	logger_persist.old_size = old->size;
+	logger_persist.old_start = old->start;
+	logger_persist.old_end = old->end;
+	/* a block that was not sealed yet is older than the active one */
+	for (i = 0; i < 2; i++) {
+		b = old->active ^ !i;
+		memcpy(logger_persist.old_open + i * LOGGER_PERSIST_BLOCK_SIZE,
+		       old->open[b], old->open_len[b]);
+		logger_persist.old_open_len[i] = old->open_len[b];
+	}
+
+	dir = proc_mkdir("last_log", NULL);
+	if (!dir)
+		goto err;
+
+	for (i = 0; i < ARRAY_SIZE(logger_logs); i++) {
+		struct proc_dir_entry *entry;
+
+		entry = create_proc_entry(logger_logs[i]->misc.name,
+					  S_IFREG | S_IRUGO, dir);
+		if (!entry) {
+			printk(KERN_ERR "logger: failed to create "
+			       "/proc/last_log/%s\n", logger_logs[i]->misc.name);
+			continue;
+		}
+		entry->proc_fops = &logger_persist_fops;
+		entry->data = (void *)(uintptr_t)i;
+	}
+
+	printk(KERN_INFO "logger: recovered old logs, %u bytes compressed\n",
+	       (old->end >= old->start ? 0 : old->size) + old->end -
+	       old->start + old->open_len[0] + old->open_len[1]);
+	return;
+
+err:
+	vfree(logger_persist.old_data);
+	vfree(logger_persist.old_open);
+	logger_persist.old_data = NULL;
+	logger_persist.old_open = NULL;
+}
+
+static int logger_persist_probe(struct platform_device *pdev)
+{
+	struct resource *res = pdev->resource;
+	struct logger_persist_buffer *buffer;
+	size_t buffer_size;
+	uint32_t i;
+
+	if (res == NULL || pdev->num_resources != 1 ||
+	    !(res->flags & IORESOURCE_MEM)) {
+		printk(KERN_ERR "logger: invalid persist resource, %p %d "
+		       "flags %lx\n", res, pdev->num_resources,
+		       res ? res->flags : 0);
+		return -ENXIO;
+	}
+	buffer_size = resource_size(res);
+	if (buffer_size < sizeof(*buffer) + 2 * LOGGER_PERSIST_BLOCK_SIZE) {
+		printk(KERN_ERR "logger: persist buffer too small, %zx\n",
+		       buffer_size);
+		return -EINVAL;
+	}
+
+	buffer = ioremap(res->start, buffer_size);
+	if (buffer == NULL) {
+		printk(KERN_ERR "logger: failed to map persist buffer\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < 2; i++)
+		logger_persist.open[i] = vmalloc(LOGGER_PERSIST_BLOCK_SIZE);
+	logger_persist.cbuf = vmalloc(
+			lzo1x_worst_compress(LOGGER_PERSIST_BLOCK_SIZE));
+	logger_persist.wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+	if (!logger_persist.open[0] || !logger_persist.open[1] ||
+	    !logger_persist.cbuf || !logger_persist.wrkmem)
+		goto err;
+
+	spin_lock_init(&logger_persist.seal_lock);
+
+	if (buffer->sig == LOGGER_PERSIST_SIG &&
+	    buffer->size == buffer_size - sizeof(*buffer))
+		logger_persist_save_old(buffer);
+
+	buffer->sig = LOGGER_PERSIST_SIG;
+	buffer->size = buffer_size - sizeof(*buffer);
+	buffer->start = 0;
+	buffer->end = 0;
+	buffer->active = 0;
+	buffer->open_len[0] = 0;
+	buffer->open_len[1] = 0;
+	wmb();
+
+	printk(KERN_INFO "logger: persisting logs to %zuK at %llx\n",
+	       buffer_size >> 10, (unsigned long long)res->start);
+
+	logger_persist.buffer = buffer;
+	return 0;
+
+err:
+	vfree(logger_persist.wrkmem);
+	vfree(logger_persist.cbuf);
+	for (i = 0; i < 2; i++)
+		vfree(logger_persist.open[i]);
+	iounmap(buffer);
+	return -ENOMEM;
+}
+
+static struct platform_driver logger_persist_driver = {
+	.probe = logger_persist_probe,
+	.driver		= {
+		.name	= "logger_persist",
+	},
+};
+#endif /* CONFIG_ANDROID_LOGGER_PERSIST */
+
 static int __init logger_init(void)
 {
 	int ret;
 
+	logger_slots = alloc_percpu(struct logger_slot);
+	if (!logger_slots)
+		return -ENOMEM;
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
@@ -610,6 +1349,9 @@ static int __init logger_init(void)
 	if (unlikely(ret))
 		goto out;
 
+#ifdef CONFIG_ANDROID_LOGGER_PERSIST
+	ret = platform_driver_register(&logger_persist_driver);
+#endif
 out:
 	return ret;
 }
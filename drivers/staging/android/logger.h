@@ -30,6 +30,28 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_mmap_header - first page of a log's mmap() view
+ *
+ * A log opened for reading can be mapped read-only at offset 0, either as
+ * PAGE_SIZE + size bytes or as PAGE_SIZE + 2 * size bytes.  In the latter
+ * case the ring appears twice back to back, so an entry that wraps can be
+ * parsed in place.  Positions are free-running and taken modulo 'size'.
+ *
+ * Entries in [head, w_commit) are valid.  Load w_commit, issue a read
+ * barrier and consume entries up to it; then issue another read barrier
+ * and re-load head: entries before it were overwritten while they were
+ * being consumed and must be dropped.  'generation' changes each time the
+ * log is flushed.  Report progress with LOGGER_SET_READ_POS so that poll()
+ * only signals entries that have not been consumed yet.
+ */
+struct logger_mmap_header {
+	__u32		w_commit;	/* end of the committed entries */
+	__u32		head;		/* oldest entry still in the buffer */
+	__u32		generation;	/* bumped by LOGGER_FLUSH_LOG */
+	__u32		size;		/* size of the ring, a power of two */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -45,5 +67,6 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_READ_POS		_IO(__LOGGERIO, 5) /* mmap reader pos */
 
 #endif /* _LINUX_LOGGER_H */
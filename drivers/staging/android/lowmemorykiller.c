@@ -16,6 +16,13 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Alternatively, with /sys/module/lowmemorykiller/parameters/use_vmpressure
+ * set, kills are driven by how much of what vmscan scans it fails to
+ * reclaim: at pressure_medium percent processes with an oom_adj of
+ * pressure_medium_adj or higher are killed, at pressure_critical percent
+ * those at pressure_critical_adj or higher.  The pressure level is
+ * reported on /dev/lowmem_pressure in either mode.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -31,10 +38,19 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/oom.h>
+#include <linux/poll.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/swap.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+
+#define CREATE_TRACE_POINTS
+#include "trace/lowmemorykiller.h"
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -55,6 +71,57 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * Every thread group sits in the bucket for its oom_adj, kept current from
+ * fork, exit and writes to /proc/<pid>/oom_adj and oom_score_adj, so that
+ * lowmem_shrink() only looks at the groups it could kill instead of walking
+ * every process.  The lists are protected by lowmem_bucket_lock; hlist heads
+ * need no initialization, which matters because tasks fork long before
+ * this driver initializes.
+ */
+#define LOWMEM_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+
+static struct hlist_head lowmem_buckets[LOWMEM_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_bucket_lock);
+
+static int lowmem_bucket(int oom_adj)
+{
+	return clamp(oom_adj, OOM_DISABLE, OOM_ADJUST_MAX) - OOM_DISABLE;
+}
+
+void lowmem_task_fork(struct task_struct *p)
+{
+	struct signal_struct *sig = p->signal;
+
+	spin_lock(&lowmem_bucket_lock);
+	hlist_add_head(&sig->lowmem_node,
+		       &lowmem_buckets[lowmem_bucket(sig->oom_adj)]);
+	spin_unlock(&lowmem_bucket_lock);
+}
+
+void lowmem_task_exit(struct task_struct *tsk)
+{
+	struct signal_struct *sig = tsk->signal;
+
+	spin_lock(&lowmem_bucket_lock);
+	if (!hlist_unhashed(&sig->lowmem_node))
+		hlist_del_init(&sig->lowmem_node);
+	spin_unlock(&lowmem_bucket_lock);
+}
+
+void lowmem_oom_adj_changed(struct task_struct *task)
+{
+	struct signal_struct *sig = task->signal;
+
+	spin_lock(&lowmem_bucket_lock);
+	if (!hlist_unhashed(&sig->lowmem_node)) {
+		hlist_del(&sig->lowmem_node);
+		hlist_add_head(&sig->lowmem_node,
+			&lowmem_buckets[lowmem_bucket(ACCESS_ONCE(sig->oom_adj))]);
+	}
+	spin_unlock(&lowmem_bucket_lock);
+}
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -79,16 +146,260 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+/*
+ * lowmem_kill - kill the largest thread group in the highest non-empty
+ * oom_adj bucket at or above 'min_adj'.  Returns the victim's size in
+ * pages, or 0 if nothing was killed.
+ */
+static int lowmem_kill(int min_adj)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
-	int rem = 0;
+	struct signal_struct *sig;
+	struct hlist_node *pos;
+	ktime_t start;
 	int tasksize;
+	int b;
+	int buckets = 0;
+	int scanned = 0;
+	int selected_tasksize = 0;
+	int selected_oom_adj = min_adj;
+
+	start = ktime_get();
+
+	read_lock(&tasklist_lock);
+	spin_lock(&lowmem_bucket_lock);
+	/* the first bucket with a candidate holds the victim */
+	for (b = LOWMEM_BUCKETS - 1;
+	     b >= lowmem_bucket(min_adj) && !selected; b--) {
+		buckets++;
+		hlist_for_each_entry(sig, pos, &lowmem_buckets[b], lowmem_node) {
+			int oom_adj;
+
+			scanned++;
+			p = find_lock_task_mm(sig->curr_target);
+			if (!p)
+				continue;
+			oom_adj = sig->oom_adj;
+			if (oom_adj < min_adj) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(p->mm);
+			task_unlock(p);
+			if (tasksize <= 0)
+				continue;
+			if (selected) {
+				if (oom_adj < selected_oom_adj)
+					continue;
+				if (oom_adj == selected_oom_adj &&
+				    tasksize <= selected_tasksize)
+					continue;
+			}
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "to kill\n", p->pid, p->comm, oom_adj,
+				     tasksize);
+		}
+	}
+	spin_unlock(&lowmem_bucket_lock);
+	trace_lowmem_select(min_adj, buckets, scanned,
+			    selected ? selected->pid : 0,
+			    selected ? selected_oom_adj : 0,
+			    selected ? selected_tasksize : 0,
+			    ktime_to_ns(ktime_sub(ktime_get(), start)));
+	if (selected) {
+		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+			     selected->pid, selected->comm,
+			     selected_oom_adj, selected_tasksize);
+		lowmem_deathpending = selected;
+		lowmem_deathpending_timeout = jiffies + HZ;
+		force_sig(SIGKILL, selected);
+	}
+	read_unlock(&tasklist_lock);
+	return selected_tasksize;
+}
+
+/* a kill is still in flight, don't pick another victim yet */
+static bool lowmem_death_pending(void)
+{
+	return lowmem_deathpending &&
+	       time_before_eq(jiffies, lowmem_deathpending_timeout);
+}
+
+/*
+ * Reclaim efficiency
+ *
+ * vmscan reports the pages it scanned and reclaimed on the global LRUs
+ * through lowmem_vmpressure().  Every 'vmpressure_window' scanned pages
+ * the share of them that could not be reclaimed is turned into a level,
+ * which is published on /dev/lowmem_pressure and, if 'use_vmpressure' is
+ * set, drives the kills instead of the minfree table.
+ */
+enum {
+	LOWMEM_PRESSURE_LOW,
+	LOWMEM_PRESSURE_MEDIUM,
+	LOWMEM_PRESSURE_CRITICAL,
+};
+
+static const char * const lowmem_pressure_names[] = {
+	"low", "medium", "critical",
+};
+
+static bool lowmem_use_vmpressure;
+static unsigned long lowmem_vmpressure_window = SWAP_CLUSTER_MAX * 16;
+static unsigned int lowmem_pressure_medium = 60;
+static unsigned int lowmem_pressure_critical = 95;
+static int lowmem_pressure_medium_adj = 12;
+static int lowmem_pressure_critical_adj = 6;
+
+static DEFINE_SPINLOCK(lowmem_vmpressure_lock);
+static unsigned long lowmem_vmpressure_scanned;
+static unsigned long lowmem_vmpressure_reclaimed;
+
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+static atomic_t lowmem_pressure_seq = ATOMIC_INIT(0);
+static int lowmem_pressure_level;
+static unsigned int lowmem_pressure_value;
+
+static void lowmem_vmpressure_work(struct work_struct *work)
+{
+	unsigned long scanned, reclaimed;
+	unsigned int pressure = 0;
+	int level;
+
+	spin_lock(&lowmem_vmpressure_lock);
+	scanned = lowmem_vmpressure_scanned;
+	reclaimed = lowmem_vmpressure_reclaimed;
+	lowmem_vmpressure_scanned = 0;
+	lowmem_vmpressure_reclaimed = 0;
+	spin_unlock(&lowmem_vmpressure_lock);
+
+	if (!scanned)
+		return;
+	if (reclaimed < scanned)
+		pressure = (scanned - reclaimed) * 100 / scanned;
+
+	if (pressure >= lowmem_pressure_critical)
+		level = LOWMEM_PRESSURE_CRITICAL;
+	else if (pressure >= lowmem_pressure_medium)
+		level = LOWMEM_PRESSURE_MEDIUM;
+	else
+		level = LOWMEM_PRESSURE_LOW;
+
+	lowmem_print(3, "vmpressure %lu scanned, %lu reclaimed, %u%% %s\n",
+		     scanned, reclaimed, pressure, lowmem_pressure_names[level]);
+
+	lowmem_pressure_level = level;
+	lowmem_pressure_value = pressure;
+	smp_wmb();
+	atomic_inc(&lowmem_pressure_seq);
+	wake_up_interruptible(&lowmem_pressure_wait);
+
+	if (!lowmem_use_vmpressure || level == LOWMEM_PRESSURE_LOW ||
+	    lowmem_death_pending())
+		return;
+	lowmem_kill(level == LOWMEM_PRESSURE_CRITICAL ?
+		    lowmem_pressure_critical_adj : lowmem_pressure_medium_adj);
+}
+
+static DECLARE_WORK(lowmem_vmpressure_wq, lowmem_vmpressure_work);
+
+void lowmem_vmpressure(gfp_t gfp, unsigned long scanned,
+		       unsigned long reclaimed)
+{
+	bool full;
+
+	/*
+	 * Allocations that can't use highmem or movable memory and can't do
+	 * I/O aren't helped by killing anything.
+	 */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+	if (!scanned)
+		return;
+
+	spin_lock(&lowmem_vmpressure_lock);
+	lowmem_vmpressure_scanned += scanned;
+	lowmem_vmpressure_reclaimed += reclaimed;
+	full = lowmem_vmpressure_scanned >= lowmem_vmpressure_window;
+	spin_unlock(&lowmem_vmpressure_lock);
+
+	if (full)
+		schedule_work(&lowmem_vmpressure_wq);
+}
+
+/*
+ * /dev/lowmem_pressure: read() returns "<level> <pressure%>\n" for the
+ * latest window, blocking until a window completes if the file has already
+ * seen the current one; poll() reports POLLIN when a read won't block.
+ * The first read after open() returns at once.
+ */
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	file->private_data =
+		(void *)(long)(atomic_read(&lowmem_pressure_seq) - 1);
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	char tmp[32];
+	int seq, len;
+
+	while (atomic_read(&lowmem_pressure_seq) ==
+	       (long)file->private_data) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(lowmem_pressure_wait,
+			atomic_read(&lowmem_pressure_seq) !=
+			(long)file->private_data))
+			return -ERESTARTSYS;
+	}
+
+	seq = atomic_read(&lowmem_pressure_seq);
+	smp_rmb();
+	len = snprintf(tmp, sizeof(tmp), "%s %u\n",
+		       lowmem_pressure_names[lowmem_pressure_level],
+		       lowmem_pressure_value);
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, tmp, len))
+		return -EFAULT;
+	file->private_data = (void *)(long)seq;
+	return len;
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &lowmem_pressure_wait, wait);
+	if (atomic_read(&lowmem_pressure_seq) != (long)file->private_data)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.read = lowmem_pressure_read,
+	.poll = lowmem_pressure_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice lowmem_pressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmem_pressure",
+	.fops = &lowmem_pressure_fops,
+};
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	int rem = 0;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
@@ -101,15 +412,15 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	 * this pass.
 	 *
 	 */
-	if (lowmem_deathpending &&
-	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+	if (lowmem_death_pending())
 		return 0;
 
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
+	/* with use_vmpressure set, kills come from lowmem_vmpressure_work */
+	for (i = 0; i < array_size && !lowmem_use_vmpressure; i++) {
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
 			min_adj = lowmem_adj[i];
@@ -129,55 +440,10 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     sc->nr_to_scan, sc->gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
-	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
-	}
+	rem -= lowmem_kill(min_adj);
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -188,6 +454,11 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	int ret;
+
+	ret = misc_register(&lowmem_pressure_misc);
+	if (ret)
+		return ret;
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
@@ -197,6 +468,7 @@ static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
+	misc_deregister(&lowmem_pressure_misc);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -205,6 +477,18 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(use_vmpressure, lowmem_use_vmpressure, bool,
+		   S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_window, lowmem_vmpressure_window, ulong,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_medium, lowmem_pressure_medium, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical, lowmem_pressure_critical, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_medium_adj, lowmem_pressure_medium_adj, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical_adj, lowmem_pressure_critical_adj, int,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -0,0 +1,47 @@
+#undef TRACE_SYSTEM
+#define TRACE_INCLUDE_PATH ../../drivers/staging/android/trace
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_select,
+
+	TP_PROTO(int min_adj, int buckets, int scanned, pid_t pid, int adj,
+		 int tasksize, u64 delta_ns),
+
+	TP_ARGS(min_adj, buckets, scanned, pid, adj, tasksize, delta_ns),
+
+	TP_STRUCT__entry(
+		__field(int,	min_adj)
+		__field(int,	buckets)
+		__field(int,	scanned)
+		__field(pid_t,	pid)
+		__field(int,	adj)
+		__field(int,	tasksize)
+		__field(u64,	delta_ns)
+	),
+
+	TP_fast_assign(
+		__entry->min_adj	= min_adj;
+		__entry->buckets	= buckets;
+		__entry->scanned	= scanned;
+		__entry->pid		= pid;
+		__entry->adj		= adj;
+		__entry->tasksize	= tasksize;
+		__entry->delta_ns	= delta_ns;
+	),
+
+	TP_printk("min_adj=%d buckets=%d scanned=%d pid=%d adj=%d size=%d "
+		  "ns=%llu",
+		__entry->min_adj, __entry->buckets, __entry->scanned,
+		__entry->pid, __entry->adj, __entry->tasksize,
+		(unsigned long long)__entry->delta_ns)
+);
+
+#endif /* _TRACE_LOWMEMORYKILLER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -8,8 +8,8 @@
  * and, thus indirectly, for cleancache and frontswap.  Zcache includes two
  * page-accessible memory [1] interfaces, both utilizing lzo1x compression:
  * 1) "compression buddies" ("zbud") is used for ephemeral pages
- * 2) xvmalloc is used for persistent pages.
- * Xvmalloc (based on the TLSF allocator) has very low fragmentation
+ * 2) zsmalloc is used for persistent pages.
+ * Zsmalloc packs objects by size class and compacts sparsely used pages
  * so maximizes space efficiency, while zbud allows pairs (and potentially,
  * in the future, more than a pair of) compressed pages to be closely linked
  * so that reclaiming can be done via the kernel's physical-page-oriented
@@ -29,9 +29,11 @@
 #include <linux/types.h>
 #include <linux/atomic.h>
 #include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
 #include "tmem.h"
 
-#include "../zram/xvmalloc.h" /* if built in drivers/staging */
+#include "../zsmalloc/zsmalloc.h" /* if built in drivers/staging */
 
 #if (!defined(CONFIG_CLEANCACHE) && !defined(CONFIG_FRONTSWAP))
 #error "zcache is useless without CONFIG_CLEANCACHE or CONFIG_FRONTSWAP"
@@ -43,6 +45,9 @@
 #include <linux/frontswap.h>
 #endif
 
+#define CREATE_TRACE_POINTS
+#include "zcache-trace.h"
+
 #if 0
 /* this is more aggressive but may cause other problems? */
 #define ZCACHE_GFP_MASK	(GFP_ATOMIC | __GFP_NORETRY | __GFP_NOWARN)
@@ -60,7 +65,7 @@ MODULE_LICENSE("GPL");
 
 struct zcache_client {
 	struct tmem_pool *tmem_pools[MAX_POOLS_PER_CLIENT];
-	struct xv_pool *xvpool;
+	struct zs_pool *zspool;
 	bool allocated;
 	atomic_t refcount;
 };
@@ -485,87 +490,111 @@ static void zbud_evict_zbpg(struct zbud_page *zbpg)
 	zbud_free_raw_page(zbpg);
 }
 
+/* zbpgs taken off the lists per hold of the list lock when evicting */
+#define ZBUD_EVICT_BATCH 16
+
+/*
+ * Take up to nr zbpgs off a buddied or unbuddied list, skipping those
+ * whose lock can't be had without waiting.  The zbpgs are unlocked again
+ * before returning: off the lists they are zombies that nobody else
+ * frees, and zbud_evict_zbpg() must not be entered with more than one
+ * zbpg locked as it takes tmem locks.  Called with the list lock held,
+ * returns how many zbpgs were taken.
+ */
+static int zbud_isolate_zbpgs(struct list_head *list,
+				struct zbud_page **batch, int nr)
+{
+	struct zbud_page *zbpg, *ztmp;
+	int n = 0;
+
+	ASSERT_SPINLOCK(&zbud_budlists_spinlock);
+	list_for_each_entry_safe(zbpg, ztmp, list, bud_list) {
+		if (n >= nr)
+			break;
+		if (unlikely(!spin_trylock(&zbpg->lock)))
+			continue;
+		list_del_init(&zbpg->bud_list);
+		spin_unlock(&zbpg->lock);
+		batch[n++] = zbpg;
+	}
+	return n;
+}
+
+static void zbud_evict_batch(struct zbud_page **batch, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		spin_lock(&batch[i]->lock);
+		zbud_evict_zbpg(batch[i]);
+	}
+}
+
 /*
  * Free nr pages.  This code is funky because we want to hold the locks
  * protecting various lists for as short a time as possible, and in some
  * circumstances the list may change asynchronously when the list lock is
  * not held.  In some cases we also trylock not only to avoid waiting on a
  * page in use by another cpu, but also to avoid potential deadlock due to
- * lock inversion.
+ * lock inversion.  Pages are taken off the lists in batches so that the
+ * list lock is taken once per ZBUD_EVICT_BATCH pages rather than per page.
  */
 static void zbud_evict_pages(int nr)
 {
-	struct zbud_page *zbpg;
-	int i;
+	struct zbud_page *batch[ZBUD_EVICT_BATCH];
+	struct zbud_page *zbpg, *ztmp;
+	LIST_HEAD(free_list);
+	int i, n, evicted = 0;
+
+	trace_zcache_evict_begin(nr);
 
 	/* first try freeing any pages on unused list */
-retry_unused_list:
 	spin_lock_bh(&zbpg_unused_list_spinlock);
-	if (!list_empty(&zbpg_unused_list)) {
-		/* can't walk list here, since it may change when unlocked */
-		zbpg = list_first_entry(&zbpg_unused_list,
-				struct zbud_page, bud_list);
-		list_del_init(&zbpg->bud_list);
+	while (evicted < nr && !list_empty(&zbpg_unused_list)) {
+		list_move(zbpg_unused_list.next, &free_list);
 		zcache_zbpg_unused_list_count--;
 		atomic_dec(&zcache_zbud_curr_raw_pages);
-		spin_unlock_bh(&zbpg_unused_list_spinlock);
-		zcache_free_page(zbpg);
-		zcache_evicted_raw_pages++;
-		if (--nr <= 0)
-			goto out;
-		goto retry_unused_list;
+		evicted++;
 	}
 	spin_unlock_bh(&zbpg_unused_list_spinlock);
+	list_for_each_entry_safe(zbpg, ztmp, &free_list, bud_list) {
+		list_del(&zbpg->bud_list);
+		zcache_free_page(zbpg);
+	}
+	zcache_evicted_raw_pages += evicted;
 
 	/* now try freeing unbuddied pages, starting with least space avail */
-	for (i = 0; i < MAX_CHUNK; i++) {
-retry_unbud_list_i:
-		spin_lock_bh(&zbud_budlists_spinlock);
-		if (list_empty(&zbud_unbuddied[i].list)) {
-			spin_unlock_bh(&zbud_budlists_spinlock);
-			continue;
-		}
-		list_for_each_entry(zbpg, &zbud_unbuddied[i].list, bud_list) {
-			if (unlikely(!spin_trylock(&zbpg->lock)))
-				continue;
-			list_del_init(&zbpg->bud_list);
-			zbud_unbuddied[i].count--;
+	for (i = 0; i < MAX_CHUNK && evicted < nr; i++) {
+		do {
+			spin_lock_bh(&zbud_budlists_spinlock);
+			n = zbud_isolate_zbpgs(&zbud_unbuddied[i].list, batch,
+				min(nr - evicted, ZBUD_EVICT_BATCH));
+			zbud_unbuddied[i].count -= n;
 			spin_unlock(&zbud_budlists_spinlock);
-			zcache_evicted_unbuddied_pages++;
+			zcache_evicted_unbuddied_pages += n;
 			/* want budlists unlocked when doing zbpg eviction */
-			zbud_evict_zbpg(zbpg);
+			zbud_evict_batch(batch, n);
 			local_bh_enable();
-			if (--nr <= 0)
-				goto out;
-			goto retry_unbud_list_i;
-		}
-		spin_unlock_bh(&zbud_budlists_spinlock);
+			evicted += n;
+		} while (n && evicted < nr);
 	}
 
 	/* as a last resort, free buddied pages */
-retry_bud_list:
-	spin_lock_bh(&zbud_budlists_spinlock);
-	if (list_empty(&zbud_buddied_list)) {
-		spin_unlock_bh(&zbud_budlists_spinlock);
-		goto out;
-	}
-	list_for_each_entry(zbpg, &zbud_buddied_list, bud_list) {
-		if (unlikely(!spin_trylock(&zbpg->lock)))
-			continue;
-		list_del_init(&zbpg->bud_list);
-		zcache_zbud_buddied_count--;
+	while (evicted < nr) {
+		spin_lock_bh(&zbud_budlists_spinlock);
+		n = zbud_isolate_zbpgs(&zbud_buddied_list, batch,
+				min(nr - evicted, ZBUD_EVICT_BATCH));
+		zcache_zbud_buddied_count -= n;
 		spin_unlock(&zbud_budlists_spinlock);
-		zcache_evicted_buddied_pages++;
-		/* want budlists unlocked when doing zbpg eviction */
-		zbud_evict_zbpg(zbpg);
+		zcache_evicted_buddied_pages += n;
+		zbud_evict_batch(batch, n);
 		local_bh_enable();
-		if (--nr <= 0)
-			goto out;
-		goto retry_bud_list;
+		if (!n)
+			break;
+		evicted += n;
 	}
-	spin_unlock_bh(&zbud_budlists_spinlock);
-out:
-	return;
+
+	trace_zcache_evict_end(nr, evicted);
 }
 
 static void zbud_init(void)
@@ -623,9 +652,9 @@ static int zbud_show_cumul_chunk_counts(char *buf)
 #endif
 
 /**********
- * This "zv" PAM implementation combines the TLSF-based xvMalloc
+ * This "zv" PAM implementation combines the size-class based zsmalloc
  * with lzo1x compression to maximize the amount of data that can
- * be packed into a physical page.
+ * be packed into a physical page.  The pampd is the zsmalloc handle.
  *
  * Zv represents a PAM page with the index and object (plus a "size" value
  * necessary for decompression) immediately preceding the compressed data.
@@ -637,6 +666,7 @@ struct zv_hdr {
 	uint32_t pool_id;
 	struct tmem_oid oid;
 	uint32_t index;
+	size_t size;	/* of the compressed data following the header */
 	DECL_SENTINEL
 };
 
@@ -658,71 +688,72 @@ static unsigned int zv_max_mean_zsize = (PAGE_SIZE / 8) * 5;
 static unsigned long zv_curr_dist_counts[NCHUNKS];
 static unsigned long zv_cumul_dist_counts[NCHUNKS];
 
-static struct zv_hdr *zv_create(struct xv_pool *xvpool, uint32_t pool_id,
+static unsigned long zv_create(struct zs_pool *pool, uint32_t pool_id,
 				struct tmem_oid *oid, uint32_t index,
 				void *cdata, unsigned clen)
 {
-	struct page *page;
-	struct zv_hdr *zv = NULL;
-	uint32_t offset;
+	struct zv_hdr *zv;
 	int alloc_size = clen + sizeof(struct zv_hdr);
 	int chunks = (alloc_size + (CHUNK_SIZE - 1)) >> CHUNK_SHIFT;
-	int ret;
+	unsigned long handle;
 
 	BUG_ON(!irqs_disabled());
 	BUG_ON(chunks >= NCHUNKS);
-	ret = xv_malloc(xvpool, alloc_size,
-			&page, &offset, ZCACHE_GFP_MASK);
-	if (unlikely(ret))
+	handle = zs_malloc(pool, alloc_size);
+	if (unlikely(!handle))
 		goto out;
 	zv_curr_dist_counts[chunks]++;
 	zv_cumul_dist_counts[chunks]++;
-	zv = kmap_atomic(page, KM_USER0) + offset;
+	zv = zs_map_object(pool, handle, ZS_MM_WO);
 	zv->index = index;
 	zv->oid = *oid;
 	zv->pool_id = pool_id;
+	zv->size = clen;
 	SET_SENTINEL(zv, ZVH);
 	memcpy((char *)zv + sizeof(struct zv_hdr), cdata, clen);
-	kunmap_atomic(zv, KM_USER0);
+	zs_unmap_object(pool, handle);
 out:
-	return zv;
+	return handle;
 }
 
-static void zv_free(struct xv_pool *xvpool, struct zv_hdr *zv)
+static void zv_free(struct zs_pool *pool, unsigned long handle)
 {
 	unsigned long flags;
-	struct page *page;
-	uint32_t offset;
-	uint16_t size = xv_get_object_size(zv);
-	int chunks = (size + (CHUNK_SIZE - 1)) >> CHUNK_SHIFT;
+	struct zv_hdr *zv;
+	uint16_t size;
+	int chunks;
 
+	zv = zs_map_object(pool, handle, ZS_MM_RW);
 	ASSERT_SENTINEL(zv, ZVH);
+	size = zv->size + sizeof(struct zv_hdr);
+	INVERT_SENTINEL(zv, ZVH);
+	zs_unmap_object(pool, handle);
+
+	chunks = (size + (CHUNK_SIZE - 1)) >> CHUNK_SHIFT;
 	BUG_ON(chunks >= NCHUNKS);
 	zv_curr_dist_counts[chunks]--;
-	size -= sizeof(*zv);
-	BUG_ON(size == 0);
-	INVERT_SENTINEL(zv, ZVH);
-	page = virt_to_page(zv);
-	offset = (unsigned long)zv & ~PAGE_MASK;
+
 	local_irq_save(flags);
-	xv_free(xvpool, page, offset);
+	zs_free(pool, handle);
 	local_irq_restore(flags);
 }
 
-static void zv_decompress(struct page *page, struct zv_hdr *zv)
+static void zv_decompress(struct zs_pool *pool, struct page *page,
+			  unsigned long handle)
 {
 	size_t clen = PAGE_SIZE;
 	char *to_va;
-	unsigned size;
+	struct zv_hdr *zv;
 	int ret;
 
+	zv = zs_map_object(pool, handle, ZS_MM_RO);
 	ASSERT_SENTINEL(zv, ZVH);
-	size = xv_get_object_size(zv) - sizeof(*zv);
-	BUG_ON(size == 0);
+	BUG_ON(zv->size == 0);
 	to_va = kmap_atomic(page, KM_USER0);
 	ret = lzo1x_decompress_safe((char *)zv + sizeof(*zv),
-					size, to_va, &clen);
+					zv->size, to_va, &clen);
 	kunmap_atomic(to_va, KM_USER0);
+	zs_unmap_object(pool, handle);
 	BUG_ON(ret != LZO_E_OK);
 	BUG_ON(clen != PAGE_SIZE);
 }
@@ -891,6 +922,16 @@ static unsigned long zcache_flobj_total;
 static unsigned long zcache_flobj_found;
 static unsigned long zcache_failed_eph_puts;
 static unsigned long zcache_failed_pers_puts;
+static unsigned long zcache_deferred_puts;
+static unsigned long zcache_deferred_cancels;
+static unsigned long zcache_deferred_batches;
+
+/*
+ * Most cleancache pages queued for compression in the background; 0 (the
+ * default) compresses them synchronously in the caller.
+ */
+static unsigned long zcache_deferred_max;
+static unsigned long zcache_deferred_count;
 
 /*
  * Tmem operations assume the poolid implies the invoking client.
@@ -949,8 +990,8 @@ int zcache_new_client(uint16_t cli_id)
 		goto out;
 	cli->allocated = 1;
 #ifdef CONFIG_FRONTSWAP
-	cli->xvpool = xv_create_pool();
-	if (cli->xvpool == NULL)
+	cli->zspool = zs_create_pool("zcache", ZCACHE_GFP_MASK | __GFP_HIGHMEM);
+	if (cli->zspool == NULL)
 		goto out;
 #endif
 	ret = 0;
@@ -1140,7 +1181,7 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 				 uint32_t index)
 {
 	void *pampd = NULL, *cdata;
-	size_t clen;
+	size_t clen = 0;
 	int ret;
 	unsigned long count;
 	struct page *page = (struct page *)(data);
@@ -1150,6 +1191,7 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 	unsigned long curr_pers_pampd_count;
 	u64 total_zsize;
 
+	trace_zcache_compress_begin(pool->pool_id, index, eph);
 	if (eph) {
 		ret = zcache_compress(page, &cdata, &clen);
 		if (ret == 0)
@@ -1181,7 +1223,7 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 		}
 		/* reject if mean compression is too poor */
 		if ((clen > zv_max_mean_zsize) && (curr_pers_pampd_count > 0)) {
-			total_zsize = xv_get_total_size_bytes(cli->xvpool);
+			total_zsize = zs_get_total_size_bytes(cli->zspool);
 			zv_mean_zsize = div_u64(total_zsize,
 						curr_pers_pampd_count);
 			if (zv_mean_zsize > zv_max_mean_zsize) {
@@ -1189,7 +1231,7 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 				goto out;
 			}
 		}
-		pampd = (void *)zv_create(cli->xvpool, pool->pool_id,
+		pampd = (void *)zv_create(cli->zspool, pool->pool_id,
 						oid, index, cdata, clen);
 		if (pampd == NULL)
 			goto out;
@@ -1198,6 +1240,7 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 			zcache_curr_pers_pampd_count_max = count;
 	}
 out:
+	trace_zcache_compress_end(pool->pool_id, index, clen, pampd != NULL);
 	return pampd;
 }
 
@@ -1210,9 +1253,10 @@ static int zcache_pampd_get_data(char *data, size_t *bufsize, bool raw,
 					struct tmem_oid *oid, uint32_t index)
 {
 	int ret = 0;
+	struct zcache_client *cli = pool->client;
 
 	BUG_ON(is_ephemeral(pool));
-	zv_decompress((struct page *)(data), pampd);
+	zv_decompress(cli->zspool, (struct page *)(data), (unsigned long)pampd);
 	return ret;
 }
 
@@ -1224,10 +1268,11 @@ static int zcache_pampd_get_data_and_free(char *data, size_t *bufsize, bool raw,
 					void *pampd, struct tmem_pool *pool,
 					struct tmem_oid *oid, uint32_t index)
 {
-	int ret = 0;
+	int ret;
 
 	BUG_ON(!is_ephemeral(pool));
-	zbud_decompress((struct page *)(data), pampd);
+	/* fails if the zbpg is being evicted, which is then a miss */
+	ret = zbud_decompress((struct page *)(data), pampd);
 	zbud_free_and_delist((struct zbud_hdr *)pampd);
 	atomic_dec(&zcache_curr_eph_pampd_count);
 	return ret;
@@ -1247,7 +1292,7 @@ static void zcache_pampd_free(void *pampd, struct tmem_pool *pool,
 		atomic_dec(&zcache_curr_eph_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_eph_pampd_count) < 0);
 	} else {
-		zv_free(cli->xvpool, (struct zv_hdr *)pampd);
+		zv_free(cli->zspool, (unsigned long)pampd);
 		atomic_dec(&zcache_curr_pers_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_pers_pampd_count) < 0);
 	}
@@ -1416,6 +1461,10 @@ ZCACHE_SYSFS_RO(failed_alloc);
 ZCACHE_SYSFS_RO(put_to_flush);
 ZCACHE_SYSFS_RO(compress_poor);
 ZCACHE_SYSFS_RO(mean_compress_poor);
+ZCACHE_SYSFS_RO(deferred_puts);
+ZCACHE_SYSFS_RO(deferred_cancels);
+ZCACHE_SYSFS_RO(deferred_batches);
+ZCACHE_SYSFS_RO(deferred_count);
 ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_raw_pages);
 ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_zpages);
 ZCACHE_SYSFS_RO_ATOMIC(curr_obj_count);
@@ -1429,6 +1478,41 @@ ZCACHE_SYSFS_RO_CUSTOM(zv_curr_dist_counts,
 ZCACHE_SYSFS_RO_CUSTOM(zv_cumul_dist_counts,
 			zv_cumul_dist_counts_show);
 
+/*
+ * setting deferred_max via sysfs lets up to that many clean page cache
+ * pages be copied and queued instead of being compressed by the task
+ * doing reclaim; a worker compresses them in batches.  0 disables it.
+ */
+static ssize_t zcache_deferred_max_show(struct kobject *kobj,
+					struct kobj_attribute *attr,
+					char *buf)
+{
+	return sprintf(buf, "%lu\n", zcache_deferred_max);
+}
+
+static ssize_t zcache_deferred_max_store(struct kobject *kobj,
+					 struct kobj_attribute *attr,
+					 const char *buf, size_t count)
+{
+	unsigned long val;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	err = strict_strtoul(buf, 10, &val);
+	if (err || (val > 4096))
+		return -EINVAL;
+	zcache_deferred_max = val;
+	return count;
+}
+
+static struct kobj_attribute zcache_deferred_max_attr = {
+		.attr = { .name = "deferred_max", .mode = 0644 },
+		.show = zcache_deferred_max_show,
+		.store = zcache_deferred_max_store,
+};
+
 static struct attribute *zcache_attrs[] = {
 	&zcache_curr_obj_count_attr.attr,
 	&zcache_curr_obj_count_max_attr.attr,
@@ -1455,6 +1539,11 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_failed_get_free_pages_attr.attr,
 	&zcache_failed_alloc_attr.attr,
 	&zcache_put_to_flush_attr.attr,
+	&zcache_deferred_puts_attr.attr,
+	&zcache_deferred_cancels_attr.attr,
+	&zcache_deferred_batches_attr.attr,
+	&zcache_deferred_count_attr.attr,
+	&zcache_deferred_max_attr.attr,
 	&zcache_zbud_unbuddied_list_counts_attr.attr,
 	&zcache_zbud_cumul_chunk_counts_attr.attr,
 	&zcache_zv_curr_dist_counts_attr.attr,
@@ -1689,6 +1778,234 @@ out:
  */
 
 #ifdef CONFIG_CLEANCACHE
+/*
+ * Deferred cleancache puts.  cleancache hands over pages from reclaim,
+ * where compressing them synchronously adds to the latency of whoever is
+ * reclaiming.  When deferred_max is set, puts instead copy the page and
+ * queue it; a worker compresses the queue in batches of ZCACHE_DEFER_BATCH.
+ *
+ * A queued page must never reach tmem after a later put, get or flush of
+ * the same page, or stale data could be returned.  So every operation
+ * first cancels matching queued pages.  Pages the worker has already
+ * taken sit on zcache_deferred_busy until they are fully dealt with and
+ * are only marked: the worker skips a marked page, or flushes it again if
+ * it was marked while being stored.  Gets miss while a matching page is
+ * busy, so they never see it half way, and destroying a pool waits for
+ * the worker to be done with the pool's busy pages.  That may cost a
+ * later put of the same page, which is fine for an ephemeral pool.
+ */
+#define ZCACHE_DEFER_BATCH 16
+
+struct zcache_deferred {
+	struct list_head list;
+	struct page *page;
+	int pool_id;
+	struct tmem_oid oid;
+	uint32_t index;
+	bool cancelled;
+};
+
+/* how much of a deferred put a cancel covers */
+enum zcache_defer_scope {
+	ZCACHE_DEFER_PAGE,
+	ZCACHE_DEFER_OBJ,
+	ZCACHE_DEFER_POOL,
+};
+
+static struct kmem_cache *zcache_deferred_cache;
+static LIST_HEAD(zcache_deferred_list);
+static LIST_HEAD(zcache_deferred_busy);
+/* protects both lists, zcache_deferred_count and the cancelled flags */
+static DEFINE_SPINLOCK(zcache_deferred_lock);
+/* woken whenever the worker takes a page off the busy list */
+static DECLARE_WAIT_QUEUE_HEAD(zcache_deferred_wait);
+
+static void zcache_deferred_free(struct zcache_deferred *zd)
+{
+	__free_page(zd->page);
+	kmem_cache_free(zcache_deferred_cache, zd);
+}
+
+static bool zcache_deferred_match(struct zcache_deferred *zd, int pool_id,
+				  struct tmem_oid *oidp, uint32_t index,
+				  enum zcache_defer_scope scope)
+{
+	if (zd->pool_id != pool_id)
+		return false;
+	if (scope == ZCACHE_DEFER_POOL)
+		return true;
+	if (tmem_oid_compare(&zd->oid, oidp))
+		return false;
+	return scope == ZCACHE_DEFER_OBJ || zd->index == index;
+}
+
+static bool zcache_deferred_pool_busy(int pool_id)
+{
+	struct zcache_deferred *zd;
+	unsigned long flags;
+	bool busy = false;
+
+	spin_lock_irqsave(&zcache_deferred_lock, flags);
+	list_for_each_entry(zd, &zcache_deferred_busy, list)
+		if (zd->pool_id == pool_id) {
+			busy = true;
+			break;
+		}
+	spin_unlock_irqrestore(&zcache_deferred_lock, flags);
+	return busy;
+}
+
+/*
+ * Cancels the deferred puts within scope.  If 'page' is given and a
+ * queued copy of it is found, the copy is handed back in it and 1 is
+ * returned: that is a cleancache hit.  Returns -EBUSY if the worker holds
+ * a matching page, tmem can not be trusted for it then, and 0 otherwise.
+ * A pool scope cancel sleeps until the worker left the pool alone.
+ */
+static int zcache_deferred_cancel(int pool_id, struct tmem_oid *oidp,
+				  uint32_t index,
+				  enum zcache_defer_scope scope,
+				  struct page *page)
+{
+	struct zcache_deferred *zd, *tmp;
+	LIST_HEAD(free_list);
+	unsigned long flags;
+	int ret = 0;
+
+	/*
+	 * Operations on one page are serialized by the page cache, which
+	 * orders this against the put that queued it.
+	 */
+	if (list_empty(&zcache_deferred_list) &&
+	    list_empty(&zcache_deferred_busy))
+		return 0;
+
+	spin_lock_irqsave(&zcache_deferred_lock, flags);
+	list_for_each_entry_safe(zd, tmp, &zcache_deferred_list, list) {
+		if (!zcache_deferred_match(zd, pool_id, oidp, index, scope))
+			continue;
+		list_move(&zd->list, &free_list);
+		zcache_deferred_count--;
+		zcache_deferred_cancels++;
+	}
+	list_for_each_entry(zd, &zcache_deferred_busy, list)
+		if (zcache_deferred_match(zd, pool_id, oidp, index, scope)) {
+			zd->cancelled = true;
+			ret = -EBUSY;
+		}
+	spin_unlock_irqrestore(&zcache_deferred_lock, flags);
+
+	list_for_each_entry_safe(zd, tmp, &free_list, list) {
+		/* a queued page is newer than anything the worker holds */
+		if (page != NULL && ret <= 0) {
+			copy_highpage(page, zd->page);
+			ret = 1;
+		}
+		list_del(&zd->list);
+		zcache_deferred_free(zd);
+	}
+
+	if (scope == ZCACHE_DEFER_POOL && ret == -EBUSY)
+		wait_event(zcache_deferred_wait,
+			   !zcache_deferred_pool_busy(pool_id));
+	return ret;
+}
+
+static void zcache_deferred_work_fn(struct work_struct *work)
+{
+	struct zcache_deferred *zd;
+	unsigned long flags;
+	bool cancelled;
+	int i, n;
+
+	for (;;) {
+		spin_lock_irqsave(&zcache_deferred_lock, flags);
+		for (n = 0; n < ZCACHE_DEFER_BATCH &&
+			    !list_empty(&zcache_deferred_list); n++)
+			list_move_tail(zcache_deferred_list.next,
+					&zcache_deferred_busy);
+		zcache_deferred_count -= n;
+		if (n)
+			zcache_deferred_batches++;
+		spin_unlock_irqrestore(&zcache_deferred_lock, flags);
+		if (!n)
+			break;
+
+		trace_zcache_deferred_batch(n, zcache_deferred_count);
+		/* only this worker takes entries off the busy list */
+		for (i = 0; i < n; i++) {
+			zd = list_first_entry(&zcache_deferred_busy,
+					struct zcache_deferred, list);
+			spin_lock_irqsave(&zcache_deferred_lock, flags);
+			cancelled = zd->cancelled;
+			spin_unlock_irqrestore(&zcache_deferred_lock, flags);
+			if (!cancelled) {
+				local_irq_save(flags);
+				(void)zcache_put_page(LOCAL_CLIENT, zd->pool_id,
+						&zd->oid, zd->index, zd->page);
+				local_irq_restore(flags);
+
+				spin_lock_irqsave(&zcache_deferred_lock, flags);
+				cancelled = zd->cancelled;
+				spin_unlock_irqrestore(&zcache_deferred_lock,
+						       flags);
+				/* still busy, so gets miss until it is gone */
+				if (cancelled)
+					(void)zcache_flush_page(LOCAL_CLIENT,
+							zd->pool_id, &zd->oid,
+							zd->index);
+			}
+
+			spin_lock_irqsave(&zcache_deferred_lock, flags);
+			list_del(&zd->list);
+			spin_unlock_irqrestore(&zcache_deferred_lock, flags);
+			wake_up_all(&zcache_deferred_wait);
+			zcache_deferred_free(zd);
+		}
+		cond_resched();
+	}
+}
+
+static DECLARE_WORK(zcache_deferred_work, zcache_deferred_work_fn);
+
+/*
+ * Queues a copy of the page for the worker.  Fails when deferring is off
+ * or the queue is full, and the put is then done synchronously.
+ */
+static bool zcache_deferred_put(int pool_id, struct tmem_oid *oidp,
+				uint32_t index, struct page *page)
+{
+	struct zcache_deferred *zd;
+	unsigned long flags;
+
+	if (zcache_freeze || zcache_deferred_cache == NULL ||
+	    zcache_deferred_count >= zcache_deferred_max)
+		return false;
+
+	zd = kmem_cache_alloc(zcache_deferred_cache, ZCACHE_GFP_MASK);
+	if (zd == NULL)
+		return false;
+	zd->page = alloc_page(ZCACHE_GFP_MASK);
+	if (zd->page == NULL) {
+		kmem_cache_free(zcache_deferred_cache, zd);
+		return false;
+	}
+	copy_highpage(zd->page, page);
+	zd->pool_id = pool_id;
+	zd->oid = *oidp;
+	zd->index = index;
+	zd->cancelled = false;
+
+	spin_lock_irqsave(&zcache_deferred_lock, flags);
+	list_add_tail(&zd->list, &zcache_deferred_list);
+	zcache_deferred_count++;
+	zcache_deferred_puts++;
+	spin_unlock_irqrestore(&zcache_deferred_lock, flags);
+	/* non-reentrant, so that the busy list has a single consumer */
+	queue_work(system_nrt_wq, &zcache_deferred_work);
+	return true;
+}
+
 static void zcache_cleancache_put_page(int pool_id,
 					struct cleancache_filekey key,
 					pgoff_t index, struct page *page)
@@ -1696,8 +2013,13 @@ static void zcache_cleancache_put_page(int pool_id,
 	u32 ind = (u32) index;
 	struct tmem_oid oid = *(struct tmem_oid *)&key;
 
-	if (likely(ind == index))
-		(void)zcache_put_page(LOCAL_CLIENT, pool_id, &oid, index, page);
+	if (likely(ind == index)) {
+		zcache_deferred_cancel(pool_id, &oid, ind,
+					ZCACHE_DEFER_PAGE, NULL);
+		if (!zcache_deferred_put(pool_id, &oid, ind, page))
+			(void)zcache_put_page(LOCAL_CLIENT, pool_id, &oid,
+						index, page);
+	}
 }
 
 static int zcache_cleancache_get_page(int pool_id,
@@ -1708,8 +2030,17 @@ static int zcache_cleancache_get_page(int pool_id,
 	struct tmem_oid oid = *(struct tmem_oid *)&key;
 	int ret = -1;
 
-	if (likely(ind == index))
-		ret = zcache_get_page(LOCAL_CLIENT, pool_id, &oid, index, page);
+	if (likely(ind == index)) {
+		ret = zcache_deferred_cancel(pool_id, &oid, ind,
+					     ZCACHE_DEFER_PAGE, page);
+		if (ret > 0)
+			ret = 0;
+		else if (ret == 0)
+			ret = zcache_get_page(LOCAL_CLIENT, pool_id, &oid,
+						index, page);
+		else
+			ret = -1;
+	}
 	return ret;
 }
 
@@ -1720,8 +2051,11 @@ static void zcache_cleancache_flush_page(int pool_id,
 	u32 ind = (u32) index;
 	struct tmem_oid oid = *(struct tmem_oid *)&key;
 
-	if (likely(ind == index))
+	if (likely(ind == index)) {
+		zcache_deferred_cancel(pool_id, &oid, ind,
+					ZCACHE_DEFER_PAGE, NULL);
 		(void)zcache_flush_page(LOCAL_CLIENT, pool_id, &oid, ind);
+	}
 }
 
 static void zcache_cleancache_flush_inode(int pool_id,
@@ -1729,13 +2063,17 @@ static void zcache_cleancache_flush_inode(int pool_id,
 {
 	struct tmem_oid oid = *(struct tmem_oid *)&key;
 
+	zcache_deferred_cancel(pool_id, &oid, 0, ZCACHE_DEFER_OBJ, NULL);
 	(void)zcache_flush_object(LOCAL_CLIENT, pool_id, &oid);
 }
 
 static void zcache_cleancache_flush_fs(int pool_id)
 {
-	if (pool_id >= 0)
+	if (pool_id >= 0) {
+		zcache_deferred_cancel(pool_id, NULL, 0,
+					ZCACHE_DEFER_POOL, NULL);
 		(void)zcache_destroy_pool(LOCAL_CLIENT, pool_id);
+	}
 }
 
 static int zcache_cleancache_init_fs(size_t pagesize)
@@ -1962,6 +2300,8 @@ static int __init zcache_init(void)
 		struct cleancache_ops old_ops;
 
 		zbud_init();
+		zcache_deferred_cache = kmem_cache_create("zcache_deferred",
+				sizeof(struct zcache_deferred), 0, 0, NULL);
 		register_shrinker(&zcache_shrinker);
 		old_ops = zcache_cleancache_register_ops();
 		pr_info("zcache: cleancache enabled using kernel "
@@ -1976,7 +2316,7 @@ static int __init zcache_init(void)
 
 		old_ops = zcache_frontswap_register_ops();
 		pr_info("zcache: frontswap enabled using kernel "
-			"transcendent memory and xvmalloc\n");
+			"transcendent memory and zsmalloc\n");
 		if (old_ops.init != NULL)
 			pr_warning("zcache: frontswap_ops overridden");
 	}
@@ -0,0 +1,117 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM zcache
+
+#if !defined(_ZCACHE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ZCACHE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(zcache_compress_begin,
+
+	TP_PROTO(int pool_id, uint32_t index, int eph),
+
+	TP_ARGS(pool_id, index, eph),
+
+	TP_STRUCT__entry(
+		__field(int, pool_id)
+		__field(uint32_t, index)
+		__field(int, eph)
+	),
+
+	TP_fast_assign(
+		__entry->pool_id = pool_id;
+		__entry->index = index;
+		__entry->eph = eph;
+	),
+
+	TP_printk("pool=%d index=%u %s", __entry->pool_id, __entry->index,
+		  __entry->eph ? "ephemeral" : "persistent")
+);
+
+TRACE_EVENT(zcache_compress_end,
+
+	TP_PROTO(int pool_id, uint32_t index, size_t clen, bool stored),
+
+	TP_ARGS(pool_id, index, clen, stored),
+
+	TP_STRUCT__entry(
+		__field(int, pool_id)
+		__field(uint32_t, index)
+		__field(size_t, clen)
+		__field(bool, stored)
+	),
+
+	TP_fast_assign(
+		__entry->pool_id = pool_id;
+		__entry->index = index;
+		__entry->clen = clen;
+		__entry->stored = stored;
+	),
+
+	TP_printk("pool=%d index=%u clen=%zu stored=%d", __entry->pool_id,
+		  __entry->index, __entry->clen, __entry->stored)
+);
+
+TRACE_EVENT(zcache_evict_begin,
+
+	TP_PROTO(int nr),
+
+	TP_ARGS(nr),
+
+	TP_STRUCT__entry(
+		__field(int, nr)
+	),
+
+	TP_fast_assign(
+		__entry->nr = nr;
+	),
+
+	TP_printk("nr=%d", __entry->nr)
+);
+
+TRACE_EVENT(zcache_evict_end,
+
+	TP_PROTO(int nr, int evicted),
+
+	TP_ARGS(nr, evicted),
+
+	TP_STRUCT__entry(
+		__field(int, nr)
+		__field(int, evicted)
+	),
+
+	TP_fast_assign(
+		__entry->nr = nr;
+		__entry->evicted = evicted;
+	),
+
+	TP_printk("nr=%d evicted=%d", __entry->nr, __entry->evicted)
+);
+
+TRACE_EVENT(zcache_deferred_batch,
+
+	TP_PROTO(int nr, unsigned long pending),
+
+	TP_ARGS(nr, pending),
+
+	TP_STRUCT__entry(
+		__field(int, nr)
+		__field(unsigned long, pending)
+	),
+
+	TP_fast_assign(
+		__entry->nr = nr;
+		__entry->pending = pending;
+	),
+
+	TP_printk("nr=%d pending=%lu", __entry->nr, __entry->pending)
+);
+
+#endif /* _ZCACHE_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH ../../drivers/staging/zcache
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE zcache-trace
+
+#include <trace/define_trace.h>
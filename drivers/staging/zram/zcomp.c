@@ -0,0 +1,222 @@
+/*
+ * Compression streams for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zcomp.h"
+
+/* compressors offered through sysfs, in order of preference */
+static const char * const backends[] = {
+	"lzo",
+	"deflate",
+	NULL
+};
+
+bool zcomp_available_algorithm(const char *comp)
+{
+	int i;
+
+	for (i = 0; backends[i]; i++)
+		if (sysfs_streq(comp, backends[i]))
+			return crypto_has_comp(backends[i], 0, 0);
+	return false;
+}
+
+/* show the compressors the crypto API can provide, the current in [] */
+ssize_t zcomp_available_show(const char *comp, char *buf)
+{
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (!crypto_has_comp(backends[i], 0, 0))
+			continue;
+		if (!strcmp(comp, backends[i]))
+			sz += sprintf(buf + sz, "[%s] ", backends[i]);
+		else
+			sz += sprintf(buf + sz, "%s ", backends[i]);
+	}
+	sz += sprintf(buf + sz, "\n");
+	return sz;
+}
+
+static void zcomp_strm_free(struct zcomp_strm *zstrm)
+{
+	if (zstrm->tfm)
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+
+	if (!zstrm)
+		return NULL;
+
+	zstrm->tfm = crypto_alloc_comp(comp->name, 0, 0);
+	if (IS_ERR(zstrm->tfm)) {
+		zstrm->tfm = NULL;
+		goto fail;
+	}
+	/* incompressible data may grow, leave room for a second page */
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (!zstrm->buffer)
+		goto fail;
+	return zstrm;
+
+fail:
+	zcomp_strm_free(zstrm);
+	return NULL;
+}
+
+/*
+ * Grows or shrinks the set of streams.  Streams that are busy when
+ * shrinking are freed as they are released.  If growing fails, the
+ * streams allocated so far are freed again and the old count is kept.
+ */
+int zcomp_set_max_streams(struct zcomp *comp, int num_strm)
+{
+	struct zcomp_strm *zstrm;
+	int ret = 0;
+
+	if (num_strm < 1)
+		return -EINVAL;
+
+	spin_lock(&comp->lock);
+	while (comp->avail < num_strm) {
+		comp->avail++;
+		spin_unlock(&comp->lock);
+		zstrm = zcomp_strm_alloc(comp);
+		spin_lock(&comp->lock);
+		if (!zstrm) {
+			comp->avail--;
+			ret = -ENOMEM;
+			break;
+		}
+		list_add(&zstrm->list, &comp->idle);
+		wake_up(&comp->wait);
+	}
+	if (!ret)
+		comp->max_strm = num_strm;
+	while (comp->avail > comp->max_strm && !list_empty(&comp->idle)) {
+		zstrm = list_first_entry(&comp->idle, struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		comp->avail--;
+		spin_unlock(&comp->lock);
+		zcomp_strm_free(zstrm);
+		spin_lock(&comp->lock);
+	}
+	spin_unlock(&comp->lock);
+	return ret;
+}
+
+/*
+ * Streams are all allocated up front: this is called from the swap-out
+ * path, where allocating a crypto tfm is not an option.
+ */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp, bool *stalled)
+{
+	struct zcomp_strm *zstrm;
+
+	*stalled = false;
+	for (;;) {
+		spin_lock(&comp->lock);
+		if (!list_empty(&comp->idle)) {
+			zstrm = list_first_entry(&comp->idle,
+						 struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->lock);
+			return zstrm;
+		}
+		spin_unlock(&comp->lock);
+		*stalled = true;
+		wait_event(comp->wait, !list_empty(&comp->idle));
+	}
+}
+
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->lock);
+	if (comp->avail > comp->max_strm) {
+		comp->avail--;
+		spin_unlock(&comp->lock);
+		zcomp_strm_free(zstrm);
+		return;
+	}
+	list_add(&zstrm->list, &comp->idle);
+	spin_unlock(&comp->lock);
+	wake_up(&comp->wait);
+}
+
+/* compresses one page from 'src' into zstrm->buffer */
+int zcomp_compress(struct zcomp_strm *zstrm, const void *src,
+		   unsigned int *dst_len)
+{
+	*dst_len = PAGE_SIZE * 2;
+	return crypto_comp_compress(zstrm->tfm, src, PAGE_SIZE,
+				    zstrm->buffer, dst_len);
+}
+
+int zcomp_decompress(struct zcomp_strm *zstrm, const void *src,
+		     unsigned int src_len, void *dst)
+{
+	unsigned int dst_len = PAGE_SIZE;
+	int ret;
+
+	ret = crypto_comp_decompress(zstrm->tfm, src, src_len, dst, &dst_len);
+	if (!ret && dst_len != PAGE_SIZE)
+		ret = -EINVAL;
+	return ret;
+}
+
+struct zcomp *zcomp_create(const char *compress, int max_strm)
+{
+	struct zcomp *comp;
+
+	if (!zcomp_available_algorithm(compress))
+		return ERR_PTR(-EINVAL);
+
+	comp = kzalloc(sizeof(struct zcomp), GFP_KERNEL);
+	if (!comp)
+		return ERR_PTR(-ENOMEM);
+
+	strlcpy(comp->name, compress, sizeof(comp->name));
+	spin_lock_init(&comp->lock);
+	INIT_LIST_HEAD(&comp->idle);
+	init_waitqueue_head(&comp->wait);
+	if (zcomp_set_max_streams(comp, max_strm)) {
+		zcomp_destroy(comp);
+		return ERR_PTR(-ENOMEM);
+	}
+	return comp;
+}
+
+/* all streams must have been released */
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (!list_empty(&comp->idle)) {
+		zstrm = list_first_entry(&comp->idle, struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(zstrm);
+	}
+	kfree(comp);
+}
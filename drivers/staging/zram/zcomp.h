@@ -0,0 +1,59 @@
+/*
+ * Compression streams for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/crypto.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+/*
+ * One compression context: a crypto tfm, which for most compressors keeps
+ * per-call state and so can't be shared, and a buffer big enough for the
+ * worst case output of compressing one page.
+ */
+struct zcomp_strm {
+	struct crypto_comp *tfm;
+	void *buffer;
+	struct list_head list;
+};
+
+/*
+ * A set of interchangeable streams.  Callers take an idle one and give it
+ * back when done; when all of them are busy they wait, which is counted
+ * as a stall.
+ */
+struct zcomp {
+	char name[CRYPTO_MAX_ALG_NAME];
+	spinlock_t lock;		/* protects idle, avail and max_strm */
+	struct list_head idle;		/* idle streams */
+	int avail;			/* streams allocated */
+	int max_strm;			/* streams wanted */
+	wait_queue_head_t wait;		/* tasks waiting for a stream */
+};
+
+ssize_t zcomp_available_show(const char *comp, char *buf);
+bool zcomp_available_algorithm(const char *comp);
+
+struct zcomp *zcomp_create(const char *comp, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+int zcomp_set_max_streams(struct zcomp *comp, int num_strm);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp, bool *stalled);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp_strm *zstrm, const void *src,
+		   unsigned int *dst_len);
+int zcomp_decompress(struct zcomp_strm *zstrm, const void *src,
+		     unsigned int src_len, void *dst);
+
+#endif /* _ZCOMP_H_ */
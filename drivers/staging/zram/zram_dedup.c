@@ -0,0 +1,197 @@
+/*
+ * Deduplication of identical zram pages
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+/*
+ * Pages are hashed after compression: the compressors are deterministic,
+ * so identical pages give identical output, and the shorter compressed
+ * data is cheaper both to checksum and to compare on a checksum hit.
+ */
+
+/* buckets per page of disk; each bucket is an rbtree, so this is loose */
+#define ZRAM_PAGES_PER_HASH	32
+
+static void zram_dedup_stat_add(struct zram *zram, u64 *v, s64 delta)
+{
+	spin_lock(&zram->stat64_lock);
+	*v += delta;
+	spin_unlock(&zram->stat64_lock);
+}
+
+static struct zram_hash *zram_dedup_hash(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[checksum % zram->hash_size];
+}
+
+static bool zram_dedup_match(struct zram *zram, struct zram_entry *entry,
+			     const void *mem, unsigned int len)
+{
+	void *cmem;
+	bool match;
+
+	if (entry->len != len)
+		return false;
+
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	match = !memcmp(cmem, mem, len);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+
+	return match;
+}
+
+/*
+ * Looks for an object holding the same 'len' bytes as 'mem' and takes a
+ * reference on it.  The checksum is returned for a later
+ * zram_dedup_insert() when there is none.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram, const void *mem,
+				   unsigned int len, u32 *checksum)
+{
+	struct zram_hash *hash;
+	struct zram_entry *entry;
+	struct rb_node *rb, *prev;
+
+	*checksum = jhash(mem, len, 0);
+	hash = zram_dedup_hash(zram, *checksum);
+
+	spin_lock(&hash->lock);
+	rb = hash->rb_root.rb_node;
+	while (rb) {
+		entry = rb_entry(rb, struct zram_entry, rb_node);
+		if (*checksum == entry->checksum)
+			break;
+		if (*checksum < entry->checksum)
+			rb = rb->rb_left;
+		else
+			rb = rb->rb_right;
+	}
+
+	/* entries sharing a checksum are neighbours, start from the first */
+	while (rb && (prev = rb_prev(rb)) &&
+	       rb_entry(prev, struct zram_entry, rb_node)->checksum == *checksum)
+		rb = prev;
+
+	for (; rb; rb = rb_next(rb)) {
+		entry = rb_entry(rb, struct zram_entry, rb_node);
+		if (entry->checksum != *checksum)
+			break;
+		if (zram_dedup_match(zram, entry, mem, len)) {
+			entry->refcount++;
+			spin_unlock(&hash->lock);
+			zram_dedup_stat_add(zram, &zram->stats.dup_data_size,
+					    len);
+			return entry;
+		}
+	}
+	spin_unlock(&hash->lock);
+
+	return NULL;
+}
+
+/*
+ * Makes a freshly stored object shareable; returns NULL if no entry could
+ * be allocated, the caller then keeps the bare handle.
+ */
+struct zram_entry *zram_dedup_insert(struct zram *zram, unsigned long handle,
+				     unsigned int len, u32 checksum)
+{
+	struct zram_hash *hash;
+	struct zram_entry *entry, *e;
+	struct rb_node **rb, *parent = NULL;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+	entry->checksum = checksum;
+	entry->len = len;
+	entry->handle = handle;
+	entry->refcount = 1;
+
+	hash = zram_dedup_hash(zram, checksum);
+	spin_lock(&hash->lock);
+	rb = &hash->rb_root.rb_node;
+	while (*rb) {
+		parent = *rb;
+		e = rb_entry(parent, struct zram_entry, rb_node);
+		if (checksum < e->checksum)
+			rb = &parent->rb_left;
+		else
+			rb = &parent->rb_right;
+	}
+	rb_link_node(&entry->rb_node, parent, rb);
+	rb_insert_color(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+
+	zram_dedup_stat_add(zram, &zram->stats.meta_data_size,
+			    sizeof(*entry));
+	return entry;
+}
+
+void zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram, entry->checksum);
+	unsigned long refcount;
+
+	spin_lock(&hash->lock);
+	refcount = --entry->refcount;
+	if (!refcount)
+		rb_erase(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+
+	if (refcount) {
+		zram_dedup_stat_add(zram, &zram->stats.dup_data_size,
+				    -(s64)entry->len);
+		return;
+	}
+
+	zs_free(zram->mem_pool, entry->handle);
+	kfree(entry);
+	zram_dedup_stat_add(zram, &zram->stats.meta_data_size,
+			    -(s64)sizeof(*entry));
+}
+
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	size_t i;
+
+	if (!zram->use_dedup)
+		return 0;
+
+	zram->hash_size = max_t(size_t, num_pages / ZRAM_PAGES_PER_HASH, 1);
+	zram->hash = vzalloc(zram->hash_size * sizeof(struct zram_hash));
+	if (!zram->hash) {
+		pr_err("Error allocating zram dedup hash\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < zram->hash_size; i++) {
+		spin_lock_init(&zram->hash[i].lock);
+		zram->hash[i].rb_root = RB_ROOT;
+	}
+	return 0;
+}
+
+/* all entries must have been put */
+void zram_dedup_fini(struct zram *zram)
+{
+	vfree(zram->hash);
+	zram->hash = NULL;
+	zram->hash_size = 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * Deduplication of identical zram pages
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+struct zram;
+
+/*
+ * One stored object shared by every table slot whose page compressed to
+ * the same bytes.  Entries live in a hash of rbtrees keyed by a checksum
+ * of the stored data.
+ */
+struct zram_entry {
+	struct rb_node rb_node;
+	u32 checksum;
+	unsigned int len;
+	unsigned long handle;
+	unsigned long refcount;	/* protected by the bucket lock */
+};
+
+struct zram_hash {
+	spinlock_t lock;
+	struct rb_root rb_root;
+};
+
+#ifdef CONFIG_ZRAM_DEDUP
+int zram_dedup_init(struct zram *zram, size_t num_pages);
+void zram_dedup_fini(struct zram *zram);
+
+struct zram_entry *zram_dedup_find(struct zram *zram, const void *mem,
+				   unsigned int len, u32 *checksum);
+struct zram_entry *zram_dedup_insert(struct zram *zram, unsigned long handle,
+				     unsigned int len, u32 checksum);
+void zram_dedup_put(struct zram *zram, struct zram_entry *entry);
+#else
+static inline int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	return 0;
+}
+static inline void zram_dedup_fini(struct zram *zram) { }
+
+static inline struct zram_entry *zram_dedup_find(struct zram *zram,
+		const void *mem, unsigned int len, u32 *checksum)
+{
+	return NULL;
+}
+static inline struct zram_entry *zram_dedup_insert(struct zram *zram,
+		unsigned long handle, unsigned int len, u32 checksum)
+{
+	return NULL;
+}
+static inline void zram_dedup_put(struct zram *zram,
+				  struct zram_entry *entry) { }
+#endif
+
+#endif
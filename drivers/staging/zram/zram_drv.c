@@ -25,13 +25,18 @@
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
 #include <linux/device.h>
+#include <linux/err.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -71,6 +76,26 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+static void zram_stat64_add_time(struct zram *zram, u64 *v, ktime_t start)
+{
+	zram_stat64_add(zram, v, ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
+/*
+ * Compression streams nest inside zram->lock: readers take a stream with
+ * the lock held, so nobody may wait for zram->lock while holding one.
+ */
+static struct zcomp_strm *zram_strm_find(struct zram *zram)
+{
+	struct zcomp_strm *zstrm;
+	bool stalled;
+
+	zstrm = zcomp_strm_find(zram->comp, &stalled);
+	if (stalled)
+		zram_stat64_inc(zram, &zram->stats.stream_stalls);
+	return zstrm;
+}
+
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
@@ -89,19 +114,177 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Pages that are one machine word repeated (zeroed pages, but also
+ * memset() and heap fill patterns) are not stored at all: the word is
+ * kept in the table.
+ */
+static bool page_same_filled(void *ptr, unsigned long *element)
 {
-	unsigned int pos;
-	unsigned long *page;
+	unsigned int pos, last = PAGE_SIZE / sizeof(unsigned long) - 1;
+	unsigned long *page = ptr;
+	unsigned long val = page[0];
 
-	page = (unsigned long *)ptr;
+	/* most pages that aren't differ at one end or the other */
+	if (val != page[last])
+		return false;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
-			return 0;
+	for (pos = 1; pos < last; pos++) {
+		if (page[pos] != val)
+			return false;
 	}
 
-	return 1;
+	*element = val;
+	return true;
+}
+
+static void zram_fill_page(void *ptr, unsigned int len, unsigned long value)
+{
+	unsigned long *page = ptr;
+	unsigned int i;
+
+	if (likely(!value)) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	for (i = 0; i < len / sizeof(*page); i++)
+		page[i] = value;
+}
+
+/* the object behind a slot, whether it is shared or not */
+static unsigned long zram_get_handle(struct zram *zram, u32 index)
+{
+	if (zram_test_flag(zram, index, ZRAM_DEDUP))
+		return zram->table[index].entry->handle;
+	return zram->table[index].handle;
+}
+
+static inline int is_partial_io(struct bio_vec *bvec)
+{
+	return bvec->bv_len != PAGE_SIZE;
+}
+
+static void zram_accessed(struct zram *zram, u32 index)
+{
+#ifdef CONFIG_ZRAM_WRITEBACK
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	zram->table[index].ac_time = div_u64(get_jiffies_64(), HZ);
+#endif
+}
+
+static void zram_free_block(struct zram *zram, unsigned long block)
+{
+	WARN_ON(!test_and_clear_bit(block, zram->bitmap));
+}
+
+struct zram_bio_ctl {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long block;
+	struct completion done;
+	int error;
+};
+
+static void zram_bdev_read_end_io(struct bio *bio, int err)
+{
+	struct zram_bio_ctl *ctl = bio->bi_private;
+
+	ctl->error = err;
+	complete(&ctl->done);
+	bio_put(bio);
+}
+
+static void zram_bdev_read_work(struct work_struct *work)
+{
+	struct zram_bio_ctl *ctl = container_of(work, struct zram_bio_ctl,
+						work);
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio) {
+		ctl->error = -ENOMEM;
+		return;
+	}
+
+	bio->bi_bdev = ctl->zram->bdev;
+	bio->bi_sector = ctl->block << SECTORS_PER_PAGE_SHIFT;
+	if (!bio_add_page(bio, ctl->page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		ctl->error = -EIO;
+		return;
+	}
+	bio->bi_private = ctl;
+	bio->bi_end_io = zram_bdev_read_end_io;
+	submit_bio(READ, bio);
+	wait_for_completion(&ctl->done);
+}
+
+/*
+ * Called from zram_make_request(), where generic_make_request() only
+ * queues the bios we submit on current->bio_list until we return.  So
+ * the read is submitted and waited for by a worker instead.
+ */
+static int zram_bdev_read(struct zram *zram, struct page *page,
+			  unsigned long block)
+{
+	struct zram_bio_ctl ctl = {
+		.zram = zram,
+		.page = page,
+		.block = block,
+	};
+
+	init_completion(&ctl.done);
+	INIT_WORK_ONSTACK(&ctl.work, zram_bdev_read_work);
+	queue_work(system_unbound_wq, &ctl.work);
+	flush_work(&ctl.work);
+	destroy_work_on_stack(&ctl.work);
+
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+	if (ctl.error)
+		pr_err("Error reading block %lu from backing device: %d\n",
+		       block, ctl.error);
+	return ctl.error;
+}
+
+/* reads a written back page into 'mem', or just the bvec part of it */
+static int zram_read_from_bdev(struct zram *zram, u32 index,
+			       struct bio_vec *bvec, int offset, char *mem)
+{
+	struct page *page;
+	unsigned char *src, *dst;
+	int ret;
+
+	if (bvec && !is_partial_io(bvec)) {
+		ret = zram_bdev_read(zram, bvec->bv_page,
+				     zram->table[index].block);
+		if (!ret)
+			flush_dcache_page(bvec->bv_page);
+		return ret;
+	}
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_bdev_read(zram, page, zram->table[index].block);
+	if (!ret) {
+		src = kmap_atomic(page, KM_USER0);
+		if (bvec) {
+			dst = kmap_atomic(bvec->bv_page, KM_USER1);
+			memcpy(dst + bvec->bv_offset, src + offset,
+			       bvec->bv_len);
+			kunmap_atomic(dst, KM_USER1);
+			flush_dcache_page(bvec->bv_page);
+		} else {
+			memcpy(mem, src, PAGE_SIZE);
+		}
+		kunmap_atomic(src, KM_USER0);
+	}
+	__free_page(page);
+
+	return ret;
 }
 
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
@@ -135,55 +318,66 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 
 static void zram_free_page(struct zram *zram, size_t index)
 {
-	u32 clen;
-	void *obj;
-
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	unsigned long handle = zram->table[index].handle;
+	u32 clen = zram->table[index].size;
+
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	/* a writeback in flight finds out the slot changed */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_free_block(zram, zram->table[index].block);
+		zram->table[index].block = 0;
+		zram_stat64_sub(zram, &zram->stats.bd_count, 1);
+		return;
+	}
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	/*
+	 * No memory is allocated for same filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (zram->table[index].element)
+			zram_stat_dec(&zram->stats.pages_same);
+		else
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		zram->table[index].element = 0;
 		return;
 	}
 
+	if (unlikely(!handle))
+		return;
+
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		zram_dedup_put(zram, zram->table[index].entry);
+	} else {
+		zs_free(zram->mem_pool, handle);
+	}
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
-		goto out;
-	}
-
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
-	if (clen <= PAGE_SIZE / 2)
+	} else if (clen <= PAGE_SIZE / 2) {
 		zram_stat_dec(&zram->stats.good_compress);
+	}
 
-out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -193,44 +387,44 @@ static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
 				     u32 index, int offset)
 {
 	struct page *page = bvec->bv_page;
+	unsigned long handle = zram_get_handle(zram, index);
 	unsigned char *user_mem, *cmem;
 
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
 
 	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
-	kunmap_atomic(cmem, KM_USER1);
 	kunmap_atomic(user_mem, KM_USER0);
+	zs_unmap_object(zram->mem_pool, handle);
 
 	flush_dcache_page(page);
 }
 
-static inline int is_partial_io(struct bio_vec *bvec)
-{
-	return bvec->bv_len != PAGE_SIZE;
-}
-
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
 	int ret;
-	size_t clen;
 	struct page *page;
-	struct zobj_header *zheader;
+	struct zcomp_strm *zstrm;
+	unsigned long handle;
 	unsigned char *user_mem, *cmem, *uncmem = NULL;
+	ktime_t start;
 
 	page = bvec->bv_page;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		handle_same_page(bvec, zram->table[index].element);
 		return 0;
 	}
 
+	if (zram_test_flag(zram, index, ZRAM_WB))
+		return zram_read_from_bdev(zram, index, bvec, offset, NULL);
+
 	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].page)) {
+	if (unlikely(!zram->table[index].handle)) {
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
+		handle_same_page(bvec, 0);
 		return 0;
 	}
 
@@ -249,17 +443,16 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		}
 	}
 
+	zstrm = zram_strm_find(zram);
+	handle = zram_get_handle(zram, index);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
-
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    uncmem, &clen);
+	start = ktime_get();
+	ret = zcomp_decompress(zstrm, cmem, zram->table[index].size, uncmem);
+	zram_stat64_add_time(zram, &zram->stats.decompr_time, start);
 
 	if (is_partial_io(bvec)) {
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
@@ -267,11 +460,12 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		kfree(uncmem);
 	}
 
-	kunmap_atomic(cmem, KM_USER1);
 	kunmap_atomic(user_mem, KM_USER0);
+	zs_unmap_object(zram->mem_pool, handle);
+	zcomp_strm_release(zram->comp, zstrm);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
 		return ret;
@@ -285,33 +479,43 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 {
 	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
+	struct zcomp_strm *zstrm;
+	unsigned long handle;
 	unsigned char *cmem;
+	ktime_t start;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].page) {
-		memset(mem, 0, PAGE_SIZE);
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_fill_page(mem, PAGE_SIZE, zram->table[index].element);
 		return 0;
 	}
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER0) +
-		zram->table[index].offset;
+	if (zram_test_flag(zram, index, ZRAM_WB))
+		return zram_read_from_bdev(zram, index, NULL, 0, mem);
+
+	if (!zram->table[index].handle) {
+		memset(mem, 0, PAGE_SIZE);
+		return 0;
+	}
+	handle = zram_get_handle(zram, index);
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 		memcpy(mem, cmem, PAGE_SIZE);
-		kunmap_atomic(cmem, KM_USER0);
+		zs_unmap_object(zram->mem_pool, handle);
 		return 0;
 	}
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    mem, &clen);
-	kunmap_atomic(cmem, KM_USER0);
+	zstrm = zram_strm_find(zram);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	start = ktime_get();
+	ret = zcomp_decompress(zstrm, cmem, zram->table[index].size, mem);
+	zram_stat64_add_time(zram, &zram->stats.decompr_time, start);
+	zs_unmap_object(zram->mem_pool, handle);
+	zcomp_strm_release(zram->comp, zstrm);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
 		return ret;
@@ -320,18 +524,26 @@ static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 	return 0;
 }
 
+/*
+ * Only the table update runs under zram->lock: the page is compressed and
+ * stored beforehand, using one of the device's streams, so writes from
+ * kswapd and direct reclaim on different CPUs proceed in parallel.  The
+ * stream is released before the lock is taken, see zram_strm_find().
+ */
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
-	int ret;
-	u32 store_offset;
-	size_t clen;
-	struct zobj_header *zheader;
-	struct page *page, *page_store;
+	int ret = 0;
+	unsigned int clen;
+	unsigned long handle = 0, element;
+	u32 checksum;
+	struct zram_entry *entry = NULL;
+	struct zcomp_strm *zstrm = NULL;
+	struct page *page;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
+	ktime_t start;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -344,21 +556,14 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			ret = -ENOMEM;
 			goto out;
 		}
+		down_read(&zram->lock);
 		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
+		up_read(&zram->lock);
+		if (ret)
 			goto out;
-		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].page ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
+	zstrm = zram_strm_find(zram);
 	user_mem = kmap_atomic(page, KM_USER0);
 
 	if (is_partial_io(bvec))
@@ -367,95 +572,443 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	else
 		uncmem = user_mem;
 
-	if (page_zero_filled(uncmem)) {
+	if (page_same_filled(uncmem, &element)) {
 		kunmap_atomic(user_mem, KM_USER0);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
-		ret = 0;
+		zcomp_strm_release(zram->comp, zstrm);
+		zstrm = NULL;
+		down_write(&zram->lock);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_free_page(zram, index);
+		if (element)
+			zram_stat_inc(&zram->stats.pages_same);
+		else
+			zram_stat_inc(&zram->stats.pages_zero);
+		zram->table[index].element = element;
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram_accessed(zram, index);
+		up_write(&zram->lock);
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
-
-	kunmap_atomic(user_mem, KM_USER0);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
-
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Compression failed! err=%d\n", ret);
-		goto out;
-	}
+	start = ktime_get();
+	ret = zcomp_compress(zstrm, uncmem, &clen);
+	zram_stat64_add_time(zram, &zram->stats.compr_time, start);
 
 	/*
 	 * Page is incompressible. Store it as-is (uncompressed)
 	 * since we do not want to return too many disk write
 	 * errors which has side effect of hanging the system.
 	 */
-	if (unlikely(clen > max_zpage_size)) {
+	if (!ret && unlikely(clen > max_zpage_size)) {
 		clen = PAGE_SIZE;
-		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-		if (unlikely(!page_store)) {
-			pr_info("Error allocating memory for "
-				"incompressible page: %u\n", index);
+		memcpy(zstrm->buffer, uncmem, PAGE_SIZE);
+	}
+
+	kunmap_atomic(user_mem, KM_USER0);
+
+	if (unlikely(ret)) {
+		pr_err("Compression failed! err=%d\n", ret);
+		goto out;
+	}
+	src = zstrm->buffer;
+
+	if (zram->use_dedup)
+		entry = zram_dedup_find(zram, src, clen, &checksum);
+
+	if (!entry) {
+		handle = zs_malloc(zram->mem_pool, clen);
+		if (!handle) {
+			pr_info("Error allocating memory for compressed "
+				"page: %u, size=%u\n", index, clen);
 			ret = -ENOMEM;
 			goto out;
 		}
 
-		store_offset = 0;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+		memcpy(cmem, src, clen);
+		zs_unmap_object(zram->mem_pool, handle);
+
+		if (zram->use_dedup)
+			entry = zram_dedup_insert(zram, handle, clen, checksum);
+	}
+
+	zcomp_strm_release(zram->comp, zstrm);
+	zstrm = NULL;
+
+	down_write(&zram->lock);
+
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	zram_free_page(zram, index);
+
+	if (entry) {
+		zram->table[index].entry = entry;
+		zram_set_flag(zram, index, ZRAM_DEDUP);
+	} else {
+		zram->table[index].handle = handle;
+	}
+	zram->table[index].size = clen;
+
+	/* Update stats */
+	if (clen == PAGE_SIZE) {
 		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_inc(&zram->stats.pages_expand);
-		zram->table[index].page = page_store;
-		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
+	} else if (clen <= PAGE_SIZE / 2) {
+		zram_stat_inc(&zram->stats.good_compress);
 	}
+	zram_stat64_add(zram, &zram->stats.compr_size, clen);
+	zram_stat_inc(&zram->stats.pages_stored);
+	zram_accessed(zram, index);
+
+	up_write(&zram->lock);
 
-	if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-		      &zram->table[index].page, &store_offset,
-		      GFP_NOIO | __GFP_HIGHMEM)) {
-		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+out:
+	if (zstrm)
+		zcomp_strm_release(zram->comp, zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
+	if (ret)
+		zram_stat64_inc(zram, &zram->stats.failed_writes);
+	return ret;
+}
+
+static void zram_reset_backing_dev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	zram->bdev = NULL;
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+	zram->nr_blocks = 0;
+	zram->backing_path[0] = '\0';
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Backing device blocks are page sized.  Block 0 is never handed out so
+ * that a written back slot never looks empty.
+ */
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long block = 1;
+
+	do {
+		block = find_next_zero_bit(zram->bitmap, zram->nr_blocks,
+					   block);
+		if (block >= zram->nr_blocks)
+			return 0;
+	} while (test_and_set_bit(block, zram->bitmap));
+
+	return block;
+}
+
+/*
+ * Called with init_lock held for write, before the device is initialized.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	struct block_device *bdev;
+	unsigned long nr_blocks, *bitmap;
+	int ret;
+
+	bdev = blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				  zram);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (nr_blocks < 2) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = set_blocksize(bdev, PAGE_SIZE);
+	if (ret)
+		goto out;
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	if (!bitmap) {
 		ret = -ENOMEM;
 		goto out;
 	}
 
-memstore:
-	zram->table[index].offset = store_offset;
+	zram_reset_backing_dev(zram);
+	zram->bdev = bdev;
+	zram->bitmap = bitmap;
+	zram->nr_blocks = nr_blocks;
+	strlcpy(zram->backing_path, path, sizeof(zram->backing_path));
+	pr_info("%s: backing device %s, %lu pages\n",
+		zram->disk->disk_name, path, nr_blocks - 1);
+	return 0;
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+out:
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	return ret;
+}
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
+/*
+ * Marks idle the stored pages that were not accessed for 'min_age'
+ * seconds; 0 marks them all.  An access clears the mark.
+ */
+void zram_mark_idle(struct zram *zram, u32 min_age)
+{
+	u32 now = div_u64(get_jiffies_64(), HZ);
+	size_t index;
+
+	down_write(&zram->lock);
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		if (!zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB))
+			continue;
+		if (now - zram->table[index].ac_time >= min_age)
+			zram_set_flag(zram, index, ZRAM_IDLE);
 	}
-#endif
+	up_write(&zram->lock);
+}
 
-	memcpy(cmem, src, clen);
+/* bios are submitted this many at a time, then the slots are updated */
+#define ZRAM_WB_BATCH	32
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+struct zram_wb_batch;
 
-	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
-	zram_stat_inc(&zram->stats.pages_stored);
-	if (clen <= PAGE_SIZE / 2)
-		zram_stat_inc(&zram->stats.good_compress);
+struct zram_wb_req {
+	struct zram_wb_batch *batch;
+	struct page *page;
+	u32 index;
+	unsigned long block;
+	int error;
+};
 
-	return 0;
+struct zram_wb_batch {
+	atomic_t pending;
+	wait_queue_head_t wait;
+	int nr;
+	struct zram_wb_req req[ZRAM_WB_BATCH];
+};
 
-out:
-	if (ret)
-		zram_stat64_inc(zram, &zram->stats.failed_writes);
+static void zram_wb_end_io(struct bio *bio, int err)
+{
+	struct zram_wb_req *req = bio->bi_private;
+	struct zram_wb_batch *batch = req->batch;
+
+	req->error = err;
+	bio_put(bio);
+	if (atomic_dec_and_test(&batch->pending))
+		wake_up(&batch->wait);
+}
+
+static bool zram_wb_eligible(struct zram *zram, u32 index,
+			     enum zram_wb_mode mode)
+{
+	/* shared objects stay in memory, they are cheap per page already */
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_DEDUP) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return false;
+
+	if (mode == ZRAM_WB_HUGE)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+	return zram_test_flag(zram, index, ZRAM_IDLE);
+}
+
+static void zram_wb_abort(struct zram *zram, u32 index)
+{
+	down_write(&zram->lock);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	up_write(&zram->lock);
+}
+
+/*
+ * Copies the slot's object out under zram->lock, which the caller holds
+ * for read and which is dropped here, and decompresses it afterwards:
+ * writeback never waits for a stream with the lock held, so it does not
+ * hold up writers while the streams are busy.
+ */
+static int zram_wb_read(struct zram *zram, u32 index, char *mem, char *cbuf)
+{
+	unsigned long handle = zram_get_handle(zram, index);
+	struct zcomp_strm *zstrm;
+	size_t clen = zram->table[index].size;
+	bool huge = zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+	unsigned char *cmem;
+	ktime_t start;
+	int ret;
+
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	memcpy(huge ? mem : cbuf, cmem, huge ? PAGE_SIZE : clen);
+	zs_unmap_object(zram->mem_pool, handle);
+	up_read(&zram->lock);
+
+	if (huge)
+		return 0;
+
+	zstrm = zram_strm_find(zram);
+	start = ktime_get();
+	ret = zcomp_decompress(zstrm, cbuf, clen, mem);
+	zram_stat64_add_time(zram, &zram->stats.decompr_time, start);
+	zcomp_strm_release(zram->comp, zstrm);
+
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+	}
 	return ret;
 }
 
+/*
+ * Waits for the batch's writes, then frees the memory of the slots that
+ * were not rewritten or freed meanwhile, which would have cleared their
+ * ZRAM_UNDER_WB, and points them at their block instead.
+ */
+static unsigned long zram_wb_complete(struct zram *zram,
+				      struct zram_wb_batch *batch)
+{
+	unsigned long written = 0;
+	int i;
+
+	wait_event(batch->wait, !atomic_read(&batch->pending));
+
+	for (i = 0; i < batch->nr; i++) {
+		struct zram_wb_req *req = &batch->req[i];
+
+		down_write(&zram->lock);
+		if (zram_test_flag(zram, req->index, ZRAM_UNDER_WB)) {
+			if (!req->error) {
+				zram_free_page(zram, req->index);
+				zram->table[req->index].block = req->block;
+				zram_set_flag(zram, req->index, ZRAM_WB);
+				zram_stat64_inc(zram, &zram->stats.bd_count);
+				req->block = 0;
+				written++;
+			} else {
+				zram_clear_flag(zram, req->index,
+						ZRAM_UNDER_WB);
+			}
+		}
+		up_write(&zram->lock);
+
+		if (req->error)
+			pr_err("Error writing block %lu to backing device: "
+			       "%d\n", req->block, req->error);
+		if (req->block)
+			zram_free_block(zram, req->block);
+	}
+	batch->nr = 0;
+
+	return written;
+}
+
+/*
+ * Moves idle or incompressible pages to the backing device.  Each page
+ * is decompressed into a bounce page and written with an asynchronous
+ * bio; the slots are only switched over once their batch completed.
+ * Called with init_lock held for read on an initialized device.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	struct zram_wb_batch *batch;
+	struct zram_wb_req *req;
+	struct bio *bio;
+	unsigned long written = 0;
+	size_t index;
+	char *cbuf;
+	int i, ret = 0;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	batch = kzalloc(sizeof(*batch), GFP_KERNEL);
+	cbuf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!batch || !cbuf) {
+		kfree(batch);
+		kfree(cbuf);
+		return -ENOMEM;
+	}
+	atomic_set(&batch->pending, 0);
+	init_waitqueue_head(&batch->wait);
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		batch->req[i].batch = batch;
+		batch->req[i].page = alloc_page(GFP_KERNEL);
+		if (!batch->req[i].page) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+	}
+
+	mutex_lock(&zram->wb_lock);
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		req = &batch->req[batch->nr];
+
+		down_write(&zram->lock);
+		if (!zram_wb_eligible(zram, index, mode)) {
+			up_write(&zram->lock);
+			continue;
+		}
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		downgrade_write(&zram->lock);
+		ret = zram_wb_read(zram, index, page_address(req->page), cbuf);
+		if (ret) {
+			zram_wb_abort(zram, index);
+			break;
+		}
+
+		req->index = index;
+		req->error = 0;
+		req->block = zram_alloc_block(zram);
+		if (!req->block) {
+			zram_wb_abort(zram, index);
+			ret = -ENOSPC;
+			break;
+		}
+
+		bio = bio_alloc(GFP_KERNEL, 1);
+		if (!bio) {
+			zram_wb_abort(zram, index);
+			zram_free_block(zram, req->block);
+			ret = -ENOMEM;
+			break;
+		}
+		bio->bi_bdev = zram->bdev;
+		bio->bi_sector = req->block << SECTORS_PER_PAGE_SHIFT;
+		bio_add_page(bio, req->page, PAGE_SIZE, 0);
+		bio->bi_private = req;
+		bio->bi_end_io = zram_wb_end_io;
+
+		atomic_inc(&batch->pending);
+		batch->nr++;
+		submit_bio(WRITE, bio);
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+
+		if (batch->nr == ZRAM_WB_BATCH)
+			written += zram_wb_complete(zram, batch);
+		cond_resched();
+	}
+	written += zram_wb_complete(zram, batch);
+	mutex_unlock(&zram->wb_lock);
+
+	pr_debug("%s: wrote back %lu pages\n", zram->disk->disk_name,
+		 written);
+
+out_free:
+	for (i = 0; i < ZRAM_WB_BATCH; i++)
+		if (batch->req[i].page)
+			__free_page(batch->req[i].page);
+	kfree(batch);
+	kfree(cbuf);
+	return ret;
+}
+#endif
+
 static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 			int offset, struct bio *bio, int rw)
 {
@@ -464,11 +1017,11 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 	if (rw == READ) {
 		down_read(&zram->lock);
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
+		if (!ret)
+			zram_accessed(zram, index);
 		up_read(&zram->lock);
 	} else {
-		down_write(&zram->lock);
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
 	}
 
 	return ret;
@@ -589,34 +1142,23 @@ void __zram_reset_device(struct zram *zram)
 
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free the compression streams */
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 
 	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
-			continue;
-
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
-	}
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+		zram_free_page(zram, index);
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	zram_dedup_fini(zram);
+	zram_reset_backing_dev(zram);
+
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -646,17 +1188,11 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	zram->comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	if (IS_ERR(zram->comp)) {
+		pr_err("Error initializing %s compressor\n", zram->compressor);
+		ret = PTR_ERR(zram->comp);
+		zram->comp = NULL;
 		goto fail_no_table;
 	}
 
@@ -668,12 +1204,17 @@ int zram_init_device(struct zram *zram)
 		goto fail_no_table;
 	}
 
+	ret = zram_dedup_init(zram, num_pages);
+	if (ret)
+		goto fail;
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name,
+					GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -717,7 +1258,12 @@ static int create_device(struct zram *zram, int device_id)
 
 	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
+	mutex_init(&zram->wb_lock);
 	spin_lock_init(&zram->stat64_lock);
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
+	/* one stream per CPU: reclaim on every CPU can compress at once */
+	zram->max_comp_streams = num_online_cpus();
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -849,6 +1395,7 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		zram_reset_backing_dev(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
@@ -18,7 +18,9 @@
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
 
-#include "xvmalloc.h"
+#include "../zsmalloc/zsmalloc.h"
+#include "zcomp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,18 +28,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -45,15 +35,13 @@ static const unsigned default_disksize_perc_ram = 25;
 
 /*
  * Pages that compress to size greater than this are stored
- * uncompressed in memory.
+ * uncompressed in memory: the space saved is not worth the
+ * decompression on every read.
  */
 static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 
-/*
- * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
- */
+/* Compressor used unless another one is picked through sysfs */
+static const char default_compressor[] = "lzo";
 
 /*-- End of configurable params */
 
@@ -71,8 +59,20 @@ enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is one machine word repeated, kept in table.element */
+	ZRAM_SAME,
+
+	/* table.entry is a deduplicated object */
+	ZRAM_DEDUP,
+
+	/* Page was not accessed since it was last marked idle */
+	ZRAM_IDLE,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* Page lives in backing device block table.block */
+	ZRAM_WB,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -81,12 +81,26 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		unsigned long handle;	/* zsmalloc handle, 0 if nothing */
+		unsigned long element;	/* ZRAM_SAME */
+		struct zram_entry *entry; /* ZRAM_DEDUP */
+		unsigned long block;	/* ZRAM_WB */
+	};
+	u16 size;		/* object size, size classes round it up */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	u32 ac_time;		/* last access, in seconds since boot */
+#endif
 } __attribute__((aligned(4)));
 
+/* what zram_writeback() moves to the backing device */
+enum zram_wb_mode {
+	ZRAM_WB_IDLE,		/* pages marked idle */
+	ZRAM_WB_HUGE,		/* pages stored uncompressed */
+};
+
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
 	u64 num_reads;		/* failed + successful */
@@ -96,19 +110,28 @@ struct zram_stats {
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of other single word filled pages */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u64 compr_time;		/* ns spent compressing */
+	u64 decompr_time;	/* ns spent decompressing */
+	u64 stream_stalls;	/* waits for an idle compression stream */
+	u64 pages_compacted;	/* pages freed by compaction */
+	u64 dup_data_size;	/* bytes not stored thanks to dedup */
+	u64 meta_data_size;	/* bytes of dedup entries */
+	u64 bd_count;		/* pages on the backing device */
+	u64 bd_reads;		/* pages read back from it */
+	u64 bd_writes;		/* pages written to it */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zcomp *comp;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
+	struct rw_semaphore lock; /* protect table against concurrent read
+				   * and writes; compression runs outside */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -119,6 +142,19 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* Set through sysfs, compressor takes effect on next init */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+	int max_comp_streams;
+	/* Set through sysfs, takes effect on next init */
+	bool use_dedup;
+	struct zram_hash *hash;
+	size_t hash_size;
+	/* Backing device, set through sysfs before init */
+	struct block_device *bdev;
+	char backing_path[64];
+	unsigned long *bitmap;	/* blocks in use, block 0 is never used */
+	unsigned long nr_blocks;
+	struct mutex wb_lock;	/* one writeback at a time */
 
 	struct zram_stats stats;
 };
@@ -130,6 +166,11 @@ extern struct attribute_group zram_disk_attr_group;
 #endif
 
 extern int zram_init_device(struct zram *zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_mark_idle(struct zram *zram, u32 min_age);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+#endif
 extern void __zram_reset_device(struct zram *zram);
 
 #endif
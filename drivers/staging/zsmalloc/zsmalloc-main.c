@@ -0,0 +1,738 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * A slab-like allocator for compressed pages.
+ *
+ * Requests are rounded up to one of a set of size classes spaced
+ * ZS_SIZE_CLASS_DELTA bytes apart, from ZS_MIN_ALLOC_SIZE up to a full
+ * page.  Each class carves its objects out of "zspages": a group of up to
+ * ZS_MAX_PAGES_PER_ZSPAGE order-0 pages, possibly highmem, treated as one
+ * contiguous run of objects.  The number of pages in a zspage is picked per
+ * class to minimise the tail left over, so e.g. 3 KB objects come four to
+ * three pages instead of one per page.  Objects may straddle a page
+ * boundary; such objects are copied through a per-cpu buffer when mapped.
+ *
+ * Callers get an opaque handle rather than an address.  The handle points
+ * to a small indirection cell holding the object's current location, so
+ * the allocator is free to move objects around: zs_compact() empties
+ * sparsely used zspages into fuller ones of the same class and frees
+ * them.  It runs from a work item once frees leave a class with enough
+ * unused space, and from a shrinker.  A handle is pinned while it is
+ * mapped or freed and compaction skips pinned objects.
+ *
+ * The per-object bookkeeping (owning handle, or next free object) lives
+ * in the zspage descriptor, not in the pages, so allocating and freeing
+ * never touch the data pages themselves.
+ */
+
+#define KMSG_COMPONENT "zsmalloc"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bit_spinlock.h>
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/workqueue.h>
+
+#include "zsmalloc.h"
+
+/*
+ * 32 bytes is about the smallest useful compressed page; with 16 byte
+ * steps a 4 KB page gives 255 classes and at most 15 bytes of rounding
+ * per object.
+ */
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / \
+				ZS_SIZE_CLASS_DELTA + 1)
+
+#define ZS_MAX_PAGES_PER_ZSPAGE	8
+
+/* objs[] entries: a handle, or the next free index tagged with bit 0 */
+#define ZS_OBJ_FREE		1UL
+#define ZS_NO_OBJ		0xffff
+
+/* handle->flags */
+#define ZS_HANDLE_PIN_BIT	0
+
+/*
+ * zspages with at most this fraction of their objects in use are the
+ * ones compaction empties; allocation prefers the fuller ones.
+ */
+#define ZS_ALMOST_EMPTY_FRAC	4	/* 3/4 */
+
+/*
+ * zs_free() schedules compaction once a class has free objects for this
+ * fraction of its zspages, and for at least ZS_COMPACT_MIN_ZSPAGES.
+ */
+#define ZS_COMPACT_FRAC		16
+#define ZS_COMPACT_MIN_ZSPAGES	2
+
+enum zs_fullness_group {
+	ZS_ALMOST_FULL,
+	ZS_ALMOST_EMPTY,
+	ZS_FULL,
+	_ZS_NR_FULLNESS_GROUPS,
+};
+
+struct size_class {
+	spinlock_t lock;	/* protects everything below and the
+				 * location of this class' handles */
+	unsigned int size;
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+	unsigned long zspages;
+	unsigned long objs_inuse;
+	struct list_head fullness_list[_ZS_NR_FULLNESS_GROUPS];
+};
+
+struct zspage {
+	struct size_class *class;
+	struct list_head list;		/* entry in a fullness list */
+	unsigned int inuse;
+	unsigned int freeobj;		/* first free object or ZS_NO_OBJ */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	unsigned long objs[0];		/* one per object, see ZS_OBJ_FREE */
+};
+
+/* what a handle points to */
+struct zs_handle {
+	unsigned long flags;
+	struct zspage *zspage;
+	unsigned int idx;
+};
+
+struct zs_pool {
+	const char *name;
+	gfp_t flags;	/* for the data pages */
+	atomic_long_t pages_allocated;
+	struct shrinker shrinker;
+	struct work_struct compact_work;
+	struct size_class size_class[ZS_SIZE_CLASSES];
+};
+
+/* state of the mapping currently held on this cpu */
+struct zs_map_area {
+	char *buf;		/* bounce buffer for straddling objects */
+	void *vaddr;		/* kmap_atomic() address otherwise */
+	enum zs_mapmode mm;
+};
+
+static DEFINE_PER_CPU(struct zs_map_area, zs_map_area);
+static struct kmem_cache *zs_handle_cachep;
+
+static unsigned int get_size_class_index(size_t size)
+{
+	if (size <= ZS_MIN_ALLOC_SIZE)
+		return 0;
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/* pick the zspage size, in pages, that wastes the least space */
+static unsigned int get_pages_per_zspage(unsigned int class_size)
+{
+	unsigned int i, best = 1, max_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int waste = zspage_size % class_size;
+		unsigned int usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			best = i;
+		}
+	}
+	return best;
+}
+
+static gfp_t zs_meta_gfp(struct zs_pool *pool)
+{
+	return pool->flags & ~(__GFP_HIGHMEM | __GFP_MOVABLE);
+}
+
+static void zs_pin_handle(struct zs_handle *h)
+{
+	bit_spin_lock(ZS_HANDLE_PIN_BIT, &h->flags);
+}
+
+static int zs_trypin_handle(struct zs_handle *h)
+{
+	return bit_spin_trylock(ZS_HANDLE_PIN_BIT, &h->flags);
+}
+
+static void zs_unpin_handle(struct zs_handle *h)
+{
+	bit_spin_unlock(ZS_HANDLE_PIN_BIT, &h->flags);
+}
+
+static enum zs_fullness_group get_fullness_group(struct size_class *class,
+						 struct zspage *zspage)
+{
+	if (zspage->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+	if (zspage->inuse <= class->objs_per_zspage *
+			(ZS_ALMOST_EMPTY_FRAC - 1) / ZS_ALMOST_EMPTY_FRAC)
+		return ZS_ALMOST_EMPTY;
+	return ZS_ALMOST_FULL;
+}
+
+static void fix_fullness_group(struct size_class *class, struct zspage *zspage)
+{
+	list_move(&zspage->list,
+		  &class->fullness_list[get_fullness_group(class, zspage)]);
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	struct size_class *class = zspage->class;
+	int i;
+
+	for (i = 0; i < class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	atomic_long_sub(class->pages_per_zspage, &pool->pages_allocated);
+	kfree(zspage);
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+				   struct size_class *class)
+{
+	struct zspage *zspage;
+	int i;
+
+	zspage = kzalloc(sizeof(*zspage) +
+			 class->objs_per_zspage * sizeof(zspage->objs[0]),
+			 zs_meta_gfp(pool));
+	if (!zspage)
+		return NULL;
+
+	zspage->class = class;
+	INIT_LIST_HEAD(&zspage->list);
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(pool->flags);
+		if (!zspage->pages[i])
+			goto fail;
+	}
+
+	for (i = 0; i < class->objs_per_zspage - 1; i++)
+		zspage->objs[i] = ((unsigned long)(i + 1) << 1) | ZS_OBJ_FREE;
+	zspage->objs[i] = ((unsigned long)ZS_NO_OBJ << 1) | ZS_OBJ_FREE;
+	zspage->freeobj = 0;
+
+	atomic_long_add(class->pages_per_zspage, &pool->pages_allocated);
+	return zspage;
+
+fail:
+	while (--i >= 0)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+	return NULL;
+}
+
+/* takes a free object off the zspage's free list, class->lock held */
+static unsigned int obj_alloc(struct size_class *class, struct zspage *zspage,
+			      struct zs_handle *h)
+{
+	unsigned int idx = zspage->freeobj;
+
+	BUG_ON(idx == ZS_NO_OBJ);
+	zspage->freeobj = zspage->objs[idx] >> 1;
+	zspage->objs[idx] = (unsigned long)h;
+	zspage->inuse++;
+	class->objs_inuse++;
+	fix_fullness_group(class, zspage);
+
+	h->zspage = zspage;
+	h->idx = idx;
+	return idx;
+}
+
+static void __obj_free(struct size_class *class, struct zspage *zspage,
+		       unsigned int idx)
+{
+	zspage->objs[idx] = ((unsigned long)zspage->freeobj << 1) |
+			    ZS_OBJ_FREE;
+	zspage->freeobj = idx;
+	zspage->inuse--;
+	class->objs_inuse--;
+}
+
+/*
+ * Puts the object back on the free list, class->lock held.  An emptied
+ * zspage is taken off the class and returned for the caller to free
+ * once the lock is dropped.
+ */
+static struct zspage *obj_free(struct size_class *class, struct zspage *zspage,
+			       unsigned int idx)
+{
+	__obj_free(class, zspage, idx);
+
+	if (!zspage->inuse) {
+		list_del(&zspage->list);
+		class->zspages--;
+		return zspage;
+	}
+	fix_fullness_group(class, zspage);
+	return NULL;
+}
+
+/*
+ * Copies between a linear buffer and an object, which may be split
+ * across two pages of its zspage.
+ */
+static void zs_copy_obj(struct size_class *class, struct zspage *zspage,
+			unsigned int idx, char *buf, bool to_obj)
+{
+	unsigned long off = (unsigned long)idx * class->size;
+	unsigned int len = class->size;
+
+	while (len) {
+		unsigned int pg_off = off & ~PAGE_MASK;
+		unsigned int n = min_t(unsigned int, len, PAGE_SIZE - pg_off);
+		char *vaddr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT],
+					  KM_USER0);
+
+		if (to_obj)
+			memcpy(vaddr + pg_off, buf, n);
+		else
+			memcpy(buf, vaddr + pg_off, n);
+		kunmap_atomic(vaddr, KM_USER0);
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+}
+
+/* moves an object between two zspages of the same class */
+static void zs_move_obj(struct size_class *class,
+			struct zspage *dst, unsigned int didx,
+			struct zspage *src, unsigned int sidx)
+{
+	unsigned long d_off = (unsigned long)didx * class->size;
+	unsigned long s_off = (unsigned long)sidx * class->size;
+	unsigned int len = class->size;
+
+	while (len) {
+		unsigned int d_pg = d_off & ~PAGE_MASK;
+		unsigned int s_pg = s_off & ~PAGE_MASK;
+		unsigned int n = min3(len, (unsigned int)PAGE_SIZE - d_pg,
+				      (unsigned int)PAGE_SIZE - s_pg);
+		char *s_addr, *d_addr;
+
+		s_addr = kmap_atomic(src->pages[s_off >> PAGE_SHIFT], KM_USER0);
+		d_addr = kmap_atomic(dst->pages[d_off >> PAGE_SHIFT], KM_USER1);
+		memcpy(d_addr + d_pg, s_addr + s_pg, n);
+		kunmap_atomic(d_addr, KM_USER1);
+		kunmap_atomic(s_addr, KM_USER0);
+
+		d_off += n;
+		s_off += n;
+		len -= n;
+	}
+}
+
+/* zspages compaction could free, class->lock held */
+static unsigned long class_zspages_free(struct size_class *class)
+{
+	return (class->zspages * class->objs_per_zspage - class->objs_inuse) /
+	       class->objs_per_zspage;
+}
+
+/**
+ * zs_malloc - allocate an object from the pool
+ * @pool: pool to allocate from
+ * @size: size of the object, at most PAGE_SIZE
+ *
+ * Returns a handle to be passed to zs_map_object() to get at the memory,
+ * or 0 on failure.  The pool's gfp flags are used for the allocation.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	struct size_class *class;
+	struct zspage *zspage;
+	struct zs_handle *h;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	h = kmem_cache_alloc(zs_handle_cachep, zs_meta_gfp(pool));
+	if (!h)
+		return 0;
+	h->flags = 0;
+
+	class = &pool->size_class[get_size_class_index(size)];
+
+	spin_lock(&class->lock);
+	if (!list_empty(&class->fullness_list[ZS_ALMOST_FULL]))
+		zspage = list_first_entry(&class->fullness_list[ZS_ALMOST_FULL],
+					  struct zspage, list);
+	else if (!list_empty(&class->fullness_list[ZS_ALMOST_EMPTY]))
+		zspage = list_first_entry(&class->fullness_list[ZS_ALMOST_EMPTY],
+					  struct zspage, list);
+	else
+		zspage = NULL;
+
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(pool, class);
+		if (!zspage) {
+			kmem_cache_free(zs_handle_cachep, h);
+			return 0;
+		}
+		spin_lock(&class->lock);
+		class->zspages++;
+	}
+	obj_alloc(class, zspage, h);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)h;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct size_class *class;
+	struct zspage *empty;
+	unsigned long zspages_free;
+	bool compact;
+
+	if (unlikely(!handle))
+		return;
+
+	/* keeps compaction from moving the object under us */
+	zs_pin_handle(h);
+	class = h->zspage->class;
+	spin_lock(&class->lock);
+	empty = obj_free(class, h->zspage, h->idx);
+	zspages_free = class_zspages_free(class);
+	compact = zspages_free >= ZS_COMPACT_MIN_ZSPAGES &&
+		  zspages_free >= class->zspages / ZS_COMPACT_FRAC;
+	spin_unlock(&class->lock);
+	zs_unpin_handle(h);
+
+	if (empty)
+		free_zspage(pool, empty);
+	kmem_cache_free(zs_handle_cachep, h);
+	if (compact)
+		schedule_work(&pool->compact_work);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - get the address of an object
+ * @pool: pool the object belongs to
+ * @handle: handle returned by zs_malloc()
+ * @mm: how the mapping is going to be used
+ *
+ * The mapping is atomic: the caller must not sleep, nor map another
+ * object, before calling zs_unmap_object().  Not for interrupt context.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct size_class *class;
+	struct zs_map_area *area;
+	unsigned long off;
+	unsigned int pg_off;
+
+	BUG_ON(!handle);
+
+	/* disables preemption, so the per-cpu area is ours */
+	zs_pin_handle(h);
+	class = h->zspage->class;
+	off = (unsigned long)h->idx * class->size;
+	pg_off = off & ~PAGE_MASK;
+
+	area = &__get_cpu_var(zs_map_area);
+	area->mm = mm;
+	if (pg_off + class->size <= PAGE_SIZE) {
+		area->vaddr = kmap_atomic(h->zspage->pages[off >> PAGE_SHIFT],
+					  KM_USER0);
+		return area->vaddr + pg_off;
+	}
+
+	area->vaddr = NULL;
+	if (mm != ZS_MM_WO)
+		zs_copy_obj(class, h->zspage, h->idx, area->buf, false);
+	return area->buf;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct zs_map_area *area = &__get_cpu_var(zs_map_area);
+
+	if (area->vaddr)
+		kunmap_atomic(area->vaddr, KM_USER0);
+	else if (area->mm != ZS_MM_RO)
+		zs_copy_obj(h->zspage->class, h->zspage, h->idx, area->buf,
+			    true);
+	area->vaddr = NULL;
+	zs_unpin_handle(h);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/* the least used zspage of the class that is worth emptying */
+static struct zspage *find_source_zspage(struct size_class *class)
+{
+	struct zspage *zspage, *src = NULL;
+
+	list_for_each_entry(zspage, &class->fullness_list[ZS_ALMOST_EMPTY],
+			    list)
+		if (!src || zspage->inuse < src->inuse)
+			src = zspage;
+	return src;
+}
+
+static struct zspage *find_dest_zspage(struct size_class *class)
+{
+	int fg;
+
+	for (fg = ZS_ALMOST_FULL; fg <= ZS_ALMOST_EMPTY; fg++)
+		if (!list_empty(&class->fullness_list[fg]))
+			return list_first_entry(&class->fullness_list[fg],
+						struct zspage, list);
+	return NULL;
+}
+
+/* a zspage can only be freed if the others can take all its objects */
+static bool class_can_compact(struct size_class *class)
+{
+	return class_zspages_free(class) > 0;
+}
+
+/*
+ * Empties the class' sparsest zspages into the fullest ones.  The
+ * source zspage is taken off the fullness lists while it is drained so
+ * it cannot be picked as a destination.  A pinned object ends the pass
+ * for this class: it is mapped or being freed right now.
+ */
+static unsigned long compact_class(struct zs_pool *pool,
+				   struct size_class *class)
+{
+	unsigned long freed = 0;
+	struct zspage *src, *dst;
+	struct zs_handle *h;
+	unsigned int i, didx;
+	bool busy = false;
+
+	spin_lock(&class->lock);
+	while (!busy && class_can_compact(class)) {
+		src = find_source_zspage(class);
+		if (!src)
+			break;
+		list_del(&src->list);
+
+		for (i = 0; i < class->objs_per_zspage && src->inuse; i++) {
+			if (src->objs[i] & ZS_OBJ_FREE)
+				continue;
+			dst = find_dest_zspage(class);
+			if (!dst)
+				break;
+			h = (struct zs_handle *)src->objs[i];
+			if (!zs_trypin_handle(h)) {
+				busy = true;
+				break;
+			}
+			didx = obj_alloc(class, dst, h);
+			zs_move_obj(class, dst, didx, src, i);
+			__obj_free(class, src, i);
+			zs_unpin_handle(h);
+		}
+
+		if (src->inuse) {
+			list_add(&src->list, &class->fullness_list[
+					get_fullness_group(class, src)]);
+			break;
+		}
+		class->zspages--;
+		spin_unlock(&class->lock);
+		free_zspage(pool, src);
+		freed += class->pages_per_zspage;
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - release sparsely used zspages
+ * @pool: pool to compact
+ *
+ * Returns the number of pages given back to the system.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long freed = 0;
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		freed += compact_class(pool, &pool->size_class[i]);
+		cond_resched();
+	}
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+static void zs_compact_work(struct work_struct *work)
+{
+	zs_compact(container_of(work, struct zs_pool, compact_work));
+}
+
+/*
+ * Reports the pages compaction could free and compacts when asked to
+ * scan.  Moving objects needs no allocation, so any reclaim context will
+ * do.
+ */
+static int zs_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(s, struct zs_pool, shrinker);
+	unsigned long pages = 0;
+	int i;
+
+	if (sc->nr_to_scan)
+		zs_compact(pool);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		pages += class_zspages_free(class) * class->pages_per_zspage;
+		spin_unlock(&class->lock);
+	}
+	return min_t(unsigned long, pages, INT_MAX);
+}
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+/**
+ * zs_create_pool - create a pool of compressed objects
+ * @name: name of the pool, for messages only
+ * @flags: allocation flags for the backing pages; highmem is fine
+ */
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
+{
+	struct zs_pool *pool;
+	int i, fg;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+					 class->size;
+		spin_lock_init(&class->lock);
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++)
+			INIT_LIST_HEAD(&class->fullness_list[fg]);
+	}
+
+	pool->name = name;
+	pool->flags = flags;
+	atomic_long_set(&pool->pages_allocated, 0);
+	INIT_WORK(&pool->compact_work, zs_compact_work);
+
+	pool->shrinker.shrink = zs_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	return pool;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+/* all objects should have been freed */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, fg;
+
+	unregister_shrinker(&pool->shrinker);
+	cancel_work_sync(&pool->compact_work);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++) {
+			if (list_empty(&class->fullness_list[fg]))
+				continue;
+			pr_info("Freeing non-empty class with size %u, "
+				"fullness group %d (pool %s)\n",
+				class->size, fg, pool->name);
+		}
+	}
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+static void zs_free_map_areas(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(zs_map_area, cpu).buf);
+		per_cpu(zs_map_area, cpu).buf = NULL;
+	}
+}
+
+static int __init zs_init(void)
+{
+	int cpu;
+
+	zs_handle_cachep = kmem_cache_create("zs_handle",
+				sizeof(struct zs_handle), 0, 0, NULL);
+	if (!zs_handle_cachep)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		char *buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+
+		if (!buf) {
+			zs_free_map_areas();
+			kmem_cache_destroy(zs_handle_cachep);
+			return -ENOMEM;
+		}
+		per_cpu(zs_map_area, cpu).buf = buf;
+	}
+	return 0;
+}
+
+static void __exit zs_exit(void)
+{
+	zs_free_map_areas();
+	kmem_cache_destroy(zs_handle_cachep);
+}
+
+module_init(zs_init);
+module_exit(zs_exit);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("Size class allocator for compressed pages");
@@ -45,4 +45,17 @@ struct ashmem_pin {
 #define ASHMEM_GET_PIN_STATUS	_IO(__ASHMEMIOC, 9)
 #define ASHMEM_PURGE_ALL_CACHES	_IO(__ASHMEMIOC, 10)
 
+#ifdef __KERNEL__
+struct file;
+
+#ifdef CONFIG_ASHMEM
+int is_ashmem_file(struct file *file);
+#else
+static inline int is_ashmem_file(struct file *file)
+{
+	return 0;
+}
+#endif
+#endif /* __KERNEL__ */
+
 #endif	/* _LINUX_ASHMEM_H */
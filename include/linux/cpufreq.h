@@ -407,5 +407,10 @@ void cpufreq_frequency_table_get_attr(struct cpufreq_frequency_table *table,
 
 void cpufreq_frequency_table_put_attr(unsigned int cpu);
 
+/* device holding the PM_OPP entries the frequency table was built from */
+void cpufreq_frequency_table_set_opp_dev(struct device *dev,
+					 unsigned int cpu);
+struct device *cpufreq_frequency_get_opp_dev(unsigned int cpu);
+
 
 #endif /* _LINUX_CPUFREQ_H */
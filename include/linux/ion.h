@@ -42,6 +42,14 @@ enum ion_heap_type {
 #define ION_HEAP_SYSTEM_CONTIG_MASK	(1 << ION_HEAP_SYSTEM_CONTIG)
 #define ION_HEAP_CARVEOUT_MASK		(1 << ION_HEAP_CARVEOUT)
 
+/*
+ * Set in the ion_alloc flags next to the heap mask to allow heaps that
+ * compact (the carveout heap) to move the buffer while it is not mapped
+ * for dma, in the kernel or in userspace.  Calling ion_phys() on the
+ * buffer pins it for good.  Heap ids must stay below 31.
+ */
+#define ION_FLAG_MOVABLE		(1U << 31)
+
 #ifdef __KERNEL__
 struct ion_device;
 struct ion_heap;
@@ -222,6 +230,21 @@ struct ion_handle *ion_import(struct ion_client *client,
  * the handle to use to refer to it further.
  */
 struct ion_handle *ion_import_fd(struct ion_client *client, int fd);
+
+struct file;
+
+/**
+ * is_ion_share_file() - check if a file was obtained via ION_IOC_SHARE
+ * @file:	the file
+ */
+#ifdef CONFIG_ION
+int is_ion_share_file(struct file *file);
+#else
+static inline int is_ion_share_file(struct file *file)
+{
+	return 0;
+}
+#endif
 #endif /* __KERNEL__ */
 
 /**
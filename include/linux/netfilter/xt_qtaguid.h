@@ -4,10 +4,59 @@
 /* For now we just replace the xt_owner.
  * FIXME: make iptables aware of qtaguid. */
 #include <linux/netfilter/xt_owner.h>
+#include <linux/if.h>
+#include <linux/types.h>
 
 #define XT_QTAGUID_UID    XT_OWNER_UID
 #define XT_QTAGUID_GID    XT_OWNER_GID
 #define XT_QTAGUID_SOCKET XT_OWNER_SOCKET
 #define xt_qtaguid_match_info xt_owner_match_info
 
+/*
+ * Binary stats export: /proc/net/xt_qtaguid/stats_bin
+ *
+ * A read returns a struct xt_qtaguid_stats_hdr followed by hdr.num_records
+ * struct xt_qtaguid_stats_rec, one per {iface, tag, counter set}.
+ * Writing a decimal generation number to the open file restricts the next
+ * read (from offset 0) to the records whose counters changed after that
+ * generation. Passing back the hdr.gen of the previous read thus only
+ * returns what changed since then.
+ * Deleted tags can't be reported that way. If any were deleted after the
+ * generation asked for, the read returns all records instead and
+ * hdr.since_gen is 0: the reader must then drop what it had cached.
+ */
+#define XT_QTAGUID_STATS_MAGIC   0x71747573	/* "qtus" */
+#define XT_QTAGUID_STATS_VERSION 1
+
+/* Index order of the counters in struct xt_qtaguid_stats_rec */
+#define XT_QTAGUID_STATS_TX     0
+#define XT_QTAGUID_STATS_RX     1
+#define XT_QTAGUID_STATS_DIRS   2
+
+#define XT_QTAGUID_STATS_TCP    0
+#define XT_QTAGUID_STATS_UDP    1
+#define XT_QTAGUID_STATS_OTHER  2
+#define XT_QTAGUID_STATS_PROTOS 3
+
+struct xt_qtaguid_stats_hdr {
+	__u32 magic;
+	__u16 version;
+	__u16 rec_size;		/* sizeof(struct xt_qtaguid_stats_rec) */
+	__u64 gen;		/* Stats generation this snapshot is at */
+	__u64 since_gen;	/* Only records newer than this are included,
+				 * 0 when all records are */
+	__u32 num_records;
+	__u32 pad;
+};
+
+struct xt_qtaguid_stats_rec {
+	char iface[IFNAMSIZ];
+	__u64 acct_tag;		/* As shown in the text stats acct_tag_hex */
+	__u32 uid;
+	__u32 cnt_set;
+	__u64 gen;		/* Generation of the last change */
+	__u64 bytes[XT_QTAGUID_STATS_DIRS][XT_QTAGUID_STATS_PROTOS];
+	__u64 packets[XT_QTAGUID_STATS_DIRS][XT_QTAGUID_STATS_PROTOS];
+};
+
 #endif /* _XT_QTAGUID_MATCH_H */
@@ -67,6 +67,29 @@ static inline void oom_killer_enable(void)
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+/* keep the lowmemorykiller's per-oom_adj index of thread groups current */
+extern void lowmem_task_fork(struct task_struct *p);
+extern void lowmem_task_exit(struct task_struct *tsk);
+extern void lowmem_oom_adj_changed(struct task_struct *task);
+extern void lowmem_vmpressure(gfp_t gfp, unsigned long scanned,
+			      unsigned long reclaimed);
+#else
+static inline void lowmem_task_fork(struct task_struct *p)
+{
+}
+static inline void lowmem_task_exit(struct task_struct *tsk)
+{
+}
+static inline void lowmem_oom_adj_changed(struct task_struct *task)
+{
+}
+static inline void lowmem_vmpressure(gfp_t gfp, unsigned long scanned,
+				     unsigned long reclaimed)
+{
+}
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
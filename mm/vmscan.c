@@ -2072,6 +2072,9 @@ restart:
 	}
 	blk_finish_plug(&plug);
 	sc->nr_reclaimed += nr_reclaimed;
+	if (scanning_global_lru(sc))
+		lowmem_vmpressure(sc->gfp_mask, sc->nr_scanned - nr_scanned,
+				  nr_reclaimed);
 
 	/*
 	 * Even if we did not try to evict anon pages at all, we want to
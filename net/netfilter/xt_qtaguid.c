@@ -15,11 +15,13 @@
 #define DEBUG
 
 #include <linux/file.h>
+#include <linux/hash.h>
 #include <linux/inetdevice.h>
 #include <linux/module.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter/xt_qtaguid.h>
 #include <linux/skbuff.h>
+#include <linux/vmalloc.h>
 #include <linux/workqueue.h>
 #include <net/addrconf.h>
 #include <net/sock.h>
@@ -45,6 +47,7 @@ static unsigned int proc_iface_perms = S_IRUGO;
 module_param_named(iface_perms, proc_iface_perms, uint, S_IRUGO | S_IWUSR);
 
 static struct proc_dir_entry *xt_qtaguid_stats_file;
+static struct proc_dir_entry *xt_qtaguid_stats_bin_file;
 static unsigned int proc_stats_perms = S_IRUGO;
 module_param_named(stats_perms, proc_stats_perms, uint, S_IRUGO | S_IWUSR);
 
@@ -178,19 +181,36 @@ static struct proc_dir_entry *iface_stat_all_procfile;
  * qtaguid_mt()
  *   account_for_uid()
  *     if_tag_stat_update()
- *       get_sock_stat()
- *         sock_tag_list_lock
+ *       get_iface_entry_cached()
+ *         iface_stat_list_lock
+ *       get_sock_tag_cached()
+ *         get_sock_stat()
+ *           sock_tag_list_lock
+ *         get_active_counter_set()
+ *           tag_counter_set_list_lock
+ *       struct qtu_pcpu_stats->delta_lock
+ *         qtu_delta_fold()
+ *           struct iface_stat->tag_stat_list_lock
+ *
+ * qtaguid_stats_proc_read()
+ *   qtu_pcpu_fold_all()
+ *     struct qtu_pcpu_stats->delta_lock
  *       struct iface_stat->tag_stat_list_lock
- *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
- *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *   iface_stat_list_lock
+ *     struct iface_stat->tag_stat_list_lock
+ *
+ * qtu_stats_bin_read()
+ *   struct qtu_stats_bin_snap->lock
+ *     qtu_stats_bin_snapshot()
+ *       qtu_pcpu_fold_all()
+ *       qtu_stats_bin_fill()
+ *         iface_stat_list_lock
+ *           struct iface_stat->tag_stat_list_lock
  *
  *
  * qtaguid_ctrl_parse()
  *   ctrl_cmd_delete()
+ *     qtu_pcpu_fold_all()
  *     sock_tag_list_lock
  *     tag_counter_set_list_lock
  *     iface_stat_list_lock
@@ -227,6 +247,27 @@ static struct rb_root proc_qtu_data_tree = RB_ROOT;
 /* No proc_qtu_data_tree_lock; use uid_tag_data_tree_lock */
 
 static struct qtaguid_event_counts qtu_events;
+
+/*
+ * The packet matching path caches the iface_stat per net_device and the tag
+ * per socket on each cpu. Changes to the iface_stat_list or to the
+ * sock_tag_tree/tag_counter_set_tree bump these to invalidate the caches.
+ */
+static atomic_t qtu_iface_gen = ATOMIC_INIT(1);
+static atomic_t qtu_sock_tag_gen = ATOMIC_INIT(1);
+static struct qtu_pcpu_stats __percpu *qtu_pcpu;
+
+/*
+ * Bumped under the tag_stat_list_lock each time counts are folded into a
+ * tag_stat, which records it in tag_stat.gen[].
+ */
+static atomic64_t qtu_stats_gen = ATOMIC64_INIT(0);
+/*
+ * qtu_stats_gen at the last deletion of tag_stats, protected by the
+ * iface_stat_list_lock.  Binary stats reads from before it can't be
+ * brought up to date, they get everything instead.
+ */
+static uint64_t qtu_stats_reset_gen;
 /*----------------------------------------------*/
 static bool can_manipulate_uids(void)
 {
@@ -753,6 +794,16 @@ static int get_active_counter_set(tag_t tag)
 	return active_set;
 }
 
+/*
+ * Called once the sock_tag_tree or tag_counter_set_tree has been changed,
+ * so that the per-cpu sock caches redo their lookups.
+ */
+static void qtu_sock_tag_changed(void)
+{
+	smp_mb__before_atomic_inc();
+	atomic_inc(&qtu_sock_tag_gen);
+}
+
 /*
  * Find the entry for tracking the specified interface.
  * Caller must hold iface_stat_list_lock
@@ -884,6 +935,7 @@ static void _iface_stat_set_active(struct iface_stat *entry,
 				   struct net_device *net_dev,
 				   bool activate)
 {
+	atomic_inc(&qtu_iface_gen);
 	if (activate) {
 		entry->net_dev = net_dev;
 		entry->active = true;
@@ -1143,25 +1195,32 @@ static struct sock_tag *get_sock_stat(const struct sock *sk)
 	return sock_tag_entry;
 }
 
-static void
-data_counters_update(struct data_counters *dc, int set,
-		     enum ifs_tx_rx direction, int proto, int bytes)
+static enum ifs_proto ifs_proto_from_ip(int proto)
 {
 	switch (proto) {
 	case IPPROTO_TCP:
-		dc_add_byte_packets(dc, set, direction, IFS_TCP, bytes, 1);
-		break;
+		return IFS_TCP;
 	case IPPROTO_UDP:
-		dc_add_byte_packets(dc, set, direction, IFS_UDP, bytes, 1);
-		break;
+		return IFS_UDP;
 	case IPPROTO_IP:
 	default:
-		dc_add_byte_packets(dc, set, direction, IFS_PROTO_OTHER, bytes,
-				    1);
-		break;
+		return IFS_PROTO_OTHER;
 	}
 }
 
+static void
+data_counters_add(struct data_counters *dc, int set,
+		  struct byte_packet_counters bpc[][IFS_MAX_PROTOS])
+{
+	int direction, proto;
+
+	for (direction = 0; direction < IFS_MAX_DIRECTIONS; direction++)
+		for (proto = 0; proto < IFS_MAX_PROTOS; proto++)
+			dc_add_byte_packets(dc, set, direction, proto,
+					    bpc[direction][proto].bytes,
+					    bpc[direction][proto].packets);
+}
+
 /*
  * Update stats for the specified interface. Do nothing if the entry
  * does not exist (when a device was never configured with an IP address).
@@ -1216,22 +1275,6 @@ static void iface_stat_update(struct net_device *net_dev, bool stash_only)
 	spin_unlock_bh(&iface_stat_list_lock);
 }
 
-static void tag_stat_update(struct tag_stat *tag_entry,
-			enum ifs_tx_rx direction, int proto, int bytes)
-{
-	int active_set;
-	active_set = get_active_counter_set(tag_entry->tn.tag);
-	MT_DEBUG("qtaguid: tag_stat_update(tag=0x%llx (uid=%u) set=%d "
-		 "dir=%d proto=%d bytes=%d)\n",
-		 tag_entry->tn.tag, get_uid_from_tag(tag_entry->tn.tag),
-		 active_set, direction, proto, bytes);
-	data_counters_update(&tag_entry->counters, active_set, direction,
-			     proto, bytes);
-	if (tag_entry->parent_counters)
-		data_counters_update(tag_entry->parent_counters, active_set,
-				     direction, proto, bytes);
-}
-
 /*
  * Create a new entry for tracking the specified {acct_tag,uid_tag} within
  * the interface.
@@ -1255,86 +1298,231 @@ done:
 	return new_tag_stat_entry;
 }
 
-static void if_tag_stat_update(const char *ifname, uid_t uid,
-			       const struct sock *sk, enum ifs_tx_rx direction,
-			       int proto, int bytes)
+/*
+ * Add the counts to the {acct_tag, uid_tag} entry, which also bills
+ * its {0, uid_tag} parent. Missing entries are created.
+ * iface_entry->tag_stat_list_lock should be held.
+ */
+static void tag_stat_fold(struct iface_stat *iface_entry, tag_t tag, int set,
+			  struct byte_packet_counters bpc[][IFS_MAX_PROTOS])
 {
 	struct tag_stat *tag_stat_entry;
-	tag_t tag, acct_tag;
-	tag_t uid_tag;
-	struct data_counters *uid_tag_counters;
-	struct sock_tag *sock_tag_entry;
-	struct iface_stat *iface_entry;
-	struct tag_stat *new_tag_stat;
-	MT_DEBUG("qtaguid: if_tag_stat_update(ifname=%s "
-		"uid=%u sk=%p dir=%d proto=%d bytes=%d)\n",
-		 ifname, uid, sk, direction, proto, bytes);
+	struct tag_stat *uid_tag_stat_entry;
+	tag_t uid_tag = get_utag_from_tag(tag);
+	uint64_t gen;
 
+	MT_DEBUG("qtaguid: iface_stat: %s(): "
+		 " looking for tag=0x%llx (uid=%u) set=%d in ife=%p\n",
+		 __func__, tag, get_uid_from_tag(tag), set, iface_entry);
+	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
+					      tag);
+	if (!tag_stat_entry) {
+		/* Loop over tag list under this interface for {0,uid_tag} */
+		uid_tag_stat_entry = tag_stat_tree_search(
+			&iface_entry->tag_stat_tree, uid_tag);
+		if (!uid_tag_stat_entry)
+			uid_tag_stat_entry = create_if_tag_stat(iface_entry,
+								uid_tag);
+		if (!uid_tag_stat_entry)
+			return;
+		if (get_atag_from_tag(tag)) {
+			tag_stat_entry = create_if_tag_stat(iface_entry, tag);
+			if (!tag_stat_entry)
+				return;
+			tag_stat_entry->parent_counters =
+				&uid_tag_stat_entry->counters;
+		} else {
+			tag_stat_entry = uid_tag_stat_entry;
+		}
+	}
+	gen = atomic64_inc_return(&qtu_stats_gen);
+	data_counters_add(&tag_stat_entry->counters, set, bpc);
+	tag_stat_entry->gen[set] = gen;
+	if (tag_stat_entry->parent_counters) {
+		data_counters_add(tag_stat_entry->parent_counters, set, bpc);
+		container_of(tag_stat_entry->parent_counters, struct tag_stat,
+			     counters)->gen[set] = gen;
+	}
+}
 
-	iface_entry = get_iface_entry(ifname);
-	if (!iface_entry) {
-		pr_err("qtaguid: iface_stat: stat_update() %s not found\n",
-		       ifname);
+/* The cpu's delta_lock should be held. */
+static void qtu_delta_fold(struct qtu_stat_delta *delta)
+{
+	struct iface_stat *iface_entry = delta->iface_entry;
+
+	if (!iface_entry)
 		return;
+	spin_lock_bh(&iface_entry->tag_stat_list_lock);
+	tag_stat_fold(iface_entry, delta->tag, delta->set, delta->bpc);
+	spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+	memset(delta, 0, sizeof(*delta));
+}
+
+/*
+ * Move all the per-cpu counts into the tag_stat_trees.
+ * Must not be called with iface_stat_list_lock or any
+ * tag_stat_list_lock held.
+ */
+static void qtu_pcpu_fold_all(void)
+{
+	struct qtu_pcpu_stats *pcpu;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(qtu_pcpu, cpu);
+		spin_lock_bh(&pcpu->delta_lock);
+		for (i = 0; i < ARRAY_SIZE(pcpu->delta); i++)
+			qtu_delta_fold(&pcpu->delta[i]);
+		spin_unlock_bh(&pcpu->delta_lock);
 	}
-	/* It is ok to process data when an iface_entry is inactive */
+}
 
-	MT_DEBUG("qtaguid: iface_stat: stat_update() dev=%s entry=%p\n",
-		 ifname, iface_entry);
+/* Called with BHs disabled */
+static struct iface_stat *
+get_iface_entry_cached(struct qtu_pcpu_stats *pcpu,
+		       const struct net_device *net_dev)
+{
+	struct qtu_iface_cache *ic;
+	struct iface_stat *iface_entry;
+	unsigned int gen;
+
+	ic = &pcpu->iface_cache[hash_ptr((void *)net_dev,
+					 QTU_PCPU_IFACE_BITS)];
+	gen = atomic_read(&qtu_iface_gen);
+	smp_rmb();
+	if (likely(ic->net_dev == net_dev && ic->gen == gen))
+		return ic->iface_entry;
+
+	spin_lock_bh(&iface_stat_list_lock);
+	iface_entry = get_iface_entry(net_dev->name);
+	spin_unlock_bh(&iface_stat_list_lock);
+	if (iface_entry) {
+		/* iface_stat entries are never freed */
+		ic->net_dev = net_dev;
+		ic->gen = gen;
+		ic->iface_entry = iface_entry;
+	}
+	return iface_entry;
+}
+
+/* Called with BHs disabled */
+static void get_sock_tag_cached(struct qtu_pcpu_stats *pcpu,
+				const struct sock *sk, uid_t uid,
+				tag_t *tag, int *active_set)
+{
+	struct qtu_sock_cache *sc = NULL;
+	struct sock_tag *sock_tag_entry;
+	unsigned int gen;
+
+	gen = atomic_read(&qtu_sock_tag_gen);
+	smp_rmb();
+	/*
+	 * An untagged sk can be freed and its address reused, so the
+	 * uid is part of the key. A tagged sk is pinned by its sock_tag.
+	 */
+	if (sk) {
+		sc = &pcpu->sock_cache[hash_ptr((void *)sk,
+						QTU_PCPU_SOCK_BITS)];
+		if (likely(sc->sk == sk && sc->uid == uid && sc->gen == gen)) {
+			*tag = sc->tag;
+			*active_set = sc->active_set;
+			return;
+		}
+	}
 
 	/*
 	 * Look for a tagged sock.
 	 * It will have an acct_uid.
 	 */
 	sock_tag_entry = get_sock_stat(sk);
-	if (sock_tag_entry) {
-		tag = sock_tag_entry->tag;
-		acct_tag = get_atag_from_tag(tag);
-		uid_tag = get_utag_from_tag(tag);
-	} else {
-		acct_tag = make_atag_from_value(0);
-		tag = combine_atag_with_uid(acct_tag, uid);
-		uid_tag = make_tag_from_uid(uid);
+	if (sock_tag_entry)
+		*tag = sock_tag_entry->tag;
+	else
+		*tag = combine_atag_with_uid(make_atag_from_value(0), uid);
+	*active_set = get_active_counter_set(*tag);
+
+	if (sc) {
+		sc->sk = sk;
+		sc->uid = uid;
+		sc->gen = gen;
+		sc->tag = *tag;
+		sc->active_set = *active_set;
 	}
-	MT_DEBUG("qtaguid: iface_stat: stat_update(): "
-		 " looking for tag=0x%llx (uid=%u) in ife=%p\n",
-		 tag, get_uid_from_tag(tag), iface_entry);
-	/* Loop over tag list under this interface for {acct_tag,uid_tag} */
-	spin_lock_bh(&iface_entry->tag_stat_list_lock);
+}
 
-	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
-					      tag);
-	if (tag_stat_entry) {
-		/*
-		 * Updating the {acct_tag, uid_tag} entry handles both stats:
-		 * {0, uid_tag} will also get updated.
-		 */
-		tag_stat_update(tag_stat_entry, direction, proto, bytes);
-		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
-		return;
+static inline u32 qtu_delta_hash(struct iface_stat *iface_entry, tag_t tag,
+				 int set)
+{
+	return hash_64((unsigned long)iface_entry ^ tag ^ set,
+		       QTU_PCPU_DELTA_BITS);
+}
+
+/*
+ * Account the packet in this cpu's deltas. They get folded into the
+ * iface_entry->tag_stat_tree when the stats are read, or when the slot
+ * is needed for another {iface, tag, set}.
+ */
+static void if_tag_stat_update(const struct net_device *net_dev, uid_t uid,
+			       const struct sock *sk, enum ifs_tx_rx direction,
+			       int proto, int bytes)
+{
+	struct qtu_pcpu_stats *pcpu;
+	struct iface_stat *iface_entry;
+	struct qtu_stat_delta *delta;
+	struct byte_packet_counters *bpc;
+	tag_t tag;
+	int active_set;
+
+	MT_DEBUG("qtaguid: if_tag_stat_update(ifname=%s "
+		"uid=%u sk=%p dir=%d proto=%d bytes=%d)\n",
+		 net_dev->name, uid, sk, direction, proto, bytes);
+
+	local_bh_disable();
+	pcpu = this_cpu_ptr(qtu_pcpu);
+
+	iface_entry = get_iface_entry_cached(pcpu, net_dev);
+	if (!iface_entry) {
+		pr_err("qtaguid: iface_stat: stat_update() %s not found\n",
+		       net_dev->name);
+		goto out;
 	}
+	/* It is ok to process data when an iface_entry is inactive */
 
-	/* Loop over tag list under this interface for {0,uid_tag} */
-	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
-					      uid_tag);
-	if (!tag_stat_entry) {
-		/* Here: the base uid_tag did not exist */
-		/*
-		 * No parent counters. So
-		 *  - No {0, uid_tag} stats and no {acc_tag, uid_tag} stats.
-		 */
-		new_tag_stat = create_if_tag_stat(iface_entry, uid_tag);
-		uid_tag_counters = &new_tag_stat->counters;
-	} else {
-		uid_tag_counters = &tag_stat_entry->counters;
+	MT_DEBUG("qtaguid: iface_stat: stat_update() dev=%s entry=%p\n",
+		 net_dev->name, iface_entry);
+
+	get_sock_tag_cached(pcpu, sk, uid, &tag, &active_set);
+
+	spin_lock(&pcpu->delta_lock);
+	delta = &pcpu->delta[qtu_delta_hash(iface_entry, tag, active_set)];
+	if (delta->iface_entry != iface_entry || delta->tag != tag
+	    || delta->set != active_set) {
+		qtu_delta_fold(delta);
+		delta->iface_entry = iface_entry;
+		delta->tag = tag;
+		delta->set = active_set;
 	}
+	bpc = &delta->bpc[direction][ifs_proto_from_ip(proto)];
+	bpc->bytes += bytes;
+	bpc->packets++;
+	spin_unlock(&pcpu->delta_lock);
+out:
+	local_bh_enable();
+}
 
-	if (acct_tag) {
-		new_tag_stat = create_if_tag_stat(iface_entry, tag);
-		new_tag_stat->parent_counters = uid_tag_counters;
+/* Allocate the per-cpu accounting state used by if_tag_stat_update() */
+static int __init qtu_pcpu_init(void)
+{
+	int cpu;
+
+	qtu_pcpu = alloc_percpu(struct qtu_pcpu_stats);
+	if (!qtu_pcpu) {
+		pr_err("qtaguid: per-cpu stats alloc failed\n");
+		return -ENOMEM;
 	}
-	tag_stat_update(new_tag_stat, direction, proto, bytes);
-	spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(qtu_pcpu, cpu)->delta_lock);
+	return 0;
 }
 
 static int iface_netdev_event_handler(struct notifier_block *nb,
@@ -1353,6 +1541,10 @@ static int iface_netdev_event_handler(struct notifier_block *nb,
 		iface_stat_create(dev, NULL);
 		atomic64_inc(&qtu_events.iface_events);
 		break;
+	case NETDEV_CHANGENAME:
+		/* The per-cpu caches still map the dev to the old name */
+		atomic_inc(&qtu_iface_gen);
+		break;
 	case NETDEV_DOWN:
 	case NETDEV_UNREGISTER:
 		iface_stat_update(dev, event == NETDEV_DOWN);
@@ -1566,7 +1758,7 @@ static void account_for_uid(const struct sk_buff *skb,
 			 el_dev->name,
 			 el_dev->type);
 
-		if_tag_stat_update(el_dev->name, uid,
+		if_tag_stat_update(el_dev, uid,
 				skb->sk ? skb->sk : alternate_sk,
 				par->in ? IFS_RX : IFS_TX,
 				ip_hdr(skb)->protocol, skb->len);
@@ -1870,6 +2062,7 @@ static int ctrl_cmd_delete(const char *input)
 	struct tag_counter_set *tcs_entry;
 	struct tag_ref *tr_entry;
 	struct uid_tag_data *utd_entry;
+	bool ts_deleted = false;
 
 	argc = sscanf(input, "%c %llu %u", &cmd, &acct_tag, &uid);
 	CT_DEBUG("qtaguid: ctrl_delete(%s): argc=%d cmd=%c "
@@ -1899,6 +2092,9 @@ static int ctrl_cmd_delete(const char *input)
 		 "looking for tag=0x%llx (uid=%u)\n",
 		 input, tag, uid);
 
+	/* Pending per-cpu counts would otherwise resurrect the entries */
+	qtu_pcpu_fold_all();
+
 	/* Delete socket tags */
 	spin_lock_bh(&sock_tag_list_lock);
 	node = rb_first(&sock_tag_tree);
@@ -1978,10 +2174,13 @@ static int ctrl_cmd_delete(const char *input)
 				rb_erase(&ts_entry->tn.node,
 					 &iface_entry->tag_stat_tree);
 				kfree(ts_entry);
+				ts_deleted = true;
 			}
 		}
 		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
 	}
+	if (ts_deleted)
+		qtu_stats_reset_gen = atomic64_inc_return(&qtu_stats_gen);
 	spin_unlock_bh(&iface_stat_list_lock);
 
 	/* Cleanup the uid_tag_data */
@@ -2343,6 +2542,7 @@ static int qtaguid_ctrl_parse(const char *input, int count)
 		res = -EINVAL;
 		goto err;
 	}
+	qtu_sock_tag_changed();
 	if (!res)
 		res = count;
 err:
@@ -2503,6 +2703,10 @@ static int qtaguid_stats_proc_read(char *page, char **num_items_returned,
 	if (*eof)
 		return 0;
 
+	/* Only fold once per read, the later chunks see the same snapshot */
+	if (!items_to_skip)
+		qtu_pcpu_fold_all();
+
 	/* The idx is there to help debug when things go belly up. */
 	len = pp_stats_line(&ppi, 0);
 	/* Don't advance the outp unless the whole line was printed */
@@ -2539,6 +2743,208 @@ static int qtaguid_stats_proc_read(char *page, char **num_items_returned,
 	return ppi.outp - page;
 }
 
+/*------------------------------------------*/
+/*
+ * Binary stats, see include/linux/netfilter/xt_qtaguid.h for the format.
+ * A snapshot of the records is taken when reading from offset 0.
+ */
+struct qtu_stats_bin_snap {
+	struct mutex lock;	/* serializes reads and writes of the file */
+	uint64_t since_gen;
+	void *buf;
+	size_t len;
+};
+
+/*
+ * Fill up to max_recs records newer than *since_gen, which is set to 0 if
+ * tags were deleted after it.
+ * Returns the number of records that were wanted, which can be more than
+ * max_recs if tags showed up since the caller sized the buffer.
+ */
+static int qtu_stats_bin_fill(struct xt_qtaguid_stats_rec *rec, int max_recs,
+			      uint64_t *since_gen)
+{
+	struct iface_stat *iface_entry;
+	struct tag_stat *ts_entry;
+	struct data_counters *cnts;
+	struct rb_node *node;
+	int num_recs = 0;
+	int cnt_set, dir, proto;
+	uid_t stat_uid;
+
+	BUILD_BUG_ON(IFS_TX != XT_QTAGUID_STATS_TX
+		     || IFS_RX != XT_QTAGUID_STATS_RX
+		     || IFS_MAX_DIRECTIONS != XT_QTAGUID_STATS_DIRS);
+	BUILD_BUG_ON(IFS_TCP != XT_QTAGUID_STATS_TCP
+		     || IFS_UDP != XT_QTAGUID_STATS_UDP
+		     || IFS_MAX_PROTOS != XT_QTAGUID_STATS_PROTOS);
+
+	spin_lock_bh(&iface_stat_list_lock);
+	if (*since_gen < qtu_stats_reset_gen)
+		*since_gen = 0;
+	list_for_each_entry(iface_entry, &iface_stat_list, list) {
+		spin_lock_bh(&iface_entry->tag_stat_list_lock);
+		for (node = rb_first(&iface_entry->tag_stat_tree);
+		     node;
+		     node = rb_next(node)) {
+			ts_entry = rb_entry(node, struct tag_stat, tn.node);
+			stat_uid = get_uid_from_tag(ts_entry->tn.tag);
+			if (!can_read_other_uid_stats(stat_uid))
+				continue;
+			cnts = &ts_entry->counters;
+			for (cnt_set = 0; cnt_set < IFS_MAX_COUNTER_SETS;
+			     cnt_set++) {
+				if (ts_entry->gen[cnt_set] <= *since_gen)
+					continue;
+				if (num_recs++ >= max_recs)
+					continue;
+				memset(rec, 0, sizeof(*rec));
+				strlcpy(rec->iface, iface_entry->ifname,
+					sizeof(rec->iface));
+				rec->acct_tag =
+					get_atag_from_tag(ts_entry->tn.tag);
+				rec->uid = stat_uid;
+				rec->cnt_set = cnt_set;
+				rec->gen = ts_entry->gen[cnt_set];
+				for (dir = 0; dir < IFS_MAX_DIRECTIONS; dir++)
+					for (proto = 0; proto < IFS_MAX_PROTOS;
+					     proto++) {
+						rec->bytes[dir][proto] = cnts->
+						bpc[cnt_set][dir][proto].bytes;
+						rec->packets[dir][proto] = cnts->
+						bpc[cnt_set][dir][proto].packets;
+					}
+				rec++;
+			}
+		}
+		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+	}
+	spin_unlock_bh(&iface_stat_list_lock);
+	return num_recs;
+}
+
+/* Called with snap->lock held */
+static int qtu_stats_bin_snapshot(struct qtu_stats_bin_snap *snap)
+{
+	struct xt_qtaguid_stats_hdr *hdr;
+	int max_recs = 0;
+	int num_recs;
+	uint64_t gen, since_gen = snap->since_gen;
+
+	if (likely(!module_passive))
+		qtu_pcpu_fold_all();
+	/*
+	 * Folds done after this read get a newer gen, so a reader passing
+	 * hdr.gen back will not miss them.
+	 */
+	gen = atomic64_read(&qtu_stats_gen);
+	for (;;) {
+		vfree(snap->buf);
+		snap->len = sizeof(*hdr) +
+			max_recs * sizeof(struct xt_qtaguid_stats_rec);
+		snap->buf = vmalloc(snap->len);
+		if (!snap->buf) {
+			snap->len = 0;
+			return -ENOMEM;
+		}
+		if (unlikely(module_passive)) {
+			num_recs = 0;
+			break;
+		}
+		num_recs = qtu_stats_bin_fill(snap->buf + sizeof(*hdr),
+					      max_recs, &since_gen);
+		if (num_recs <= max_recs)
+			break;
+		/* Leave room for tags created while reallocating */
+		max_recs = num_recs + num_recs / 8 + 16;
+	}
+
+	hdr = snap->buf;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = XT_QTAGUID_STATS_MAGIC;
+	hdr->version = XT_QTAGUID_STATS_VERSION;
+	hdr->rec_size = sizeof(struct xt_qtaguid_stats_rec);
+	hdr->gen = gen;
+	hdr->since_gen = since_gen;
+	hdr->num_records = num_recs;
+	snap->len = sizeof(*hdr) + num_recs * sizeof(struct xt_qtaguid_stats_rec);
+	CT_DEBUG("qtaguid: stats_bin: since_gen=%llu gen=%llu records=%d\n",
+		 since_gen, gen, num_recs);
+	return 0;
+}
+
+static int qtu_stats_bin_open(struct inode *inode, struct file *file)
+{
+	struct qtu_stats_bin_snap *snap;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+	mutex_init(&snap->lock);
+	file->private_data = snap;
+	return 0;
+}
+
+static ssize_t qtu_stats_bin_read(struct file *file, char __user *buffer,
+				  size_t count, loff_t *ppos)
+{
+	struct qtu_stats_bin_snap *snap = file->private_data;
+	ssize_t res;
+
+	mutex_lock(&snap->lock);
+	if (!*ppos || !snap->buf) {
+		res = qtu_stats_bin_snapshot(snap);
+		if (res)
+			goto out;
+	}
+	res = simple_read_from_buffer(buffer, count, ppos, snap->buf,
+				      snap->len);
+out:
+	mutex_unlock(&snap->lock);
+	return res;
+}
+
+static ssize_t qtu_stats_bin_write(struct file *file,
+				   const char __user *buffer,
+				   size_t count, loff_t *ppos)
+{
+	struct qtu_stats_bin_snap *snap = file->private_data;
+	char input[24];
+	unsigned long long since_gen;
+	int res;
+
+	if (count >= sizeof(input))
+		return -EINVAL;
+	if (copy_from_user(input, buffer, count))
+		return -EFAULT;
+	input[count] = '\0';
+	res = kstrtoull(strim(input), 10, &since_gen);
+	if (res)
+		return res;
+	mutex_lock(&snap->lock);
+	snap->since_gen = since_gen;
+	mutex_unlock(&snap->lock);
+	return count;
+}
+
+static int qtu_stats_bin_release(struct inode *inode, struct file *file)
+{
+	struct qtu_stats_bin_snap *snap = file->private_data;
+
+	vfree(snap->buf);
+	kfree(snap);
+	return 0;
+}
+
+static const struct file_operations qtu_stats_bin_fops = {
+	.owner = THIS_MODULE,
+	.open = qtu_stats_bin_open,
+	.read = qtu_stats_bin_read,
+	.write = qtu_stats_bin_write,
+	.llseek = default_llseek,
+	.release = qtu_stats_bin_release,
+};
+
 /*------------------------------------------*/
 static int qtudev_open(struct inode *inode, struct file *file)
 {
@@ -2678,7 +3084,7 @@ static int qtudev_release(struct inode *inode, struct file *file)
 
 	spin_unlock_bh(&uid_tag_data_tree_lock);
 	spin_unlock_bh(&sock_tag_list_lock);
-
+	qtu_sock_tag_changed();
 
 	sock_tag_tree_erase(&st_to_free_tree);
 
@@ -2736,8 +3142,20 @@ static int __init qtaguid_proc_register(struct proc_dir_entry **res_procdir)
 	 * TODO: add support counter hacking
 	 * xt_qtaguid_stats_file->write_proc = qtaguid_stats_proc_write;
 	 */
+
+	xt_qtaguid_stats_bin_file = proc_create("stats_bin", proc_stats_perms,
+						*res_procdir,
+						&qtu_stats_bin_fops);
+	if (!xt_qtaguid_stats_bin_file) {
+		pr_err("qtaguid: failed to create xt_qtaguid/stats_bin "
+			"file\n");
+		ret = -ENOMEM;
+		goto no_stats_bin_entry;
+	}
 	return 0;
 
+no_stats_bin_entry:
+	remove_proc_entry("stats", *res_procdir);
 no_stats_entry:
 	remove_proc_entry("ctrl", *res_procdir);
 no_ctrl_entry:
@@ -2761,7 +3179,8 @@ static struct xt_match qtaguid_mt_reg __read_mostly = {
 
 static int __init qtaguid_mt_init(void)
 {
-	if (qtaguid_proc_register(&xt_qtaguid_procdir)
+	if (qtu_pcpu_init()
+	    || qtaguid_proc_register(&xt_qtaguid_procdir)
 	    || iface_stat_init(xt_qtaguid_procdir)
 	    || xt_register_match(&qtaguid_mt_reg)
 	    || misc_register(&qtu_device))
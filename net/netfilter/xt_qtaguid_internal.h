@@ -193,6 +193,8 @@ struct tag_stat {
 	 * matching parent uid_tag.
 	 */
 	struct data_counters *parent_counters;
+	/* qtu_stats_gen of the last update, per counter set */
+	uint64_t gen[IFS_MAX_COUNTER_SETS];
 };
 
 struct iface_stat {
@@ -281,6 +283,48 @@ struct tag_counter_set {
 	int active_set;
 };
 
+/*----------------------------------------------*/
+/*
+ * Per-cpu accounting state used by the packet matching path.
+ * The lookup caches are only touched by their own cpu with BHs off.
+ * The deltas are also read by the stats folding, hence the lock.
+ */
+#define QTU_PCPU_IFACE_BITS 3
+#define QTU_PCPU_SOCK_BITS 6
+#define QTU_PCPU_DELTA_BITS 5
+
+struct qtu_iface_cache {
+	const struct net_device *net_dev;
+	/* Valid while it matches qtu_iface_gen */
+	unsigned int gen;
+	struct iface_stat *iface_entry;
+};
+
+struct qtu_sock_cache {
+	const struct sock *sk;  /* Only used as a number, never dereferenced */
+	uid_t uid;
+	/* Valid while it matches qtu_sock_tag_gen */
+	unsigned int gen;
+	tag_t tag;
+	int active_set;
+};
+
+/* Counts not yet folded into the iface_entry->tag_stat_tree */
+struct qtu_stat_delta {
+	struct iface_stat *iface_entry;
+	tag_t tag;
+	int set;
+	struct byte_packet_counters bpc[IFS_MAX_DIRECTIONS][IFS_MAX_PROTOS];
+};
+
+struct qtu_pcpu_stats {
+	struct qtu_iface_cache iface_cache[1 << QTU_PCPU_IFACE_BITS];
+	struct qtu_sock_cache sock_cache[1 << QTU_PCPU_SOCK_BITS];
+
+	spinlock_t delta_lock;
+	struct qtu_stat_delta delta[1 << QTU_PCPU_DELTA_BITS];
+};
+
 /*----------------------------------------------*/
 /*
  * The qtu uid data is used to track resources that are created directly or
@@ -0,0 +1,269 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o ashmem-bench ashmem-bench.c -lpthread */
+
+/*
+ * Time ashmem pin/unpin with many unpinned ranges per region, from one or
+ * more threads, each working on a region of its own.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * Every thread maps a region and unpins every other page of it, leaving
+ * pages/2 separate unpinned ranges behind, as an image cache does.  It
+ * then pins and unpins random single pages, queries the pin status of
+ * random pages and finally pins the whole region back in one call.  Each
+ * phase is timed per call; with more than one thread the rate of all of
+ * them together is reported too, which is where a global lock shows up.
+ * -p adds a thread that keeps purging all unpinned pages through the
+ * shrinker.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/types.h>
+#include "../../include/linux/ashmem.h"
+
+#define MAX_THREADS	64
+
+enum {
+	PHASE_UNPIN,		/* unpin every other page */
+	PHASE_REPIN,		/* pin then unpin a random unpinned page */
+	PHASE_STATUS,		/* pin status of a random page */
+	PHASE_PIN_ALL,		/* pin the whole region */
+	NR_PHASES,
+};
+
+static const char *phase_names[NR_PHASES] = {
+	"unpin", "pin+unpin", "status", "pin all",
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int seed;
+	unsigned long long ns[NR_PHASES];
+	unsigned long ops[NR_PHASES];
+	unsigned long errors;
+};
+
+static struct worker workers[MAX_THREADS];
+static unsigned int nr_threads = 1;
+static unsigned int nr_pages = 4096;
+static unsigned int nr_ops = 100000;
+static long page_size;
+static pthread_barrier_t barrier;
+static unsigned long long phase_ns[NR_PHASES];
+static volatile int stop_purge;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int pin(int fd, int cmd, unsigned int page, unsigned int pages)
+{
+	struct ashmem_pin p = {
+		.offset = page * page_size,
+		.len = pages * page_size,
+	};
+
+	return ioctl(fd, cmd, &p);
+}
+
+/* all threads start each phase together, thread 0 times it as a whole */
+static void phase_sync(struct worker *w, int phase, unsigned long long *t)
+{
+	pthread_barrier_wait(&barrier);
+	if (w == &workers[0]) {
+		if (phase > 0)
+			phase_ns[phase - 1] = now_ns() - *t;
+		*t = now_ns();
+	}
+	pthread_barrier_wait(&barrier);
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	char name[ASHMEM_NAME_LEN] = "ashmem-bench";
+	unsigned long long t, t0 = 0;
+	unsigned int i, page;
+	char *map;
+	int fd;
+
+	fd = open("/dev/ashmem", O_RDWR);
+	if (fd < 0) {
+		perror("/dev/ashmem");
+		exit(1);
+	}
+	if (ioctl(fd, ASHMEM_SET_NAME, name) < 0 ||
+	    ioctl(fd, ASHMEM_SET_SIZE, (size_t)nr_pages * page_size) < 0) {
+		perror("ashmem");
+		exit(1);
+	}
+	/* pinning needs the backing file, which mmap() creates */
+	map = mmap(NULL, (size_t)nr_pages * page_size,
+		   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	for (i = 0; i < nr_pages; i++)
+		map[(size_t)i * page_size] = 1;
+
+	phase_sync(w, PHASE_UNPIN, &t0);
+	t = now_ns();
+	for (page = 0; page < nr_pages; page += 2)
+		if (pin(fd, ASHMEM_UNPIN, page, 1) < 0)
+			w->errors++;
+	w->ns[PHASE_UNPIN] = now_ns() - t;
+	w->ops[PHASE_UNPIN] = (nr_pages + 1) / 2;
+
+	phase_sync(w, PHASE_REPIN, &t0);
+	t = now_ns();
+	for (i = 0; i < nr_ops; i++) {
+		page = rand_r(&w->seed) % nr_pages & ~1U;
+		if (pin(fd, ASHMEM_PIN, page, 1) < 0 ||
+		    pin(fd, ASHMEM_UNPIN, page, 1) < 0)
+			w->errors++;
+	}
+	w->ns[PHASE_REPIN] = now_ns() - t;
+	w->ops[PHASE_REPIN] = nr_ops;
+
+	phase_sync(w, PHASE_STATUS, &t0);
+	t = now_ns();
+	for (i = 0; i < nr_ops; i++) {
+		page = rand_r(&w->seed) % nr_pages;
+		if (pin(fd, ASHMEM_GET_PIN_STATUS, page, 1) !=
+		    (page & 1 ? ASHMEM_IS_PINNED : ASHMEM_IS_UNPINNED))
+			w->errors++;
+	}
+	w->ns[PHASE_STATUS] = now_ns() - t;
+	w->ops[PHASE_STATUS] = nr_ops;
+
+	phase_sync(w, PHASE_PIN_ALL, &t0);
+	t = now_ns();
+	/* the purge thread may have taken pages, that is not an error */
+	if (pin(fd, ASHMEM_PIN, 0, nr_pages) < 0)
+		w->errors++;
+	w->ns[PHASE_PIN_ALL] = now_ns() - t;
+	w->ops[PHASE_PIN_ALL] = 1;
+
+	phase_sync(w, NR_PHASES, &t0);
+	munmap(map, (size_t)nr_pages * page_size);
+	close(fd);
+	return NULL;
+}
+
+static void *purge_fn(void *arg)
+{
+	int fd = open("/dev/ashmem", O_RDWR);
+	unsigned long *purges = arg;
+
+	if (fd < 0) {
+		perror("/dev/ashmem");
+		exit(1);
+	}
+	while (!stop_purge) {
+		if (ioctl(fd, ASHMEM_PURGE_ALL_CACHES) < 0) {
+			perror("ASHMEM_PURGE_ALL_CACHES");
+			exit(1);
+		}
+		(*purges)++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: ashmem-bench [-t threads] [-n pages] [-o ops] [-p]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long errors = 0, purges = 0;
+	pthread_t purger;
+	int c, purge = 0;
+	unsigned int i, p;
+
+	while ((c = getopt(argc, argv, "t:n:o:p")) != -1) {
+		switch (c) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			nr_pages = atoi(optarg);
+			break;
+		case 'o':
+			nr_ops = atoi(optarg);
+			break;
+		case 'p':
+			purge = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (!nr_threads || nr_threads > MAX_THREADS || nr_pages < 2 ||
+	    !nr_ops)
+		usage();
+
+	page_size = sysconf(_SC_PAGESIZE);
+	pthread_barrier_init(&barrier, NULL, nr_threads);
+	if (purge && pthread_create(&purger, NULL, purge_fn, &purges)) {
+		perror("pthread_create");
+		return 1;
+	}
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].seed = i + 1;
+		if (pthread_create(&workers[i].thread, NULL, worker_fn,
+				   &workers[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	if (purge) {
+		stop_purge = 1;
+		pthread_join(purger, NULL);
+	}
+
+	printf("%u threads, %u pages per region, %u ranges unpinned, "
+	       "%u random ops%s\n", nr_threads, nr_pages, (nr_pages + 1) / 2,
+	       nr_ops, purge ? ", purging" : "");
+	printf("%-10s %10s %12s\n", "phase", "ns/call", "calls/s");
+	for (p = 0; p < NR_PHASES; p++) {
+		unsigned long long ns = 0;
+		unsigned long ops = 0;
+
+		for (i = 0; i < nr_threads; i++) {
+			ns += workers[i].ns[p];
+			ops += workers[i].ops[p];
+		}
+		/* pin+unpin counts as two calls */
+		if (p == PHASE_REPIN)
+			ops *= 2;
+		printf("%-10s %10.0f %12.0f\n", phase_names[p],
+		       (double)ns / ops, ops * 1e9 / phase_ns[p]);
+	}
+	for (i = 0; i < nr_threads; i++)
+		errors += workers[i].errors;
+	if (purge)
+		printf("%lu purges\n", purges);
+	if (errors)
+		printf("%lu calls failed\n", errors);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,550 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -I../../drivers/staging/android -o binder-stress binder-stress.c */
+
+/*
+ * Drive independent client/server process pairs through binder and see
+ * whether the transaction rate scales with the number of pairs.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * A manager process becomes the context manager and acts as a tiny
+ * service manager: each server registers its binder with it under a
+ * number, and the client with the same number looks it up.  The pairs
+ * then run BC_TRANSACTION/BC_REPLY round trips for a fixed time; the
+ * server echoes the payload back and the client checks it.  Pairs never
+ * talk to each other, so with fine-grained locking in the driver the
+ * total rate should grow with the number of pairs, up to the number of
+ * cpus.
+ *
+ * Only one context manager can exist, so servicemanager must not be
+ * running (stop it, or boot to a shell).  Once a context manager has
+ * run, only its euid may register again: use -u 1000 after
+ * servicemanager has been up.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(128 * 1024)
+#define MAX_PAIRS	64
+#define MAX_PAYLOAD	4096
+#define MAX_SERVICES	4096
+
+/* transaction codes understood by the manager */
+#define CODE_REGISTER	1
+#define CODE_LOOKUP	2
+
+/* transaction code used by the pairs */
+#define CODE_ECHO	0x10
+
+struct binder_conn {
+	int fd;
+	void *map;
+	uint32_t rbuf[256];
+};
+
+/* shared between all processes */
+struct shared {
+	volatile int go;
+	volatile int stop;
+	volatile int ready;
+	struct pair_stats {
+		unsigned long long calls;
+		unsigned long long ns;
+		unsigned long long max_ns;
+		unsigned long errors;
+	} pair[MAX_PAIRS];
+};
+
+static struct shared *shared;
+static unsigned int payload = 64;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void binder_open_conn(struct binder_conn *bc)
+{
+	struct binder_version vers;
+
+	bc->fd = open("/dev/binder", O_RDWR);
+	if (bc->fd < 0)
+		die("/dev/binder");
+	if (ioctl(bc->fd, BINDER_VERSION, &vers) < 0)
+		die("BINDER_VERSION");
+	if (vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol %ld, built for %d\n",
+			vers.protocol_version, BINDER_CURRENT_PROTOCOL_VERSION);
+		exit(1);
+	}
+	bc->map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, bc->fd, 0);
+	if (bc->map == MAP_FAILED)
+		die("mmap");
+}
+
+/* write 'wsize' bytes of commands, then read into bc->rbuf if 'rd' */
+static long binder_io(struct binder_conn *bc, void *wbuf, size_t wsize,
+		      int rd)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = wsize;
+	bwr.write_buffer = (unsigned long)wbuf;
+	if (rd) {
+		bwr.read_size = sizeof(bc->rbuf);
+		bwr.read_buffer = (unsigned long)bc->rbuf;
+	}
+	while (ioctl(bc->fd, BINDER_WRITE_READ, &bwr) < 0) {
+		if (errno != EINTR)
+			die("BINDER_WRITE_READ");
+		/* what was written stays written */
+		bwr.write_size -= bwr.write_consumed;
+		bwr.write_buffer += bwr.write_consumed;
+		bwr.write_consumed = 0;
+	}
+	return bwr.read_consumed;
+}
+
+/* a write-only buffer of commands */
+struct cmdbuf {
+	unsigned char buf[512];
+	size_t len;
+};
+
+static void cmd_put(struct cmdbuf *cb, uint32_t cmd, const void *arg,
+		    size_t size)
+{
+	memcpy(cb->buf + cb->len, &cmd, sizeof(cmd));
+	cb->len += sizeof(cmd);
+	if (size) {
+		memcpy(cb->buf + cb->len, arg, size);
+		cb->len += size;
+	}
+}
+
+static void cmd_put_u32(struct cmdbuf *cb, uint32_t cmd, uint32_t arg)
+{
+	cmd_put(cb, cmd, &arg, sizeof(arg));
+}
+
+static void cmd_put_ptr(struct cmdbuf *cb, uint32_t cmd, const void *ptr)
+{
+	cmd_put(cb, cmd, &ptr, sizeof(ptr));
+}
+
+/*
+ * Walks the returned commands.  Reference counting requests on our own
+ * node are acked into 'cb', a transaction or reply is copied to 'tr' and
+ * its command returned; 0 when the buffer holds neither.
+ */
+static uint32_t binder_parse(struct binder_conn *bc, long len,
+			     struct cmdbuf *cb,
+			     struct binder_transaction_data *tr)
+{
+	unsigned char *p = (unsigned char *)bc->rbuf;
+	unsigned char *end = p + len;
+	uint32_t cmd, ret = 0;
+
+	while (p < end) {
+		memcpy(&cmd, p, sizeof(cmd));
+		p += sizeof(cmd);
+		switch (cmd) {
+		case BR_INCREFS:
+		case BR_ACQUIRE:
+			cmd_put(cb, cmd == BR_INCREFS ? BC_INCREFS_DONE :
+				BC_ACQUIRE_DONE, p,
+				sizeof(struct binder_ptr_cookie));
+			break;
+		case BR_TRANSACTION:
+		case BR_REPLY:
+			memcpy(tr, p, sizeof(*tr));
+			ret = cmd;
+			break;
+		case BR_DEAD_REPLY:
+		case BR_FAILED_REPLY:
+			ret = cmd;
+			break;
+		case BR_ERROR:
+			fprintf(stderr, "BR_ERROR %d\n", *(int *)p);
+			exit(1);
+		}
+		p += _IOC_SIZE(cmd);
+	}
+	return ret;
+}
+
+/*
+ * Sends a transaction to 'handle' and waits for the reply, which is left
+ * in 'reply'; its buffer must be freed by the caller.  Returns false on a
+ * failed or dead reply.
+ */
+static int binder_call(struct binder_conn *bc, struct cmdbuf *cb,
+		       uint32_t handle, uint32_t code, const void *data,
+		       size_t size, const size_t *offs, size_t offs_size,
+		       struct binder_transaction_data *reply)
+{
+	struct binder_transaction_data tr;
+	uint32_t ret;
+	long len;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	tr.data_size = size;
+	tr.offsets_size = offs_size;
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offs;
+	cmd_put(cb, BC_TRANSACTION, &tr, sizeof(tr));
+
+	do {
+		len = binder_io(bc, cb->buf, cb->len, 1);
+		cb->len = 0;
+		ret = binder_parse(bc, len, cb, reply);
+	} while (!ret);
+	return ret == BR_REPLY;
+}
+
+static void binder_reply(struct cmdbuf *cb,
+			 const struct binder_transaction_data *txn,
+			 const void *data, size_t size, const size_t *offs,
+			 size_t offs_size)
+{
+	struct binder_transaction_data tr;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.data_size = size;
+	tr.offsets_size = offs_size;
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offs;
+	cmd_put(cb, BC_REPLY, &tr, sizeof(tr));
+	cmd_put_ptr(cb, BC_FREE_BUFFER, txn->data.ptr.buffer);
+}
+
+/* handle 0: hands out the servers' binders by number */
+static void manager(void)
+{
+	static uint32_t handles[MAX_SERVICES];
+	struct binder_transaction_data tr;
+	struct flat_binder_object obj;
+	struct binder_conn bc;
+	struct cmdbuf cb = { .len = 0 };
+	size_t off = 0;
+	uint32_t idx;
+	long len;
+
+	binder_open_conn(&bc);
+	if (ioctl(bc.fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR");
+	cmd_put(&cb, BC_ENTER_LOOPER, NULL, 0);
+	shared->ready = 1;
+
+	for (;;) {
+		len = binder_io(&bc, cb.buf, cb.len, 1);
+		cb.len = 0;
+		if (binder_parse(&bc, len, &cb, &tr) != BR_TRANSACTION)
+			continue;
+
+		/* the number comes last */
+		idx = 0;
+		if (tr.data_size >= sizeof(idx))
+			memcpy(&idx, (char *)tr.data.ptr.buffer + tr.data_size -
+			       sizeof(idx), sizeof(idx));
+		idx %= MAX_SERVICES;
+
+		if (tr.code == CODE_REGISTER &&
+		    tr.data_size == sizeof(obj) + sizeof(idx) &&
+		    tr.offsets_size == sizeof(off)) {
+			memcpy(&obj, tr.data.ptr.buffer, sizeof(obj));
+			/* keep the handle once the buffer is freed */
+			cmd_put_u32(&cb, BC_ACQUIRE, obj.handle);
+			handles[idx] = obj.handle;
+			binder_reply(&cb, &tr, NULL, 0, NULL, 0);
+		} else if (tr.code == CODE_LOOKUP && handles[idx]) {
+			memset(&obj, 0, sizeof(obj));
+			obj.type = BINDER_TYPE_HANDLE;
+			obj.handle = handles[idx];
+			/* sent, and obj copied, by the next binder_io() */
+			binder_reply(&cb, &tr, &obj, sizeof(obj), &off,
+				     sizeof(off));
+		} else {
+			binder_reply(&cb, &tr, NULL, 0, NULL, 0);
+		}
+	}
+}
+
+/* echoes every transaction back */
+static void server(unsigned int idx)
+{
+	struct {
+		struct flat_binder_object obj;
+		uint32_t idx;
+	} reg;
+	struct binder_transaction_data tr;
+	struct binder_conn bc;
+	struct cmdbuf cb = { .len = 0 };
+	size_t off = 0;
+	static int node;
+	long len;
+
+	binder_open_conn(&bc);
+	cmd_put(&cb, BC_ENTER_LOOPER, NULL, 0);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.idx = idx;
+	reg.obj.type = BINDER_TYPE_BINDER;
+	reg.obj.binder = &node;
+	reg.obj.cookie = &node;
+	if (!binder_call(&bc, &cb, 0, CODE_REGISTER, &reg,
+			 sizeof(reg.obj) + sizeof(reg.idx), &off, sizeof(off),
+			 &tr)) {
+		fprintf(stderr, "server %u: register failed\n", idx);
+		exit(1);
+	}
+	cmd_put_ptr(&cb, BC_FREE_BUFFER, tr.data.ptr.buffer);
+
+	for (;;) {
+		len = binder_io(&bc, cb.buf, cb.len, 1);
+		cb.len = 0;
+		if (binder_parse(&bc, len, &cb, &tr) != BR_TRANSACTION)
+			continue;
+		binder_reply(&cb, &tr, tr.data.ptr.buffer, tr.data_size,
+			     NULL, 0);
+	}
+}
+
+static void client(unsigned int idx, unsigned int pair)
+{
+	struct pair_stats *st = &shared->pair[pair];
+	struct binder_transaction_data tr;
+	struct flat_binder_object obj;
+	struct binder_conn bc;
+	struct cmdbuf cb = { .len = 0 };
+	unsigned char data[MAX_PAYLOAD];
+	unsigned long long t, d;
+	uint32_t handle, seq = 0;
+
+	binder_open_conn(&bc);
+
+	/* the server may not have registered yet */
+	for (;;) {
+		if (!binder_call(&bc, &cb, 0, CODE_LOOKUP, &idx, sizeof(idx),
+				 NULL, 0, &tr)) {
+			fprintf(stderr, "client %u: lookup failed\n", idx);
+			exit(1);
+		}
+		if (tr.offsets_size == sizeof(size_t) &&
+		    tr.data_size == sizeof(obj)) {
+			memcpy(&obj, tr.data.ptr.buffer, sizeof(obj));
+			break;
+		}
+		cmd_put_ptr(&cb, BC_FREE_BUFFER, tr.data.ptr.buffer);
+		usleep(1000);
+	}
+	handle = obj.handle;
+	cmd_put_u32(&cb, BC_ACQUIRE, handle);
+	cmd_put_ptr(&cb, BC_FREE_BUFFER, tr.data.ptr.buffer);
+
+	__sync_fetch_and_add(&shared->ready, 1);
+	while (!shared->go)
+		usleep(1000);
+
+	while (!shared->stop) {
+		memset(data, seq & 0xff, payload);
+		memcpy(data, &seq, sizeof(seq));
+		t = now_ns();
+		if (!binder_call(&bc, &cb, handle, CODE_ECHO, data, payload,
+				 NULL, 0, &tr)) {
+			st->errors++;
+			continue;
+		}
+		d = now_ns() - t;
+		if (tr.data_size != payload ||
+		    memcmp(tr.data.ptr.buffer, data, payload))
+			st->errors++;
+		cmd_put_ptr(&cb, BC_FREE_BUFFER, tr.data.ptr.buffer);
+		st->calls++;
+		st->ns += d;
+		if (d > st->max_ns)
+			st->max_ns = d;
+		seq++;
+	}
+	exit(0);
+}
+
+static pid_t spawn(void (*fn)(unsigned int, unsigned int), unsigned int a,
+		   unsigned int b)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		fn(a, b);
+		exit(0);
+	}
+	return pid;
+}
+
+static void server_fn(unsigned int idx, unsigned int unused)
+{
+	(void)unused;
+	server(idx);
+}
+
+/* runs 'pairs' pairs for 'seconds', returns the total calls/s */
+static double run(unsigned int pairs, unsigned int seconds,
+		  unsigned int *next_idx, double base)
+{
+	pid_t servers[MAX_PAIRS], clients[MAX_PAIRS];
+	unsigned long long calls = 0, ns = 0, max_ns = 0;
+	unsigned long errors = 0;
+	unsigned long long t;
+	double rate;
+	unsigned int i;
+	int status;
+
+	memset(shared->pair, 0, sizeof(shared->pair));
+	shared->go = 0;
+	shared->stop = 0;
+	shared->ready = 0;
+
+	for (i = 0; i < pairs; i++) {
+		servers[i] = spawn(server_fn, *next_idx + i, 0);
+		clients[i] = spawn(client, *next_idx + i, i);
+	}
+	*next_idx += pairs;
+
+	while (shared->ready < (int)pairs) {
+		/* a pair that could not get going */
+		if (waitpid(-1, &status, WNOHANG) > 0) {
+			fprintf(stderr, "a pair exited early\n");
+			exit(1);
+		}
+		usleep(1000);
+	}
+	t = now_ns();
+	shared->go = 1;
+	sleep(seconds);
+	shared->stop = 1;
+	for (i = 0; i < pairs; i++) {
+		waitpid(clients[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			errors++;
+	}
+	t = now_ns() - t;
+	for (i = 0; i < pairs; i++) {
+		kill(servers[i], SIGKILL);
+		waitpid(servers[i], NULL, 0);
+	}
+
+	for (i = 0; i < pairs; i++) {
+		struct pair_stats *st = &shared->pair[i];
+
+		calls += st->calls;
+		ns += st->ns;
+		if (st->max_ns > max_ns)
+			max_ns = st->max_ns;
+		errors += st->errors;
+	}
+	rate = calls * 1e9 / t;
+	printf("%5u %12.0f %10.0f %8.2f %10.1f %10.1f %6lu\n", pairs, rate,
+	       rate / pairs, base ? rate / base : 1.0,
+	       calls ? ns / 1e3 / calls : 0, max_ns / 1e3, errors);
+	return rate;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: binder-stress [-p max_pairs] [-d seconds] "
+		"[-s payload] [-u uid]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int max_pairs = 8, seconds = 5, pairs, idx = 1;
+	double rate, base = 0;
+	pid_t mgr;
+	int c;
+
+	while ((c = getopt(argc, argv, "p:d:s:u:")) != -1) {
+		switch (c) {
+		case 'p':
+			max_pairs = atoi(optarg);
+			break;
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 's':
+			payload = atoi(optarg);
+			break;
+		case 'u':
+			if (setuid(atoi(optarg)) < 0)
+				die("setuid");
+			break;
+		default:
+			usage();
+		}
+	}
+	if (!max_pairs || max_pairs > MAX_PAIRS || !seconds ||
+	    payload < sizeof(uint32_t) || payload > MAX_PAYLOAD)
+		usage();
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		die("mmap");
+
+	mgr = fork();
+	if (mgr < 0)
+		die("fork");
+	if (!mgr) {
+		manager();
+		exit(0);
+	}
+	while (!shared->ready) {
+		if (waitpid(mgr, NULL, WNOHANG) == mgr)
+			return 1;
+		usleep(1000);
+	}
+
+	printf("%ld cpus, %u byte payload, %us per run\n",
+	       sysconf(_SC_NPROCESSORS_ONLN), payload, seconds);
+	printf("%5s %12s %10s %8s %10s %10s %6s\n", "pairs", "calls/s",
+	       "per_pair", "scaling", "avg_us", "max_us", "errors");
+	for (pairs = 1; pairs <= max_pairs; pairs *= 2) {
+		rate = run(pairs, seconds, &idx, base);
+		if (!base)
+			base = rate;
+	}
+
+	kill(mgr, SIGKILL);
+	waitpid(mgr, NULL, 0);
+	return 0;
+}
@@ -0,0 +1,301 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -I../../drivers/staging/android -o logger-stress logger-stress.c -lpthread */
+
+/*
+ * Flood an Android log device from many threads and check what comes
+ * back out of it.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * Each writer thread writes numbered entries through one shared file
+ * descriptor, the way liblog does, and times every writev().  A reader
+ * thread reads the log at the same time and checks each entry of ours:
+ * the header must carry the writer's pid and tid, the payload must be the
+ * one that was written, and a writer's sequence numbers must only go up.
+ * Entries the reader fell too far behind to see are counted as lost, not
+ * as errors; the log is a ring.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define TAG		"logger-stress"
+#define MAX_THREADS	256
+
+struct writer {
+	pthread_t thread;
+	unsigned int id;
+	pid_t tid;
+	unsigned long long lat_ns;
+	unsigned long long max_ns;
+	unsigned int failed;
+
+	/* reader side */
+	int seen;
+	unsigned int last_seq;
+	unsigned int received;
+	unsigned int lost;
+};
+
+static struct writer writers[MAX_THREADS];
+static unsigned int nr_threads = 4;
+static unsigned int nr_entries = 100000;
+static unsigned int msg_len = 64;
+static int log_fd;
+static pid_t pid;
+static volatile int writers_done;
+
+static unsigned int corrupt, reordered, foreign;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* "id seq " followed by filler derived from both, NUL terminated */
+static unsigned int make_msg(char *buf, unsigned int id, unsigned int seq)
+{
+	unsigned int n, i;
+
+	n = sprintf(buf, "%u %u ", id, seq);
+	for (i = n; i < msg_len - 1; i++)
+		buf[i] = 'a' + (id + seq + i) % 26;
+	buf[i] = '\0';
+	return i + 1;
+}
+
+static void *writer_fn(void *arg)
+{
+	struct writer *w = arg;
+	char prio = 4;		/* ANDROID_LOG_INFO */
+	char msg[LOGGER_ENTRY_MAX_PAYLOAD];
+	struct iovec iov[3];
+	unsigned long long t, d;
+	unsigned int seq;
+
+	w->tid = syscall(SYS_gettid);
+	iov[0].iov_base = &prio;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = TAG;
+	iov[1].iov_len = sizeof(TAG);
+	iov[2].iov_base = msg;
+
+	for (seq = 0; seq < nr_entries; seq++) {
+		iov[2].iov_len = make_msg(msg, w->id, seq);
+		t = now_ns();
+		if (writev(log_fd, iov, 3) < 0)
+			w->failed++;
+		d = now_ns() - t;
+		w->lat_ns += d;
+		if (d > w->max_ns)
+			w->max_ns = d;
+	}
+	return NULL;
+}
+
+static void check_entry(struct logger_entry *e)
+{
+	char *tag = e->msg + 1;
+	char *msg, expect[LOGGER_ENTRY_MAX_PAYLOAD];
+	unsigned int id, seq, len;
+	struct writer *w;
+
+	if (e->pid != pid)
+		return;
+	if (e->len < 1 + sizeof(TAG) || strcmp(tag, TAG)) {
+		foreign++;
+		return;
+	}
+	msg = tag + sizeof(TAG);
+	len = e->len - 1 - sizeof(TAG);
+	if (sscanf(msg, "%u %u", &id, &seq) != 2 || id >= nr_threads) {
+		corrupt++;
+		return;
+	}
+	w = &writers[id];
+	if (make_msg(expect, id, seq) != len || memcmp(msg, expect, len) ||
+	    e->tid != w->tid) {
+		corrupt++;
+		return;
+	}
+	if (w->seen && seq <= w->last_seq) {
+		reordered++;
+		return;
+	}
+	w->lost += seq - (w->seen ? w->last_seq + 1 : 0);
+	w->seen = 1;
+	w->last_seq = seq;
+	w->received++;
+}
+
+static int all_seen(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_threads; i++)
+		if (!writers[i].seen || writers[i].last_seq != nr_entries - 1)
+			return 0;
+	return 1;
+}
+
+static void *reader_fn(void *arg)
+{
+	int fd = *(int *)arg;
+	char buf[LOGGER_ENTRY_MAX_LEN + 1];
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	ssize_t n;
+
+	for (;;) {
+		/* once the writers are done, wait a second for stragglers */
+		if (poll(&pfd, 1, writers_done ? 1000 : 100) == 0) {
+			if (writers_done)
+				break;
+			continue;
+		}
+		n = read(fd, buf, LOGGER_ENTRY_MAX_LEN);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+		if ((size_t)n < sizeof(struct logger_entry) ||
+		    ((struct logger_entry *)buf)->len + sizeof(struct logger_entry)
+		    != (size_t)n) {
+			corrupt++;
+			continue;
+		}
+		buf[n] = '\0';
+		check_entry((struct logger_entry *)buf);
+		if (writers_done && all_seen())
+			break;
+	}
+	return NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: logger-stress [-t threads] [-n entries] [-s msg_len] "
+		"[-R] [log]\n"
+		"  -R  do not read back, only write\n"
+		"  log defaults to /dev/log/main\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = "/dev/log/main";
+	unsigned long long start, elapsed, lat = 0, max = 0;
+	unsigned int i, failed = 0, received = 0, lost = 0;
+	int c, rfd = -1, check = 1;
+	pthread_t reader;
+	double total;
+
+	while ((c = getopt(argc, argv, "t:n:s:R")) != -1) {
+		switch (c) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			nr_entries = atoi(optarg);
+			break;
+		case 's':
+			msg_len = atoi(optarg);
+			break;
+		case 'R':
+			check = 0;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		path = argv[optind];
+	if (!nr_threads || nr_threads > MAX_THREADS || !nr_entries ||
+	    msg_len < 32 || msg_len > LOGGER_ENTRY_MAX_PAYLOAD - 1 - sizeof(TAG))
+		usage();
+
+	pid = getpid();
+	log_fd = open(path, O_WRONLY);
+	if (log_fd < 0) {
+		perror(path);
+		return 1;
+	}
+	if (check) {
+		rfd = open(path, O_RDONLY | O_NONBLOCK);
+		if (rfd < 0) {
+			perror(path);
+			return 1;
+		}
+		/* skip what is already in the log */
+		for (;;) {
+			char buf[LOGGER_ENTRY_MAX_LEN];
+
+			if (read(rfd, buf, sizeof(buf)) < 0)
+				break;
+		}
+		if (pthread_create(&reader, NULL, reader_fn, &rfd)) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+
+	start = now_ns();
+	for (i = 0; i < nr_threads; i++) {
+		writers[i].id = i;
+		if (pthread_create(&writers[i].thread, NULL, writer_fn,
+				   &writers[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(writers[i].thread, NULL);
+	elapsed = now_ns() - start;
+	writers_done = 1;
+	if (check)
+		pthread_join(reader, NULL);
+
+	for (i = 0; i < nr_threads; i++) {
+		struct writer *w = &writers[i];
+
+		failed += w->failed;
+		lat += w->lat_ns;
+		if (w->max_ns > max)
+			max = w->max_ns;
+		received += w->received;
+		/* the tail after the last entry the reader saw */
+		lost += w->lost + nr_entries - (w->seen ? w->last_seq + 1 : 0);
+	}
+	total = (double)nr_threads * nr_entries;
+
+	printf("%u threads x %u entries of %u bytes: %.3f s\n",
+	       nr_threads, nr_entries, msg_len, elapsed / 1e9);
+	printf("write: %.0f entries/s, %.1f MB/s, latency avg %.1f us, "
+	       "max %.1f us, %u failed\n",
+	       total * 1e9 / elapsed,
+	       total * (1 + sizeof(TAG) + msg_len) / elapsed * 1e3,
+	       lat / total / 1e3, max / 1e3, failed);
+	if (check)
+		printf("read: %u received, %u lost, %u corrupt, %u reordered, "
+		       "%u foreign\n", received, lost, corrupt, reordered,
+		       foreign);
+	return failed || corrupt || reordered || foreign ? 1 : 0;
+}
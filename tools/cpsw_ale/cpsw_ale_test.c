@@ -0,0 +1,439 @@
+/*
+ * cpsw_ale_test -- run drivers/net/ethernet/ti/cpsw_ale.c in userspace
+ * against a simulated ALE table and check that its RAM shadow stays in
+ * step with the table.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * The table is plugged in through cpsw_ale_params.table_ops.  Besides the
+ * driver's own writes, the test plays the parts of the hardware the shadow
+ * can't see: it learns unicast addresses into free slots and ages learned
+ * entries out again.  A fixed sequence covers those cases one at a time,
+ * then random adds, deletes, learning and ageing of unicast and multicast
+ * addresses are checked after every step:
+ *  - entries the driver wrote are the same in the shadow and the table,
+ *  - the hash index holds exactly the shadow's used slots,
+ *  - no address is in the table twice,
+ *  - cpsw_ale_match_addr() finds what the table holds, and nothing else.
+ *
+ * The number of table reads per lookup is reported, these are the MMIO
+ * accesses the shadow is there to save.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/kernel.h>
+#include "../../drivers/net/ethernet/ti/cpsw_ale.h"
+
+#define ALE_ENTRY_WORDS		3
+#define ALE_ENTRIES		1024
+#define NR_ADDRS		64
+
+#define ADDR_FMT		"%02x:%02x:%02x:%02x:%02x:%02x"
+#define ADDR_ARGS(a)		(a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+
+#define ALE_TYPE_FREE		0
+#define ALE_TYPE_ADDR		1
+#define ALE_TYPE_VLAN		2
+#define ALE_UCAST_PERSISTANT	0
+#define ALE_UCAST_OUI		2
+#define ALE_UCAST_TOUCHED	3
+
+static u32 table[ALE_ENTRIES][ALE_ENTRY_WORDS];
+static u32 regs[64];
+static unsigned long table_reads;
+static int errors;
+
+static void fake_read(struct cpsw_ale *ale, int idx, u32 *ale_entry)
+{
+	memcpy(ale_entry, table[idx], sizeof(table[idx]));
+	table_reads++;
+}
+
+static void fake_write(struct cpsw_ale *ale, int idx, u32 *ale_entry)
+{
+	memcpy(table[idx], ale_entry, sizeof(table[idx]));
+}
+
+static const struct cpsw_ale_table_ops fake_ops = {
+	.read	= fake_read,
+	.write	= fake_write,
+};
+
+/* the entry layout, as cpsw_ale_get_field() and cpsw_ale_set_field() */
+static u32 get_field(const u32 *e, u32 start, u32 bits)
+{
+	return (e[2 - start / 32] >> (start % 32)) & (BIT(bits) - 1);
+}
+
+static void set_field(u32 *e, u32 start, u32 bits, u32 value)
+{
+	e[2 - start / 32] &= ~((BIT(bits) - 1) << (start % 32));
+	e[2 - start / 32] |= (value & (BIT(bits) - 1)) << (start % 32);
+}
+
+static int entry_type(const u32 *e)
+{
+	return get_field(e, 60, 2);
+}
+
+static void entry_addr(const u32 *e, u8 *addr)
+{
+	int i;
+
+	for (i = 0; i < 6; i++)
+		addr[i] = get_field(e, 40 - 8 * i, 8);
+}
+
+/* what the hardware may change by itself: free slots and learned entries */
+static bool hw_owned(const u32 *e)
+{
+	int type = entry_type(e);
+
+	if (type == ALE_TYPE_FREE)
+		return true;
+	if (type == ALE_TYPE_VLAN || get_field(e, 40, 1))
+		return false;
+	type = get_field(e, 62, 2);
+	return type != ALE_UCAST_PERSISTANT && type != ALE_UCAST_OUI;
+}
+
+static void ucast_addr(int n, u8 *addr)
+{
+	u8 a[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, n };
+
+	memcpy(addr, a, 6);
+}
+
+static void mcast_addr(int n, u8 *addr)
+{
+	u8 a[6] = { 0x01, 0x00, 0x5e, 0x00, 0x00, n };
+
+	memcpy(addr, a, 6);
+}
+
+/* index of addr in the table, vid 0, or -ENOENT */
+static int table_find(const u8 *addr)
+{
+	u8 a[6];
+	int idx;
+
+	for (idx = 0; idx < ALE_ENTRIES; idx++) {
+		if (entry_type(table[idx]) == ALE_TYPE_FREE ||
+		    entry_type(table[idx]) == ALE_TYPE_VLAN ||
+		    get_field(table[idx], 48, 12))
+			continue;
+		entry_addr(table[idx], a);
+		if (!memcmp(a, addr, 6))
+			return idx;
+	}
+	return -ENOENT;
+}
+
+/* the hardware learns addr on port into a free slot */
+static int hw_learn(const u8 *addr, int port)
+{
+	int idx, i;
+
+	for (idx = 0; idx < ALE_ENTRIES; idx++)
+		if (entry_type(table[idx]) == ALE_TYPE_FREE)
+			break;
+	if (idx == ALE_ENTRIES)
+		return -ENOMEM;
+	memset(table[idx], 0, sizeof(table[idx]));
+	set_field(table[idx], 60, 2, ALE_TYPE_ADDR);
+	for (i = 0; i < 6; i++)
+		set_field(table[idx], 40 - 8 * i, 8, addr[i]);
+	set_field(table[idx], 62, 2, ALE_UCAST_TOUCHED);
+	set_field(table[idx], 66, 2, port);
+	return idx;
+}
+
+static void hw_age(int idx)
+{
+	memset(table[idx], 0, sizeof(table[idx]));
+}
+
+#define fail(fmt, ...) do {						\
+	fprintf(stderr, "%s: " fmt "\n", step, ##__VA_ARGS__);		\
+	errors++;							\
+} while (0)
+
+static void check(struct cpsw_ale *ale, const char *step)
+{
+	struct hlist_node *node;
+	u8 a[6], b[6];
+	int idx, j, used = 0, hashed = 0;
+
+	for (idx = 0; idx < ALE_ENTRIES; idx++) {
+		u32 *shadow = ale->shadow + idx * ALE_ENTRY_WORDS;
+
+		if ((!hw_owned(table[idx]) || !hw_owned(shadow)) &&
+		    memcmp(shadow, table[idx], sizeof(table[idx])))
+			fail("slot %d: shadow %08x %08x %08x, table "
+			     "%08x %08x %08x", idx, shadow[0], shadow[1],
+			     shadow[2], table[idx][0], table[idx][1],
+			     table[idx][2]);
+		if (entry_type(shadow) != ALE_TYPE_FREE)
+			used++;
+	}
+	for (j = 0; j < ARRAY_SIZE(ale->shadow_hash); j++)
+		hlist_for_each(node, &ale->shadow_hash[j]) {
+			idx = node - ale->shadow_node;
+			if (entry_type(ale->shadow + idx * ALE_ENTRY_WORDS) ==
+			    ALE_TYPE_FREE)
+				fail("free slot %d is hashed", idx);
+			hashed++;
+		}
+	if (hashed != used)
+		fail("%d slots hashed, %d used", hashed, used);
+
+	for (idx = 0; idx < ALE_ENTRIES; idx++) {
+		if (entry_type(table[idx]) == ALE_TYPE_FREE ||
+		    entry_type(table[idx]) == ALE_TYPE_VLAN)
+			continue;
+		entry_addr(table[idx], a);
+		for (j = idx + 1; j < ALE_ENTRIES; j++) {
+			if (entry_type(table[j]) == ALE_TYPE_FREE ||
+			    entry_type(table[j]) == ALE_TYPE_VLAN ||
+			    get_field(table[j], 48, 12) !=
+			    get_field(table[idx], 48, 12))
+				continue;
+			entry_addr(table[j], b);
+			if (!memcmp(a, b, 6))
+				fail(ADDR_FMT " in slots %d and %d",
+				     ADDR_ARGS(a), idx, j);
+		}
+	}
+}
+
+static void check_lookups(struct cpsw_ale *ale, const char *step)
+{
+	u8 addr[6];
+	int n, idx, want;
+
+	for (n = 0; n < 2 * NR_ADDRS; n++) {
+		if (n < NR_ADDRS)
+			ucast_addr(n, addr);
+		else
+			mcast_addr(n - NR_ADDRS, addr);
+		want = table_find(addr);
+		idx = cpsw_ale_match_addr(ale, addr, 0);
+		if (idx != want)
+			fail(ADDR_FMT " matched %d, table has %d",
+			     ADDR_ARGS(addr), idx, want);
+	}
+}
+
+/* the cases the shadow can't see coming, one at a time */
+static void run_cases(struct cpsw_ale *ale)
+{
+	const char *step;
+	u8 own[6], peer[6], other[6], group[6];
+	int idx, slot;
+
+	ucast_addr(0, own);
+	ucast_addr(1, peer);
+	ucast_addr(2, other);
+	mcast_addr(0, group);
+
+	step = "add own address";
+	if (cpsw_ale_add_ucast(ale, own, 0, 0) ||
+	    cpsw_ale_match_addr(ale, own, 0) != table_find(own))
+		fail("not found");
+	check(ale, step);
+
+	step = "add multicast twice";
+	cpsw_ale_add_mcast(ale, group, 0x1, 0, 3);
+	idx = table_find(group);
+	cpsw_ale_add_mcast(ale, group, 0x4, 0, 3);
+	if (table_find(group) != idx || get_field(table[idx], 66, 3) != 0x5)
+		fail("slot %d, port mask %x", table_find(group),
+		     get_field(table[idx], 66, 3));
+	check(ale, step);
+
+	step = "delete multicast ports";
+	cpsw_ale_del_mcast(ale, group, 0x1);
+	if (get_field(table[idx], 66, 3) != 0x1)
+		fail("port mask %x", get_field(table[idx], 66, 3));
+	cpsw_ale_del_mcast(ale, group, 0);
+	if (table_find(group) >= 0)
+		fail("still in slot %d", table_find(group));
+	check(ale, step);
+
+	step = "add an address the hardware learned";
+	slot = hw_learn(peer, 1);
+	if (cpsw_ale_match_addr(ale, peer, 0) != slot)
+		fail("learned entry in slot %d not found", slot);
+	cpsw_ale_add_ucast(ale, peer, 0, 0);
+	if (table_find(peer) != slot)
+		fail("added to slot %d, learned in %d", table_find(peer),
+		     slot);
+	check(ale, step);
+
+	step = "delete an address aged out and relearned elsewhere";
+	cpsw_ale_del_ucast(ale, peer, 0);
+	slot = hw_learn(peer, 1);
+	cpsw_ale_match_addr(ale, peer, 0);	/* the shadow sees it */
+	hw_age(slot);
+	hw_learn(other, 2);			/* slot reused... */
+	idx = hw_learn(peer, 2);		/* ...peer learned elsewhere */
+	if (cpsw_ale_match_addr(ale, peer, 0) != idx)
+		fail("found in slot %d, table has %d",
+		     cpsw_ale_match_addr(ale, peer, 0), idx);
+	cpsw_ale_del_ucast(ale, peer, 0);
+	if (table_find(peer) >= 0 || entry_type(table[slot]) == ALE_TYPE_FREE)
+		fail("slot %d freed instead of %d", slot, idx);
+	check(ale, step);
+
+	step = "delete an address aged out";
+	slot = hw_learn(peer, 1);
+	cpsw_ale_match_addr(ale, peer, 0);
+	hw_age(slot);
+	if (cpsw_ale_del_ucast(ale, peer, 0) != -ENOENT)
+		fail("deleted");
+	check(ale, step);
+	check_lookups(ale, step);
+}
+
+static void run_random(struct cpsw_ale *ale, unsigned int steps)
+{
+	const char *step = "random";
+	unsigned int n;
+	u8 addr[6];
+	int idx;
+
+	for (n = 0; n < steps; n++) {
+		switch (rand() % 6) {
+		case 0:
+			ucast_addr(rand() % NR_ADDRS, addr);
+			if (cpsw_ale_add_ucast(ale, addr, rand() % 3, 0))
+				fail("add_ucast failed");
+			break;
+		case 1:
+			ucast_addr(rand() % NR_ADDRS, addr);
+			idx = table_find(addr);
+			if (cpsw_ale_del_ucast(ale, addr, 0) !=
+			    (idx < 0 ? -ENOENT : 0))
+				fail("del_ucast with the address in slot %d",
+				     idx);
+			break;
+		case 2:
+			mcast_addr(rand() % NR_ADDRS, addr);
+			if (cpsw_ale_add_mcast(ale, addr, 1 + rand() % 7, 0,
+					       3))
+				fail("add_mcast failed");
+			break;
+		case 3:
+			mcast_addr(rand() % NR_ADDRS, addr);
+			cpsw_ale_del_mcast(ale, addr, rand() % 2 ?
+					   1 + rand() % 7 : 0);
+			break;
+		case 4:
+			ucast_addr(rand() % NR_ADDRS, addr);
+			if (table_find(addr) < 0)
+				hw_learn(addr, 1 + rand() % 2);
+			break;
+		case 5:
+			idx = rand() % ALE_ENTRIES;
+			if (entry_type(table[idx]) != ALE_TYPE_FREE &&
+			    hw_owned(table[idx]))
+				hw_age(idx);
+			break;
+		}
+		check(ale, step);
+		if (n % 16 == 0)
+			check_lookups(ale, step);
+		if (errors > 10)
+			return;
+	}
+}
+
+/* table reads of one lookup */
+static unsigned long lookup_reads(struct cpsw_ale *ale, const u8 *addr)
+{
+	table_reads = 0;
+	cpsw_ale_match_addr(ale, (u8 *)addr, 0);
+	return table_reads;
+}
+
+static void report_reads(struct cpsw_ale *ale)
+{
+	u8 own[6], peer[6], group[6], absent[6];
+	int used = 0, idx;
+
+	for (idx = 0; idx < ALE_ENTRIES; idx++)
+		if (!hw_owned(table[idx]))
+			used++;
+
+	ucast_addr(NR_ADDRS + 1, own);
+	ucast_addr(NR_ADDRS + 2, peer);
+	ucast_addr(NR_ADDRS + 3, absent);
+	mcast_addr(NR_ADDRS + 1, group);
+	cpsw_ale_add_ucast(ale, own, 0, 0);
+	cpsw_ale_add_mcast(ale, group, 0x7, 0, 3);
+	hw_learn(peer, 1);
+	cpsw_ale_match_addr(ale, peer, 0);
+
+	printf("table reads per lookup, %d of %d slots written by the "
+	       "driver:\n", used + 2, ALE_ENTRIES);
+	printf("  multicast hit      %4lu\n", lookup_reads(ale, group));
+	printf("  own unicast hit    %4lu\n", lookup_reads(ale, own));
+	printf("  learned unicast    %4lu\n", lookup_reads(ale, peer));
+	printf("  unicast miss       %4lu\n", lookup_reads(ale, absent));
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: cpsw_ale_test [-n steps] [-s seed]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct cpsw_ale_params params = {
+		.ale_regs	= regs,
+		.ale_entries	= ALE_ENTRIES,
+		.ale_ports	= 3,
+		.table_ops	= &fake_ops,
+	};
+	struct cpsw_ale *ale;
+	unsigned int steps = 20000, seed = 1;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			steps = atoi(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	srand(seed);
+
+	ale = cpsw_ale_create(&params);
+	if (!ale)
+		return 1;
+	cpsw_ale_start(ale);
+
+	run_cases(ale);
+	run_random(ale, steps);
+	report_reads(ale);
+
+	cpsw_ale_destroy(ale);
+	if (errors) {
+		fprintf(stderr, "%d errors\n", errors);
+		return 1;
+	}
+	printf("%u random steps, shadow consistent\n", steps);
+	return 0;
+}
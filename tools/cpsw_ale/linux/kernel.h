@@ -0,0 +1,179 @@
+#ifndef LINUX_KERNEL_H
+#define LINUX_KERNEL_H
+
+/*
+ * Just enough of the kernel to run cpsw_ale in a single userspace thread:
+ * the ALE registers are plain memory, the table is reached through the
+ * table_ops the test plugs in, locks only record that they are held and
+ * there is no sysfs and no timer.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+
+#define __iomem
+
+#define BIT(nr)			(1UL << (nr))
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define SZ_4K			0x1000
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define WARN_ON(cond)		({ int __c = !!(cond); \
+				   if (__c) fprintf(stderr, "WARN_ON(%s)\n", \
+						    #cond); \
+				   __c; })
+
+#define dev_dbg(dev, fmt, ...) \
+	do { if (0) printf(fmt, ##__VA_ARGS__); } while (0)
+
+#define EXPORT_SYMBOL_GPL(sym)
+#define MODULE_AUTHOR(s)
+#define MODULE_LICENSE(s)
+#define MODULE_DESCRIPTION(s)
+
+#define simple_strtoul		strtoul
+
+/* slab */
+#define GFP_KERNEL		0u
+
+static inline void *kzalloc(size_t size, unsigned int flags)
+{
+	return calloc(1, size);
+}
+
+static inline void *kcalloc(size_t n, size_t size, unsigned int flags)
+{
+	return calloc(n, size);
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+/* registers */
+#define __raw_readl(addr)	(*(volatile u32 *)(addr))
+#define __raw_writel(v, addr)	(*(volatile u32 *)(addr) = (v))
+
+/* locks */
+typedef struct {
+	int locked;
+} spinlock_t;
+
+#define spin_lock_init(l)	((l)->locked = 0)
+#define spin_lock_irqsave(l, f) \
+	do { (void)(f); assert(!(l)->locked); (l)->locked = 1; } while (0)
+#define spin_unlock_irqrestore(l, f) \
+	do { (void)(f); assert((l)->locked); (l)->locked = 0; } while (0)
+
+/* hlist */
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+
+#define INIT_HLIST_NODE(n)	((n)->next = NULL, (n)->pprev = NULL)
+
+static inline void hlist_del_init(struct hlist_node *n)
+{
+	if (!n->pprev)
+		return;
+	*n->pprev = n->next;
+	if (n->next)
+		n->next->pprev = n->pprev;
+	INIT_HLIST_NODE(n);
+}
+
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	n->next = h->first;
+	if (h->first)
+		h->first->pprev = &n->next;
+	h->first = n;
+	n->pprev = &h->first;
+}
+
+#define hlist_for_each(pos, head) \
+	for ((pos) = (head)->first; (pos); (pos) = (pos)->next)
+
+/* linux/hash.h, GOLDEN_RATIO_PRIME_64 */
+static inline u64 hash_64(u64 val, unsigned int bits)
+{
+	return (val * 0x9e37fffffffc0001ULL) >> (64 - bits);
+}
+
+/* etherdevice */
+static inline bool is_multicast_ether_addr(const u8 *addr)
+{
+	return addr[0] & 1;
+}
+
+static inline bool is_broadcast_ether_addr(const u8 *addr)
+{
+	return (addr[0] & addr[1] & addr[2] & addr[3] & addr[4] &
+		addr[5]) == 0xff;
+}
+
+/* timer, never fires here */
+#define HZ			100
+#define jiffies			0UL
+
+struct timer_list {
+	void (*function)(unsigned long data);
+	unsigned long data;
+	unsigned long expires;
+};
+
+#define init_timer(t)		do { } while (0)
+#define add_timer(t)		do { } while (0)
+#define del_timer_sync(t)	do { } while (0)
+
+/* sysfs, not created */
+struct device;
+
+struct attribute {
+	const char *name;
+	unsigned short mode;
+};
+
+struct device_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct device *dev, struct device_attribute *attr,
+			char *buf);
+	ssize_t (*store)(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count);
+};
+
+#define S_IWUSR			0200
+#define S_IRUGO			0444
+
+#define DEVICE_ATTR(_name, _mode, _show, _store) \
+	struct device_attribute dev_attr_##_name = { \
+		.attr = { .name = #_name, .mode = _mode }, \
+		.show = _show, \
+		.store = _store, \
+	}
+
+#define sysfs_attr_init(attr)		do { } while (0)
+#define device_create_file(dev, attr)	0
+#define device_remove_file(dev, attr)	do { } while (0)
+
+#endif
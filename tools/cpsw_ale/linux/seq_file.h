@@ -0,0 +1,2 @@
+/* everything is in linux/kernel.h */
+#include <linux/kernel.h>
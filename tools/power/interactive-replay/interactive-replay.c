@@ -0,0 +1,450 @@
+/*
+ * interactive-replay -- replay a CPU load trace through the interactive
+ * cpufreq governor, in its default and in its energy_aware mode, and
+ * compare energy and delayed work.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * The trace holds one "busy_percent freq_khz" line per timer_rate sample,
+ * as written by record.sh on the device; lines starting with '#' are
+ * ignored.  Each line is turned into the work that was done in the sample,
+ * busy_percent * freq_khz.  That work is then fed to a simulated CPU whose
+ * speed the governor picks, work that does not fit in a sample is carried
+ * over to the next one.  Without a trace file, built-in synthetic traces
+ * are replayed.
+ *
+ * drivers/cpufreq/cpufreq_interactive.c and freq_table.c are built as they
+ * are against the headers in linux/.  This program plays the cpufreq
+ * driver and the idle loop: it keeps the clock and the idle time, sends
+ * the idle notifications, fires the governor's timer at the end of each
+ * sample and sets the tunables through the governor's sysfs group.  There
+ * is a single cpu and no boost.
+ *
+ * Energy is counted as in the governor's energy model, V^2 * f while busy;
+ * idle power is taken as zero.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/kernel.h>
+
+int init_module(void);
+void cleanup_module(void);
+
+#define MAX_OPPS	16
+
+struct opp {
+	unsigned int freq;	/* kHz */
+	unsigned int volt;	/* mV */
+	unsigned int power;	/* as in the governor's opp_power */
+};
+
+/* AM335x OPP50, OPP100, OPP120, Turbo and Nitro */
+static struct opp opps[MAX_OPPS] = {
+	{ 300000, 950 }, { 600000, 1100 }, { 720000, 1200 },
+	{ 800000, 1260 }, { 1000000, 1325 },
+};
+static int nr_opps = 5;
+
+static struct cpufreq_frequency_table freq_table[MAX_OPPS + 1];
+static struct cpufreq_policy policy;
+
+/* tunables, written to the governor's sysfs group when it starts */
+static struct {
+	const char *name;
+	unsigned long val;
+} tunables[] = {
+	{ "timer_rate", 20 * USEC_PER_MSEC },
+	{ "go_hispeed_load", 95 },
+	{ "target_load", 80 },
+	{ "load_window", 4 },
+	{ "energy_aware", 0 },
+};
+
+#define TUNABLE_TIMER_RATE	0
+#define TUNABLE_GO_HISPEED_LOAD	1
+#define TUNABLE_TARGET_LOAD	2
+#define TUNABLE_LOAD_WINDOW	3
+#define TUNABLE_ENERGY_AWARE	4
+
+static unsigned int timer_rate = 20;		/* ms */
+
+/* the kernel side of linux/kernel.h */
+u64 replay_now_us;
+struct timer_list *replay_timer;
+struct workqueue_struct replay_wq;
+struct notifier_block *replay_idle_nb;
+struct kobject *cpufreq_global_kobject;
+const struct attribute_group *replay_attr_group;
+struct cpufreq_governor *replay_governor;
+
+static u64 idle_us;
+
+struct sim {
+	const char *name;
+	int idling;
+	double backlog;			/* kHz * ms of work carried over */
+
+	/* results */
+	double energy;
+	double busy_ms;
+	double freq_ms;			/* sum of cur * busy ms */
+	double delayed;			/* kHz * ms summed over samples */
+	unsigned int late_samples;
+	unsigned int changes;
+	unsigned int samples;
+};
+
+static struct sim *running;
+
+u64 get_cpu_idle_time_us(int cpu, u64 *wall)
+{
+	*wall = replay_now_us;
+	return idle_us;
+}
+
+int __cpufreq_driver_target(struct cpufreq_policy *policy,
+			    unsigned int target_freq, unsigned int relation)
+{
+	unsigned int index;
+
+	if (cpufreq_frequency_table_target(policy, freq_table, target_freq,
+					   relation, &index))
+		return -EINVAL;
+	if (freq_table[index].frequency != policy->cur) {
+		policy->cur = freq_table[index].frequency;
+		running->changes++;
+	}
+	return 0;
+}
+
+struct opp *opp_find_freq_exact(struct device *dev, unsigned long freq,
+				bool available)
+{
+	int i;
+
+	for (i = 0; i < nr_opps; i++)
+		if (opps[i].freq * 1000UL == freq)
+			return &opps[i];
+	return ERR_PTR(-ERANGE);
+}
+
+unsigned long opp_get_voltage(struct opp *opp)
+{
+	return opp->volt * 1000UL;
+}
+
+static struct opp *opp_of(unsigned int freq)
+{
+	int i;
+
+	for (i = 0; i < nr_opps; i++)
+		if (opps[i].freq == freq)
+			return &opps[i];
+	return &opps[nr_opps - 1];
+}
+
+static struct global_attr *tunable_attr(const char *name)
+{
+	struct attribute **attr;
+
+	for (attr = replay_attr_group->attrs; *attr; attr++)
+		if (!strcmp((*attr)->name, name))
+			return container_of(*attr, struct global_attr, attr);
+	return NULL;
+}
+
+static int set_tunables(void)
+{
+	struct global_attr *ga;
+	char buf[32];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(tunables) / sizeof(tunables[0]); i++) {
+		ga = tunable_attr(tunables[i].name);
+		snprintf(buf, sizeof(buf), "%lu\n", tunables[i].val);
+		if (!ga || ga->store(cpufreq_global_kobject, &ga->attr, buf,
+				     strlen(buf)) < 0) {
+			fprintf(stderr, "%s: bad value %lu\n",
+				tunables[i].name, tunables[i].val);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* the energy model the governor built, "freq volt capacity power" lines */
+static void read_opp_power(void)
+{
+	static char buf[PAGE_SIZE];
+	struct global_attr *ga = tunable_attr("opp_power");
+	unsigned int freq, volt, capacity, power;
+	char *line;
+
+	ga->show(cpufreq_global_kobject, &ga->attr, buf);
+	for (line = strtok(buf, "\n"); line; line = strtok(NULL, "\n"))
+		if (sscanf(line, "%u %u %u %u", &freq, &volt, &capacity,
+			   &power) == 4)
+			opp_of(freq)->power = power;
+}
+
+static void idle_notify(unsigned long val)
+{
+	replay_idle_nb->notifier_call(replay_idle_nb, val, NULL);
+}
+
+/* run one sample with 'work' kHz * ms of new work */
+static void sim_sample(struct sim *s, double work)
+{
+	unsigned int cur = policy.cur;
+	double capacity = (double)cur * timer_rate;
+	double todo = s->backlog + work;
+	double done = todo < capacity ? todo : capacity;
+	u64 start = replay_now_us, end = start + timer_rate * 1000;
+
+	s->busy_ms += done / cur;
+	s->freq_ms += done;
+	s->energy += opp_of(cur)->power * (done / cur) / 1000.0;
+	s->backlog = todo - done;
+	if (s->backlog > 0.5) {
+		s->late_samples++;
+		s->delayed += s->backlog;
+	}
+	s->samples++;
+
+	/* busy first, then idle for the rest of the sample */
+	if (todo > 0 && s->idling) {
+		idle_notify(IDLE_END);
+		s->idling = 0;
+	}
+	replay_now_us = start + (u64)(done / cur * 1000 + 0.5);
+	if (replay_now_us < end) {
+		idle_notify(IDLE_START);
+		s->idling = 1;
+		idle_us += end - replay_now_us;
+		replay_now_us = end;
+	}
+
+	if (replay_timer->pending && jiffies >= replay_timer->expires) {
+		replay_timer->pending = 0;
+		replay_timer->function(replay_timer->data);
+	}
+}
+
+static void sim_start(struct sim *s, const char *name, int energy_aware)
+{
+	memset(s, 0, sizeof(*s));
+	s->name = name;
+	s->idling = 1;
+	running = s;
+
+	policy.cur = policy.min;
+	replay_governor->governor(&policy, CPUFREQ_GOV_START);
+	tunables[TUNABLE_ENERGY_AWARE].val = energy_aware;
+	if (set_tunables())
+		exit(1);
+	read_opp_power();
+}
+
+static void sim_stop(struct sim *s)
+{
+	replay_governor->governor(&policy, CPUFREQ_GOV_STOP);
+}
+
+static void sim_report(const char *trace, struct sim *s)
+{
+	printf("%-12s %-8s %10.1f %9.0f %8.1f %9u %10.1f %8u\n",
+	       trace, s->name, s->energy,
+	       s->busy_ms ? s->freq_ms / s->busy_ms / 1000 : 0,
+	       100.0 * s->late_samples / s->samples, s->changes,
+	       s->delayed / policy.max, s->samples);
+}
+
+/* synthetic traces, work per sample in kHz * ms */
+static double synth_work(const char *name, unsigned int n)
+{
+	double fmax_sample = (double)policy.max * timer_rate;
+
+	if (!strcmp(name, "idle"))
+		/* a 2% background with a 60% burst every 5s */
+		return fmax_sample * (n % 250 == 0 ? 0.60 : 0.02);
+	if (!strcmp(name, "video"))
+		/* 30fps decode, 11ms at 1GHz per 33ms frame */
+		return fmax_sample * (11.0 / 33.0) *
+			(0.9 + 0.2 * ((n * 7919) % 100) / 100.0);
+	if (!strcmp(name, "browse"))
+		/* 1s of 70% rendering every 4s, light load in between */
+		return fmax_sample * ((n % 200) < 50 ? 0.70 : 0.05);
+	if (!strcmp(name, "bulk"))
+		/* a long CPU bound job */
+		return fmax_sample;
+	if (!strcmp(name, "ramp"))
+		/* load rising from 0 to 100% and back over 20s */
+		return fmax_sample * ((n % 1000) < 500 ? (n % 1000) / 500.0 :
+				      (1000 - n % 1000) / 500.0);
+	return -1;
+}
+
+static const char *synth_names[] = { "idle", "video", "browse", "bulk",
+				     "ramp" };
+
+static void replay_synth(const char *name, unsigned int seconds)
+{
+	static const char *modes[] = { "default", "energy" };
+	struct sim s;
+	unsigned int n, samples = seconds * 1000 / timer_rate;
+	int ea;
+
+	for (ea = 0; ea < 2; ea++) {
+		sim_start(&s, modes[ea], ea);
+		for (n = 0; n < samples; n++)
+			sim_sample(&s, synth_work(name, n));
+		sim_stop(&s);
+		sim_report(name, &s);
+	}
+}
+
+static int replay_file(const char *path)
+{
+	static const char *modes[] = { "default", "energy" };
+	struct sim s;
+	char line[128];
+	unsigned int busy, freq;
+	const char *name;
+	FILE *f;
+	int ea;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+
+	for (ea = 0; ea < 2; ea++) {
+		rewind(f);
+		sim_start(&s, modes[ea], ea);
+		while (fgets(line, sizeof(line), f)) {
+			if (line[0] == '#')
+				continue;
+			if (sscanf(line, "%u %u", &busy, &freq) != 2 ||
+			    busy > 100)
+				continue;
+			sim_sample(&s, (double)freq * timer_rate * busy / 100);
+		}
+		sim_stop(&s);
+		sim_report(name, &s);
+	}
+	fclose(f);
+	return 0;
+}
+
+/* "freq_khz volt_mv" lines */
+static int read_opps(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[128];
+
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	nr_opps = 0;
+	while (fgets(line, sizeof(line), f) && nr_opps < MAX_OPPS) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%u %u", &opps[nr_opps].freq,
+			   &opps[nr_opps].volt) == 2)
+			nr_opps++;
+	}
+	fclose(f);
+	if (!nr_opps) {
+		fprintf(stderr, "%s: no OPPs\n", path);
+		return 1;
+	}
+	return 0;
+}
+
+/* what a cpufreq driver's init does for its policy */
+static int driver_init(void)
+{
+	int i;
+
+	for (i = 0; i < nr_opps; i++) {
+		freq_table[i].index = i;
+		freq_table[i].frequency = opps[i].freq;
+	}
+	freq_table[i].frequency = CPUFREQ_TABLE_END;
+
+	cpumask_set_cpu(0, policy.cpus);
+	if (cpufreq_frequency_table_cpuinfo(&policy, freq_table))
+		return -1;
+	cpufreq_frequency_table_get_attr(freq_table, 0);
+	/* any device will do, the OPPs are looked up in opps[] */
+	cpufreq_frequency_table_set_opp_dev((struct device *)opps, 0);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: interactive-replay [-o opps] [-t target_load] "
+		"[-w load_window]\n"
+		"                          [-g go_hispeed_load] "
+		"[-s seconds] [trace...]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int seconds = 60;
+	int c, i, ret = 0;
+
+	while ((c = getopt(argc, argv, "o:t:w:g:s:")) != -1) {
+		switch (c) {
+		case 'o':
+			if (read_opps(optarg))
+				return 1;
+			break;
+		case 't':
+			tunables[TUNABLE_TARGET_LOAD].val = atoi(optarg);
+			break;
+		case 'w':
+			tunables[TUNABLE_LOAD_WINDOW].val = atoi(optarg);
+			break;
+		case 'g':
+			tunables[TUNABLE_GO_HISPEED_LOAD].val = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (!seconds)
+		usage();
+	tunables[TUNABLE_TIMER_RATE].val = timer_rate * USEC_PER_MSEC;
+
+	if (driver_init() || init_module())
+		return 1;
+
+	printf("%-12s %-8s %10s %9s %8s %9s %10s %8s\n", "trace", "mode",
+	       "energy", "avg_mhz", "late_%", "changes", "delayed_ms",
+	       "samples");
+	if (optind == argc)
+		for (i = 0; i < (int)(sizeof(synth_names) /
+				      sizeof(synth_names[0])); i++)
+			replay_synth(synth_names[i], seconds);
+	for (i = optind; i < argc; i++)
+		ret |= replay_file(argv[i]);
+
+	cleanup_module();
+	return ret;
+}
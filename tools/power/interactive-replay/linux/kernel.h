@@ -0,0 +1,386 @@
+#ifndef LINUX_KERNEL_H
+#define LINUX_KERNEL_H
+
+/*
+ * Just enough of the kernel to run the interactive governor in a single
+ * userspace thread on one cpu.  interactive-replay.c owns the clock, the
+ * idle time and the frequency table, and drives the governor through the
+ * hooks it registers: the per-cpu timer, the idle notifier, the sysfs
+ * group and the governor callback.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef unsigned int gfp_t;
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min_t(type, x, y)	((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+#define max_t(type, x, y)	((type)(x) > (type)(y) ? (type)(x) : (type)(y))
+#define div_u64(n, d)		((u64)(n) / (d))
+
+#define MAX_ERRNO		4095
+#define IS_ERR(p)		((unsigned long)(p) >= (unsigned long)-MAX_ERRNO)
+#define PTR_ERR(p)		((long)(p))
+#define ERR_PTR(e)		((void *)(long)(e))
+
+#define pr_debug(fmt, ...)	do { if (0) printf(fmt, ##__VA_ARGS__); } while (0)
+#define pr_warn(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_warn_once(fmt, ...)	pr_warn(fmt, ##__VA_ARGS__)
+
+#define __init
+#define __exit
+#define THIS_MODULE		NULL
+#define EXPORT_SYMBOL_GPL(sym)
+#define MODULE_AUTHOR(s)
+#define MODULE_LICENSE(s)
+#define MODULE_DESCRIPTION(s)
+#define module_init(fn)		int init_module(void) __attribute__((alias(#fn)))
+#define module_exit(fn)		void cleanup_module(void) __attribute__((alias(#fn)))
+
+#define PAGE_SIZE		4096UL
+
+static inline int strict_strtoull(const char *s, unsigned int base,
+				  unsigned long long *res)
+{
+	char *end;
+
+	errno = 0;
+	*res = strtoull(s, &end, base);
+	if (errno || end == s || (*end && strcmp(end, "\n")))
+		return -EINVAL;
+	return 0;
+}
+
+static inline int strict_strtoul(const char *s, unsigned int base,
+				 unsigned long *res)
+{
+	unsigned long long v;
+	int ret = strict_strtoull(s, base, &v);
+
+	*res = v;
+	return ret;
+}
+
+/* slab */
+#define GFP_KERNEL		0u
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+	return calloc(1, size);
+}
+
+static inline void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+	return calloc(n, size);
+}
+
+static inline void *kmemdup(const void *src, size_t len, gfp_t flags)
+{
+	void *p = malloc(len);
+
+	if (p)
+		memcpy(p, src, len);
+	return p;
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+/* one cpu */
+typedef struct cpumask {
+	unsigned long bits;
+} cpumask_t;
+
+#define cpumask_set_cpu(cpu, m)		((m)->bits |= 1UL << (cpu))
+#define cpumask_clear(m)		((m)->bits = 0)
+#define cpumask_empty(m)		(!(m)->bits)
+#define for_each_cpu(cpu, m) \
+	for ((cpu) = 0; (cpu) < 1; (cpu)++) \
+		if (!((m)->bits & (1UL << (cpu)))) {} else
+#define for_each_possible_cpu(cpu)	for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define for_each_online_cpu(cpu)	for_each_possible_cpu(cpu)
+#define cpu_online(cpu)			((cpu) == 0)
+#define smp_processor_id()		0
+
+#define DEFINE_PER_CPU(type, name)	__typeof__(type) name
+#define per_cpu(var, cpu)		(*((void)(cpu), &(var)))
+
+#define smp_rmb()			do { } while (0)
+#define smp_wmb()			do { } while (0)
+
+typedef struct {
+	int counter;
+} atomic_t;
+
+#define ATOMIC_INIT(i)			{ (i) }
+#define atomic_inc_return(v)		(++(v)->counter)
+#define atomic_dec_return(v)		(--(v)->counter)
+
+/* locks, nothing runs concurrently */
+typedef struct {
+	int locked;
+} spinlock_t;
+
+struct mutex {
+	int locked;
+};
+
+#define spin_lock_init(l)		((l)->locked = 0)
+#define spin_lock_irqsave(l, f)		((void)(f), (l)->locked = 1)
+#define spin_unlock_irqrestore(l, f)	((void)(f), (l)->locked = 0)
+#define mutex_init(m)			((m)->locked = 0)
+#define mutex_lock(m)			((m)->locked = 1)
+#define mutex_unlock(m)			((m)->locked = 0)
+
+#define rcu_read_lock()			do { } while (0)
+#define rcu_read_unlock()		do { } while (0)
+
+/* time, the replay clock in usecs */
+extern u64 replay_now_us;
+
+#define USEC_PER_MSEC			1000L
+#define HZ				100
+#define jiffies				(replay_now_us / (1000000 / HZ))
+#define get_jiffies_64()		jiffies
+#define usecs_to_jiffies(us)		((us) / (1000000 / HZ))
+#define jiffies_64_to_clock_t(j)	(j)
+#define ktime_get()			replay_now_us
+#define ktime_to_us(t)			(t)
+#define cputime64_sub(a, b)		((a) - (b))
+
+u64 get_cpu_idle_time_us(int cpu, u64 *wall);
+
+/* the governor has one timer, the replay fires it */
+struct timer_list {
+	void (*function)(unsigned long data);
+	unsigned long data;
+	unsigned long expires;
+	int pending;
+};
+
+extern struct timer_list *replay_timer;
+
+#define init_timer(t)		((t)->pending = 0, replay_timer = (t))
+#define mod_timer(t, e)		((t)->expires = (e), (t)->pending = 1)
+#define timer_pending(t)	((t)->pending)
+#define del_timer(t)		((t)->pending = 0)
+#define del_timer_sync(t)	del_timer(t)
+
+/*
+ * There is no other thread to hand work to: queued work runs at once, and
+ * waking the up task runs one pass of its loop, kthread_should_stop()
+ * ending it as soon as there is nothing left to do.
+ */
+struct work_struct {
+	void (*func)(struct work_struct *work);
+};
+
+struct workqueue_struct {
+	int dummy;
+};
+
+extern struct workqueue_struct replay_wq;
+
+#define INIT_WORK(w, f)			((w)->func = (f))
+#define alloc_workqueue(n, f, a)	(&replay_wq)
+#define destroy_workqueue(wq)		do { } while (0)
+#define flush_work(w)			do { } while (0)
+
+static inline int queue_work(struct workqueue_struct *wq,
+			     struct work_struct *work)
+{
+	work->func(work);
+	return 1;
+}
+
+struct task_struct {
+	int (*fn)(void *data);
+	void *data;
+};
+
+struct sched_param {
+	int sched_priority;
+};
+
+#define MAX_RT_PRIO			100
+#define SCHED_FIFO			1
+#define TASK_RUNNING			0
+#define TASK_INTERRUPTIBLE		1
+
+static inline struct task_struct *kthread_create(int (*fn)(void *data),
+		void *data, const char *name)
+{
+	struct task_struct *t = malloc(sizeof(*t));
+
+	if (!t)
+		return ERR_PTR(-ENOMEM);
+	t->fn = fn;
+	t->data = data;
+	return t;
+}
+
+#define wake_up_process(t)		((t)->fn((t)->data))
+#define kthread_should_stop()		1
+#define set_current_state(s)		do { } while (0)
+#define schedule()			do { } while (0)
+#define get_task_struct(t)		do { } while (0)
+#define put_task_struct(t)		free(t)
+
+static inline int kthread_stop(struct task_struct *t)
+{
+	return 0;
+}
+
+static inline int sched_setscheduler_nocheck(struct task_struct *t,
+		int policy, const struct sched_param *param)
+{
+	return 0;
+}
+
+/* idle notifier */
+struct notifier_block {
+	int (*notifier_call)(struct notifier_block *nb, unsigned long val,
+			     void *data);
+};
+
+#define IDLE_START			1
+#define IDLE_END			2
+
+extern struct notifier_block *replay_idle_nb;
+
+#define idle_notifier_register(nb)	(replay_idle_nb = (nb))
+
+/* sysfs, the replay sets the tunables through the group */
+struct kobject {
+	int dummy;
+};
+
+struct attribute {
+	const char *name;
+	unsigned short mode;
+};
+
+struct attribute_group {
+	const char *name;
+	struct attribute **attrs;
+};
+
+struct global_attr {
+	struct attribute attr;
+	ssize_t (*show)(struct kobject *kobj, struct attribute *attr,
+			char *buf);
+	ssize_t (*store)(struct kobject *kobj, struct attribute *attr,
+			 const char *buf, size_t count);
+};
+
+#define __ATTR(_name, _mode, _show, _store) {				\
+	.attr = { .name = #_name, .mode = _mode },			\
+	.show = _show,							\
+	.store = _store,						\
+}
+
+extern struct kobject *cpufreq_global_kobject;
+extern const struct attribute_group *replay_attr_group;
+
+#define sysfs_create_group(k, g)	(replay_attr_group = (g), 0)
+#define sysfs_remove_group(k, g)	(replay_attr_group = NULL)
+
+/* cpufreq, the replay is the driver */
+#define CPUFREQ_ENTRY_INVALID		~0
+#define CPUFREQ_TABLE_END		~1
+#define CPUFREQ_RELATION_L		0
+#define CPUFREQ_RELATION_H		1
+#define CPUFREQ_GOV_START		1
+#define CPUFREQ_GOV_STOP		2
+#define CPUFREQ_GOV_LIMITS		3
+
+struct cpufreq_frequency_table {
+	unsigned int index;
+	unsigned int frequency;
+};
+
+struct cpufreq_cpuinfo {
+	unsigned int max_freq;
+	unsigned int min_freq;
+};
+
+struct cpufreq_policy {
+	cpumask_t cpus[1];
+	unsigned int cpu;
+	struct cpufreq_cpuinfo cpuinfo;
+	unsigned int min;
+	unsigned int max;
+	unsigned int cur;
+};
+
+struct freq_attr {
+	struct attribute attr;
+	ssize_t (*show)(struct cpufreq_policy *policy, char *buf);
+	ssize_t (*store)(struct cpufreq_policy *policy, const char *buf,
+			 size_t count);
+};
+
+struct cpufreq_governor {
+	char name[16];
+	int (*governor)(struct cpufreq_policy *policy, unsigned int event);
+	unsigned int max_transition_latency;
+	void *owner;
+};
+
+extern struct cpufreq_governor *replay_governor;
+
+#define cpufreq_register_governor(g)	(replay_governor = (g), 0)
+#define cpufreq_unregister_governor(g)	(replay_governor = NULL)
+
+static inline void cpufreq_verify_within_limits(struct cpufreq_policy *policy,
+		unsigned int min, unsigned int max)
+{
+	if (policy->min < min)
+		policy->min = min;
+	if (policy->max < min)
+		policy->max = min;
+	if (policy->min > max)
+		policy->min = max;
+	if (policy->max > max)
+		policy->max = max;
+}
+
+int __cpufreq_driver_target(struct cpufreq_policy *policy,
+			    unsigned int target_freq, unsigned int relation);
+
+/* drivers/cpufreq/freq_table.c */
+int cpufreq_frequency_table_cpuinfo(struct cpufreq_policy *policy,
+				    struct cpufreq_frequency_table *table);
+int cpufreq_frequency_table_target(struct cpufreq_policy *policy,
+				   struct cpufreq_frequency_table *table,
+				   unsigned int target_freq,
+				   unsigned int relation, unsigned int *index);
+void cpufreq_frequency_table_get_attr(struct cpufreq_frequency_table *table,
+				      unsigned int cpu);
+struct cpufreq_frequency_table *cpufreq_frequency_get_table(unsigned int cpu);
+
+/* OPPs, the replay's opps[] */
+struct device;
+struct opp;
+
+void cpufreq_frequency_table_set_opp_dev(struct device *dev,
+					 unsigned int cpu);
+struct device *cpufreq_frequency_get_opp_dev(unsigned int cpu);
+struct opp *opp_find_freq_exact(struct device *dev, unsigned long freq,
+				bool available);
+unsigned long opp_get_voltage(struct opp *opp);
+
+#endif
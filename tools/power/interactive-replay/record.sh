@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+# Record a load trace for interactive-replay on the device: one
+# "busy_percent freq_khz" line per sample of cpu0, every 20ms by default.
+#
+# usage: record.sh seconds [interval_ms] > trace
+
+seconds=${1:?usage: record.sh seconds [interval_ms]}
+interval=${2:-20}
+freq=/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq
+samples=$((seconds * 1000 / interval))
+sleep=$(printf "0.%03d" $interval)
+
+echo "# interactive-replay trace, ${interval}ms samples"
+set -- $(grep '^cpu0 ' /proc/stat)
+prev_idle=$5
+prev_total=$(($2 + $3 + $4 + $5 + $6 + $7 + $8))
+while [ $samples -gt 0 ]; do
+	sleep $sleep
+	set -- $(grep '^cpu0 ' /proc/stat)
+	idle=$5
+	total=$(($2 + $3 + $4 + $5 + $6 + $7 + $8))
+	if [ $total -gt $prev_total ]; then
+		busy=$((100 - 100 * (idle - prev_idle) / (total - prev_total)))
+		echo "$busy $(cat $freq)"
+	fi
+	prev_idle=$idle
+	prev_total=$total
+	samples=$((samples - 1))
+done
@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# Measure the CPU cost of cpsw receive and transmit with netperf.
+#
+# Run on the board, with netserver running on a peer on the other end of
+# the cable.  TCP_MAERTS has the peer send to the board, which is what
+# the rx path changes are about; TCP_STREAM is the transmit direction.
+# CPU time is taken from /proc/stat on the board while each test runs.
+# The result is reported as CPU percent per Mbit/s, so runs that were
+# link bound can be compared with runs that were CPU bound.
+#
+# When the knobs are there, the receive test is repeated with GRO off
+# (needs ethtool) and with rx_copybreak at 0, to show what each part
+# brings.  For the old driver, which has neither, only the default line
+# is printed.  Compare the output of the old and the new kernel.
+#
+# usage: netperf.sh peer [seconds] [iface]
+
+peer=${1:?usage: netperf.sh peer [seconds] [iface]}
+seconds=${2:-30}
+iface=${3:-eth0}
+copybreak=/sys/module/cpsw/parameters/rx_copybreak
+
+# busy and total jiffies of all cpus
+cpu_time()
+{
+	set -- $(grep '^cpu ' /proc/stat)
+	echo $(($2 + $3 + $4 + $7 + $8)) $(($2 + $3 + $4 + $5 + $6 + $7 + $8))
+}
+
+# run label test
+run()
+{
+	local label=$1 test=$2 b0 t0 b1 t1 mbit cpu
+
+	set -- $(cpu_time)
+	b0=$1 t0=$2
+	mbit=$(netperf -H $peer -t $test -l $seconds -f m -P 0 |
+	       awk 'NF { v = $NF } END { print v }')
+	set -- $(cpu_time)
+	b1=$1 t1=$2
+
+	if [ -z "$mbit" ]; then
+		echo "$label: netperf $test to $peer failed" >&2
+		return
+	fi
+	cpu=$(awk "BEGIN { print 100 * ($b1 - $b0) / ($t1 - $t0) }")
+	awk "BEGIN { printf \"%-16s %-10s %9.1f %6.1f %12.3f\\n\", \
+		\"$label\", \"$test\", $mbit, $cpu, $cpu / $mbit }"
+}
+
+command -v netperf > /dev/null || { echo "netperf not found" >&2; exit 1; }
+
+echo "$(uname -r), $iface to $peer, ${seconds}s per test"
+printf "%-16s %-10s %9s %6s %12s\n" config test Mbit/s cpu% cpu%/Mbit/s
+
+run default TCP_MAERTS
+run default TCP_STREAM
+
+if command -v ethtool > /dev/null &&
+   ethtool -k $iface 2>/dev/null | grep -q "generic-receive-offload: on"; then
+	ethtool -K $iface gro off
+	run gro-off TCP_MAERTS
+	ethtool -K $iface gro on
+fi
+
+if [ -w $copybreak ]; then
+	old=$(cat $copybreak)
+	echo 0 > $copybreak
+	run copybreak-0 TCP_MAERTS
+	echo $old > $copybreak
+fi
@@ -0,0 +1,153 @@
+#!/bin/sh
+#
+# Measure the cost per packet of the xt_qtaguid match with pktgen.
+#
+# pktgen sends UDP packets at a fixed rate into one end of a veth pair.
+# They come out of the other end through netif_rx() and the IPv4 input
+# path, from a non-local address on the link, so they go through the
+# INPUT chain like packets from a real interface.  Each run is done
+# without and with an "owner" (xt_qtaguid) rule on that interface.  The
+# script reports the CPU time per packet taken from /proc/stat and the
+# difference between the two runs.
+#
+# With a UDP listener on the destination port, qtaguid_find_sk() finds a
+# socket and the packets are accounted to its uid, as with real traffic.
+# Without one, they go to uid 0.  The port is listened on with nc when it
+# is available.
+#
+# Needs CONFIG_NET_PKTGEN, CONFIG_VETH, iptables and ip.  Run as root on
+# an otherwise idle system and compare the output of the old and the new
+# kernel.  Keep the rate below the point where softnet_stat shows drops:
+# past it, the time per packet includes work on packets that were dropped.
+#
+# usage: pktgen.sh [rate_pps] [seconds] [pkt_size]
+
+rate=${1:-50000}
+seconds=${2:-10}
+size=${3:-60}
+tx=qtu_pg0
+rx=qtu_pg1
+port=9
+pg=/proc/net/pktgen
+
+pgset()
+{
+	echo "$2" > $pg/$1
+	if ! grep -q "^Result: OK" $pg/$1; then
+		echo "pktgen: $1: $2: $(grep ^Result $pg/$1)" >&2
+		exit 1
+	fi
+}
+
+# busy and total jiffies of all cpus
+cpu_time()
+{
+	set -- $(grep '^cpu ' /proc/stat)
+	echo $(($2 + $3 + $4 + $7 + $8)) $(($2 + $3 + $4 + $5 + $6 + $7 + $8))
+}
+
+rx_packets()
+{
+	cat /sys/class/net/$rx/statistics/rx_packets
+}
+
+# second column of softnet_stat, summed over cpus
+drops()
+{
+	local d=0 x
+
+	for x in $(awk '{ print $2 }' /proc/net/softnet_stat); do
+		d=$((d + 0x$x))
+	done
+	echo $d
+}
+
+match_calls()
+{
+	sed -n 's/.*match_calls=\([0-9]*\).*/\1/p' /proc/net/xt_qtaguid/ctrl
+}
+
+cleanup()
+{
+	[ -n "$nc_pid" ] && kill $nc_pid 2>/dev/null
+	iptables -D INPUT -i $rx -m owner --socket-exists 2>/dev/null
+	[ -w $pg/kpktgend_0 ] && echo "rem_device_all" > $pg/kpktgend_0
+	ip link del $tx 2>/dev/null
+}
+
+# run label: sends rate * seconds packets, prints the cost per packet
+run()
+{
+	local label=$1 b0 t0 b1 t1 r0 r1 d0 d1 m0 m1 pkts busy ns
+
+	set -- $(cpu_time)
+	b0=$1 t0=$2
+	r0=$(rx_packets)
+	d0=$(drops)
+	m0=$(match_calls)
+
+	pgset $tx "count $((rate * seconds))"
+	echo "start" > $pg/pgctrl
+
+	set -- $(cpu_time)
+	b1=$1 t1=$2
+	r1=$(rx_packets)
+	d1=$(drops)
+	m1=$(match_calls)
+
+	pkts=$((r1 - r0))
+	busy=$((b1 - b0))
+	if [ $pkts -eq 0 ]; then
+		echo "$label: no packets received" >&2
+		exit 1
+	fi
+	# /proc/stat counts in USER_HZ
+	ns=$((busy * (1000000000 / $(getconf CLK_TCK)) / pkts))
+	printf "%-10s %10d %8d %6d%% %8d %10d\n" "$label" $pkts $((d1 - d0)) \
+		$((100 * busy / (t1 - t0))) $ns $((m1 - m0))
+	last_ns=$ns
+}
+
+if [ ! -d $pg ]; then
+	modprobe pktgen 2>/dev/null
+	[ -d $pg ] || { echo "no $pg, CONFIG_NET_PKTGEN needed" >&2; exit 1; }
+fi
+[ -r /proc/net/xt_qtaguid/ctrl ] ||
+	{ echo "xt_qtaguid is not loaded" >&2; exit 1; }
+
+trap cleanup EXIT INT TERM
+ip link add $tx type veth peer name $rx || exit 1
+ip addr add 10.211.0.2/24 dev $rx
+ip link set $tx up
+ip link set $rx up
+mac=$(cat /sys/class/net/$rx/address)
+
+listener=none
+if command -v nc > /dev/null; then
+	nc -u -l -p $port > /dev/null 2>&1 &
+	nc_pid=$!
+	listener="nc on port $port"
+	sleep 1
+fi
+
+echo "rem_device_all" > $pg/kpktgend_0
+pgset kpktgend_0 "add_device $tx"
+pgset $tx "clone_skb 0"
+pgset $tx "pkt_size $size"
+pgset $tx "delay $((1000000000 / rate))"
+pgset $tx "dst 10.211.0.2"
+pgset $tx "dst_mac $mac"
+pgset $tx "src_min 10.211.0.3"
+pgset $tx "udp_src_min $port"
+pgset $tx "udp_dst_min $port"
+
+echo "$(uname -r), $rate pps for ${seconds}s, $size byte packets," \
+	"listener: $listener"
+printf "%-10s %10s %8s %7s %8s %10s\n" run packets drops cpu ns/pkt matches
+
+run no-rule
+base_ns=$last_ns
+
+iptables -A INPUT -i $rx -m owner --socket-exists || exit 1
+run qtaguid
+echo "qtaguid match: $((last_ns - base_ns)) ns/pkt"
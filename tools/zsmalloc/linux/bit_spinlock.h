@@ -0,0 +1,2 @@
+#ifndef LINUX_BIT_SPINLOCK_H
+#endif
@@ -0,0 +1,2 @@
+#ifndef LINUX_HIGHMEM_H
+#endif
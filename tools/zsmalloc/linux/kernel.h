@@ -0,0 +1,197 @@
+#ifndef LINUX_KERNEL_H
+#define LINUX_KERNEL_H
+
+/*
+ * Just enough of the kernel to run zsmalloc in a single userspace thread:
+ * pages come from malloc(), kmap is the identity, locks only record that
+ * they are held.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/types.h>
+
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+
+#define BUG_ON(cond)		assert(!(cond))
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define min(x, y)		((x) < (y) ? (x) : (y))
+#define min_t(type, x, y)	min((type)(x), (type)(y))
+#define min3(x, y, z)		min(min(x, y), z)
+
+#define pr_info(fmt, ...)	printf(pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_err(fmt, ...)	fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+
+#define __init
+#define __exit
+#define EXPORT_SYMBOL_GPL(sym)
+#define MODULE_LICENSE(s)
+#define MODULE_DESCRIPTION(s)
+#define module_init(fn)		int init_module(void) __attribute__((alias(#fn)))
+#define module_exit(fn)		void cleanup_module(void) __attribute__((alias(#fn)))
+
+#define cond_resched()		do { } while (0)
+
+/* gfp */
+#define __GFP_HIGHMEM		0x02u
+#define __GFP_MOVABLE		0x08u
+#define __GFP_IO		0x40u
+#define __GFP_FS		0x80u
+#define GFP_NOIO		0u
+#define GFP_KERNEL		(__GFP_IO | __GFP_FS)
+
+/* pages */
+#define PAGE_SHIFT		12
+#define PAGE_SIZE		(1UL << PAGE_SHIFT)
+#define PAGE_MASK		(~(PAGE_SIZE - 1))
+
+struct page {
+	void *virtual;
+};
+
+extern unsigned long nr_pages_allocated;
+
+static inline struct page *alloc_page(gfp_t flags)
+{
+	struct page *page = malloc(sizeof(*page));
+
+	if (!page)
+		return NULL;
+	if (posix_memalign(&page->virtual, PAGE_SIZE, PAGE_SIZE)) {
+		free(page);
+		return NULL;
+	}
+	nr_pages_allocated++;
+	return page;
+}
+
+static inline void __free_page(struct page *page)
+{
+	nr_pages_allocated--;
+	free(page->virtual);
+	free(page);
+}
+
+#define KM_USER0		0
+#define KM_USER1		1
+#define kmap_atomic(page, km)	((page)->virtual)
+#define kunmap_atomic(addr, km)	do { } while (0)
+
+/* slab */
+struct kmem_cache {
+	size_t size;
+};
+
+static inline void *kmalloc(size_t size, gfp_t flags)
+{
+	return malloc(size);
+}
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+	return calloc(1, size);
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+static inline struct kmem_cache *kmem_cache_create(const char *name,
+		size_t size, size_t align, unsigned long flags,
+		void (*ctor)(void *))
+{
+	struct kmem_cache *c = malloc(sizeof(*c));
+
+	if (c)
+		c->size = size;
+	return c;
+}
+
+static inline void kmem_cache_destroy(struct kmem_cache *c)
+{
+	free(c);
+}
+
+static inline void *kmem_cache_alloc(struct kmem_cache *c, gfp_t flags)
+{
+	return malloc(c->size);
+}
+
+static inline void kmem_cache_free(struct kmem_cache *c, void *p)
+{
+	free(p);
+}
+
+/* one cpu */
+#define DEFINE_PER_CPU(type, name)	__typeof__(type) name
+#define __get_cpu_var(var)		(var)
+#define per_cpu(var, cpu)		(*((void)(cpu), &(var)))
+#define for_each_possible_cpu(cpu)	for ((cpu) = 0; (cpu) < 1; (cpu)++)
+
+/* locks */
+typedef struct {
+	int locked;
+} spinlock_t;
+
+#define spin_lock_init(l)	((l)->locked = 0)
+#define spin_lock(l)		do { BUG_ON((l)->locked); (l)->locked = 1; } while (0)
+#define spin_unlock(l)		do { BUG_ON(!(l)->locked); (l)->locked = 0; } while (0)
+
+static inline int bit_spin_trylock(int nr, unsigned long *addr)
+{
+	if (*addr & (1UL << nr))
+		return 0;
+	*addr |= 1UL << nr;
+	return 1;
+}
+
+#define bit_spin_lock(nr, addr)		BUG_ON(!bit_spin_trylock(nr, addr))
+#define bit_spin_unlock(nr, addr)	(*(addr) &= ~(1UL << (nr)))
+
+typedef struct {
+	long counter;
+} atomic_long_t;
+
+#define atomic_long_read(v)		((v)->counter)
+#define atomic_long_set(v, i)		((v)->counter = (i))
+#define atomic_long_add(i, v)		((v)->counter += (i))
+#define atomic_long_sub(i, v)		((v)->counter -= (i))
+
+/* reclaim, never called back here */
+struct shrink_control {
+	gfp_t gfp_mask;
+	unsigned long nr_to_scan;
+};
+
+struct shrinker {
+	int (*shrink)(struct shrinker *, struct shrink_control *sc);
+	int seeks;
+};
+
+#define DEFAULT_SEEKS		2
+#define register_shrinker(s)	do { } while (0)
+#define unregister_shrinker(s)	do { } while (0)
+
+/* there is no other thread to hand work to: it runs when scheduled */
+struct work_struct {
+	void (*func)(struct work_struct *work);
+};
+
+#define INIT_WORK(w, f)		((w)->func = (f))
+#define schedule_work(w)	((w)->func(w))
+#define cancel_work_sync(w)	do { } while (0)
+
+#include <linux/list.h>
+
+#endif
@@ -0,0 +1,2 @@
+#ifndef LINUX_MM_H
+#endif
@@ -0,0 +1,2 @@
+#ifndef LINUX_MODULE_H
+#endif
@@ -0,0 +1,2 @@
+#ifndef LINUX_PERCPU_H
+#endif
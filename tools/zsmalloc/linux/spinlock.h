@@ -0,0 +1,2 @@
+#ifndef LINUX_SPINLOCK_H
+#endif
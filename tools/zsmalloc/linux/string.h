@@ -0,0 +1,2 @@
+#ifndef LINUX_STRING_H
+#endif
@@ -0,0 +1,11 @@
+#ifndef LINUX_TYPES_H
+#define LINUX_TYPES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint64_t u64;
+typedef unsigned int gfp_t;
+
+#endif
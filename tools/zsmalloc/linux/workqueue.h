@@ -0,0 +1,2 @@
+#ifndef LINUX_WORKQUEUE_H
+#endif
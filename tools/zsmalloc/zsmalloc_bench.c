@@ -0,0 +1,285 @@
+/*
+ * zsmalloc_bench -- run drivers/staging/zsmalloc in userspace and report
+ * what zram would see: alloc/free cost, mem_used_total against
+ * orig_data_size, and how much of the fragmentation churn leaves behind
+ * zs_compact() gets back.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * Objects are sized after a compressed swap stream: a share of nearly
+ * empty pages, a spread of ordinary ones around the middle of the page and
+ * a tail that does not compress and is stored as a full page, as zram does
+ * above max_zpage_size.  With -f, sizes are read one per line from a file
+ * instead, e.g. collected from zram_bvec_write() with a trace_printk().
+ *
+ * Each object is stamped with its index and checked after every phase, so
+ * a compaction that loses or mixes up objects shows up as an error.
+ *
+ * The kernel environment is emulated by the headers in linux/: pages come
+ * from malloc(), kmap is free and there is a single cpu, so the times only
+ * compare allocator paths with each other, they are not what a device will
+ * show.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/kernel.h>
+#include "../../drivers/staging/zsmalloc/zsmalloc.h"
+
+int init_module(void);
+void cleanup_module(void);
+
+unsigned long nr_pages_allocated;
+
+/* zram's max_zpage_size, objects larger than this are stored uncompressed */
+#define MAX_ZPAGE_SIZE	(PAGE_SIZE / 4 * 3)
+
+struct obj {
+	unsigned long handle;
+	unsigned int size;
+};
+
+static struct obj *objs;
+static unsigned int nr_objs = 65536;	/* 256 MB of swap */
+static unsigned int *file_sizes;
+static unsigned int nr_file_sizes;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned int pick_size(void)
+{
+	unsigned int r = rand() % 100;
+	unsigned int size;
+
+	if (nr_file_sizes)
+		size = file_sizes[rand() % nr_file_sizes];
+	else if (r < 15)
+		/* zero filled and nearly empty pages */
+		size = 32 + rand() % 96;
+	else if (r < 90)
+		/* ordinary anonymous memory, 2:1 to 4:1 */
+		size = 1024 + rand() % 1024 + rand() % 1024;
+	else
+		/* does not compress */
+		size = MAX_ZPAGE_SIZE + rand() % (PAGE_SIZE - MAX_ZPAGE_SIZE);
+
+	if (size > MAX_ZPAGE_SIZE)
+		size = PAGE_SIZE;
+	return size;
+}
+
+static int obj_alloc(struct zs_pool *pool, unsigned int i)
+{
+	unsigned int *p;
+
+	objs[i].size = pick_size();
+	objs[i].handle = zs_malloc(pool, objs[i].size);
+	if (!objs[i].handle) {
+		fprintf(stderr, "zs_malloc(%u) failed\n", objs[i].size);
+		return -1;
+	}
+	p = zs_map_object(pool, objs[i].handle, ZS_MM_WO);
+	p[0] = i;
+	((unsigned char *)p)[objs[i].size - 1] = i & 0xff;
+	zs_unmap_object(pool, objs[i].handle);
+	return 0;
+}
+
+static void obj_free(struct zs_pool *pool, unsigned int i)
+{
+	zs_free(pool, objs[i].handle);
+	objs[i].handle = 0;
+}
+
+static int check(struct zs_pool *pool, const char *phase)
+{
+	unsigned int i, *p, bad = 0;
+
+	for (i = 0; i < nr_objs; i++) {
+		if (!objs[i].handle)
+			continue;
+		p = zs_map_object(pool, objs[i].handle, ZS_MM_RO);
+		if (p[0] != i ||
+		    ((unsigned char *)p)[objs[i].size - 1] != (i & 0xff))
+			bad++;
+		zs_unmap_object(pool, objs[i].handle);
+	}
+	if (bad)
+		fprintf(stderr, "%s: %u objects corrupted\n", phase, bad);
+	return bad;
+}
+
+static void report(struct zs_pool *pool, const char *phase)
+{
+	unsigned long long orig = 0, compr = 0, used;
+	unsigned int i;
+
+	for (i = 0; i < nr_objs; i++) {
+		if (!objs[i].handle)
+			continue;
+		orig += PAGE_SIZE;
+		compr += objs[i].size;
+	}
+	used = zs_get_total_size_bytes(pool);
+	printf("%-10s %10llu %10llu %10llu %7.2f %7.1f\n", phase,
+	       orig >> 10, compr >> 10, used >> 10,
+	       used ? (double)orig / used : 0,
+	       used ? 100.0 * (used - compr) / used : 0);
+}
+
+static int read_sizes(const char *path)
+{
+	unsigned int size, max = 0;
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	while (fscanf(f, "%u", &size) == 1) {
+		if (!size || size > PAGE_SIZE)
+			continue;
+		if (nr_file_sizes == max) {
+			max = max ? max * 2 : 4096;
+			file_sizes = realloc(file_sizes,
+					     max * sizeof(*file_sizes));
+			if (!file_sizes) {
+				fclose(f);
+				return -1;
+			}
+		}
+		file_sizes[nr_file_sizes++] = size;
+	}
+	fclose(f);
+	if (!nr_file_sizes) {
+		fprintf(stderr, "%s: no sizes\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: zsmalloc_bench [-n objects] [-c churn] [-k keep_%%] "
+		"[-s seed] [-f sizes]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int churn = 4, keep = 50, seed = 1;
+	unsigned int i, n, ops, err = 0;
+	unsigned long freed;
+	struct zs_pool *pool;
+	double t;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:c:k:s:f:")) != -1) {
+		switch (c) {
+		case 'n':
+			nr_objs = atoi(optarg);
+			break;
+		case 'c':
+			churn = atoi(optarg);
+			break;
+		case 'k':
+			keep = atoi(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		case 'f':
+			if (read_sizes(optarg))
+				return 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (!nr_objs || keep > 100)
+		usage();
+	srand(seed);
+
+	objs = calloc(nr_objs, sizeof(*objs));
+	if (!objs || init_module())
+		return 1;
+	pool = zs_create_pool("bench", GFP_NOIO | __GFP_HIGHMEM);
+	if (!pool)
+		return 1;
+
+	printf("%-10s %10s %10s %10s %7s %7s\n", "phase", "orig_kb",
+	       "compr_kb", "used_kb", "ratio", "waste_%");
+
+	/* fill the disk */
+	t = now_ns();
+	for (i = 0; i < nr_objs; i++)
+		if (obj_alloc(pool, i))
+			return 1;
+	t = now_ns() - t;
+	report(pool, "fill");
+	err += check(pool, "fill");
+	printf("%-10s %8.0f ns/alloc+write\n", "", t / nr_objs);
+
+	/* swap in and out at random, churn times over */
+	ops = churn * nr_objs;
+	t = now_ns();
+	for (n = 0; n < ops; n++) {
+		i = rand() % nr_objs;
+		obj_free(pool, i);
+		if (obj_alloc(pool, i))
+			return 1;
+	}
+	t = now_ns() - t;
+	report(pool, "churn");
+	err += check(pool, "churn");
+	printf("%-10s %8.0f ns/free+alloc+write\n", "", ops ? t / ops : 0);
+
+	/* an app exits or is swapped in: keep only some of the objects */
+	for (i = 0; i < nr_objs; i++)
+		if ((unsigned int)rand() % 100 >= keep)
+			obj_free(pool, i);
+	report(pool, "shrink");
+	err += check(pool, "shrink");
+
+	t = now_ns();
+	freed = zs_compact(pool);
+	t = now_ns() - t;
+	report(pool, "compact");
+	err += check(pool, "compact");
+	printf("%-10s %8lu pages freed in %.1f ms\n", "", freed, t / 1e6);
+
+	/* and refill the freed slots */
+	for (i = 0; i < nr_objs; i++)
+		if (!objs[i].handle && obj_alloc(pool, i))
+			return 1;
+	report(pool, "refill");
+	err += check(pool, "refill");
+
+	t = now_ns();
+	for (i = 0; i < nr_objs; i++)
+		obj_free(pool, i);
+	t = now_ns() - t;
+	printf("%-10s %8.0f ns/free\n", "free", t / nr_objs);
+
+	if (nr_pages_allocated) {
+		fprintf(stderr, "%lu pages leaked\n", nr_pages_allocated);
+		err++;
+	}
+	zs_destroy_pool(pool);
+	cleanup_module();
+	free(objs);
+	return err ? 1 : 0;
+}